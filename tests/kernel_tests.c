@@ -0,0 +1,806 @@
+/* Host regression and timing suite for the tune analysis kernels.
+ *
+ * Each sweep in the corpus is run through the kernels in processing order: IQ
+ * extraction from the raw buffers, power, smoothing to the finest peak level of
+ * the smoothing pyramid defined in tune_pyramid.py, second derivative,
+ * peak extraction and the two passes of peak fitting, each stage taking its
+ * input from the stages before.  The outputs are compared with the golden
+ * outputs saved alongside each corpus sweep, and cos_sin() and Reciprocal()
+ * are compared with libm.  For each kernel the distribution of run times and
+ * the largest deviation are reported, and any deviation beyond the kernel's
+ * tolerance fails the run.
+ *
+ * The corpus is synthetic, generated by make_corpus.py, but recorded sweeps can
+ * be added in the same layout.  measure_tune_basic() is part of the EPICS tune
+ * module and is not covered here.
+ *
+ * Usage: kernel_tests [-g] [-r repeat] corpus-file...
+ *
+ *  -g  Write the golden outputs from this run instead of checking them.
+ *  -r  Number of times each kernel is run on each sweep, default 10. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <complex.h>
+#include <math.h>
+
+#include "error.h"
+#include "hardware.h"
+#include "detector.h"
+#include "numeric.h"
+#include "tune_support.h"
+#include "peak_search.h"
+#include "tune_pyramid.h"
+
+/* struct rotation has a field named I, so from here on the complex unit is
+ * spelt in full. */
+#undef I
+#include "iq_extract.h"
+
+
+#define CORPUS_PEAKS    5
+/* Smoothing runs through the pyramid levels up to the finest peak level. */
+#define SMOOTH_LEVELS   (FIRST_PEAK_LEVEL + 1)
+#define SMOOTH_LENGTH   (TUNE_LENGTH / FIRST_PEAK_SCALING)
+#define BATCH_SIZE      1024    // Calls per sample for the scalar kernels
+#define MAX_REPEAT      1000
+
+static const char corpus_magic[8] = "TMBFKC01";
+
+
+enum {
+    KERNEL_IQ,              // reference_sweep_info(), including all powers
+    KERNEL_IQ_FUSED,        // fused_sweep_info()
+    KERNEL_POWER,           // compute_power()
+    KERNEL_SMOOTH,          // smooth_waveform_pyramid() to finest peak level
+    KERNEL_SMOOTH_4,        // smooth_waveform_4() for each level
+    KERNEL_DD,              // compute_dd()
+    KERNEL_PEAKS,           // extract_peaks()
+    KERNEL_PEAKS_REF,       // reference_extract_peaks()
+    KERNEL_FIT,             // Both passes of double precision fit
+    KERNEL_FIT_FLOAT,       // Both passes of single precision fit
+    KERNEL_FIT_FIXED,       // Both passes of fixed point fit
+    KERNEL_COS_SIN,         // cos_sin()
+    KERNEL_RECIPROCAL,      // Reciprocal()
+    KERNEL_COUNT
+};
+
+/* Deviations are in the units of each kernel's output: raw counts for the
+ * waveforms, mismatched peaks for extraction, tunes for the fits, 2^-30 for
+ * cos_sin() and relative error for Reciprocal().  The reduced precision fits
+ * are compared with the double precision golden output, and cos_sin() is only
+ * good to around 2^-23. */
+static const struct kernel_info {
+    const char *name;
+    double tolerance;
+} kernel_info[KERNEL_COUNT] = {
+    [KERNEL_IQ]         = { "IQ",        0 },
+    [KERNEL_IQ_FUSED]   = { "IQ:FUSED",  1 },
+    [KERNEL_POWER]      = { "POWER",     0 },
+    [KERNEL_SMOOTH]     = { "SMOOTH",    0 },
+    [KERNEL_SMOOTH_4]   = { "SMOOTH:4",  0 },
+    [KERNEL_DD]         = { "DD",        0 },
+    [KERNEL_PEAKS]      = { "PEAKS",     0 },
+    [KERNEL_PEAKS_REF]  = { "PEAKS:REF", 0 },
+    [KERNEL_FIT]        = { "FIT",       1e-9 },
+    [KERNEL_FIT_FLOAT]  = { "FIT:FLOAT", 1e-5 },
+    [KERNEL_FIT_FIXED]  = { "FIT:FIXED", 1e-5 },
+    [KERNEL_COS_SIN]    = { "COSSIN",    128 },
+    [KERNEL_RECIPROCAL] = { "RECIP",     1e-9 },
+};
+
+
+/* A single corpus sweep as read from file. */
+struct corpus_sweep {
+    const char *filename;
+    unsigned int sweep_length;
+    unsigned int peak_count;
+    struct peak_range ranges[CORPUS_PEAKS];
+    short buffer_low[BUF_DATA_LENGTH];
+    short buffer_high[BUF_DATA_LENGTH];
+    struct rotation rotation[TUNE_LENGTH];
+    double scale[TUNE_LENGTH];
+};
+
+/* Outputs of the sweep kernels for a single corpus sweep, as saved in the
+ * golden files. */
+struct kernel_outputs {
+    int abs_max;
+    int mean_i[TUNE_LENGTH];
+    int mean_q[TUNE_LENGTH];
+    int power[TUNE_LENGTH];
+    int smooth[SMOOTH_LENGTH];
+    int dd[SMOOTH_LENGTH];
+    unsigned int peak_count;
+    struct raw_peak_data peaks[CORPUS_PEAKS];
+    unsigned int fit_count;
+    struct one_pole fits[CORPUS_PEAKS];
+    double errors[CORPUS_PEAKS];
+};
+
+/* Working storage for the kernels. */
+static struct sweep_info work_info;
+static struct channel_sweep work_sweep;
+static int work_pyramid[SMOOTH_LEVELS - 1][TUNE_LENGTH];
+static int work_smooth_4[SMOOTH_LEVELS][TUNE_LENGTH];
+static bool peak_marks[SMOOTH_LENGTH];
+static struct peak_candidate peak_candidates[MAX_CANDIDATES(SMOOTH_LENGTH)];
+static struct peak_candidate peak_heap[CORPUS_PEAKS];
+static const struct peak_arena peak_arena = {
+    .max_length = SMOOTH_LENGTH,
+    .max_peaks = CORPUS_PEAKS,
+    .candidates = peak_candidates,
+    .heap = peak_heap,
+};
+static const unsigned int pyramid_factors[PYRAMID_LEVELS] = PYRAMID_FACTORS;
+
+static int batch_angles[BATCH_SIZE];
+static unsigned int batch_values[BATCH_SIZE];
+static int batch_cos[BATCH_SIZE];
+static int batch_sin[BATCH_SIZE];
+static unsigned int batch_reciprocal[BATCH_SIZE];
+static int batch_shift[BATCH_SIZE];
+
+static unsigned int repeat_count = 10;
+static bool save_golden;
+
+static double *samples[KERNEL_COUNT];
+static unsigned int sample_count[KERNEL_COUNT];
+static double deviations[KERNEL_COUNT];
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Corpus and golden files. */
+
+static bool read_block(FILE *file, void *data, size_t size)
+{
+    return TEST_OK_(fread(data, size, 1, file) == 1, "Corpus file too short");
+}
+
+/* All fields are converted from little endian through this buffer, which is
+ * large enough for the largest field. */
+static unsigned char file_data[2 * BUF_DATA_LENGTH];
+
+static bool read_data(FILE *file, size_t size)
+{
+    ASSERT_OK(size <= sizeof(file_data));
+    return read_block(file, file_data, size);
+}
+
+static uint32_t get_uint32(const unsigned char *data)
+{
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8 |
+        (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static bool read_uint32s(FILE *file, unsigned int count, uint32_t values[])
+{
+    bool ok = read_data(file, 4 * count);
+    for (unsigned int i = 0; ok  &&  i < count; i ++)
+        values[i] = get_uint32(&file_data[4 * i]);
+    return ok;
+}
+
+static bool read_shorts(FILE *file, unsigned int count, short values[])
+{
+    bool ok = read_data(file, 2 * count);
+    for (unsigned int i = 0; ok  &&  i < count; i ++)
+        values[i] = (short) (file_data[2 * i] | file_data[2 * i + 1] << 8);
+    return ok;
+}
+
+static bool read_doubles(FILE *file, unsigned int count, double values[])
+{
+    bool ok = read_data(file, 8 * count);
+    for (unsigned int i = 0; ok  &&  i < count; i ++)
+    {
+        uint64_t bits = get_uint32(&file_data[8 * i]) |
+            (uint64_t) get_uint32(&file_data[8 * i + 4]) << 32;
+        memcpy(&values[i], &bits, sizeof(double));
+    }
+    return ok;
+}
+
+
+static bool read_corpus_sweep(const char *filename, struct corpus_sweep *sweep)
+{
+    sweep->filename = filename;
+    FILE *file;
+    bool ok = TEST_NULL_(file = fopen(filename, "rb"),
+        "Unable to open corpus file %s", filename);
+    if (ok)
+    {
+        char magic[sizeof(corpus_magic)];
+        uint32_t header[2];
+        uint32_t ranges[2 * CORPUS_PEAKS];
+        uint32_t rotation[2 * TUNE_LENGTH];
+        ok =
+            read_block(file, magic, sizeof(magic))  &&
+            TEST_OK_(memcmp(magic, corpus_magic, sizeof(magic)) == 0,
+                "%s is not a corpus file", filename)  &&
+            read_uint32s(file, 2, header)  &&
+            read_uint32s(file, 2 * CORPUS_PEAKS, ranges)  &&
+            read_shorts(file, BUF_DATA_LENGTH, sweep->buffer_low)  &&
+            read_shorts(file, BUF_DATA_LENGTH, sweep->buffer_high)  &&
+            read_uint32s(file, 2 * TUNE_LENGTH, rotation)  &&
+            read_doubles(file, TUNE_LENGTH, sweep->scale)  &&
+            TEST_OK_(0 < header[0]  &&  header[0] <= TUNE_LENGTH  &&
+                header[1] <= CORPUS_PEAKS,
+                "Invalid corpus header in %s", filename);
+        fclose(file);
+
+        if (ok)
+        {
+            sweep->sweep_length = header[0];
+            sweep->peak_count = header[1];
+            for (unsigned int i = 0; i < CORPUS_PEAKS; i ++)
+                sweep->ranges[i] = (struct peak_range) {
+                    .left = ranges[2 * i], .right = ranges[2 * i + 1] };
+            for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+                sweep->rotation[i] = (struct rotation) {
+                    .I = (int32_t) rotation[2 * i],
+                    .Q = (int32_t) rotation[2 * i + 1] };
+        }
+    }
+    return ok;
+}
+
+
+/* The golden outputs are kept as text, each value preceded by a header line
+ * giving its name and number of values. */
+static char *golden_filename(const char *filename)
+{
+    size_t length = strlen(filename);
+    const char *suffix = ".sweep";
+    if (length > strlen(suffix)  &&
+        strcmp(filename + length - strlen(suffix), suffix) == 0)
+        length -= strlen(suffix);
+    char *result = malloc(length + sizeof(".golden"));
+    memcpy(result, filename, length);
+    strcpy(result + length, ".golden");
+    return result;
+}
+
+static void write_ints(
+    FILE *file, const char *name, unsigned int count, const int values[])
+{
+    fprintf(file, "%s %u\n", name, count);
+    for (unsigned int i = 0; i < count; i ++)
+        fprintf(file, "%d%c", values[i],
+            i % 16 == 15  ||  i == count - 1 ? '\n' : ' ');
+}
+
+static void write_doubles(
+    FILE *file, const char *name, unsigned int count, const double values[])
+{
+    fprintf(file, "%s %u\n", name, count);
+    for (unsigned int i = 0; i < count; i ++)
+        fprintf(file, "%.17g\n", values[i]);
+}
+
+static bool read_header(FILE *file, const char *name, unsigned int *count)
+{
+    char found[40];
+    return
+        TEST_OK_(fscanf(file, "%39s %u", found, count) == 2,
+            "Malformed golden file")  &&
+        TEST_OK_(strcmp(found, name) == 0,
+            "Expected %s in golden file, found %s", name, found);
+}
+
+static bool read_ints(
+    FILE *file, const char *name, unsigned int count, int values[])
+{
+    unsigned int found;
+    bool ok = read_header(file, name, &found)  &&
+        TEST_OK_(found == count, "Wrong length for %s", name);
+    for (unsigned int i = 0; ok  &&  i < count; i ++)
+        ok = TEST_OK_(fscanf(file, "%d", &values[i]) == 1,
+            "Malformed golden %s", name);
+    return ok;
+}
+
+
+
+/* Peaks are saved as (ix, left, right) triples and fits as (a, b, error). */
+static bool write_golden(
+    const char *filename, const struct kernel_outputs *out)
+{
+    FILE *file;
+    bool ok = TEST_NULL_(file = fopen(filename, "w"),
+        "Unable to write %s", filename);
+    if (ok)
+    {
+        int peaks[3 * CORPUS_PEAKS];
+        for (unsigned int i = 0; i < out->peak_count; i ++)
+        {
+            peaks[3 * i] = (int) out->peaks[i].ix;
+            peaks[3 * i + 1] = (int) out->peaks[i].left;
+            peaks[3 * i + 2] = (int) out->peaks[i].right;
+        }
+        double fits[5 * CORPUS_PEAKS];
+        for (unsigned int i = 0; i < out->fit_count; i ++)
+        {
+            const struct one_pole *fit = &out->fits[i];
+            double *f = &fits[5 * i];
+            f[0] = creal(fit->a);
+            f[1] = cimag(fit->a);
+            f[2] = creal(fit->b);
+            f[3] = cimag(fit->b);
+            f[4] = out->errors[i];
+        }
+
+        write_ints(file, "abs_max", 1, &out->abs_max);
+        write_ints(file, "mean_i", TUNE_LENGTH, out->mean_i);
+        write_ints(file, "mean_q", TUNE_LENGTH, out->mean_q);
+        write_ints(file, "power", TUNE_LENGTH, out->power);
+        write_ints(file, "smooth", SMOOTH_LENGTH, out->smooth);
+        write_ints(file, "dd", SMOOTH_LENGTH, out->dd);
+        write_ints(file, "peaks", 3 * out->peak_count, peaks);
+        write_doubles(file, "fits", 5 * out->fit_count, fits);
+        ok = TEST_OK_(fclose(file) == 0, "Error writing %s", filename);
+    }
+    return ok;
+}
+
+static bool read_golden(const char *filename, struct kernel_outputs *out)
+{
+    FILE *file;
+    bool ok = TEST_NULL_(file = fopen(filename, "r"),
+        "Unable to open golden file %s", filename);
+    if (ok)
+    {
+        int peaks[3 * CORPUS_PEAKS];
+        double fits[5 * CORPUS_PEAKS];
+        unsigned int peak_values, fit_values;
+        ok =
+            read_ints(file, "abs_max", 1, &out->abs_max)  &&
+            read_ints(file, "mean_i", TUNE_LENGTH, out->mean_i)  &&
+            read_ints(file, "mean_q", TUNE_LENGTH, out->mean_q)  &&
+            read_ints(file, "power", TUNE_LENGTH, out->power)  &&
+            read_ints(file, "smooth", SMOOTH_LENGTH, out->smooth)  &&
+            read_ints(file, "dd", SMOOTH_LENGTH, out->dd)  &&
+            read_header(file, "peaks", &peak_values)  &&
+            TEST_OK_(peak_values % 3 == 0  &&
+                peak_values <= 3 * CORPUS_PEAKS, "Bad golden peaks");
+        for (unsigned int i = 0; ok  &&  i < peak_values; i ++)
+            ok = TEST_OK_(fscanf(file, "%d", &peaks[i]) == 1,
+                "Malformed golden peaks");
+        ok = ok  &&
+            read_header(file, "fits", &fit_values)  &&
+            TEST_OK_(fit_values % 5 == 0  &&
+                fit_values <= 5 * CORPUS_PEAKS, "Bad golden fits");
+        for (unsigned int i = 0; ok  &&  i < fit_values; i ++)
+            ok = TEST_OK_(fscanf(file, "%lf", &fits[i]) == 1,
+                "Malformed golden fits");
+        fclose(file);
+
+        if (ok)
+        {
+            out->peak_count = peak_values / 3;
+            for (unsigned int i = 0; i < out->peak_count; i ++)
+                out->peaks[i] = (struct raw_peak_data) {
+                    .ix = (unsigned int) peaks[3 * i],
+                    .left = (unsigned int) peaks[3 * i + 1],
+                    .right = (unsigned int) peaks[3 * i + 2] };
+            out->fit_count = fit_values / 5;
+            for (unsigned int i = 0; i < out->fit_count; i ++)
+            {
+                const double *f = &fits[5 * i];
+                out->fits[i] = (struct one_pole) {
+                    .a = f[0] + _Complex_I * f[1],
+                    .b = f[2] + _Complex_I * f[3] };
+                out->errors[i] = f[4];
+            }
+        }
+    }
+    return ok;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Running and checking the kernels. */
+
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+/* Runs the given statement recording its duration in us. */
+#define TIME_KERNEL(kernel, statement) \
+    do { \
+        double start__ = get_time(); \
+        statement; \
+        add_sample(kernel, 1e6 * (get_time() - start__)); \
+    } while (0)
+
+static void add_sample(unsigned int kernel, double time)
+{
+    samples[kernel][sample_count[kernel]++] = time;
+}
+
+static void add_deviation(unsigned int kernel, double deviation)
+{
+    if (deviation > deviations[kernel])
+        deviations[kernel] = deviation;
+}
+
+
+static double max_int_difference(
+    unsigned int length, const int a[], const int b[])
+{
+    double difference = 0;
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        double d = fabs((double) a[i] - (double) b[i]);
+        if (d > difference)
+            difference = d;
+    }
+    return difference;
+}
+
+static double max_iq_difference(
+    const struct channel_sweep *sweep, const struct kernel_outputs *golden)
+{
+    double difference = 0;
+    for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+    {
+        double diff_i = abs(sweep->wf_i[i] - golden->mean_i[i]);
+        double diff_q = abs(sweep->wf_q[i] - golden->mean_q[i]);
+        if (diff_i > difference)  difference = diff_i;
+        if (diff_q > difference)  difference = diff_q;
+    }
+    return difference;
+}
+
+/* Returns the number of peaks which differ. */
+static double compare_peaks(
+    unsigned int count, const struct raw_peak_data peaks[],
+    const struct kernel_outputs *golden)
+{
+    unsigned int common = count < golden->peak_count ?
+        count : golden->peak_count;
+    unsigned int difference = count + golden->peak_count - 2 * common;
+    for (unsigned int i = 0; i < common; i ++)
+        if (peaks[i].ix != golden->peaks[i].ix  ||
+            peaks[i].left != golden->peaks[i].left  ||
+            peaks[i].right != golden->peaks[i].right)
+            difference += 1;
+    return difference;
+}
+
+/* Fits are compared by centre and width in tunes.  A difference in the number
+ * of fits counts as a whole tune. */
+static double compare_fits(
+    unsigned int count, const struct one_pole fits[],
+    const struct kernel_outputs *golden)
+{
+    if (count != golden->fit_count)
+        return 1;
+    double difference = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        double centre = fabs(
+            peak_centre(&fits[i]) - peak_centre(&golden->fits[i]));
+        double width = fabs(
+            peak_width(&fits[i]) - peak_width(&golden->fits[i]));
+        if (centre > difference)  difference = centre;
+        if (width > difference)   difference = width;
+    }
+    return difference;
+}
+
+
+/* Runs both passes of the given fit on the extracted mean IQ. */
+static unsigned int run_fit(
+    enum fit_kernel kernel, const struct corpus_sweep *sweep,
+    struct one_pole fits[], double errors[])
+{
+    const struct channel_sweep *mean = &work_info.mean;
+    unsigned int count = fit_multiple_peaks_kernel(kernel,
+        sweep->peak_count, false, sweep->scale, mean->wf_i, mean->wf_q,
+        sweep->ranges, fits, errors);
+    return fit_multiple_peaks_kernel(kernel,
+        count, true, sweep->scale, mean->wf_i, mean->wf_q,
+        sweep->ranges, fits, errors);
+}
+
+
+/* Smooths through the given number of levels by repeated smoothing by 4. */
+static void smooth_by_4(
+    unsigned int levels, const int power[], int smooth[][TUNE_LENGTH])
+{
+    unsigned int length = TUNE_LENGTH;
+    const int *input = power;
+    for (unsigned int level = 0; level < levels; level ++)
+    {
+        smooth_waveform_4(length, input, smooth[level]);
+        input = smooth[level];
+        length /= 4;
+    }
+}
+
+
+/* Runs every sweep kernel repeat_count times on the given sweep in processing
+ * order, recording the outputs of the reference stages.  The alternative
+ * implementations are checked against the golden outputs where given. */
+static void run_sweep_kernels(
+    const struct corpus_sweep *sweep, struct kernel_outputs *out,
+    const struct kernel_outputs *golden)
+{
+    struct sweep_info *info = &work_info;
+    info->sweep_length = sweep->sweep_length;
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_IQ,
+            out->abs_max = reference_sweep_info(info,
+                sweep->rotation, sweep->buffer_low, sweep->buffer_high));
+    for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+    {
+        out->mean_i[i] = info->mean.wf_i[i];
+        out->mean_q[i] = info->mean.wf_q[i];
+    }
+
+    static struct sweep_info fused_info;
+    fused_info.sweep_length = sweep->sweep_length;
+    int fused_max = 0;
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_IQ_FUSED,
+            fused_max = fused_sweep_info(&fused_info,
+                sweep->rotation, sweep->buffer_low, sweep->buffer_high));
+
+    /* compute_power() works in place, so works on a copy of the mean. */
+    memcpy(work_sweep.wf_i, info->mean.wf_i, sizeof(work_sweep.wf_i));
+    memcpy(work_sweep.wf_q, info->mean.wf_q, sizeof(work_sweep.wf_q));
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_POWER, compute_power(&work_sweep));
+    memcpy(out->power, work_sweep.power, sizeof(out->power));
+
+    int *pyramid[SMOOTH_LEVELS];
+    for (unsigned int level = 0; level < SMOOTH_LEVELS - 1; level ++)
+        pyramid[level] = work_pyramid[level];
+    pyramid[SMOOTH_LEVELS - 1] = out->smooth;
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_SMOOTH,
+            smooth_waveform_pyramid(TUNE_LENGTH, out->power,
+                SMOOTH_LEVELS, pyramid_factors, pyramid));
+    /* Repeated smoothing by 4 only matches the pyramid while all its factors
+     * are 4. */
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_SMOOTH_4,
+            smooth_by_4(SMOOTH_LEVELS, out->power, work_smooth_4));
+
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_DD, compute_dd(SMOOTH_LENGTH, out->smooth, out->dd));
+
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_PEAKS,
+            out->peak_count = extract_peaks(
+                SMOOTH_LENGTH, CORPUS_PEAKS, out->smooth, out->dd,
+                &peak_arena, out->peaks));
+    struct raw_peak_data reference_peaks[CORPUS_PEAKS];
+    unsigned int reference_count = 0;
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_PEAKS_REF,
+            memset(peak_marks, 0, sizeof(peak_marks));
+            reference_count = reference_extract_peaks(
+                SMOOTH_LENGTH, CORPUS_PEAKS, out->smooth, out->dd,
+                peak_marks, reference_peaks));
+
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_FIT,
+            out->fit_count = run_fit(
+                FIT_KERNEL_DOUBLE, sweep, out->fits, out->errors));
+    struct one_pole float_fits[CORPUS_PEAKS], fixed_fits[CORPUS_PEAKS];
+    double errors[CORPUS_PEAKS];
+    unsigned int float_count = 0, fixed_count = 0;
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_FIT_FLOAT,
+            float_count = run_fit(
+                FIT_KERNEL_FLOAT, sweep, float_fits, errors));
+    for (unsigned int n = 0; n < repeat_count; n ++)
+        TIME_KERNEL(KERNEL_FIT_FIXED,
+            fixed_count = run_fit(
+                FIT_KERNEL_FIXED, sweep, fixed_fits, errors));
+
+    /* When saving the golden outputs the alternatives are checked against the
+     * outputs of this run. */
+    if (golden == NULL)
+        golden = out;
+    else
+    {
+        add_deviation(KERNEL_IQ, max_iq_difference(&info->mean, golden));
+        add_deviation(KERNEL_IQ, abs(out->abs_max - golden->abs_max));
+        add_deviation(KERNEL_POWER,
+            max_int_difference(TUNE_LENGTH, out->power, golden->power));
+        add_deviation(KERNEL_SMOOTH,
+            max_int_difference(SMOOTH_LENGTH, out->smooth, golden->smooth));
+        add_deviation(KERNEL_DD,
+            max_int_difference(SMOOTH_LENGTH, out->dd, golden->dd));
+        add_deviation(KERNEL_PEAKS,
+            compare_peaks(out->peak_count, out->peaks, golden));
+        add_deviation(KERNEL_FIT,
+            compare_fits(out->fit_count, out->fits, golden));
+    }
+    add_deviation(KERNEL_IQ_FUSED,
+        max_iq_difference(&fused_info.mean, golden));
+    add_deviation(KERNEL_IQ_FUSED, abs(fused_max - golden->abs_max));
+    add_deviation(KERNEL_SMOOTH_4,
+        max_int_difference(SMOOTH_LENGTH,
+            work_smooth_4[SMOOTH_LEVELS - 1], golden->smooth));
+    add_deviation(KERNEL_PEAKS_REF,
+        compare_peaks(reference_count, reference_peaks, golden));
+    add_deviation(KERNEL_FIT_FLOAT,
+        compare_fits(float_count, float_fits, golden));
+    add_deviation(KERNEL_FIT_FIXED,
+        compare_fits(fixed_count, fixed_fits, golden));
+}
+
+
+/* Arguments for the scalar kernels are spread evenly over their range. */
+static void prepare_batch(void)
+{
+    for (unsigned int i = 0; i < BATCH_SIZE; i ++)
+    {
+        uint32_t step = i * 2654435761U;
+        batch_angles[i] = (int) step;
+        batch_values[i] = step | 1;
+    }
+}
+
+static void run_scalar_kernels(void)
+{
+    for (unsigned int n = 0; n < repeat_count; n ++)
+    {
+        TIME_KERNEL(KERNEL_COS_SIN,
+            for (unsigned int i = 0; i < BATCH_SIZE; i ++)
+                cos_sin(batch_angles[i], &batch_cos[i], &batch_sin[i]));
+        TIME_KERNEL(KERNEL_RECIPROCAL,
+            for (unsigned int i = 0; i < BATCH_SIZE; i ++)
+            {
+                batch_shift[i] = 0;
+                batch_reciprocal[i] =
+                    Reciprocal(batch_values[i], &batch_shift[i]);
+            });
+    }
+}
+
+/* The cos_sin() error is in units of its 2^-30 scaling, the Reciprocal() error
+ * is relative. */
+static void check_scalar_kernels(void)
+{
+    for (unsigned int i = 0; i < BATCH_SIZE; i ++)
+    {
+        double angle = 2 * M_PI * ldexp(batch_angles[i], -32);
+        add_deviation(KERNEL_COS_SIN,
+            fabs(batch_cos[i] - ldexp(cos(angle), 30)));
+        add_deviation(KERNEL_COS_SIN,
+            fabs(batch_sin[i] - ldexp(sin(angle), 30)));
+
+        double product = ldexp(batch_reciprocal[i], -batch_shift[i]) *
+            batch_values[i];
+        add_deviation(KERNEL_RECIPROCAL, fabs(product - 1));
+    }
+}
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Prints the timing distribution and deviation of each kernel, returns false
+ * if any deviation is out of tolerance. */
+static bool report_results(void)
+{
+    bool ok = true;
+    printf("%-10s %10s %10s %10s %10s %12s\n",
+        "Kernel", "Min/us", "Median/us", "Mean/us", "Max/us", "Deviation");
+    for (unsigned int k = 0; k < KERNEL_COUNT; k ++)
+    {
+        unsigned int count = sample_count[k];
+        double *sample = samples[k];
+        qsort(sample, count, sizeof(double), compare_double);
+        double total = 0;
+        for (unsigned int i = 0; i < count; i ++)
+            total += sample[i];
+
+        bool pass = deviations[k] <= kernel_info[k].tolerance;
+        printf("%-10s %10.2f %10.2f %10.2f %10.2f %12.4g%s\n",
+            kernel_info[k].name, sample[0], sample[count / 2],
+            total / count, sample[count - 1], deviations[k],
+            pass ? "" : "  FAIL");
+        ok = ok  &&  pass;
+    }
+    return ok;
+}
+
+
+static bool process_corpus(unsigned int count, char *filenames[])
+{
+    struct corpus_sweep *sweep = malloc(sizeof(struct corpus_sweep));
+    struct kernel_outputs *out = malloc(sizeof(struct kernel_outputs));
+    struct kernel_outputs *golden = malloc(sizeof(struct kernel_outputs));
+
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < count; i ++)
+    {
+        char *golden_file = golden_filename(filenames[i]);
+        ok = read_corpus_sweep(filenames[i], sweep);
+        if (ok  &&  save_golden)
+        {
+            run_sweep_kernels(sweep, out, NULL);
+            ok = write_golden(golden_file, out);
+        }
+        else if (ok)
+        {
+            ok = read_golden(golden_file, golden);
+            if (ok)
+                run_sweep_kernels(sweep, out, golden);
+        }
+        free(golden_file);
+    }
+
+    free(sweep);
+    free(out);
+    free(golden);
+    return ok;
+}
+
+
+static bool parse_args(int argc, char *argv[])
+{
+    bool ok = true;
+    int opt;
+    while (ok  &&  (opt = getopt(argc, argv, "gr:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'g':
+                save_golden = true;
+                break;
+            case 'r':
+                repeat_count = (unsigned int) atoi(optarg);
+                ok = TEST_OK_(0 < repeat_count  &&  repeat_count <= MAX_REPEAT,
+                    "Repeat count must be between 1 and %d", MAX_REPEAT);
+                break;
+            default:
+                ok = false;
+        }
+    }
+    return
+        ok  &&
+        TEST_OK_(optind < argc,
+            "Usage: %s [-g] [-r repeat] corpus-file...", argv[0]);
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (!parse_args(argc, argv))
+        return 2;
+
+    unsigned int sweeps = (unsigned int) (argc - optind);
+    for (unsigned int k = 0; k < KERNEL_COUNT; k ++)
+        samples[k] = malloc(sweeps * repeat_count * sizeof(double));
+
+    if (!process_corpus(sweeps, &argv[optind]))
+        return 2;
+    prepare_batch();
+    run_scalar_kernels();
+    check_scalar_kernels();
+
+    bool ok = report_results();
+    if (save_golden)
+        printf("Golden outputs written for %u sweeps\n", sweeps);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,130 @@
+# Generates the synthetic sweep corpus used by the kernel tests.
+#
+# Each sweep is written in the layout read by kernel_tests.c, all values little
+# endian:
+#
+#   char magic[8]               "TMBFKC01"
+#   uint32 sweep_length         Number of valid sweep points
+#   uint32 peak_count           Number of peak ranges for fitting
+#   uint32 ranges[5][2]         Left and right sweep index of each peak range
+#   int16 buffer_low[16384]     Raw I for four channels, interleaved
+#   int16 buffer_high[16384]    Raw Q for four channels, interleaved
+#   int32 rotation[4096][2]     Delay compensation, 2^30 * (cos, sin)
+#   float64 tune_scale[4096]    Tune of each sweep point
+#
+# The raw buffers are computed so that IQ extraction recovers a sum of one pole
+# resonances together with a little background and noise, and the peak ranges
+# cover each resonance in descending order of size, as the first peak fit would
+# have found them.  Recorded sweeps can be added to the corpus in the same
+# layout.
+#
+# Usage: make_corpus.py output-directory
+
+import sys
+import os
+import math
+import cmath
+import random
+import struct
+
+
+TUNE_LENGTH = 4096
+CHANNELS = 4
+MAX_PEAKS = 5
+
+
+# Each sweep is described by its length, tune range, delay in turns used for
+# the rotation, noise level and a list of resonances given as (tune, width,
+# height, phase in degrees).
+SWEEPS = [
+    ('single', dict(
+        length = 4096, start = 0.15, end = 0.35, delay = 12.3,
+        noise = 50, background = 40,
+        peaks = [(0.27, 0.004, 6000, 30)])),
+    ('sidebands', dict(
+        length = 4096, start = 0.20, end = 0.30, delay = 7.9,
+        noise = 150, background = 100,
+        peaks = [
+            (0.250, 0.0020, 5000, -60),
+            (0.244, 0.0015, 1500, 120),
+            (0.256, 0.0015, 1200, 100)])),
+    ('reversed', dict(
+        length = 1000, start = 0.45, end = 0.05, delay = 3.1,
+        noise = 300, background = 0,
+        peaks = [
+            (0.31, 0.010, 3000, 0),
+            (0.34, 0.006, 1800, 90)])),
+]
+
+
+def response(f, peaks, background):
+    z = background
+    for tune, width, height, phase in peaks:
+        a = 1j * width * height * cmath.exp(1j * math.radians(phase))
+        z += a / (f - (tune - 1j * width))
+    return z
+
+
+def clip(x):
+    return max(-32768, min(32767, int(round(x))))
+
+
+def peak_ranges(sweep, scale):
+    peaks = sorted(sweep['peaks'], key = lambda p: -p[2])[:MAX_PEAKS]
+    length = sweep['length']
+    ranges = []
+    for tune, width, height, phase in peaks:
+        inside = [i for i in range(length)
+            if abs(scale[i] - tune) <= 3 * width]
+        ranges.append((min(inside), max(inside)))
+    return ranges
+
+
+def make_sweep(seed, sweep):
+    random.seed(seed)
+    length = sweep['length']
+    start = sweep['start']
+    end = sweep['end']
+    scale = [start + (end - start) * i / (length - 1) for i in range(length)]
+    scale.extend([scale[-1]] * (TUNE_LENGTH - length))
+
+    rotation = []
+    for f in scale:
+        phase = 2 * math.pi * math.fmod(f * sweep['delay'], 1)
+        rotation.append((
+            int(round(2**30 * math.cos(phase))),
+            int(round(2**30 * math.sin(phase)))))
+
+    # Extraction computes half the rotated raw value, and the channel gains
+    # differ slightly.
+    raw_i = [0] * (CHANNELS * TUNE_LENGTH)
+    raw_q = [0] * (CHANNELS * TUNE_LENGTH)
+    for i in range(length):
+        z = response(scale[i], sweep['peaks'], sweep['background'])
+        phase = 2 * math.pi * math.fmod(scale[i] * sweep['delay'], 1)
+        for c in range(CHANNELS):
+            noise = complex(
+                random.gauss(0, sweep['noise']),
+                random.gauss(0, sweep['noise']))
+            raw = 2 * ((1 + 0.05 * c) * z + noise) * cmath.exp(-1j * phase)
+            raw_i[CHANNELS * i + c] = clip(raw.real)
+            raw_q[CHANNELS * i + c] = clip(raw.imag)
+
+    ranges = peak_ranges(sweep, scale)
+    padded = ranges + [(0, 0)] * (MAX_PEAKS - len(ranges))
+
+    data = [b'TMBFKC01', struct.pack('<II', length, len(ranges))]
+    for left, right in padded:
+        data.append(struct.pack('<II', left, right))
+    data.append(struct.pack('<%dh' % len(raw_i), *raw_i))
+    data.append(struct.pack('<%dh' % len(raw_q), *raw_q))
+    for rot_i, rot_q in rotation:
+        data.append(struct.pack('<ii', rot_i, rot_q))
+    data.append(struct.pack('<%dd' % TUNE_LENGTH, *scale))
+    return b''.join(data)
+
+
+output = sys.argv[1]
+for seed, (name, sweep) in enumerate(SWEEPS):
+    with open(os.path.join(output, name + '.sweep'), 'wb') as f:
+        f.write(make_sweep(seed, sweep))
@@ -0,0 +1,14 @@
+# Derived waveforms are only computed when monitored or needed for processing
+
+from common import *
+
+
+boolOut('DERIVED:MODE', 'On demand', 'Always',
+    DESC = 'Derived waveform computation')
+
+# Computation statistics published for each derived waveform.
+def derived_stats(name):
+    longIn('%s:COUNT' % name, SCAN = '1 second', DESC = 'Times computed')
+    longIn('%s:SKIP' % name, SCAN = '1 second', DESC = 'Times not computed')
+    aIn('%s:TIME' % name, 0, 10, 'ms', 3, SCAN = '1 second',
+        DESC = 'Last computation time')
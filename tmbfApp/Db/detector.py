@@ -3,6 +3,7 @@
 from common import *
 
 import tune
+from derived import derived_stats
 
 
 mbbOut('DET:GAIN', DESC = 'Detector gain', *dBrange(7, -12) + ['-120dB'])
@@ -12,6 +13,8 @@ mbbOut('DET:INPUT', 'ADC', 'FIR',
     DESC = 'Detector input selection')
 boolOut('DET:AUTOGAIN', 'Fixed Gain', 'Autogain',
     DESC = 'Detector automatic gain')
+mbbOut('DET:AUTOGAIN:MODE', 'Step', 'Predictive',
+    DESC = 'Detector autogain algorithm')
 
 for bunch in range(4):
     bunch_select = longOut('DET:BUNCH%d' % bunch, 0, BUNCHES_PER_TURN/4-1,
@@ -28,7 +31,10 @@ Trigger('DET:SCALE',
     aIn('DET:DELAY', PREC = 3, EGU = 'turns', DESC = 'Detector delay'),
     Waveform('DET:SCALE', TUNE_LENGTH, 'DOUBLE',
         DESC = 'Scale for frequency sweep'),
-    Waveform('DET:TIMEBASE', TUNE_LENGTH, 'LONG', DESC = 'Timebase scale'))
+    Waveform('DET:TIMEBASE', TUNE_LENGTH, 'LONG', DESC = 'Timebase scale'),
+    # Statistics for the cache of recent detector scales.
+    longIn('DET:CACHE:HITS', DESC = 'Scale cache hits'),
+    longIn('DET:CACHE:MISSES', DESC = 'Scale cache misses'))
 
 # Three overflow detection bits are generated
 overflows = [
@@ -55,13 +61,49 @@ def SweepChannel(name, desc):
 
 bunch_channels = [SweepChannel(b, 'Bunch %s' % b) for b in '0123']
 mean_channel = SweepChannel('M', 'Bunch mean')
-Trigger('DET', *concat(bunch_channels) + mean_channel + overflows)
+# Autogain statistics are updated with each sweep.
+autogain_stats = [
+    Waveform('DET:AUTOGAIN:HIST', 17, 'LONG',
+        DESC = 'Peak magnitude histogram by bits'),
+    longIn('DET:AUTOGAIN:SETTLE', DESC = 'Sweeps for last gain settle'),
+    longIn('DET:AUTOGAIN:WASTED', DESC = 'Sweeps with wrong gain'),
+    longIn('DET:AUTOGAIN:CHANGES', DESC = 'Number of gain changes')]
+Trigger('DET',
+    *concat(bunch_channels) + mean_channel + overflows + autogain_stats)
+for channel in '0123M':
+    derived_stats('DET:POWER:%s' % channel)
 
 
 # Control over the internal detector window.
 det_window = WaveformOut('DET:WINDOW', 1024, 'FLOAT', DESC = 'Detector window')
-Action('DET:RESET_WIN', FLNK = det_window,
-    DESC = 'Reset detector window to Hamming')
+reset_window = Action('DET:RESET_WIN', FLNK = det_window,
+    DESC = 'Reset detector window to selected type')
+
+# Built in window functions, selecting a window or changing its parameter
+# reloads the window.
+for record in [
+        mbbOut('DET:WINDOW:TYPE',
+            'Hamming', 'Kaiser', 'Blackman-Harris', 'Flat top', 'Tukey',
+            'DPSS', DESC = 'Detector window type'),
+        aOut('DET:WINDOW:BETA', 0, 40, PREC = 2, VAL = 8.6,
+            DESC = 'Kaiser window beta'),
+        aOut('DET:WINDOW:ALPHA', 0, 1, PREC = 3, VAL = 0.5,
+            DESC = 'Tukey window taper fraction'),
+        aOut('DET:WINDOW:NW', 0.5, 16, PREC = 2, VAL = 4,
+            DESC = 'DPSS time bandwidth product')]:
+    record.FLNK = reset_window
+
+# Window metrics for the loaded window at the current sweep dwell time.
+aIn('DET:WINDOW:ENBW', PREC = 3, EGU = 'bins', SCAN = '1 second',
+    FLNK = create_fanout('DET:WINDOW:FAN',
+        aIn('DET:WINDOW:BW', PREC = 6, EGU = 'tune',
+            DESC = 'Window noise bandwidth'),
+        aIn('DET:WINDOW:GAIN', PREC = 4, DESC = 'Window coherent gain'),
+        aIn('DET:WINDOW:SCALLOP', PREC = 3, EGU = 'dB',
+            DESC = 'Window scalloping loss'),
+        aIn('DET:WINDOW:SIDELOBE', PREC = 1, EGU = 'dB',
+            DESC = 'Window peak sidelobe level')),
+    DESC = 'Window equivalent noise bandwidth')
 
 # Total loop delay in turns.
 aOut('DET:LOOP:ADC',
@@ -69,3 +111,23 @@ aOut('DET:LOOP:ADC',
 
 
 stringIn('TUNE:MODE', SCAN = '1 second', DESC = 'Tune mode')
+
+
+# Sweeps are queued for processing by a separate worker thread.
+longIn('DET:QUEUE:DEPTH', 0, 2, SCAN = '1 second',
+    DESC = 'Sweeps waiting for processing')
+longIn('DET:QUEUE:MAX', 0, 2, SCAN = '1 second',
+    DESC = 'Maximum sweep queue depth')
+longIn('DET:QUEUE:DROPPED', SCAN = '1 second',
+    DESC = 'Sweeps dropped as queue full')
+
+
+# Benchmarking of IQ extraction.  Compares the time taken by the fused single
+# pass extraction with the original implementation on the last captured buffer.
+Action('DET:BENCH', DESC = 'Benchmark IQ extraction')
+stringIn('DET:BENCH:KERNEL', PINI = 'YES', DESC = 'IQ extraction kernel')
+Trigger('DET:BENCH',
+    aIn('DET:BENCH:REF', 0, 10, 'ms', 3, DESC = 'Reference extraction time'),
+    aIn('DET:BENCH:FUSED', 0, 10, 'ms', 3, DESC = 'Fused extraction time'),
+    longIn('DET:BENCH:LENGTH', DESC = 'Benchmark sweep length'),
+    longIn('DET:BENCH:DIFF', DESC = 'Largest IQ discrepancy'))
@@ -0,0 +1,25 @@
+# Coupled bunch mode scan analysis
+
+from common import *
+
+
+boolOut('MODE:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Enable mode scan analysis')
+
+Trigger('MODE',
+    mbbIn('MODE:STATUS', 'Ok', 'No scan', 'No fits',
+        DESC = 'Mode scan status'),
+    longIn('MODE:COUNT', DESC = 'Number of modes measured'),
+    longIn('MODE:UNSTABLE', DESC = 'Number of growing modes'),
+    longIn('MODE:LEAST', 0, BUNCHES_PER_TURN - 1,
+        DESC = 'Least stable mode'),
+    aIn('MODE:MIN_DAMPING', PREC = 5, EGU = '1/turn',
+        DESC = 'Damping rate of least stable mode'),
+    Waveform('MODE:TUNE', BUNCHES_PER_TURN, 'DOUBLE',
+        DESC = 'Tune for each mode'),
+    Waveform('MODE:DAMPING', BUNCHES_PER_TURN, 'DOUBLE',
+        DESC = 'Damping rate for each mode'),
+    Waveform('MODE:AMPLITUDE', BUNCHES_PER_TURN, 'DOUBLE',
+        DESC = 'Response amplitude for each mode'),
+    Waveform('MODE:POWER', BUNCHES_PER_TURN, 'DOUBLE',
+        DESC = 'Response power for each mode in dB'))
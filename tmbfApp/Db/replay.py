@@ -0,0 +1,33 @@
+# Soak replay of recorded or injected sweeps through the processing path
+
+from common import *
+
+
+Action('DET:REPLAY:RECORD', DESC = 'Record next captured sweeps')
+longOut('DET:REPLAY:DEPTH', 1, 16, VAL = 16, DESC = 'Sweeps to record')
+longIn('DET:REPLAY:RECORDED', 0, 16, SCAN = '1 second',
+    DESC = 'Number of recorded sweeps')
+mbbOut('DET:REPLAY:SOURCE', 'Recorded', 'Injected', 'Synthetic',
+    DESC = 'Source of replayed sweeps')
+longOut('DET:REPLAY:COUNT', VAL = 1000,
+    DESC = 'Sweeps to replay, 0 until stopped')
+Action('DET:REPLAY:START', DESC = 'Start replay')
+Action('DET:REPLAY:STOP', DESC = 'Stop replay')
+
+mbbIn('DET:REPLAY:STATUS', 'Idle', 'Running', 'No data',
+    SCAN = '1 second', DESC = 'Replay status')
+longIn('DET:REPLAY:DONE', SCAN = '1 second', DESC = 'Sweeps replayed')
+aIn('DET:REPLAY:RATE', 0, 1000, 'Hz', 1, SCAN = '1 second',
+    DESC = 'Sustained sweep rate')
+aIn('DET:REPLAY:CPU', 0, 100, '%', 1, SCAN = '1 second',
+    DESC = 'IOC CPU usage during replay')
+aIn('DET:REPLAY:QUEUE', 0, 1000, 'ms', 3, SCAN = '1 second',
+    DESC = 'Mean time waiting in queue')
+aIn('DET:REPLAY:DET', 0, 1000, 'ms', 3, SCAN = '1 second',
+    DESC = 'Mean detector processing time')
+aIn('DET:REPLAY:TUNE', 0, 1000, 'ms', 3, SCAN = '1 second',
+    DESC = 'Mean tune processing time')
+aIn('DET:REPLAY:TOTAL', 0, 1000, 'ms', 3, SCAN = '1 second',
+    DESC = 'Mean total sweep latency')
+aIn('DET:REPLAY:MAX', 0, 1000, 'ms', 3, SCAN = '1 second',
+    DESC = 'Maximum total sweep latency')
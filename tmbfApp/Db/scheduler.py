@@ -0,0 +1,43 @@
+# Interleaved scheduling of stored sweep configurations
+
+from common import *
+
+import tune
+
+
+SCHEDULE_CONFIGS = 4
+
+boolOut('SCHED:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Interleave stored sweep configurations')
+Action('SCHED:RESET', DESC = 'Reset scheduler statistics')
+longIn('SCHED:CURRENT', 0, SCHEDULE_CONFIGS, SCAN = '1 second',
+    DESC = 'Configuration of current sweep')
+longOut('SCHED:PRIMARY', 0, SCHEDULE_CONFIGS,
+    DESC = 'Configuration updating main results')
+longIn('SCHED:SWITCHES', SCAN = '1 second',
+    DESC = 'Number of configuration switches')
+aIn('SCHED:SWITCH', 0, 100, 'ms', 2, SCAN = '1 second',
+    DESC = 'Last configuration switch time')
+aIn('SCHED:SWITCH:MAX', 0, 100, 'ms', 2, SCAN = '1 second',
+    DESC = 'Longest configuration switch time')
+aIn('SCHED:SWITCH:MEAN', 0, 100, 'ms', 2, SCAN = '1 second',
+    DESC = 'Mean configuration switch time')
+
+for n in range(1, SCHEDULE_CONFIGS + 1):
+    prefix = 'SCHED:%d' % n
+    stringOut('%s:NAME' % prefix, DESC = 'Configuration name')
+    longOut('%s:WEIGHT' % prefix, 0, 100, VAL = 1,
+        DESC = 'Relative sweep rate, 0 to skip')
+    Action('%s:STORE' % prefix, DESC = 'Store current sweep settings')
+    Action('%s:CLEAR' % prefix, DESC = 'Discard stored settings')
+    boolIn('%s:STORED' % prefix, 'Empty', 'Stored', SCAN = '1 second',
+        DESC = 'Configuration stored')
+    longIn('%s:POINTS' % prefix, 0, 4096, SCAN = '1 second',
+        DESC = 'Points captured per sweep')
+    longIn('%s:SWEEPS' % prefix, SCAN = '1 second',
+        DESC = 'Sweeps with this configuration')
+
+    Trigger('%s:RESULT' % prefix,
+        *tune.tune_results('%s:BASIC' % prefix) +
+        tune.tune_results('%s:PEAK' % prefix) +
+        [longIn('%s:RESULTS' % prefix, DESC = 'Sweeps processed')])
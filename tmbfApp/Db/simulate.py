@@ -0,0 +1,26 @@
+# Synthetic beam response generator, used as a replay source
+
+from common import *
+
+
+aOut('SIM:TUNE', 0, 1, PREC = 4, VAL = 0.2, DESC = 'Simulated tune')
+aOut('SIM:WIDTH', 0, 0.1, PREC = 5, VAL = 0.002,
+    DESC = 'Simulated resonance half width')
+aOut('SIM:AMPLITUDE', 0, 65536, PREC = 0, VAL = 8000,
+    DESC = 'Peak response at gain 0')
+aOut('SIM:SPREAD', -0.1, 0.1, PREC = 5, DESC = 'Tune step between channels')
+aOut('SIM:SYNC', 0, 0.1, PREC = 5, VAL = 0.005, DESC = 'Synchrotron tune')
+aOut('SIM:SIDEBAND', 0, 1, PREC = 3, VAL = 0.2,
+    DESC = 'Relative sideband amplitude')
+aOut('SIM:COUPLE:TUNE', 0, 1, PREC = 4, VAL = 0.25,
+    DESC = 'Coupling peak tune')
+aOut('SIM:COUPLE', 0, 1, PREC = 3, DESC = 'Relative coupling peak amplitude')
+aOut('SIM:NOISE', 0, 10000, PREC = 1, VAL = 50,
+    DESC = 'Noise standard deviation')
+longOut('SIM:SEED', VAL = 1, DESC = 'Noise generator seed')
+Action('SIM:RESET', DESC = 'Restart noise sequence')
+
+longIn('SIM:COUNT', SCAN = '1 second', DESC = 'Sweeps generated')
+longIn('SIM:OVERFLOWS', SCAN = '1 second', DESC = 'Saturated sweeps')
+aIn('SIM:DURATION', 0, 1000, 'ms', 3, SCAN = '1 second',
+    DESC = 'Time to generate last sweep')
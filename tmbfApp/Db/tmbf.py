@@ -12,7 +12,20 @@ import sequencer    # SEQ
 import triggers     # TRG
 import tune         # TUNE
 import tune_peaks   # PEAK
+import tune_average # TUNE:AVG
+import tune_segments # TUNE:SEG
+import mode_scan    # MODE
+import tune_channels # TUNE:CHAN
+import tune_history # TUNE:HIST
+import tune_zoom    # TUNE:ZOOM
+import tune_dwell   # TUNE:DWELL
+import replay       # DET:REPLAY
+import simulate     # SIM
+import scheduler    # SCHED
+import tune_multicast # TUNE:MCAST
+import tune_kalman  # TUNE:KF
 import tune_follow  # FTUN
+import derived      # DERIVED
 
 
 stringIn('VERSION', PINI = 'YES', DESC = 'TMBF version')
@@ -116,3 +116,14 @@ Trigger('TRG:TICK',
         INPA = jitter, INPB = trigger_count, HIGH = 0.001, HSV = 'MAJOR',
         DESC = 'Jitter count percentage'))
 Action('TRG:RESET_COUNT', DESC = 'Reset trigger count')
+
+
+# Event polling.  The monitor thread adapts its poll interval to the level of
+# activity, so we report the current interval and an estimate of the delay added
+# by polling, taken as half the poll interval.  Hardware events are not
+# timestamped, so this is not a measured latency.
+Trigger('TRG:POLL',
+    aIn('TRG:POLL', 0, 100, 'ms', 1, DESC = 'Event poll interval'),
+    aIn('TRG:POLL:DELAY', 0, 100, 'ms', 2, DESC = 'Estimated polling delay'),
+    aIn('TRG:POLL:DELAY:MAX', 0, 100, 'ms', 2,
+        DESC = 'Maximum estimated polling delay'))
@@ -1,6 +1,7 @@
 # Tune control
 
 from common import *
+from derived import derived_stats
 
 
 # Common controls for simple tune control
@@ -59,6 +60,8 @@ Trigger('TUNE',
 
     aIn('TUNE:MEANPOWER', DESC = 'Mean tune power'),
     longIn('TUNE:MAXPOWER', DESC = 'Maximum tune power'),
+    boolIn('TUNE:SYNTHETIC', 'Beam', 'Synthetic', OSV = 'MINOR',
+        DESC = 'Sweep from replay or injection'),
 
     # Cumsum waveforms for easy viewing of phase information
     Waveform('TUNE:CUMSUMI', TUNE_LENGTH, 'LONG', DESC = 'Cumsum I'),
@@ -72,6 +75,9 @@ Trigger('TUNE',
 
 Trigger('TUNE:RESULT', *tune_results('TUNE', '$(DEVICE):TUNE'))
 
+derived_stats('TUNE:PHASEWF')
+derived_stats('TUNE:CUMSUMI')
+
 
 mbbOut('TUNE:SELECT', 'Basic', 'Peak Fit', 'Tune PLL',
     DESC = 'Select tune measurement algorithm')
@@ -0,0 +1,13 @@
+# Coherent averaging of tune sweeps
+
+from common import *
+
+
+mbbOut('TUNE:AVG:MODE', 'Block', 'Exponential', DESC = 'Tune sweep averaging')
+mbbOut('TUNE:AVG:COUNT', *['%d' % (1 << n) for n in range(7)],
+    DESC = 'Number of sweeps to average')
+Action('TUNE:AVG:RESET', DESC = 'Restart tune sweep averaging')
+
+Trigger('TUNE:AVG',
+    aIn('TUNE:AVG:N', 0, 64, PREC = 1, DESC = 'Effective sweep count'),
+    aIn('TUNE:AVG:SNR', -20, 60, 'dB', 1, DESC = 'Averaged sweep SNR'))
@@ -0,0 +1,24 @@
+# Tune measurement on all four detector channels
+
+from common import *
+
+import tune
+
+
+boolOut('TUNE:CHAN:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Enable tune fit for each channel')
+boolOut('TUNE:CHAN:JOINT', 'Disabled', 'Enabled',
+    DESC = 'Enable joint fit of all channels')
+aOut('TUNE:CHAN:THRESHOLD', 0, 1, PREC = 2, VAL = 0.3,
+    DESC = 'Fraction of peak power to fit')
+
+def channel_results(name):
+    prefix = 'TUNE:CHAN:%s' % name
+    return tune.tune_results(prefix) + [
+        aIn('%s:WIDTH' % prefix, 0, 0.1, PREC = 5, DESC = 'Peak width'),
+        aIn('%s:ERROR' % prefix, 0, 1, PREC = 3, DESC = 'Relative fit error')]
+
+Trigger('TUNE:CHAN',
+    *concat([channel_results(name) for name in ['0', '1', '2', '3', 'JOINT']])
+    + [aIn('TUNE:CHAN:DURATION', PREC = 1, EGU = 'ms',
+        DESC = 'Processing time')])
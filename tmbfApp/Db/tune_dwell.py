@@ -0,0 +1,36 @@
+# Adaptive sweep dwell time control
+
+from common import *
+
+
+boolOut('TUNE:DWELL:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Enable adaptive dwell control')
+aOut('TUNE:DWELL:TARGET', 0, 60, 'dB', 1, VAL = 20,
+    DESC = 'Target tune peak SNR')
+aOut('TUNE:DWELL:DEADBAND', 0, 20, 'dB', 1, VAL = 3,
+    DESC = 'SNR range left alone')
+aOut('TUNE:DWELL:MAXERR', 0, 1, PREC = 3, VAL = 0.2,
+    DESC = 'Maximum tune peak fit error')
+longOut('TUNE:DWELL:MIN', 1, 1<<16, VAL = 1, DESC = 'Minimum dwell time')
+longOut('TUNE:DWELL:MAX', 1, 1<<16, VAL = 1000, DESC = 'Maximum dwell time')
+longOut('TUNE:DWELL:MINCOUNT', 1, 4096, VAL = 256,
+    DESC = 'Minimum capture count')
+longOut('TUNE:DWELL:MAXCOUNT', 1, 4096, VAL = 4096,
+    DESC = 'Maximum capture count')
+longOut('TUNE:DWELL:FILTER', 1, 100, VAL = 4,
+    DESC = 'Sweeps averaged per decision')
+
+mbbIn('TUNE:DWELL:STATUS',
+    'Off', 'Settling', 'Holding', 'Longer', 'Shorter', 'At limit',
+    SCAN = '1 second', DESC = 'Dwell controller status')
+aIn('TUNE:DWELL:SNR', -20, 80, 'dB', 1, SCAN = '1 second',
+    DESC = 'Filtered tune peak SNR')
+aIn('TUNE:DWELL:ERROR', 0, 1, PREC = 4, SCAN = '1 second',
+    DESC = 'Filtered tune peak fit error')
+longIn('TUNE:DWELL:DWELL', SCAN = '1 second', DESC = 'Current dwell time')
+longIn('TUNE:DWELL:COUNT', 0, 4096, SCAN = '1 second',
+    DESC = 'Current capture count')
+aIn('TUNE:DWELL:RATE', 0, 1000, 'Hz', 2, SCAN = '1 second',
+    DESC = 'Achieved sweep rate')
+longIn('TUNE:DWELL:CHANGES', SCAN = '1 second',
+    DESC = 'Number of dwell adjustments')
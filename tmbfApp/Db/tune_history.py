@@ -0,0 +1,44 @@
+# History of tune results with rolling statistics
+
+from common import *
+
+
+HISTORY_LENGTH = 1024
+
+longOut('TUNE:HIST:WINDOW', 1, HISTORY_LENGTH, VAL = 100,
+    DESC = 'Results in statistics window')
+aOut('TUNE:HIST:PERIOD', 0, 3600, 's', 1,
+    DESC = 'Maximum result age, 0 for no limit')
+Action('TUNE:HIST:RESET', DESC = 'Discard tune history')
+
+def tune_history(name, desc):
+    prefix = 'TUNE:HIST:%s' % name
+    pvs = [
+        Waveform('%s:TUNE' % prefix, HISTORY_LENGTH, 'FLOAT',
+            DESC = '%s tune history' % desc),
+        Waveform('%s:PHASE' % prefix, HISTORY_LENGTH, 'FLOAT',
+            DESC = '%s phase history' % desc),
+        Waveform('%s:TIME' % prefix, HISTORY_LENGTH, 'FLOAT',
+            DESC = '%s result times' % desc),
+        Waveform('%s:STATUS' % prefix, HISTORY_LENGTH, 'CHAR',
+            DESC = '%s result status' % desc),
+        longIn('%s:LENGTH' % prefix, 0, HISTORY_LENGTH,
+            DESC = 'Number of results in history'),
+        longIn('%s:TOTAL' % prefix, DESC = 'Total results received'),
+        longIn('%s:SAMPLES' % prefix, 0, HISTORY_LENGTH,
+            DESC = 'Good results in window'),
+        aIn('%s:MEAN' % prefix, 0, 1, PREC = 5, DESC = 'Mean tune'),
+        aIn('%s:STD' % prefix, 0, 0.1, PREC = 6,
+            DESC = 'Tune standard deviation'),
+        aIn('%s:MIN' % prefix, 0, 1, PREC = 5, DESC = 'Minimum tune'),
+        aIn('%s:MAX' % prefix, 0, 1, PREC = 5, DESC = 'Maximum tune'),
+        aIn('%s:AGE' % prefix, 0, 3600, 's', 1,
+            DESC = 'Time since last result'),
+    ]
+    Action('%s:SCAN' % prefix,
+        DESC = 'Update %s tune history' % desc, SCAN = '1 second',
+        FLNK = create_fanout('%s:FAN' % prefix, *pvs))
+
+tune_history('BASIC', 'Basic')
+tune_history('PEAK', 'Peak fit')
+tune_history('PLL', 'Tune PLL')
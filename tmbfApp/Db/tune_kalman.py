@@ -0,0 +1,43 @@
+# Kalman filter fusing sweep and tune follow tune measurements
+
+from common import *
+
+
+boolOut('TUNE:KF:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Enable Kalman tune estimate')
+Action('TUNE:KF:RESET', DESC = 'Restart filter and statistics')
+aOut('TUNE:KF:DRIFT', 0, 1, 'tune/rts', 6, VAL = 1e-4,
+    DESC = 'Tune random walk rate')
+aOut('TUNE:KF:GATE', 1, 100, 'sd', 1, VAL = 5,
+    DESC = 'Innovation rejection gate')
+longOut('TUNE:KF:FILTER', 1, 1000, VAL = 20,
+    DESC = 'Length of statistics filters')
+
+mbbIn('TUNE:KF:STATUS', 'Off', 'Waiting', 'Tracking', 'Restarted',
+    SCAN = '1 second', DESC = 'Kalman filter status')
+longIn('TUNE:KF:RESTARTS', SCAN = '1 second',
+    DESC = 'Restarts after rejections')
+
+Trigger('TUNE:KF',
+    aIn('TUNE:KF:TUNE', 0, 1, '', 5, DESC = 'Fused tune estimate'),
+    aIn('TUNE:KF:SD', 0, 1, '', 6, DESC = 'Tune estimate standard deviation'))
+
+for source, noise, name in [
+        ('SWEEP', 1e-4, 'sweep'), ('FTUN', 1e-5, 'tune follow')]:
+    prefix = 'TUNE:KF:%s' % source
+    aOut('%s:NOISE' % prefix, 0, 1, '', 6, VAL = noise,
+        DESC = 'Minimum %s noise' % name)
+    aIn('%s:SD' % prefix, 0, 1, '', 6, SCAN = '1 second',
+        DESC = 'Measured %s noise' % name)
+    aIn('%s:INNOV' % prefix, -0.5, 0.5, '', 6, SCAN = '1 second',
+        DESC = 'Last %s innovation' % name)
+    aIn('%s:BIAS' % prefix, -0.5, 0.5, '', 6, SCAN = '1 second',
+        DESC = 'Mean %s innovation' % name)
+    aIn('%s:NIS' % prefix, 0, 100, '', 2, SCAN = '1 second',
+        DESC = 'Normalised innovation squared')
+    aIn('%s:RATE' % prefix, 0, 1000, 'Hz', 2, SCAN = '1 second',
+        DESC = 'Measured %s update rate' % name)
+    longIn('%s:COUNT' % prefix, SCAN = '1 second',
+        DESC = 'Measurements from %s' % name)
+    longIn('%s:REJECT' % prefix, SCAN = '1 second',
+        DESC = 'Rejected %s measurements' % name)
@@ -0,0 +1,37 @@
+# UDP multicast of tune results
+
+from common import *
+
+
+stringOut('TUNE:MCAST:ADDR', VAL = '239.255.77.1',
+    DESC = 'Multicast group address')
+longOut('TUNE:MCAST:PORT', 1, 65535, VAL = 21920, DESC = 'UDP port')
+longOut('TUNE:MCAST:TTL', 0, 255, VAL = 1, DESC = 'Multicast time to live')
+boolOut('TUNE:MCAST:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Multicast tune results')
+Action('TUNE:MCAST:RESET', DESC = 'Reset multicast statistics')
+
+mbbIn('TUNE:MCAST:STATUS', 'Off', 'Sending', 'Error',
+    SCAN = '1 second', DESC = 'Multicast sender status')
+longIn('TUNE:MCAST:SENT', SCAN = '1 second', DESC = 'Datagrams sent')
+longIn('TUNE:MCAST:ERRORS', SCAN = '1 second', DESC = 'Datagrams not sent')
+aIn('TUNE:MCAST:SEND', 0, 1000, 'us', 1, SCAN = '1 second',
+    DESC = 'Time taken by last send')
+
+boolOut('TUNE:MCAST:RX:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Enable loopback receiver')
+mbbIn('TUNE:MCAST:RX:STATUS', 'Off', 'Receiving', 'Error',
+    SCAN = '1 second', DESC = 'Loopback receiver status')
+longIn('TUNE:MCAST:RX:COUNT', SCAN = '1 second', DESC = 'Datagrams received')
+longIn('TUNE:MCAST:RX:LOST', SCAN = '1 second',
+    DESC = 'Datagrams missing from sequence')
+longIn('TUNE:MCAST:RX:INVALID', SCAN = '1 second',
+    DESC = 'Malformed datagrams received')
+aIn('TUNE:MCAST:RX:LATENCY', 0, 10000, 'us', 1, SCAN = '1 second',
+    DESC = 'Mean delivery latency')
+aIn('TUNE:MCAST:RX:MAX', 0, 10000, 'us', 1, SCAN = '1 second',
+    DESC = 'Longest delivery latency')
+aIn('TUNE:MCAST:RX:TUNE', 0, 1, '', 5, SCAN = '1 second',
+    DESC = 'Last sweep tune received')
+aIn('TUNE:MCAST:RX:FTUN', 0, 1, '', 5, SCAN = '1 second',
+    DESC = 'Last tune follow tune received')
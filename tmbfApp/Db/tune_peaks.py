@@ -1,6 +1,8 @@
 # Tune peak detect
 
 from common import *
+from derived import derived_stats
+from tune_pyramid import PEAK_SCALINGS
 
 MAX_PEAKS = 5
 
@@ -65,7 +67,47 @@ Trigger('PEAK',
     longIn('PEAK:COUNT', DESC = 'Final fitted peak count'),
 
     aIn('PEAK:SYNCTUNE', 0, 1, PREC = 5, DESC = 'Synchrotron tune'),
+    aIn('PEAK:SNR', -20, 80, 'dB', 1, DESC = 'Tune peak signal to noise'),
+    aIn('PEAK:RESIDUAL', 0, 1, PREC = 4, DESC = 'Relative model residual'),
+    aIn('PEAK:ERROR', 0, 1, PREC = 4, DESC = 'Tune peak fit error'),
     aIn('PEAK:DURATION', PREC = 1, EGU = 'ms', DESC = 'Processing time'),
+    longIn('PEAK:AUTO:SCALING', DESC = 'Smoothing level searched'),
+    aIn('PEAK:AUTO:WIDTH', PREC = 1, DESC = 'Expected peak width in points'),
+
+    # Joint refinement results, the list must match the enum in tune_peaks.c
+    mbbIn('PEAK:LM:STATUS',
+        ('Off',             0, 'NO_ALARM'),
+        ('Converged',       1, 'NO_ALARM'),
+        ('Max iterations',  2, 'MINOR'),
+        ('Rejected',        3, 'MINOR'),
+        ('Failed',          4, 'MAJOR'),
+        DESC = 'Joint refinement status'),
+    longIn('PEAK:LM:ITER', DESC = 'Refinement steps taken'),
+    aIn('PEAK:LM:DURATION', PREC = 2, EGU = 'ms', DESC = 'Refinement time'),
+    aIn('PEAK:LM:BEFORE', 0, 1, PREC = 5, DESC = 'Residual before refinement'),
+    aIn('PEAK:LM:AFTER', 0, 1, PREC = 5, DESC = 'Residual after refinement'),
+    aIn('PEAK:LM:IMPROVE', 0, 40, 'dB', 2, DESC = 'Residual reduction'),
+    aIn('PEAK:LM:BACKGROUND', PREC = 1, DESC = 'Fitted background magnitude'),
+
+    # Tracking results, the list must match the enum in tune_peaks.c
+    mbbIn('PEAK:TRACK:STATUS',
+        ('Off',             0, 'NO_ALARM'),
+        ('Tracking',        1, 'NO_ALARM'),
+        ('Search',          2, 'NO_ALARM'),
+        ('Lost',            3, 'MINOR'),
+        ('Jump',            4, 'MINOR'),
+        DESC = 'Peak tracking status'),
+    longIn('PEAK:TRACK:SWEEPS', DESC = 'Sweeps since reset'),
+    longIn('PEAK:TRACK:FAST', DESC = 'Sweeps served by tracking'),
+    longIn('PEAK:TRACK:FALLBACK', DESC = 'Failed tracking attempts'),
+    aIn('PEAK:TRACK:FRACTION', 0, 1, PREC = 3,
+        DESC = 'Fraction of sweeps tracked'),
+    aIn('PEAK:TRACK:FULLTIME', PREC = 2, EGU = 'ms',
+        DESC = 'Mean full search time'),
+    aIn('PEAK:TRACK:FASTTIME', PREC = 2, EGU = 'ms',
+        DESC = 'Mean tracked sweep time'),
+    aIn('PEAK:TRACK:SAVED', PREC = 1, EGU = 's',
+        DESC = 'Processing time saved'),
 
 *
     # Peak detection support
@@ -81,4 +123,63 @@ aOut('PEAK:MINWIDTH', 0, 1, PREC = 2, DESC = 'Minimum valid peak width')
 aOut('PEAK:MAXWIDTH', 0, 1, PREC = 2, DESC = 'Maximum valid peak width')
 aOut('PEAK:FITERROR', 0, 10, PREC = 3, DESC = 'Maximum fit error')
 
-mbbOut('PEAK:SEL', '/16', '/64', DESC = 'Select smoothing')
+mbbOut('PEAK:SEL', *['/%d' % scaling for scaling in PEAK_SCALINGS] + ['Auto'],
+    DESC = 'Select smoothing')
+longOut('PEAK:AUTO:POINTS', 1, 64, VAL = 4,
+    DESC = 'Smoothed points across peak')
+
+# Optional joint Levenberg-Marquardt refinement of the final peak fits.
+boolOut('PEAK:LM:ENABLE', 'Off', 'On', DESC = 'Enable joint fit refinement')
+longOut('PEAK:LM:MAXITER', 1, 100, VAL = 10, DESC = 'Maximum refinement steps')
+
+# Incremental tracking seeded by the previous result.
+boolOut('PEAK:TRACK:ENABLE', 'Off', 'On', DESC = 'Enable peak tracking')
+aOut('PEAK:TRACK:JUMP', 0, 0.5, PREC = 4, VAL = 0.01,
+    DESC = 'Largest tune change tracked')
+Action('PEAK:TRACK:RESET', DESC = 'Reset tracking statistics')
+
+# The whole smoothing pyramid is computed together and takes its name from the
+# finest level.
+derived_stats('PEAK:POWER:%d' % PEAK_SCALINGS[0])
+for suffix in PEAK_SCALINGS:
+    derived_stats('PEAK:PDD:%d' % suffix)
+
+# Benchmarking of peak extraction.  Compares the single pass extraction with
+# the original implementation on synthetic data over a range of lengths, for
+# the normal number of peaks and for 32 peaks.
+BENCHMARK_LENGTHS = 4
+Action('PEAK:BENCH', DESC = 'Benchmark peak extraction')
+Trigger('PEAK:BENCH',
+    Waveform('PEAK:BENCH:LENGTH', BENCHMARK_LENGTHS, 'LONG',
+        DESC = 'Benchmark sweep lengths'),
+    Waveform('PEAK:BENCH:REF', BENCHMARK_LENGTHS, 'DOUBLE',
+        DESC = 'Reference extraction time in us'),
+    Waveform('PEAK:BENCH:FAST', BENCHMARK_LENGTHS, 'DOUBLE',
+        DESC = 'Single pass extraction time in us'),
+    Waveform('PEAK:BENCH:REFK', BENCHMARK_LENGTHS, 'DOUBLE',
+        DESC = 'Reference time for 32 peaks in us'),
+    Waveform('PEAK:BENCH:FASTK', BENCHMARK_LENGTHS, 'DOUBLE',
+        DESC = 'Single pass time for 32 peaks in us'),
+    longIn('PEAK:BENCH:DIFF', DESC = 'Mismatched peaks'))
+
+# Selection and benchmarking of peak fitting kernels.  The benchmark compares
+# the single precision and fixed point kernels with the double precision
+# reference on the last recorded sweep.
+mbbOut('PEAK:FIT:KERNEL', 'Build', 'Double', 'Float', 'Fixed',
+    DESC = 'Peak fitting implementation')
+Action('PEAK:FIT:BENCH', DESC = 'Benchmark fitting kernels')
+Action('PEAK:FIT:RESET', DESC = 'Reset worst fitting errors')
+fit_records = [longIn('PEAK:FIT:RUNS', DESC = 'Benchmark runs since reset')]
+for kernel in ['DOUBLE', 'FLOAT', 'FIXED']:
+    fit_records.extend([
+        aIn('PEAK:FIT:%s:TIME' % kernel, 0, 100, 'ms', 3,
+            DESC = '%s fit time' % kernel.capitalize()),
+        aIn('PEAK:FIT:%s:SPEEDUP' % kernel, 0, 100, '', 2,
+            DESC = 'Speedup over double'),
+        aIn('PEAK:FIT:%s:ERROR' % kernel, 0, 1, '', 7,
+            DESC = 'Largest tune error this run'),
+        aIn('PEAK:FIT:%s:WORST' % kernel, 0, 1, '', 7,
+            DESC = 'Largest tune error since reset'),
+        longIn('PEAK:FIT:%s:MISMATCH' % kernel,
+            DESC = 'Runs with different fit count')])
+Trigger('PEAK:FIT', *fit_records)
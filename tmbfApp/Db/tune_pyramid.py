@@ -0,0 +1,31 @@
+# Smoothing pyramid used for tune peak detection.  This is shared between the
+# peak records in tune_peaks.py and tune_peaks.c: run as a script it writes the
+# C definitions for tune_pyramid.h.
+
+# Decimation factor of each pyramid level from the level before, the first
+# level being decimated from the raw sweep.
+PYRAMID_FACTORS = [4, 4, 4]
+
+# Peaks are searched for on the levels from this level onwards.
+FIRST_PEAK_LEVEL = 1
+
+
+def pyramid_scalings():
+    scalings = []
+    ratio = 1
+    for factor in PYRAMID_FACTORS:
+        ratio *= factor
+        scalings.append(ratio)
+    return scalings
+
+# Scaling of each level searched for peaks, from finest to coarsest.
+PEAK_SCALINGS = pyramid_scalings()[FIRST_PEAK_LEVEL:]
+
+
+if __name__ == '__main__':
+    print('/* Generated by tune_pyramid.py, do not edit. */')
+    print('#define PYRAMID_LEVELS      %d' % len(PYRAMID_FACTORS))
+    print('#define FIRST_PEAK_LEVEL    %d' % FIRST_PEAK_LEVEL)
+    print('#define FIRST_PEAK_SCALING  %d' % PEAK_SCALINGS[0])
+    print('#define PYRAMID_FACTORS     { %s }' %
+        ', '.join(str(factor) for factor in PYRAMID_FACTORS))
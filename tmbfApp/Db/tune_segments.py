@@ -0,0 +1,22 @@
+# Segmented tune analysis for super sequencer sweeps
+
+from common import *
+from sequencer import SUPER_SEQ_STATES
+
+
+boolOut('TUNE:SEG:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Enable per segment tune analysis')
+
+Trigger('TUNE:SEG',
+    longIn('TUNE:SEG:COUNT', DESC = 'Number of segments fitted'),
+    longIn('TUNE:SEG:LENGTH', DESC = 'Points per segment'),
+    longIn('TUNE:SEG:GOOD', DESC = 'Number of successful fits'),
+    aIn('TUNE:SEG:DURATION', PREC = 1, EGU = 'ms', DESC = 'Processing time'),
+    Waveform('TUNE:SEG:TUNE', SUPER_SEQ_STATES, 'DOUBLE',
+        DESC = 'Tune for each segment'),
+    Waveform('TUNE:SEG:PHASE', SUPER_SEQ_STATES, 'DOUBLE',
+        DESC = 'Phase for each segment'),
+    Waveform('TUNE:SEG:AMPLITUDE', SUPER_SEQ_STATES, 'DOUBLE',
+        DESC = 'Peak amplitude for each segment'),
+    Waveform('TUNE:SEG:ERROR', SUPER_SEQ_STATES, 'DOUBLE',
+        DESC = 'Fit error for each segment'))
@@ -0,0 +1,33 @@
+# Adaptive zoom sweep planning
+
+from common import *
+
+
+boolOut('TUNE:ZOOM:ENABLE', 'Disabled', 'Enabled',
+    DESC = 'Enable adaptive zoom sweep')
+boolOut('TUNE:ZOOM:SIDEBANDS', 'Tune only', 'With sidebands',
+    DESC = 'Zoom on synchrotron sidebands')
+longOut('TUNE:ZOOM:COARSE', 1, 2048, VAL = 256,
+    DESC = 'Points in coarse full range sweep')
+longOut('TUNE:ZOOM:DENSE', 1, 4096, VAL = 256,
+    DESC = 'Points across each zoom window')
+aOut('TUNE:ZOOM:SPAN', 1, 50, PREC = 1, VAL = 5,
+    DESC = 'Window half width in peak widths')
+aOut('TUNE:ZOOM:MINWIN', 0, 0.1, PREC = 4, VAL = 0.001,
+    DESC = 'Minimum window half width')
+longOut('TUNE:ZOOM:MISSES', 1, 100, VAL = 3,
+    DESC = 'Failed fits before wide sweep')
+Action('TUNE:ZOOM:WIDE', DESC = 'Restore saved sweep setup')
+
+mbbIn('TUNE:ZOOM:STATUS', 'Off', 'Restored', 'Zoomed',
+    SCAN = '1 second', DESC = 'Zoom planner status')
+longIn('TUNE:ZOOM:STATES', 0, 7, SCAN = '1 second',
+    DESC = 'Sequencer states in plan')
+longIn('TUNE:ZOOM:POINTS', 0, 4096, SCAN = '1 second',
+    DESC = 'Sweep points in plan')
+longIn('TUNE:ZOOM:PLANS', SCAN = '1 second',
+    DESC = 'Number of sweeps planned')
+aIn('TUNE:ZOOM:STEP', 0, 0.01, PREC = 6, SCAN = '1 second',
+    DESC = 'Finest sweep step')
+aIn('TUNE:ZOOM:SPEEDUP', 0, 100, PREC = 1, SCAN = '1 second',
+    DESC = 'Uniform points over planned points')
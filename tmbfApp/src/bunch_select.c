@@ -16,6 +16,7 @@
 #include "epics_extra.h"
 #include "adc_dac.h"
 #include "tmbf.h"
+#include "event_wait.h"
 
 #include "bunch_select.h"
 
@@ -284,6 +285,11 @@ enum sync_status {
 };
 static unsigned int sync_status = SYNC_NO_SYNC;
 
+/* Bunch synchronisation is normally complete within a few turns, so poll
+ * quickly at first and back off to the original 20 ms polling if nothing
+ * happens. */
+static struct event_waiter *sync_waiter;
+
 static pthread_mutex_t bunch_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t bunch_sync_signal = PTHREAD_COND_INITIALIZER;
 enum sync_action { SYNC_ACTION_RESET, SYNC_ACTION_SYNC } sync_action;
@@ -318,18 +324,20 @@ static void update_status(unsigned int phase, enum sync_status status)
     interlock_signal(sync_interlock, NULL);
 }
 
-/* Triggers bunch synchronisation and busy waits for completion.  Returns
- * measured phase after successful synchronisation. */
+/* Triggers bunch synchronisation and waits for completion.  Returns measured
+ * phase after successful synchronisation. */
 static unsigned int wait_for_bunch_sync(void)
 {
     /* Configure selected zero bunch offset and request synchronisation. */
     hw_write_bun_sync();
+    notify_event(sync_waiter);
 
-    /* Busy loop until trigger seen. */
+    /* Poll until trigger seen. */
     unsigned int phase;
-    while (phase = hw_read_bun_trigger_phase(),
+    while (wait_for_event(sync_waiter),
+           phase = hw_read_bun_trigger_phase(),
            phase == 0)
-        usleep(20000);     // 20 ms
+        update_event_interval(sync_waiter, false, true);
     return phase;
 }
 
@@ -470,6 +478,8 @@ static bool publish_bunch_sync(void)
 
     PUBLISH_READER(stringin, "BUN:MODE", read_feedback_mode);
 
+    sync_waiter = create_event_waiter(1000, 20000, 20000);
+
     pthread_t thread_id;
     return TEST_PTHREAD(
         pthread_create(&thread_id, NULL, bunch_sync_thread, NULL));
@@ -0,0 +1,144 @@
+/* Lazy computation of derived waveforms. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dbAccess.h>
+#include <dbCommon.h>
+#include <ellLib.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "timing.h"
+
+#include "derived.h"
+
+
+/* Each derived waveform can be associated with a handful of records. */
+#define MAX_DERIVED_RECORDS     6
+
+struct derived_wf {
+    void (*compute)(void *context);
+    void *context;
+    bool stale;                 // Set until computed for current source data
+
+    /* Records to check for monitors, looked up after EPICS has started. */
+    unsigned int record_count;
+    const char *names[MAX_DERIVED_RECORDS];
+    struct dbCommon *records[MAX_DERIVED_RECORDS];
+    bool resolved;
+
+    /* Statistics. */
+    unsigned int compute_count; // Number of times computed
+    unsigned int skip_count;    // Number of updates not computed
+    double compute_time;        // Duration of last computation in ms
+};
+
+
+/* Device name prefix needed for record lookup. */
+static const char *device_name;
+
+/* If set then all derived waveforms are computed whether monitored or not. */
+static bool always_compute;
+
+
+struct derived_wf *register_derived_wf(
+    const char *name, void (*compute)(void *context), void *context)
+{
+    struct derived_wf *wf = malloc(sizeof(struct derived_wf));
+    *wf = (struct derived_wf) {
+        .compute = compute,
+        .context = context,
+    };
+    add_derived_record(wf, name);
+
+    char buffer[40];
+#define FORMAT(field) (sprintf(buffer, "%s:%s", name, field), buffer)
+    PUBLISH_READ_VAR(ulongin, FORMAT("COUNT"), wf->compute_count);
+    PUBLISH_READ_VAR(ulongin, FORMAT("SKIP"), wf->skip_count);
+    PUBLISH_READ_VAR(ai, FORMAT("TIME"), wf->compute_time);
+#undef FORMAT
+    return wf;
+}
+
+
+void add_derived_record(struct derived_wf *wf, const char *name)
+{
+    ASSERT_OK(wf->record_count < MAX_DERIVED_RECORDS);
+    wf->names[wf->record_count] = strdup(name);
+    wf->record_count += 1;
+}
+
+
+/* Record lookup has to wait until the database has been loaded.  Records that
+ * can't be found are reported once and treated as permanently monitored. */
+static void resolve_records(struct derived_wf *wf)
+{
+    for (unsigned int i = 0; i < wf->record_count; i ++)
+    {
+        char full_name[80];
+        snprintf(full_name, sizeof(full_name),
+            "%s:%s", device_name, wf->names[i]);
+        DBADDR address;
+        if (dbNameToAddr(full_name, &address) == 0)
+            wf->records[i] = address.precord;
+        else
+            print_error("Unable to find derived record %s", full_name);
+    }
+    wf->resolved = true;
+}
+
+
+/* A waveform is wanted if any of its records has a monitor attached.  We read
+ * the monitor count without taking the record lock: at worst we'll compute one
+ * sweep too many or too few when a client connects or disconnects. */
+static bool derived_wf_wanted(struct derived_wf *wf)
+{
+    if (always_compute  ||  !check_epics_ready())
+        return true;
+
+    if (!wf->resolved)
+        resolve_records(wf);
+    for (unsigned int i = 0; i < wf->record_count; i ++)
+    {
+        struct dbCommon *record = wf->records[i];
+        if (record == NULL  ||  ellCount(&record->mlis) > 0)
+            return true;
+    }
+    return false;
+}
+
+
+void require_derived_wf(struct derived_wf *wf)
+{
+    if (wf->stale)
+    {
+        TIC();
+        wf->compute(wf->context);
+        wf->compute_time = 1e3 * TOC();
+        wf->compute_count += 1;
+        wf->stale = false;
+    }
+}
+
+
+void update_derived_wf(struct derived_wf *wf)
+{
+    if (wf->stale)
+        wf->skip_count += 1;
+    wf->stale = true;
+    if (derived_wf_wanted(wf))
+        require_derived_wf(wf);
+}
+
+
+bool initialise_derived(const char *device)
+{
+    device_name = device;
+    PUBLISH_WRITE_VAR_P(bo, "DERIVED:MODE", always_compute);
+    return true;
+}
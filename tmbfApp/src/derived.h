@@ -0,0 +1,30 @@
+/* Lazy computation of derived waveforms.
+ *
+ * A derived waveform is a waveform computed from some other data purely for
+ * presentation or for a later processing stage.  Each derived waveform
+ * registers a compute function, and this is only called when the underlying
+ * record (or one of its associated records) is being monitored by a client, or
+ * when a downstream processing stage explicitly requires the result. */
+
+struct derived_wf;
+
+/* Registers a derived waveform.  The name is the name of the published
+ * waveform record (without device prefix) and is also used to publish
+ * <name>:COUNT, <name>:SKIP and <name>:TIME statistics. */
+struct derived_wf *register_derived_wf(
+    const char *name, void (*compute)(void *context), void *context);
+
+/* Adds a further record to be checked for monitors.  Use this where a single
+ * compute function updates more than one published record. */
+void add_derived_record(struct derived_wf *wf, const char *name);
+
+/* Called by the producer whenever the source data changes.  Marks the waveform
+ * as stale and then recomputes it if anybody is watching. */
+void update_derived_wf(struct derived_wf *wf);
+
+/* Called by consumers of the waveform to ensure that it is up to date. */
+void require_derived_wf(struct derived_wf *wf);
+
+/* Must be called before any waveforms are registered, the device name is
+ * needed to look up the records for monitor checking. */
+bool initialise_derived(const char *device_name);
@@ -8,7 +8,9 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <stddef.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "error.h"
 #include "hardware.h"
@@ -19,6 +21,11 @@
 #include "tune.h"
 #include "bunch_select.h"
 #include "tmbf.h"
+#include "timing.h"
+#include "derived.h"
+#include "window.h"
+#include "replay.h"
+#include "iq_extract.h"
 
 #include "detector.h"
 
@@ -44,6 +51,7 @@ static bool overflows[PULSED_BIT_COUNT];
  * detector gain up or down where necessary and possible. */
 static bool autogain_enable;
 static unsigned int detector_gain;
+static unsigned int capture_gain;   // Gain used for the current capture
 static struct epics_record *gain_setting;
 #define MAX_DET_GAIN    7       // 3 bit enumeration
 /* The gain will be pushed up if the signal is below this threshold.  This has
@@ -54,8 +62,32 @@ static struct epics_record *gain_setting;
  * this case.  Shift by an extra 6 bits on top of the 2 bits already counted. */
 #define MIN_GAIN_UP_THRESHOLD   (GAIN_UP_THRESHOLD >> 6)
 
+/* Predictive autogain selects the highest gain for which the predicted peak is
+ * below GAIN_TARGET, but only reduces gain when the observed peak exceeds
+ * GAIN_DOWN_THRESHOLD.  The gap between the two provides hysteresis. */
+enum { AUTOGAIN_STEP, AUTOGAIN_PREDICTIVE };
+static unsigned int autogain_mode;
+#define GAIN_TARGET             (4 * GAIN_UP_THRESHOLD)
+#define GAIN_DOWN_THRESHOLD     30000
+/* Histogram of peak magnitude for each point, binned by number of bits. */
+#define HISTOGRAM_BINS          17
+static int magnitude_histogram[HISTOGRAM_BINS];
+/* If on overflow at least 1/SATURATED_FRACTION of the points are above half
+ * full scale then we're well over range and drop the gain by two steps. */
+#define SATURATED_FRACTION      64
+#define HALF_SCALE_BIN          15
+
+/* Autogain convergence statistics. */
+static unsigned int settle_sweeps;      // Sweeps taken for last convergence
+static unsigned int settling_count;     // Sweeps so far in current convergence
+static unsigned int wasted_sweeps;      // Total sweeps at the wrong gain
+static unsigned int gain_changes;       // Total number of gain changes
+
 /* Completely analysed data from a successful detector sweep. */
 static struct sweep_info sweep_info;
+/* Power waveforms for the four channels and the mean are computed on demand. */
+static struct derived_wf *channel_power[4];
+static struct derived_wf *mean_power;
 /* Used to trigger update of all sweep info. */
 static struct epics_interlock *iq_trigger;
 
@@ -72,10 +104,10 @@ static struct epics_interlock *iq_trigger;
  * 500MHz RF frequency).
  *    For economy of calculation, we precompute the rotations as scaled
  * integers so that the final computation can be a simple integer
- * multiplication (one instruction when the compiler is in the right mood). */
+ * multiplication (one instruction when the compiler is in the right mood).  The
+ * I and Q rotations are interleaved as they are always used together. */
 static double adc_loop_delay;       // Base ADC loop delay as input by user
-static int rotate_I[TUNE_LENGTH];   // 2**30 * cos(phase)
-static int rotate_Q[TUNE_LENGTH];   // 2**30 * sin(phase)
+static struct rotation rotation[TUNE_LENGTH];
 
 /* Helper constants for fast tune scale and rotation waveform calculations
  * corresponding to multiplication by BUNCHES_PER_TURN*2^-32. */
@@ -85,28 +117,134 @@ static int wf_shift;
 static unsigned int detector_input; // FIR or ADC, affects compensated delay
 
 
-/* This is called each time an IQ waveform has been captured.  If autogain is
- * enabled we bump the gain up or down as appropriate if necessary and possible.
- * A certain amount of hystersis is added to avoid bouncing. */
-static void update_autogain(int abs_max)
-{
-    if (autogain_enable)
-    {
-        unsigned int new_gain = detector_gain;
-        if (overflows[OVERFLOW_IQ_SCALE])
-            /* Push gain down on overflow. */
-            new_gain += 1;
-        else if (detector_gain < MAX_DET_GAIN  &&  abs_max < GAIN_UP_THRESHOLD)
-            /* Push gain up if signal too low. */
-            new_gain -= 1;
-        else if (detector_gain == MAX_DET_GAIN  &&
-                 abs_max < MIN_GAIN_UP_THRESHOLD)
-            new_gain -= 1;
+/* Bumps the gain up or down by one step from the capture gain as appropriate
+ * if necessary and possible.  A certain amount of hystersis is added to avoid
+ * bouncing. */
+static unsigned int step_autogain(int abs_max, unsigned int sweep_gain)
+{
+    unsigned int new_gain = sweep_gain;
+    if (overflows[OVERFLOW_IQ_SCALE])
+        /* Push gain down on overflow. */
+        new_gain += 1;
+    else if (sweep_gain < MAX_DET_GAIN  &&  abs_max < GAIN_UP_THRESHOLD)
+        /* Push gain up if signal too low. */
+        new_gain -= 1;
+    else if (sweep_gain == MAX_DET_GAIN  &&
+             abs_max < MIN_GAIN_UP_THRESHOLD)
+        new_gain -= 1;
+    return new_gain;
+}
+
+
+/* Each gain step is a factor of 4 except for the last, which is 2^-20. */
+int detector_gain_shift(unsigned int gain)
+{
+    return gain < MAX_DET_GAIN ? 2 * (int) gain : 20;
+}
+
+/* Peak magnitude expected at the given gain given the peak observed at the
+ * capture gain. */
+static double predict_peak(
+    int abs_max, unsigned int sweep_gain, unsigned int gain)
+{
+    return ldexp(abs_max,
+        detector_gain_shift(sweep_gain) - detector_gain_shift(gain));
+}
+
+
+/* Bins the larger of |I| and |Q| for each point by its bit length. */
+static void update_magnitude_histogram(
+    unsigned int length, const short buffer_low[], const short buffer_high[])
+{
+    memset(magnitude_histogram, 0, sizeof(magnitude_histogram));
+    for (unsigned int i = 0; i < 4 * length; i ++)
+    {
+        unsigned int I = (unsigned int) abs(buffer_low[i]);
+        unsigned int Q = (unsigned int) abs(buffer_high[i]);
+        unsigned int magnitude = I > Q ? I : Q;
+        unsigned int bin = magnitude == 0 ? 0 : 32 - CLZ(magnitude);
+        magnitude_histogram[bin] += 1;
+    }
+}
+
+
+/* Computes the required gain directly from the observed peak.  If the capture
+ * overflowed we don't know the true peak, so we step down by one or two steps
+ * depending on how much of the sweep is saturated. */
+static unsigned int predictive_autogain(
+    int abs_max, unsigned int sweep_gain, unsigned int length)
+{
+    if (overflows[OVERFLOW_IQ_SCALE])
+    {
+        unsigned int saturated = (unsigned int) (
+            magnitude_histogram[HALF_SCALE_BIN] +
+            magnitude_histogram[HALF_SCALE_BIN + 1]);
+        unsigned int gain = sweep_gain +
+            (saturated * SATURATED_FRACTION >= 4 * length ? 2 : 1);
+        return gain < MAX_DET_GAIN ? gain : MAX_DET_GAIN;
+    }
+    else
+    {
+        /* Search for the highest gain giving a peak below target. */
+        unsigned int gain = 0;
+        while (gain < MAX_DET_GAIN  &&
+               predict_peak(abs_max, sweep_gain, gain) >= GAIN_TARGET)
+            gain += 1;
+        /* Only reduce the gain when we're close to overflow. */
+        if (gain < sweep_gain  ||  abs_max > GAIN_DOWN_THRESHOLD)
+            return gain;
+        else
+            return sweep_gain;
+    }
+}
+
 
+/* Keeps track of how many sweeps are taken to converge after the first gain
+ * change: every sweep which results in a change is a wasted sweep. */
+static void update_autogain_stats(bool changed)
+{
+    if (changed)
+    {
+        settling_count += 1;
+        wasted_sweeps += 1;
+        gain_changes += 1;
+    }
+    else if (settling_count > 0)
+    {
+        settle_sweeps = settling_count;
+        settling_count = 0;
+    }
+}
+
+
+/* This is called each time an IQ waveform has been captured.  If autogain is
+ * enabled we update the gain as appropriate if necessary and possible.  Sweeps
+ * captured before the last gain change was applied are ignored, as they say
+ * nothing about the gain now in use. */
+static void update_autogain(
+    int abs_max, unsigned int sweep_gain, unsigned int length,
+    const short buffer_low[], const short buffer_high[])
+{
+    if (autogain_enable  &&  sweep_gain == detector_gain)
+    {
+        unsigned int new_gain;
+        switch (autogain_mode)
+        {
+            default:
+            case AUTOGAIN_STEP:
+                new_gain = step_autogain(abs_max, sweep_gain);
+                break;
+            case AUTOGAIN_PREDICTIVE:
+                update_magnitude_histogram(length, buffer_low, buffer_high);
+                new_gain = predictive_autogain(abs_max, sweep_gain, length);
+                break;
+        }
         /* Only write new gain if in range and changed.  Push the update
          * through the EPICS layer so the outside is fully informed. */
-        if (new_gain <= MAX_DET_GAIN  &&  new_gain != detector_gain)
+        bool changed = new_gain <= MAX_DET_GAIN  &&  new_gain != detector_gain;
+        if (changed)
             WRITE_OUT_RECORD(mbbo, gain_setting, new_gain, true);
+        update_autogain_stats(changed);
     }
 }
 
@@ -129,16 +267,16 @@ unsigned int tune_to_freq(double tune)
 
 /* Computes compensated delay (in bunches) from user entered loop delay (in
  * turns together with input specific delay. */
-static int compute_delay(void)
+static int compute_delay(unsigned int input)
 {
     int adc_delay, fir_delay;
     hw_read_det_delays(&adc_delay, &fir_delay);
-    int delay = detector_input == DET_IN_ADC ? adc_delay : fir_delay;
+    int delay = input == DET_IN_ADC ? adc_delay : fir_delay;
     /* In ADC input mode we compensate for the overall configured loop delay
      * because what we want is a measurement of the machine in isolation.  In
      * FIR input mode, however, we're interested in the closed loop system
      * response so we ignore this. */
-    if (detector_input == DET_IN_ADC)
+    if (input == DET_IN_ADC)
         delay += lround(BUNCHES_PER_TURN * adc_loop_delay);
     return delay;
 }
@@ -149,22 +287,83 @@ static void unsigned_fixed_to_double(
     *result = ldexp((double) input * scaling, scaling_shift);
 }
 
-static void store_one_tune_freq(int delay, unsigned int freq, unsigned int ix)
+/* Cache of recently computed detector scales.  Computing the scale involves a
+ * cos_sin() call for every point, so we keep the results for the last few
+ * sequencer configurations: switching between a handful of sweep setups is
+ * then just a copy.  Entries are looked up by a hash of the inputs to
+ * compute_det_scale(), but the full key is compared to confirm a hit.
+ *    Each queued sweep refers to the cache entry it was captured with, and the
+ * entry is only copied into the live scale when the sweep is processed.  An
+ * entry is pinned while it is the scale for the next capture, is referenced by
+ * a queued sweep, or is loaded into the live scale, and only entries which
+ * aren't pinned are replaced.  At most 1 + QUEUE_SLOTS + 1 entries are pinned,
+ * so the cache is large enough for this together with all the scheduler
+ * configurations and the EPICS settings. */
+#define SCALE_CACHE_SIZE    6
+
+/* Only the sequencer fields which affect the scale are part of the key.  Only
+ * the first super_count offsets are significant. */
+struct scale_key {
+    int delay;
+    unsigned int state_count;
+    unsigned int super_count;
+    struct {
+        unsigned int start_freq;
+        unsigned int delta_freq;
+        unsigned int dwell_time;    // Includes holdoff
+        unsigned int capture_count;
+        bool write_enable;
+    } states[MAX_SEQUENCER_COUNT];
+    uint32_t offsets[SUPER_SEQ_STATES];
+};
+
+struct scale_entry {
+    bool valid;
+    uint32_t hash;
+    unsigned int last_used;         // For least recently used replacement
+    unsigned int pins;              // References preventing replacement
+    struct scale_key key;
+
+    unsigned int sweep_length;
+    unsigned int segment_length;
+    unsigned int segment_count;
+    double tune_scale[TUNE_LENGTH];
+    struct rotation rotation[TUNE_LENGTH];
+    int timebase[TUNE_LENGTH];
+};
+
+static struct scale_entry *scale_cache;
+static unsigned int scale_cache_clock;
+static unsigned int scale_cache_hits;
+static unsigned int scale_cache_misses;
+
+/* Scale currently loaded into sweep_info, rotation and timebase, and the scale
+ * for the next capture.  These and all pin counts are guarded by scale_lock,
+ * the cache is otherwise only accessed from the trigger monitor thread. */
+static pthread_mutex_t scale_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct scale_entry *loaded_scale;
+static struct scale_entry *capture_scale;
+
+#define SCALE_LOCK()    ASSERT_PTHREAD(pthread_mutex_lock(&scale_lock))
+#define SCALE_UNLOCK()  ASSERT_PTHREAD(pthread_mutex_unlock(&scale_lock))
+
+
+static void store_one_tune_freq(
+    struct scale_entry *scale, int delay, unsigned int freq, unsigned int ix)
 {
     unsigned_fixed_to_double(
-        freq, &sweep_info.tune_scale[ix], wf_scaling, wf_shift);
-    cos_sin(-(int) freq * delay, &rotate_I[ix], &rotate_Q[ix]);
+        freq, &scale->tune_scale[ix], wf_scaling, wf_shift);
+    cos_sin(-(int) freq * delay,
+        &scale->rotation[ix].I, &scale->rotation[ix].Q);
 }
 
-/* Computes frequency scale directly from sequencer settings.  Triggered
- * whenever the sequencer state changes. */
-static void update_det_scale(
+/* Computes frequency scale directly from sequencer settings into the given
+ * scale cache entry. */
+static void compute_det_scale(
+    struct scale_entry *scale, int delay,
     unsigned int state_count, const struct seq_entry *sequencer_table,
     unsigned int super_count, const uint32_t offsets[])
 {
-    int delay = compute_delay();
-    detector_delay = (double) delay / BUNCHES_PER_TURN;
-
     unsigned int ix = 0;
     unsigned int total_time = 0;     // Accumulates captured timebase
     unsigned int gap_time = 0;       // Accumulates non captured time
@@ -185,185 +384,692 @@ static void update_det_scale(
                      i < entry->capture_count  &&  ix < TUNE_LENGTH;
                      i ++, ix ++)
                 {
-                    store_one_tune_freq(delay, f0, ix);
+                    store_one_tune_freq(scale, delay, f0, ix);
                     f0 += entry->delta_freq;
                     total_time += dwell_time;
-                    timebase[ix] = (int) total_time;
+                    scale->timebase[ix] = (int) total_time;
                 }
             }
             else
                 gap_time += dwell_time * entry->capture_count;
         }
 
-    /* Record how many points will actually be captured. */
-    sweep_info.sweep_length = ix;
+    /* Record how many points will actually be captured and how these are
+     * divided into complete super sequencer segments. */
+    scale->sweep_length = ix;
+    unsigned int segment_length = 0;
+    for (unsigned int state = 0; state < state_count; state ++)
+        if (sequencer_table[state].write_enable)
+            segment_length += sequencer_table[state].capture_count;
+    scale->segment_length = segment_length;
+    scale->segment_count = segment_length > 0 ? ix / segment_length : 0;
 
     /* Pad the rest of the scale.  The last frequency is a good a choice as any,
      * anything that goes here is invalid. */
     for ( ; ix < TUNE_LENGTH; ix ++)
     {
-        store_one_tune_freq(delay, f0, ix);
-        timebase[ix] = (int) total_time;
+        store_one_tune_freq(scale, delay, f0, ix);
+        scale->timebase[ix] = (int) total_time;
     }
-
-    tune_scale_needs_refresh = false;
 }
 
 
-static void set_adc_loop_delay(double delay)
+/* Number of significant bytes in key. */
+static size_t scale_key_size(const struct scale_key *key)
 {
-    adc_loop_delay = delay;
-    tune_scale_needs_refresh = true;
+    return offsetof(struct scale_key, offsets) +
+        key->super_count * sizeof(uint32_t);
 }
 
-static void write_det_input_select(unsigned int input)
+/* FNV-1a hash of the significant part of the key. */
+static uint32_t hash_scale_key(const struct scale_key *key)
 {
-    detector_input = input;
-    tune_scale_needs_refresh = true;
+    const uint8_t *bytes = (const uint8_t *) key;
+    size_t length = scale_key_size(key);
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < length; i ++)
+        hash = (hash ^ bytes[i]) * 16777619U;
+    return hash;
 }
 
-
-/* Returns 2^-31 * (a*c + b*d) with rounding of the last bit.  The scaling here
- * is chosen to balance the 2^30 scaling on (sin,cos) without risking overflow,
- * which unfortunately is possible if we scale by 2^-30. */
-static int32_t dot_product(int32_t a, int32_t b, int32_t c, int32_t d)
+/* The key is cleared first so that padding bytes compare equal. */
+static void build_scale_key(
+    struct scale_key *key, int delay,
+    unsigned int state_count, const struct seq_entry *sequencer_table,
+    unsigned int super_count, const uint32_t offsets[])
 {
-    int64_t full = (int64_t) a * c + (int64_t) b * d;
-    return (int32_t) ((full + (1UL << 30)) >> 31);
+    memset(key, 0, sizeof(struct scale_key));
+    key->delay = delay;
+    key->state_count = state_count;
+    key->super_count = super_count;
+    for (unsigned int state = 0; state < state_count; state ++)
+    {
+        const struct seq_entry *entry = &sequencer_table[state];
+        key->states[state].start_freq = entry->start_freq;
+        key->states[state].delta_freq = entry->delta_freq;
+        key->states[state].dwell_time = entry->dwell_time + entry->holdoff;
+        key->states[state].capture_count = entry->capture_count;
+        key->states[state].write_enable = entry->write_enable;
+    }
+    memcpy(key->offsets, offsets, super_count * sizeof(uint32_t));
 }
 
 
-/* Extracts and scales IQ for one channel from the incoming raw IQ buffer.  Also
- * updates *abs_max for autogain calculation. */
-static void extract_iq(
-    const short buffer_low[], const short buffer_high[], unsigned int channel,
-    struct channel_sweep *sweep, int *abs_max)
+/* Returns matching cache entry or NULL if not found. */
+static struct scale_entry *lookup_scale_cache(
+    const struct scale_key *key, uint32_t hash)
 {
-    for (unsigned int i = 0; i < sweep_info.sweep_length; i ++)
+    for (unsigned int i = 0; i < SCALE_CACHE_SIZE; i ++)
     {
-        int raw_I = buffer_low[4 * i + channel];
-        int raw_Q = buffer_high[4 * i + channel];
-        if (abs(raw_I) > *abs_max)  *abs_max = abs(raw_I);
-        if (abs(raw_Q) > *abs_max)  *abs_max = abs(raw_Q);
-
-        int rot_I = rotate_I[i];
-        int rot_Q = rotate_Q[i];
-        sweep->wf_i[i] = (short) dot_product(raw_I, raw_Q, rot_I, -rot_Q);
-        sweep->wf_q[i] = (short) dot_product(raw_I, raw_Q, rot_Q, rot_I);
+        struct scale_entry *entry = &scale_cache[i];
+        if (entry->valid  &&  entry->hash == hash  &&
+            memcmp(&entry->key, key, scale_key_size(key)) == 0)
+            return entry;
     }
+    return NULL;
+}
 
-    /* Ensure the entire array is filled.  If IQ capture was short we extend the
-     * last read value to fill the rest of the waveform.  This makes the
-     * resulting display look better on a display tool like EDM. */
-    for (unsigned int i = sweep_info.sweep_length; i < TUNE_LENGTH; i ++)
+/* Returns an empty entry if there is one, otherwise the least recently used
+ * entry which isn't pinned.  The entry is marked invalid until it is filled. */
+static struct scale_entry *allocate_scale_entry(void)
+{
+    SCALE_LOCK();
+    struct scale_entry *result = NULL;
+    for (unsigned int i = 0; i < SCALE_CACHE_SIZE; i ++)
     {
-        sweep->wf_i[i] = sweep->wf_i[sweep_info.sweep_length-1];
-        sweep->wf_q[i] = sweep->wf_q[sweep_info.sweep_length-1];
+        struct scale_entry *entry = &scale_cache[i];
+        if (!entry->valid)
+        {
+            result = entry;
+            break;
+        }
+        else if (entry->pins == 0  &&
+                 (result == NULL  ||  entry->last_used < result->last_used))
+            result = entry;
     }
+    ASSERT_OK(result);
+    result->valid = false;
+    SCALE_UNLOCK();
+    return result;
 }
 
 
-/* Once IQ has been computed for the four channels, the mean IQ is just the mean
- * of the four channels. */
-static void compute_mean_iq(void)
+/* Releases a pin taken on the given entry, which may be NULL. */
+static void release_scale(struct scale_entry *entry)
 {
-    for (int i = 0; i < TUNE_LENGTH; i ++)
+    if (entry)
     {
-        int I_sum = 0, Q_sum = 0;
-        for (int channel = 0; channel < 4; channel ++)
-        {
-            struct channel_sweep *sweep = &sweep_info.channels[channel];
-            I_sum += sweep->wf_i[i];
-            Q_sum += sweep->wf_q[i];
-        }
-        sweep_info.mean.wf_i[i] = (short) ((I_sum + 2) / 4);  // Rounded average
-        sweep_info.mean.wf_q[i] = (short) ((Q_sum + 2) / 4);  // of 4 channels
+        SCALE_LOCK();
+        entry->pins -= 1;
+        SCALE_UNLOCK();
     }
 }
 
+/* Returns the scale for the next capture with a pin taken for the caller. */
+static struct scale_entry *pin_capture_scale(void)
+{
+    SCALE_LOCK();
+    struct scale_entry *entry = capture_scale;
+    if (entry)
+        entry->pins += 1;
+    SCALE_UNLOCK();
+    return entry;
+}
 
-/* The power waveform for each sweep is simply the sum of squares. */
-#define SQR(x)      ((x) * (x))
-void compute_power(struct channel_sweep *sweep)
+/* Moves the capture pin to the given entry. */
+static void set_capture_scale(struct scale_entry *entry)
 {
-    for (int i = 0; i < TUNE_LENGTH; i ++)
-        sweep->power[i] = SQR(sweep->wf_i[i]) + SQR(sweep->wf_q[i]);
+    SCALE_LOCK();
+    entry->pins += 1;
+    if (capture_scale)
+        capture_scale->pins -= 1;
+    capture_scale = entry;
+    SCALE_UNLOCK();
 }
 
 
-/* From the raw buffer extract IQ data for each channel and update the computed
- * power waveform. */
-static void update_sweep_info(
-    const short buffer_low[], const short buffer_high[], int *abs_max)
+/* Copies a cached scale into the live scale used for sweep processing.  Must
+ * be called inside the tune_scale_trigger interlock. */
+static void copy_det_scale(struct scale_entry *entry)
 {
-    *abs_max = 0;
-    for (unsigned int channel = 0; channel < 4; channel ++)
+    const struct scale_key *key = &entry->key;
+    detector_delay = (double) key->delay / BUNCHES_PER_TURN;
+    /* The segment offsets are cheap to compute so aren't cached. */
+    for (unsigned int super = 0; super < key->super_count; super ++)
+        unsigned_fixed_to_double(key->offsets[super],
+            &sweep_info.segment_offsets[super], wf_scaling, wf_shift);
+    sweep_info.sweep_length = entry->sweep_length;
+    sweep_info.segment_length = entry->segment_length;
+    sweep_info.segment_count = entry->segment_count;
+    memcpy(sweep_info.tune_scale, entry->tune_scale,
+        sizeof(sweep_info.tune_scale));
+    memcpy(rotation, entry->rotation, sizeof(rotation));
+    memcpy(timebase, entry->timebase, sizeof(timebase));
+
+    SCALE_LOCK();
+    entry->pins += 1;
+    if (loaded_scale)
+        loaded_scale->pins -= 1;
+    loaded_scale = entry;
+    SCALE_UNLOCK();
+}
+
+/* Loads and publishes a cached scale if it isn't already loaded. */
+static void load_det_scale(struct scale_entry *entry)
+{
+    SCALE_LOCK();
+    bool loaded = entry == loaded_scale;
+    SCALE_UNLOCK();
+    if (!loaded)
     {
-        struct channel_sweep *sweep = &sweep_info.channels[channel];
-        extract_iq(buffer_low, buffer_high, channel, sweep, abs_max);
-        compute_power(sweep);
+        interlock_wait(tune_scale_trigger);
+        copy_det_scale(entry);
+        interlock_signal(tune_scale_trigger, NULL);
     }
-    compute_mean_iq();
-    compute_power(&sweep_info.mean);
+}
+
+
+static void set_adc_loop_delay(double delay)
+{
+    adc_loop_delay = delay;
+    tune_scale_needs_refresh = true;
+}
+
+static void write_det_input_select(unsigned int input)
+{
+    detector_input = input;
+    tune_scale_needs_refresh = true;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Power waveforms.  IQ extraction itself is in iq_extract.c, the power
+ * waveforms are derived waveforms and are only computed when needed. */
+
+static void compute_derived_power(void *context)
+{
+    compute_power(context);
+}
+
+
+/* Marks all power waveforms as stale and ensures that the power waveform needed
+ * for tune measurement is computed. */
+static void update_power(struct sweep_info *info)
+{
+    for (unsigned int channel = 0; channel < 4; channel ++)
+        update_derived_wf(channel_power[channel]);
+    update_derived_wf(mean_power);
+
+    const struct channel_sweep *tune_sweep = tune_sweep_channel(info);
+    if (tune_sweep == &info->mean)
+        require_derived_wf(mean_power);
+    else
+        require_derived_wf(channel_power[tune_sweep - info->channels]);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Sweep processing queue.
+ *
+ * Sweep readout happens on the trigger monitor thread, but the analysis of each
+ * sweep can take much longer than servicing a trigger.  So the raw IQ data is
+ * copied into one of two queue slots together with the capture settings, and
+ * all further processing is done by a separate worker thread.  If both slots
+ * are full the new sweep is dropped.
+ *    Replayed sweeps go through the same queue, but wait for a free slot
+ * rather than being dropped and leave the hardware alone.
+ *    Each slot pins the detector scale cache entry it was captured with, which
+ * is loaded into the live scale by the worker as required and released when
+ * the sweep has been processed. */
+
+#define QUEUE_SLOTS     2
+
+struct sweep_slot {
+    short buffer_low[BUF_DATA_LENGTH];
+    short buffer_high[BUF_DATA_LENGTH];
+    bool overflows[PULSED_BIT_COUNT];
+    unsigned int gain;
+    bool single_bunch_mode;
+    int schedule;                       // Scheduled configuration or -1
+    struct scale_entry *scale;          // Scale in use for this capture
+    bool replay;                        // Set for sweeps from replay_iq()
+    double queue_time;                  // Monotonic time sweep was queued
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_free = PTHREAD_COND_INITIALIZER;
+static struct sweep_slot *queue_slots;
+static unsigned int queue_head;         // Next slot to process
+static unsigned int queue_depth;        // Number of slots waiting
+static int last_queued = -1;            // Slot most recently filled
+
+/* Published queue statistics. */
+static unsigned int max_queue_depth;
+static unsigned int dropped_sweeps;
+
+#define QUEUE_LOCK()    ASSERT_PTHREAD(pthread_mutex_lock(&queue_lock))
+#define QUEUE_UNLOCK()  ASSERT_PTHREAD(pthread_mutex_unlock(&queue_lock))
+
+/* Serialises the filling of the tail slot between update_iq and replay_iq. */
+static pthread_mutex_t producer_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PRODUCER_LOCK()   ASSERT_PTHREAD(pthread_mutex_lock(&producer_lock))
+#define PRODUCER_UNLOCK() ASSERT_PTHREAD(pthread_mutex_unlock(&producer_lock))
+
+
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
 }
 
 
 /* Read out accumulated overflow bits over the last capture. */
-static bool update_overflow(void)
+static void read_overflow(bool sweep_overflows[])
 {
     const bool read_mask[PULSED_BIT_COUNT] = {
         [OVERFLOW_IQ_FIR] = true,
         [OVERFLOW_IQ_ACC] = true,
         [OVERFLOW_IQ_SCALE] = true,
     };
-    hw_read_pulsed_bits(read_mask, overflows);
-    return
-        overflows[OVERFLOW_IQ_FIR] ||
-        overflows[OVERFLOW_IQ_ACC] ||
-        overflows[OVERFLOW_IQ_SCALE];
+    hw_read_pulsed_bits(read_mask, sweep_overflows);
 }
 
 
-/* This is called when IQ data has been read into the fast buffer.  Process it
- * according to our current configuration into separate IQ wavforms.  One
+/* Processes one sweep from the queue.  Extracts separate IQ waveforms: one
  * separate I/Q value is extracted from each channel and rotated to compensate
  * for the precomputed group delay, and an average is also stored. */
-void update_iq(const short buffer_low[], const short buffer_high[])
+static void process_iq(const struct sweep_slot *slot)
 {
+    double start = get_time();
+    if (slot->scale)
+        load_det_scale(slot->scale);
+
     interlock_wait(iq_trigger);
-    bool overflow = update_overflow();
+    memcpy(overflows, slot->overflows, sizeof(overflows));
+    bool overflow =
+        overflows[OVERFLOW_IQ_FIR] ||
+        overflows[OVERFLOW_IQ_ACC] ||
+        overflows[OVERFLOW_IQ_SCALE];
 
-    int abs_max;
-    update_sweep_info(buffer_low, buffer_high, &abs_max);
-    update_autogain(abs_max);
-    sweep_info.single_bunch_mode = detector_mode;
+    int abs_max = fused_sweep_info(
+        &sweep_info, rotation, slot->buffer_low, slot->buffer_high);
+    /* Replayed data must not be allowed to change the hardware gain, and
+     * scheduled configurations each have their own fixed gain. */
+    if (!slot->replay  &&  slot->schedule < 0)
+        update_autogain(abs_max, slot->gain, sweep_info.sweep_length,
+            slot->buffer_low, slot->buffer_high);
+    sweep_info.single_bunch_mode = slot->single_bunch_mode;
+    sweep_info.gain = slot->gain;
+    sweep_info.schedule = slot->schedule;
+    sweep_info.synthetic = slot->replay;
+    update_power(&sweep_info);
 
     interlock_signal(iq_trigger, NULL);
 
+    double detector_done = get_time();
+
     /* Perform tune sweep update outside trigger interlock so that the tune
      * layer can do its own separate update signalling. */
     update_tune_sweep(&sweep_info, overflow);
+
+    if (slot->replay)
+        replay_complete(
+            start - slot->queue_time, detector_done - start,
+            get_time() - detector_done);
+}
+
+
+static void *sweep_worker(void *context)
+{
+    while (true)
+    {
+        QUEUE_LOCK();
+        while (queue_depth == 0)
+            ASSERT_PTHREAD(pthread_cond_wait(&queue_ready, &queue_lock));
+        struct sweep_slot *slot = &queue_slots[queue_head];
+        QUEUE_UNLOCK();
+
+        process_iq(slot);
+        release_scale(slot->scale);
+
+        /* Only release the slot once we've finished with it. */
+        QUEUE_LOCK();
+        queue_head = (queue_head + 1) % QUEUE_SLOTS;
+        queue_depth -= 1;
+        ASSERT_PTHREAD(pthread_cond_signal(&queue_free));
+        QUEUE_UNLOCK();
+    }
+    return NULL;
+}
+
+
+/* Detector settings for the capture in progress. */
+static bool capture_mode;
+static int capture_schedule = -1;
+
+/* Number of points captured with the given detector scale. */
+static unsigned int scale_length(const struct scale_entry *scale)
+{
+    return scale ? scale->sweep_length : 0;
+}
+
+
+/* This is called when IQ data has been read into the fast buffer.  We take a
+ * copy of the data together with the capture settings and queue it for
+ * processing. */
+void update_iq(const short buffer_low[], const short buffer_high[])
+{
+    struct scale_entry *scale = pin_capture_scale();
+    record_replay_sweep(buffer_low, buffer_high, 4 * scale_length(scale));
+
+    PRODUCER_LOCK();
+    QUEUE_LOCK();
+    bool full = queue_depth >= QUEUE_SLOTS;
+    unsigned int tail = (queue_head + queue_depth) % QUEUE_SLOTS;
+    QUEUE_UNLOCK();
+
+    if (full)
+    {
+        /* Still need to clear the overflow bits for the next capture. */
+        bool discard[PULSED_BIT_COUNT];
+        read_overflow(discard);
+        dropped_sweeps += 1;
+        release_scale(scale);
+    }
+    else
+    {
+        /* The worker won't touch this slot until we increment the depth. */
+        struct sweep_slot *slot = &queue_slots[tail];
+        size_t length = 4 * scale_length(scale) * sizeof(short);
+        memcpy(slot->buffer_low, buffer_low, length);
+        memcpy(slot->buffer_high, buffer_high, length);
+        read_overflow(slot->overflows);
+        slot->gain = capture_gain;
+        slot->single_bunch_mode = capture_mode;
+        slot->schedule = capture_schedule;
+        slot->scale = scale;
+        slot->replay = false;
+        slot->queue_time = get_time();
+        last_queued = (int) tail;
+
+        QUEUE_LOCK();
+        queue_depth += 1;
+        if (queue_depth > max_queue_depth)
+            max_queue_depth = queue_depth;
+        ASSERT_PTHREAD(pthread_cond_signal(&queue_ready));
+        QUEUE_UNLOCK();
+    }
+    PRODUCER_UNLOCK();
+}
+
+
+void replay_iq(
+    const short buffer_low[], const short buffer_high[], bool overflow)
+{
+    /* Wait for a free slot without holding the producer lock, as that would
+     * hold up the trigger monitor thread.  Live sweeps can take the slot
+     * before we get the lock, in which case we go round again. */
+    unsigned int tail;
+    while (true)
+    {
+        QUEUE_LOCK();
+        while (queue_depth >= QUEUE_SLOTS)
+            ASSERT_PTHREAD(pthread_cond_wait(&queue_free, &queue_lock));
+        QUEUE_UNLOCK();
+
+        PRODUCER_LOCK();
+        QUEUE_LOCK();
+        bool full = queue_depth >= QUEUE_SLOTS;
+        tail = (queue_head + queue_depth) % QUEUE_SLOTS;
+        QUEUE_UNLOCK();
+        if (!full)
+            break;
+        PRODUCER_UNLOCK();
+    }
+
+    /* Any overflow is reported as a scaling overflow. */
+    struct sweep_slot *slot = &queue_slots[tail];
+    struct scale_entry *scale = pin_capture_scale();
+    size_t length = 4 * scale_length(scale) * sizeof(short);
+    memcpy(slot->buffer_low, buffer_low, length);
+    memcpy(slot->buffer_high, buffer_high, length);
+    memset(slot->overflows, 0, sizeof(slot->overflows));
+    slot->overflows[OVERFLOW_IQ_SCALE] = overflow;
+    slot->gain = capture_gain;
+    slot->single_bunch_mode = capture_mode;
+    slot->schedule = capture_schedule;
+    slot->scale = scale;
+    slot->replay = true;
+    slot->queue_time = get_time();
+    last_queued = (int) tail;
+
+    QUEUE_LOCK();
+    queue_depth += 1;
+    if (queue_depth > max_queue_depth)
+        max_queue_depth = queue_depth;
+    ASSERT_PTHREAD(pthread_cond_signal(&queue_ready));
+    QUEUE_UNLOCK();
+    PRODUCER_UNLOCK();
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Benchmarking.  The two extraction implementations are compared on a private
+ * copy of the last queued sweep and of the live delay compensation, so that
+ * the benchmark doesn't race with sweep capture and processing. */
+#define BENCHMARK_REPEAT    10
+static struct epics_interlock *benchmark_trigger;
+static double reference_duration;   // Reference time in ms
+static double fused_duration;       // Fused time in ms
+static unsigned int benchmark_length;
+static int benchmark_difference;    // Maximum difference between the two
+static EPICS_STRING iq_kernel;
+
+static int compare_channels(
+    const struct channel_sweep *a, const struct channel_sweep *b)
+{
+    int difference = 0;
+    for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+    {
+        int diff_i = abs(a->wf_i[i] - b->wf_i[i]);
+        int diff_q = abs(a->wf_q[i] - b->wf_q[i]);
+        if (diff_i > difference)  difference = diff_i;
+        if (diff_q > difference)  difference = diff_q;
+    }
+    return difference;
+}
+
+struct benchmark_data {
+    short buffer_low[BUF_DATA_LENGTH];
+    short buffer_high[BUF_DATA_LENGTH];
+    struct rotation rotation[TUNE_LENGTH];
+    struct sweep_info reference;
+    struct sweep_info fused;
+};
+
+
+/* Copies the last sweep to be queued.  Slots are only ever written with the
+ * producer lock held, so the copy can't be overwritten as we take it. */
+static bool copy_last_sweep(struct benchmark_data *data)
+{
+    PRODUCER_LOCK();
+    bool ok = last_queued >= 0;
+    if (ok)
+    {
+        const struct sweep_slot *slot = &queue_slots[last_queued];
+        memcpy(data->buffer_low, slot->buffer_low, sizeof(data->buffer_low));
+        memcpy(data->buffer_high, slot->buffer_high,
+            sizeof(data->buffer_high));
+    }
+    PRODUCER_UNLOCK();
+    return ok;
+}
+
+
+static void run_benchmark(void)
+{
+    struct benchmark_data *data = malloc(sizeof(struct benchmark_data));
+    if (!copy_last_sweep(data))
+    {
+        free(data);
+        return;
+    }
+
+    /* The live rotation is only updated inside the scale interlock. */
+    interlock_wait(tune_scale_trigger);
+    memcpy(data->rotation, rotation, sizeof(data->rotation));
+    interlock_signal(tune_scale_trigger, NULL);
+
+    struct sweep_info *reference = &data->reference;
+    struct sweep_info *fused = &data->fused;
+    const short *buffer_low = data->buffer_low;
+    const short *buffer_high = data->buffer_high;
+    /* Always benchmark the full length for a fair comparison. */
+    reference->sweep_length = TUNE_LENGTH;
+    fused->sweep_length = TUNE_LENGTH;
+
+    interlock_wait(benchmark_trigger);
+
+    {
+        TIC();
+        for (int n = 0; n < BENCHMARK_REPEAT; n ++)
+            reference_sweep_info(
+                reference, data->rotation, buffer_low, buffer_high);
+        reference_duration = 1e3 * TOC() / BENCHMARK_REPEAT;
+    }
+    {
+        TIC();
+        for (int n = 0; n < BENCHMARK_REPEAT; n ++)
+        {
+            /* Include computation of all powers for a fair comparison. */
+            fused_sweep_info(fused, data->rotation, buffer_low, buffer_high);
+            for (unsigned int channel = 0; channel < 4; channel ++)
+                compute_power(&fused->channels[channel]);
+            compute_power(&fused->mean);
+        }
+        fused_duration = 1e3 * TOC() / BENCHMARK_REPEAT;
+    }
+
+    benchmark_length = TUNE_LENGTH;
+    benchmark_difference = compare_channels(&reference->mean, &fused->mean);
+    for (unsigned int channel = 0; channel < 4; channel ++)
+    {
+        int difference = compare_channels(
+            &reference->channels[channel], &fused->channels[channel]);
+        if (difference > benchmark_difference)
+            benchmark_difference = difference;
+    }
+
+    interlock_signal(benchmark_trigger, NULL);
+
+    free(data);
+}
+
+
+unsigned int read_sweep_scale(
+    double tune_scale[TUNE_LENGTH],
+    int rotation_i[TUNE_LENGTH], int rotation_q[TUNE_LENGTH])
+{
+    struct scale_entry *scale = pin_capture_scale();
+    if (scale == NULL)
+        return 0;
+
+    memcpy(tune_scale, scale->tune_scale, sizeof(scale->tune_scale));
+    for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+    {
+        rotation_i[i] = scale->rotation[i].I;
+        rotation_q[i] = scale->rotation[i].Q;
+    }
+    unsigned int length = scale->sweep_length;
+    release_scale(scale);
+    return length;
+}
+
+
+static unsigned int read_queue_depth(void)
+{
+    return queue_depth;
+}
+
+
+/* Looks up the detector scale for the given settings in the cache, otherwise
+ * computes it into a free entry.  Called whenever the sequencer state changes,
+ * returns the scale for the next capture.  The live scale is left alone: it is
+ * loaded by the worker when the first sweep with the new scale is processed. */
+static struct scale_entry *update_det_scale(
+    unsigned int input,
+    unsigned int state_count, const struct seq_entry *sequencer_table,
+    unsigned int super_count, const uint32_t offsets[])
+{
+    int delay = compute_delay(input);
+    struct scale_key *key = malloc(sizeof(struct scale_key));
+    build_scale_key(
+        key, delay, state_count, sequencer_table, super_count, offsets);
+    uint32_t hash = hash_scale_key(key);
+
+    struct scale_entry *entry = lookup_scale_cache(key, hash);
+    if (entry)
+        scale_cache_hits += 1;
+    else
+    {
+        scale_cache_misses += 1;
+
+        /* Nothing else can refer to an entry which isn't pinned, so we can
+         * fill it without holding any locks. */
+        entry = allocate_scale_entry();
+        compute_det_scale(
+            entry, delay, state_count, sequencer_table, super_count, offsets);
+        entry->hash = hash;
+        memcpy(&entry->key, key, sizeof(struct scale_key));
+        entry->valid = true;
+    }
+    entry->last_used = scale_cache_clock++;
+    free(key);
+    return entry;
+}
+
+
+void read_detector_config(struct detector_config *config)
+{
+    memcpy(config->bunches, detector_bunches, sizeof(config->bunches));
+    config->gain = detector_gain;
+    config->input = detector_input;
+    config->single_bunch_mode = detector_mode;
 }
 
 
 void prepare_detector(
     bool settings_changed,
+    const struct detector_config *config, int schedule,
     unsigned int sequencer_pc, const struct seq_entry *sequencer_table,
     unsigned int super_count, const uint32_t offsets[])
 {
+    struct detector_config epics_config;
+    if (config == NULL)
+    {
+        read_detector_config(&epics_config);
+        config = &epics_config;
+        schedule = -1;
+    }
+
     /* We don't want the following states to change during a detector sweep, so
      * we write them now immediately before starting a fresh sweep. */
-    hw_write_det_bunches(detector_bunches);
-    hw_write_det_gain(detector_gain);
-    hw_write_det_input_select(detector_input);
-    hw_write_det_mode(detector_mode);
+    hw_write_det_bunches(config->bunches);
+    hw_write_det_gain(config->gain);
+    capture_gain = config->gain;
+    hw_write_det_input_select(config->input);
+    hw_write_det_mode(config->single_bunch_mode);
+    capture_mode = config->single_bunch_mode;
+    capture_schedule = schedule;
 
     /* Update detector or tune scale at start of tune sweep. */
     if (settings_changed  ||  tune_scale_needs_refresh)
     {
-        interlock_wait(tune_scale_trigger);
-        update_det_scale(sequencer_pc, sequencer_table, super_count, offsets);
-        interlock_signal(tune_scale_trigger, NULL);
+        set_capture_scale(update_det_scale(config->input,
+            sequencer_pc, sequencer_table, super_count, offsets));
+        tune_scale_needs_refresh = false;
     }
 }
 
@@ -375,11 +1081,18 @@ void inject_tune_scale(const double tune_scale[TUNE_LENGTH])
 {
     interlock_wait(tune_scale_trigger);
     memcpy(sweep_info.tune_scale, tune_scale, sizeof(sweep_info.tune_scale));
+    /* The live scale no longer matches any cache entry. */
+    SCALE_LOCK();
+    if (loaded_scale)
+        loaded_scale->pins -= 1;
+    loaded_scale = NULL;
+    SCALE_UNLOCK();
     interlock_signal(tune_scale_trigger, NULL);
 }
 
 
-static void publish_channel(const char *name, struct channel_sweep *sweep)
+static struct derived_wf *publish_channel(
+    const char *name, struct channel_sweep *sweep)
 {
     char buffer[20];
 #define FORMAT(field) \
@@ -388,40 +1101,61 @@ static void publish_channel(const char *name, struct channel_sweep *sweep)
     PUBLISH_WF_READ_VAR(short, FORMAT("I"), TUNE_LENGTH, sweep->wf_i);
     PUBLISH_WF_READ_VAR(short, FORMAT("Q"), TUNE_LENGTH, sweep->wf_q);
     PUBLISH_WF_READ_VAR(int, FORMAT("POWER"), TUNE_LENGTH, sweep->power);
+    return register_derived_wf(FORMAT("POWER"), compute_derived_power, sweep);
 
 #undef FORMAT
 }
 
 
-static void compute_default_window(float window[])
+/* Window selection.  The window parameters are kept separately for each
+ * window type so that switching between types doesn't lose settings. */
+static unsigned int window_type = WINDOW_HAMMING;
+static double kaiser_beta = 8.6;
+static double tukey_alpha = 0.5;
+static double dpss_nw = 4;
+
+/* Copy of the window as loaded into hardware, for computing metrics. */
+static float detector_window[DET_WINDOW_LENGTH];
+static bool window_metrics_stale = true;
+static unsigned int window_metrics_dwell;
+static struct window_metrics window_metrics;
+static double window_bandwidth;     // Noise bandwidth in tunes
+
+
+static void compute_selected_window(float window[])
 {
-    /* Let's use the Hamming window.  As this is only done once at startup it
-     * doesn't matter if we take our time and use full floating point
-     * arithmetic. */
-    float a = 0.54F;
-    float b = 1 - a;
-    float f = 2 * (float) M_PI / (DET_WINDOW_LENGTH - 1);
-    for (int i = 0; i < DET_WINDOW_LENGTH; i ++)
-        window[i] = a - b * cosf(f * (float) i);
+    double parameter = 0;
+    switch (window_type)
+    {
+        case WINDOW_KAISER:     parameter = kaiser_beta;    break;
+        case WINDOW_TUKEY:      parameter = tukey_alpha;    break;
+        case WINDOW_DPSS:       parameter = dpss_nw;        break;
+    }
+    compute_window(window_type, parameter, DET_WINDOW_LENGTH, window);
 }
 
 
 static bool reset_window = true;
 
 /* Compute the appropriate windowing function for the detector.  If called after
- * reset_window has been set then the incoming window is replaced by a standard
- * window before being written to hardware. */
+ * reset_window has been set then the incoming window is replaced by the
+ * selected standard window before being written to hardware. */
 static void write_detector_window(float window[])
 {
     if (reset_window)
     {
-        compute_default_window(window);
+        compute_selected_window(window);
         reset_window = false;
     }
 
     int window_int[DET_WINDOW_LENGTH];
     float_array_to_int(DET_WINDOW_LENGTH, window, window_int, 16, 0);
     hw_write_det_window(window_int);
+
+    /* float_array_to_int() has updated window to the values actually written,
+     * so the metrics will reflect the quantised window. */
+    memcpy(detector_window, window, sizeof(detector_window));
+    window_metrics_stale = true;
 }
 
 static void reset_detector_window(void)
@@ -430,6 +1164,24 @@ static void reset_detector_window(void)
 }
 
 
+/* The metrics depend on the dwell time of the sweep, so they're recomputed
+ * whenever either the window or the dwell changes.  This is polled. */
+static double read_window_enbw(void)
+{
+    unsigned int dwell = READ_NAMED_RECORD(ulongout, "SEQ:1:DWELL");
+    if (window_metrics_stale  ||  dwell != window_metrics_dwell)
+    {
+        compute_window_metrics(
+            detector_window, DET_WINDOW_LENGTH, dwell, &window_metrics);
+        window_bandwidth =
+            dwell > 0 ? window_metrics.enbw / dwell : window_metrics.enbw;
+        window_metrics_dwell = dwell;
+        window_metrics_stale = false;
+    }
+    return window_metrics.enbw;
+}
+
+
 static const char *tune_sweep_state(
     bool single_bunch, unsigned int bunch, bool *sweep_ok)
 {
@@ -528,6 +1280,12 @@ bool initialise_detector(void)
 {
     gain_setting = PUBLISH_WRITE_VAR_P(mbbo, "DET:GAIN", detector_gain);
     PUBLISH_WRITE_VAR_P(bo, "DET:AUTOGAIN", autogain_enable);
+    PUBLISH_WRITE_VAR_P(mbbo, "DET:AUTOGAIN:MODE", autogain_mode);
+    PUBLISH_WF_READ_VAR(
+        int, "DET:AUTOGAIN:HIST", HISTOGRAM_BINS, magnitude_histogram);
+    PUBLISH_READ_VAR(ulongin, "DET:AUTOGAIN:SETTLE", settle_sweeps);
+    PUBLISH_READ_VAR(ulongin, "DET:AUTOGAIN:WASTED", wasted_sweeps);
+    PUBLISH_READ_VAR(ulongin, "DET:AUTOGAIN:CHANGES", gain_changes);
     PUBLISH_WRITER_P(mbbo, "DET:INPUT", write_det_input_select);
     PUBLISH_WRITE_VAR_P(bo, "DET:MODE", detector_mode);
     PUBLISH_WRITER_P(ao, "DET:LOOP:ADC", set_adc_loop_delay);
@@ -542,16 +1300,19 @@ bool initialise_detector(void)
         sprintf(name, "DET:BUNCH%d", i);
         PUBLISH_WRITE_VAR_P(ulongout, name, detector_bunches[i]);
         sprintf(name, "%d", i);
-        publish_channel(name, &sweep_info.channels[i]);
+        channel_power[i] = publish_channel(name, &sweep_info.channels[i]);
     }
-    publish_channel("M", &sweep_info.mean);
+    mean_power = publish_channel("M", &sweep_info.mean);
     iq_trigger = create_interlock("DET", false);
 
     PUBLISH_READ_VAR(ai, "DET:DELAY", detector_delay);
     PUBLISH_WF_READ_VAR(
         double, "DET:SCALE", TUNE_LENGTH, sweep_info.tune_scale);
     PUBLISH_WF_READ_VAR(int, "DET:TIMEBASE", TUNE_LENGTH, timebase);
+    PUBLISH_READ_VAR(ulongin, "DET:CACHE:HITS", scale_cache_hits);
+    PUBLISH_READ_VAR(ulongin, "DET:CACHE:MISSES", scale_cache_misses);
     tune_scale_trigger = create_interlock("DET:SCALE", false);
+    scale_cache = calloc(SCALE_CACHE_SIZE, sizeof(struct scale_entry));
 
     /* Initialise the scaling constants so that
      *  wf_scaling * 2^wf_shift = BUNCHES_PER_TURN * 2^-32. */
@@ -562,8 +1323,34 @@ bool initialise_detector(void)
     PUBLISH_WF_ACTION(
         float, "DET:WINDOW", DET_WINDOW_LENGTH, write_detector_window);
     PUBLISH_ACTION("DET:RESET_WIN", reset_detector_window);
+    PUBLISH_WRITE_VAR_P(mbbo, "DET:WINDOW:TYPE", window_type);
+    PUBLISH_WRITE_VAR_P(ao, "DET:WINDOW:BETA", kaiser_beta);
+    PUBLISH_WRITE_VAR_P(ao, "DET:WINDOW:ALPHA", tukey_alpha);
+    PUBLISH_WRITE_VAR_P(ao, "DET:WINDOW:NW", dpss_nw);
+    PUBLISH_READER(ai, "DET:WINDOW:ENBW", read_window_enbw);
+    PUBLISH_READ_VAR(ai, "DET:WINDOW:BW", window_bandwidth);
+    PUBLISH_READ_VAR(ai, "DET:WINDOW:GAIN", window_metrics.coherent_gain);
+    PUBLISH_READ_VAR(ai, "DET:WINDOW:SCALLOP", window_metrics.scalloping);
+    PUBLISH_READ_VAR(ai, "DET:WINDOW:SIDELOBE", window_metrics.sidelobe);
 
     PUBLISH_READER(stringin, "TUNE:MODE", read_tune_mode);
 
-    return true;
+    /* Benchmarking of IQ extraction. */
+    snprintf(iq_kernel.s, sizeof(iq_kernel.s), "%s", iq_kernel_name);
+    PUBLISH_ACTION("DET:BENCH", run_benchmark);
+    PUBLISH_READ_VAR(stringin, "DET:BENCH:KERNEL", iq_kernel);
+    PUBLISH_READ_VAR(ai, "DET:BENCH:REF", reference_duration);
+    PUBLISH_READ_VAR(ai, "DET:BENCH:FUSED", fused_duration);
+    PUBLISH_READ_VAR(ulongin, "DET:BENCH:LENGTH", benchmark_length);
+    PUBLISH_READ_VAR(longin, "DET:BENCH:DIFF", benchmark_difference);
+    benchmark_trigger = create_interlock("DET:BENCH", false);
+
+    /* Sweep processing queue. */
+    PUBLISH_READER(ulongin, "DET:QUEUE:DEPTH", read_queue_depth);
+    PUBLISH_READ_VAR(ulongin, "DET:QUEUE:MAX", max_queue_depth);
+    PUBLISH_READ_VAR(ulongin, "DET:QUEUE:DROPPED", dropped_sweeps);
+    queue_slots = calloc(QUEUE_SLOTS, sizeof(struct sweep_slot));
+
+    pthread_t thread_id;
+    return TEST_PTHREAD(pthread_create(&thread_id, NULL, sweep_worker, NULL));
 }
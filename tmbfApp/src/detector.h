@@ -16,7 +16,17 @@ struct channel_sweep {
 struct sweep_info {
     unsigned int sweep_length;
     bool single_bunch_mode;
+    unsigned int gain;          // Detector gain used for this sweep
+    int schedule;               // Scheduled configuration, or -1 if none
+    bool synthetic;             // Set for replayed and simulated sweeps
     double tune_scale[TUNE_LENGTH];
+    /* When the super sequencer is in use the sweep consists of segment_count
+     * consecutive segments, one for each super sequencer state, each of
+     * segment_length points. */
+    unsigned int segment_length;
+    unsigned int segment_count;
+    /* Frequency offset in tunes for each segment. */
+    double segment_offsets[SUPER_SEQ_STATES];
     /* Aggregate sweep info for the four individual channels below. */
     struct channel_sweep mean;
     /* Channel specific sweep info. */
@@ -25,6 +35,15 @@ struct sweep_info {
 
 
 
+/* Detector settings written to hardware at the start of each sweep. */
+struct detector_config {
+    unsigned int bunches[4];
+    unsigned int gain;
+    unsigned int input;
+    bool single_bunch_mode;
+};
+
+
 bool initialise_detector(void);
 
 /* Converts frequency in tunes (cycles per turn) into fractions of phase advance
@@ -34,16 +53,42 @@ unsigned int tune_to_freq(double tune);
 void compute_power(struct channel_sweep *sweep);
 
 /* Called immediately before arming and triggering the sequencer so that the
- * hardware settings appropriate to the new scan can be programmed. */
+ * hardware settings appropriate to the new scan can be programmed.  If config
+ * is NULL the detector settings as currently set through EPICS are used,
+ * otherwise the given settings are used and the sweep is tagged with the given
+ * schedule index. */
 void prepare_detector(
     bool settings_changed,
+    const struct detector_config *config, int schedule,
     unsigned int sequencer_pc, const struct seq_entry *sequencer_table,
     unsigned int super_count, const uint32_t offsets[]);
 
+/* Returns a copy of the detector settings as currently set through EPICS. */
+void read_detector_config(struct detector_config *config);
+
 /* Called on completion of buffer processing in IQ mode.  The packed I and Q
- * components are passed through for processing by the detector. */
+ * components are copied and queued for processing by the detector's worker
+ * thread, so this returns without waiting for sweep analysis. */
 void update_iq(const short buffer_low[], const short buffer_high[]);
 
+/* Queues packed raw IQ data for processing in the same way as update_iq(), but
+ * without reference to the hardware: overflow is passed in rather than read
+ * and autogain is not run.  The sweep is processed with the current capture
+ * scale and tagged with the scheduled configuration it belongs to.  Blocks
+ * until a queue slot is free.  Used to replay sweeps. */
+void replay_iq(
+    const short buffer_low[], const short buffer_high[], bool overflow);
+
+/* Returns the current sweep length and copies out the sweep frequency scale and
+ * the group delay compensation applied to each point as cos and sin scaled by
+ * 2^30.  Used to synthesise raw IQ data. */
+unsigned int read_sweep_scale(
+    double tune_scale[TUNE_LENGTH],
+    int rotation_i[TUNE_LENGTH], int rotation_q[TUNE_LENGTH]);
+
+/* Returns the right shift applied to the detector output at the given gain. */
+int detector_gain_shift(unsigned int gain);
+
 /* This is called as part of injection tune processing to forcibly update the
  * tune scale from outside. */
 void inject_tune_scale(const double tune_scale[TUNE_LENGTH]);
@@ -0,0 +1,195 @@
+/* Event driven wakeup support for hardware monitoring threads. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include "error.h"
+
+#include "event_wait.h"
+
+
+struct event_waiter {
+    unsigned int min_interval;      // Poll interval after activity
+    unsigned int armed_interval;    // Longest interval while event expected
+    unsigned int idle_interval;     // Longest interval when idle
+    unsigned int interval;          // Current poll interval
+
+    int notify_pipe[2];             // Used for software notification
+    int interrupt;                  // Interrupt device or -1 if none
+
+    double last_wake;               // Time of previous wakeup
+    double poll_delay;              // Estimated polling delay of last wakeup
+};
+
+
+/* Name of UIO device to use for interrupts, if any. */
+static const char *interrupt_device;
+
+
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+
+struct event_waiter *create_event_waiter(
+    unsigned int min_interval, unsigned int armed_interval,
+    unsigned int idle_interval)
+{
+    struct event_waiter *waiter = malloc(sizeof(struct event_waiter));
+    *waiter = (struct event_waiter) {
+        .min_interval = min_interval,
+        .armed_interval = armed_interval,
+        .idle_interval = idle_interval,
+        .interval = min_interval,
+        .interrupt = -1,
+        .last_wake = get_time(),
+    };
+    ASSERT_IO(pipe(waiter->notify_pipe));
+    ASSERT_IO(fcntl(waiter->notify_pipe[0], F_SETFL, O_NONBLOCK));
+    ASSERT_IO(fcntl(waiter->notify_pipe[1], F_SETFL, O_NONBLOCK));
+    return waiter;
+}
+
+
+/* Reading a UIO device consumes the interrupt count, after which the interrupt
+ * needs to be reenabled by writing 1. */
+static void acknowledge_interrupt(int interrupt)
+{
+    uint32_t count;
+    IGNORE(TEST_IO(read(interrupt, &count, sizeof(count))));
+    uint32_t enable = 1;
+    IGNORE(TEST_IO(write(interrupt, &enable, sizeof(enable))));
+}
+
+
+static void drain_notify(int notify)
+{
+    char buffer[16];
+    while (read(notify, buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+
+bool wait_for_event(struct event_waiter *waiter)
+{
+    struct pollfd fds[2] = {
+        { .fd = waiter->notify_pipe[0], .events = POLLIN },
+        { .fd = waiter->interrupt, .events = POLLIN },
+    };
+    nfds_t nfds = waiter->interrupt >= 0 ? 2 : 1;
+    int timeout = (int) (waiter->interval + 999) / 1000;
+    int rc = poll(fds, nfds, timeout);
+
+    double now = get_time();
+    bool event = false;
+    if (rc > 0)
+    {
+        if (fds[0].revents & POLLIN)
+        {
+            drain_notify(waiter->notify_pipe[0]);
+            event = true;
+        }
+        if (nfds > 1  &&  fds[1].revents & POLLIN)
+        {
+            acknowledge_interrupt(waiter->interrupt);
+            event = true;
+        }
+    }
+    else if (rc < 0  &&  errno != EINTR)
+        print_error("Unexpected error in event poll");
+
+    /* If we were woken explicitly then polling added no delay, otherwise the
+     * best estimate is half the last interval. */
+    if (event)
+    {
+        waiter->poll_delay = 0;
+        waiter->interval = waiter->min_interval;
+    }
+    else
+        waiter->poll_delay = 0.5 * (now - waiter->last_wake);
+    waiter->last_wake = now;
+    return event;
+}
+
+
+void notify_event(struct event_waiter *waiter)
+{
+    char byte = 0;
+    /* If the pipe is full then a wakeup is already pending, so we can safely
+     * ignore any failure here. */
+    ssize_t written = write(waiter->notify_pipe[1], &byte, 1);
+    IGNORE(written);
+}
+
+
+void update_event_interval(
+    struct event_waiter *waiter, bool active, bool armed)
+{
+    unsigned int limit = armed ? waiter->armed_interval : waiter->idle_interval;
+    if (active)
+        waiter->interval = waiter->min_interval;
+    else if (waiter->interval < limit / 2)
+        waiter->interval *= 2;
+    else
+        waiter->interval = limit;
+}
+
+
+void update_event_level(
+    struct event_waiter *waiter, size_t level, size_t capacity, bool armed)
+{
+    if (level > capacity / 2)
+    {
+        /* Getting too close to overflow, come back sooner. */
+        waiter->interval /= 2;
+        if (waiter->interval < waiter->min_interval)
+            waiter->interval = waiter->min_interval;
+    }
+    else if (level < capacity / 4)
+        /* Only back off if the FIFO is nearly empty, this leaves a dead band
+         * between a quarter and half full where we leave the interval alone. */
+        update_event_interval(waiter, false, armed);
+}
+
+
+double event_poll_delay(const struct event_waiter *waiter)
+{
+    return waiter->poll_delay;
+}
+
+
+double event_poll_interval(const struct event_waiter *waiter)
+{
+    return 1e-6 * waiter->interval;
+}
+
+
+bool attach_event_interrupt(struct event_waiter *waiter)
+{
+    if (interrupt_device == NULL)
+        return true;
+    else
+    {
+        uint32_t enable = 1;
+        return
+            TEST_IO_(waiter->interrupt = open(interrupt_device, O_RDWR),
+                "Unable to open interrupt device %s", interrupt_device)  &&
+            TEST_IO(write(waiter->interrupt, &enable, sizeof(enable)));
+    }
+}
+
+
+void set_event_interrupt_device(const char *device)
+{
+    interrupt_device = device;
+}
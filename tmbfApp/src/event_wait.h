@@ -0,0 +1,51 @@
+/* Event driven wakeup support for hardware monitoring threads.
+ *
+ * Each waiter blocks until it is either explicitly notified, the configured
+ * interrupt device (if any) fires, or its adaptive poll interval expires.  The
+ * poll interval is reset to its minimum whenever activity is seen and backs off
+ * towards its configured limits when nothing happens. */
+
+struct event_waiter;
+
+/* Creates a waiter.  All intervals are in microseconds: min_interval is used
+ * immediately after activity, the interval then doubles on each idle poll up to
+ * armed_interval while an event is expected and up to idle_interval
+ * otherwise. */
+struct event_waiter *create_event_waiter(
+    unsigned int min_interval, unsigned int armed_interval,
+    unsigned int idle_interval);
+
+/* Blocks until notified, interrupted or timed out.  Returns true if woken by an
+ * explicit event rather than by the poll timer. */
+bool wait_for_event(struct event_waiter *waiter);
+
+/* Wakes up the waiter and resets its poll interval, used when software knows
+ * that hardware activity is imminent. */
+void notify_event(struct event_waiter *waiter);
+
+/* Called after each poll to adjust the poll interval.  Set active if the poll
+ * found something to do, set armed if an event is expected. */
+void update_event_interval(
+    struct event_waiter *waiter, bool active, bool armed);
+
+/* Alternative adjustment for FIFO polling: adjusts the interval so that the
+ * FIFO is roughly half full at each wakeup. */
+void update_event_level(
+    struct event_waiter *waiter, size_t level, size_t capacity, bool armed);
+
+/* Returns an estimate in seconds of the delay added by polling to the last
+ * wakeup.  This is not a measurement: explicit and interrupt wakeups count as
+ * no delay, and for polled wakeups we assume the event occurred half way
+ * through the last poll interval. */
+double event_poll_delay(const struct event_waiter *waiter);
+
+/* Returns the current poll interval in seconds. */
+double event_poll_interval(const struct event_waiter *waiter);
+
+/* Attaches the configured interrupt device (if any) to this waiter.  Only one
+ * waiter should claim the interrupt. */
+bool attach_event_interrupt(struct event_waiter *waiter);
+
+/* Configures the interrupt device, which must be a UIO device.  Must be called
+ * before any waiters are created. */
+void set_event_interrupt_device(const char *device);
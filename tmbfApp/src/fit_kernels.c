@@ -0,0 +1,615 @@
+/* Single precision and fixed point implementations of peak fitting.
+ *
+ * The reference fit_multiple_peaks() in tune_support.c works throughout in
+ * double complex arithmetic, which on a processor without floating point
+ * hardware means a soft float library call for every operation.  Here the same
+ * algorithm is implemented with the per point work done in single precision or
+ * in integer arithmetic; only the final 2x2 solve for each fit, which is done
+ * once per fit, remains in double precision.
+ *
+ * To make this possible the frequency scale of each fit block is normalised:
+ * writing s0 for the centre of the block and h for its half width, we fit over
+ * t = (s - s0) / h, which runs from -1 to +1 across the block.  The model
+ * a/(s - b) becomes alpha/(t - beta) with a = h alpha and b = s0 + h beta.
+ * Without this the normal equations subtract nearly equal sums, which single
+ * precision cannot tolerate.
+ *
+ * All complex arithmetic is written out explicitly, as the C complex operators
+ * call library functions to handle infinities. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+
+#include "error.h"
+
+#include "tune_support.h"
+#include "fit_kernels.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Common support. */
+
+/* Normalisation of the frequency scale of a fit block. */
+struct block_scale {
+    double s0;          // Centre of block
+    double h;           // Half width of block
+};
+
+
+static bool normalise_block(
+    unsigned int count, const double scale[], struct block_scale *block)
+{
+    block->s0 = (scale[0] + scale[count - 1]) / 2;
+    block->h = (scale[count - 1] - scale[0]) / 2;
+    return count >= 2  &&  block->h != 0;
+}
+
+
+/* Converts a fit to and from the normalised scale. */
+static void normalise_fit(
+    const struct block_scale *block, const struct one_pole *fit,
+    double complex *alpha, double complex *beta)
+{
+    *alpha = fit->a / block->h;
+    *beta = (fit->b - block->s0) / block->h;
+}
+
+static void denormalise_fit(
+    const struct block_scale *block,
+    double complex alpha, double complex beta, struct one_pole *fit)
+{
+    fit->a = block->h * alpha;
+    fit->b = block->s0 + block->h * beta;
+}
+
+
+/* Sums over the fit block for the normal equations of fit_one_pole() in
+ * tune_support.c, but computed over the normalised scale t. */
+struct fit_sums {
+    double S_w;
+    double complex S_w_iq;
+    double S_w_iq2;
+    double complex S_w_t_iq;
+    double S_w_t_iq2;
+};
+
+
+/* Solves the normal equations for the normalised fit.  The weights in the sums
+ * are w_scale times the weights used by the reference, so that the reference
+ * test for a degenerate fit can be reproduced. */
+static bool solve_one_pole(
+    const struct fit_sums *sums, double w_scale,
+    double complex *alpha, double complex *beta)
+{
+    double det = sums->S_w * sums->S_w_iq2 - cabs2(sums->S_w_iq);
+    if (fabs(det) > sums->S_w * w_scale)
+    {
+        *alpha = (sums->S_w_iq2 * sums->S_w_t_iq -
+            sums->S_w_iq * sums->S_w_t_iq2) / det;
+        *beta = (sums->S_w * sums->S_w_t_iq2 -
+            conj(sums->S_w_iq) * sums->S_w_t_iq) / det;
+        return true;
+    }
+    else
+        return false;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Single precision. */
+
+struct pole_float {
+    float alpha_r, alpha_i;
+    float beta_r, beta_i;
+};
+
+
+static void to_pole_float(
+    const struct block_scale *block, const struct one_pole *fit,
+    struct pole_float *pole)
+{
+    double complex alpha, beta;
+    normalise_fit(block, fit, &alpha, &beta);
+    pole->alpha_r = (float) creal(alpha);
+    pole->alpha_i = (float) cimag(alpha);
+    pole->beta_r = (float) creal(beta);
+    pole->beta_i = (float) cimag(beta);
+}
+
+
+/* Evaluates alpha/(t - beta) = alpha conj(t - beta) / |t - beta|^2. */
+static void eval_pole_float(
+    const struct pole_float *pole, float t, float *model_i, float *model_q)
+{
+    float d_r = t - pole->beta_r;
+    float d_i = -pole->beta_i;
+    float scale = 1.0F / (d_r * d_r + d_i * d_i);
+    *model_i = (pole->alpha_r * d_r + pole->alpha_i * d_i) * scale;
+    *model_q = (pole->alpha_i * d_r - pole->alpha_r * d_i) * scale;
+}
+
+
+/* As for adjust_iq_with_model() in tune_support.c. */
+static void adjust_iq_with_model_float(
+    unsigned int peak_count, const struct one_pole fits[],
+    unsigned int peak_ix, bool refine_fit, const struct block_scale *block,
+    unsigned int count, const float t[], float iq_i[], float iq_q[])
+{
+    for (unsigned int j = 0; j < peak_count; j ++)
+    {
+        if (j == peak_ix)
+        {
+            if (!refine_fit)
+                break;
+        }
+        else
+        {
+            struct pole_float pole;
+            to_pole_float(block, &fits[j], &pole);
+            for (unsigned int i = 0; i < count; i ++)
+            {
+                float model_i, model_q;
+                eval_pole_float(&pole, t[i], &model_i, &model_q);
+                iq_i[i] -= model_i;
+                iq_q[i] -= model_q;
+            }
+        }
+    }
+}
+
+
+/* As for compute_weights() in tune_support.c, but refined weights are h^2
+ * times the reference weights. */
+static void compute_weights_float(
+    unsigned int count, bool refine_fit, float weights[],
+    const float t[], const float iq_i[], const float iq_q[],
+    const struct pole_float *pole)
+{
+    if (refine_fit)
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            float d_r = t[i] - pole->beta_r;
+            float d_i = pole->beta_i;
+            weights[i] = 1.0F / (d_r * d_r + d_i * d_i);
+        }
+    else
+        for (unsigned int i = 0; i < count; i ++)
+            weights[i] = iq_i[i] * iq_i[i] + iq_q[i] * iq_q[i];
+}
+
+
+static void fit_sums_float(
+    unsigned int count, const float t[], const float iq_i[],
+    const float iq_q[], const float weights[], struct fit_sums *sums)
+{
+    float S_w = 0;
+    float S_w_iq_r = 0, S_w_iq_i = 0;
+    float S_w_iq2 = 0;
+    float S_w_t_iq_r = 0, S_w_t_iq_i = 0;
+    float S_w_t_iq2 = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        float w = weights[i];
+        float w_iq_r = w * iq_i[i];
+        float w_iq_i = w * iq_q[i];
+        float w_iq2 = w * (iq_i[i] * iq_i[i] + iq_q[i] * iq_q[i]);
+        S_w += w;
+        S_w_iq_r += w_iq_r;
+        S_w_iq_i += w_iq_i;
+        S_w_iq2 += w_iq2;
+        S_w_t_iq_r += t[i] * w_iq_r;
+        S_w_t_iq_i += t[i] * w_iq_i;
+        S_w_t_iq2 += t[i] * w_iq2;
+    }
+    *sums = (struct fit_sums) {
+        .S_w = S_w,
+        .S_w_iq = S_w_iq_r + I * S_w_iq_i,
+        .S_w_iq2 = S_w_iq2,
+        .S_w_t_iq = S_w_t_iq_r + I * S_w_t_iq_i,
+        .S_w_t_iq2 = S_w_t_iq2,
+    };
+}
+
+
+/* As for compute_fit_error() in tune_support.c. */
+static double compute_fit_error_float(
+    unsigned int count, const float t[], const float iq_i[],
+    const float iq_q[], const struct pole_float *pole)
+{
+    float error = 0;
+    float sum = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        float model_i, model_q;
+        eval_pole_float(pole, t[i], &model_i, &model_q);
+        float e_i = iq_i[i] - model_i;
+        float e_q = iq_q[i] - model_q;
+        error += e_i * e_i + e_q * e_q;
+        sum += iq_i[i] * iq_i[i] + iq_q[i] * iq_q[i];
+    }
+    return error / sum;
+}
+
+
+unsigned int fit_multiple_peaks_float(
+    unsigned int peak_count, bool refine_fit,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    const struct peak_range ranges[],
+    struct one_pole fits[], double errors[])
+{
+    unsigned int peak_ix = 0;
+    for (; peak_ix < peak_count; peak_ix ++)
+    {
+        const struct peak_range *range = &ranges[peak_ix];
+        struct one_pole *fit = &fits[peak_ix];
+
+        unsigned int count = range->right - range->left + 1;
+        const double *scale = &scale_in[range->left];
+        struct block_scale block;
+        if (!normalise_block(count, scale, &block))
+            break;
+
+        float t[count], iq_i[count], iq_q[count];
+        double inv_h = 1 / block.h;
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            t[i] = (float) ((scale[i] - block.s0) * inv_h);
+            iq_i[i] = wf_i[range->left + i];
+            iq_q[i] = wf_q[range->left + i];
+        }
+
+        adjust_iq_with_model_float(
+            peak_count, fits, peak_ix, refine_fit, &block,
+            count, t, iq_i, iq_q);
+
+        struct pole_float pole = { };
+        if (refine_fit)
+            to_pole_float(&block, fit, &pole);
+        float weights[count];
+        compute_weights_float(count, refine_fit, weights, t, iq_i, iq_q, &pole);
+
+        struct fit_sums sums;
+        fit_sums_float(count, t, iq_i, iq_q, weights, &sums);
+        double w_scale = refine_fit ? block.h * block.h : 1;
+        double complex alpha, beta;
+        if (!solve_one_pole(&sums, w_scale, &alpha, &beta))
+            break;
+        denormalise_fit(&block, alpha, beta, fit);
+
+        to_pole_float(&block, fit, &pole);
+        errors[peak_ix] = compute_fit_error_float(count, t, iq_i, iq_q, &pole);
+    }
+    return peak_ix;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Fixed point.
+ *
+ * The normalised scale t and the poles are held with 16 bits after the binary
+ * point and IQ data in raw detector units.  Weights are normalised to at most
+ * 2^19 and the IQ data is shifted down if necessary to fit into 16 bits before
+ * forming the sums, which then fit comfortably into 64 bits for blocks of up
+ * to TUNE_LENGTH points.  Model evaluation needs one 64 bit division per
+ * point, still far cheaper than the soft float complex division it replaces. */
+
+#define T_BITS          16          // Bits after the point in t and poles
+#define WEIGHT_BITS     19          // Largest weight is 2^WEIGHT_BITS
+#define IQ_BITS         15          // IQ is shifted to fit into this range
+#define MAX_DELTA       (1LL << 24) // Limit on |t - beta| to avoid overflow
+#define MAX_ALPHA       (1LL << 36) // Limit on alpha
+#define MAX_MODEL       (1LL << 24) // Limit on model evaluated near the pole
+
+struct pole_fixed {
+    int64_t alpha_r, alpha_i;
+    int64_t beta_r, beta_i;
+};
+
+
+static int64_t clamp_64(int64_t value, int64_t limit)
+{
+    if (value > limit)
+        return limit;
+    else if (value < -limit)
+        return -limit;
+    else
+        return value;
+}
+
+
+static int64_t to_fixed(double value, int64_t limit)
+{
+    double scaled = ldexp(value, T_BITS);
+    if (isnan(scaled))
+        return 0;
+    else if (scaled >= (double) limit)
+        return limit;
+    else if (scaled <= (double) -limit)
+        return -limit;
+    else
+        return llround(scaled);
+}
+
+
+static void to_pole_fixed(
+    const struct block_scale *block, const struct one_pole *fit,
+    struct pole_fixed *pole)
+{
+    double complex alpha, beta;
+    normalise_fit(block, fit, &alpha, &beta);
+    pole->alpha_r = to_fixed(creal(alpha), MAX_ALPHA);
+    pole->alpha_i = to_fixed(cimag(alpha), MAX_ALPHA);
+    pole->beta_r = to_fixed(creal(beta), MAX_DELTA);
+    pole->beta_i = to_fixed(cimag(beta), MAX_DELTA);
+}
+
+
+/* Returns |t - beta|^2 with 2*T_BITS bits after the point, and the difference
+ * itself. */
+static int64_t pole_distance(
+    const struct pole_fixed *pole, int32_t t, int64_t *d_r, int64_t *d_i)
+{
+    *d_r = clamp_64(t - pole->beta_r, MAX_DELTA);
+    *d_i = -pole->beta_i;
+    return *d_r * *d_r + *d_i * *d_i;
+}
+
+
+static int64_t divide_rounded(int64_t num, int64_t den)
+{
+    if (num >= 0)
+        return (num + den / 2) / den;
+    else
+        return (num - den / 2) / den;
+}
+
+
+/* Evaluates the model at t in raw IQ units. */
+static void eval_pole_fixed(
+    const struct pole_fixed *pole, int32_t t,
+    int32_t *model_i, int32_t *model_q)
+{
+    int64_t d_r, d_i;
+    int64_t den = pole_distance(pole, t, &d_r, &d_i);
+    if (den > 0)
+    {
+        *model_i = (int32_t) clamp_64(divide_rounded(
+            pole->alpha_r * d_r + pole->alpha_i * d_i, den), MAX_MODEL);
+        *model_q = (int32_t) clamp_64(divide_rounded(
+            pole->alpha_i * d_r - pole->alpha_r * d_i, den), MAX_MODEL);
+    }
+    else
+    {
+        *model_i = 0;
+        *model_q = 0;
+    }
+}
+
+
+static void adjust_iq_with_model_fixed(
+    unsigned int peak_count, const struct one_pole fits[],
+    unsigned int peak_ix, bool refine_fit, const struct block_scale *block,
+    unsigned int count, const int32_t t[], int32_t iq_i[], int32_t iq_q[])
+{
+    for (unsigned int j = 0; j < peak_count; j ++)
+    {
+        if (j == peak_ix)
+        {
+            if (!refine_fit)
+                break;
+        }
+        else
+        {
+            struct pole_fixed pole;
+            to_pole_fixed(block, &fits[j], &pole);
+            for (unsigned int i = 0; i < count; i ++)
+            {
+                int32_t model_i, model_q;
+                eval_pole_fixed(&pole, t[i], &model_i, &model_q);
+                iq_i[i] -= model_i;
+                iq_q[i] -= model_q;
+            }
+        }
+    }
+}
+
+
+static unsigned int bit_length(uint64_t value)
+{
+    unsigned int bits = 0;
+    while (value >> bits)
+        bits += 1;
+    return bits;
+}
+
+
+/* Computes weights normalised so that the largest is 2^WEIGHT_BITS, returns
+ * the factor by which these weights exceed the reference weights. */
+static double compute_weights_fixed(
+    unsigned int count, bool refine_fit, int32_t weights[],
+    const int32_t t[], const int32_t iq_i[], const int32_t iq_q[],
+    const struct pole_fixed *pole, double h)
+{
+    if (refine_fit)
+    {
+        /* Reference weight is 1 / (h^2 |t - beta|^2), we compute the weight
+         * relative to the point nearest the pole. */
+        int64_t distance[count];
+        int64_t min_distance = INT64_MAX;
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            int64_t d_r, d_i;
+            distance[i] = pole_distance(pole, t[i], &d_r, &d_i);
+            if (distance[i] == 0)
+                distance[i] = 1;
+            if (distance[i] < min_distance)
+                min_distance = distance[i];
+        }
+        /* Ensure min_distance << WEIGHT_BITS cannot overflow. */
+        unsigned int bits = bit_length((uint64_t) min_distance);
+        unsigned int shift =
+            bits > 62 - WEIGHT_BITS ? bits - (62 - WEIGHT_BITS) : 0;
+        int64_t numerator = (min_distance >> shift) << WEIGHT_BITS;
+        for (unsigned int i = 0; i < count; i ++)
+            weights[i] = (int32_t) (numerator / (distance[i] >> shift));
+        return ldexp(h * h * (double) min_distance, WEIGHT_BITS - 2 * T_BITS);
+    }
+    else
+    {
+        int64_t max_weight = 0;
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            int64_t w = (int64_t) iq_i[i] * iq_i[i] +
+                (int64_t) iq_q[i] * iq_q[i];
+            if (w > max_weight)
+                max_weight = w;
+        }
+        unsigned int bits = bit_length((uint64_t) max_weight);
+        unsigned int shift = bits > WEIGHT_BITS ? bits - WEIGHT_BITS : 0;
+        for (unsigned int i = 0; i < count; i ++)
+            weights[i] = (int32_t) (((int64_t) iq_i[i] * iq_i[i] +
+                (int64_t) iq_q[i] * iq_q[i]) >> shift);
+        return ldexp(1, -(int) shift);
+    }
+}
+
+
+/* Returns the shift needed to bring the IQ data into IQ_BITS. */
+static unsigned int compute_iq_shift(
+    unsigned int count, const int32_t iq_i[], const int32_t iq_q[])
+{
+    int32_t max_iq = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        int32_t a_i = iq_i[i] < 0 ? -iq_i[i] : iq_i[i];
+        int32_t a_q = iq_q[i] < 0 ? -iq_q[i] : iq_q[i];
+        if (a_i > max_iq)  max_iq = a_i;
+        if (a_q > max_iq)  max_iq = a_q;
+    }
+    unsigned int bits = bit_length((uint64_t) max_iq);
+    return bits > IQ_BITS ? bits - IQ_BITS : 0;
+}
+
+
+/* Forms the normal equation sums, converted to double. */
+static void fit_sums_fixed(
+    unsigned int count, const int32_t t[], const int32_t iq_i[],
+    const int32_t iq_q[], const int32_t weights[], unsigned int shift,
+    struct fit_sums *sums)
+{
+    int64_t S_w = 0;
+    int64_t S_w_iq_r = 0, S_w_iq_i = 0;
+    int64_t S_w_iq2 = 0;
+    int64_t S_w_t_iq_r = 0, S_w_t_iq_i = 0;
+    int64_t S_w_t_iq2 = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        int64_t w = weights[i];
+        int64_t i_s = iq_i[i] >> shift;
+        int64_t q_s = iq_q[i] >> shift;
+        int64_t w_iq_r = w * i_s;
+        int64_t w_iq_i = w * q_s;
+        int64_t w_iq2 = (w * (i_s * i_s + q_s * q_s)) >> WEIGHT_BITS;
+        S_w += w;
+        S_w_iq_r += w_iq_r;
+        S_w_iq_i += w_iq_i;
+        S_w_iq2 += w_iq2;
+        S_w_t_iq_r += t[i] * w_iq_r;
+        S_w_t_iq_i += t[i] * w_iq_i;
+        S_w_t_iq2 += t[i] * w_iq2;
+    }
+
+    int iq_shift = (int) shift;
+    *sums = (struct fit_sums) {
+        .S_w = (double) S_w,
+        .S_w_iq = ldexp(1, iq_shift) *
+            ((double) S_w_iq_r + I * (double) S_w_iq_i),
+        .S_w_iq2 = ldexp((double) S_w_iq2, WEIGHT_BITS + 2 * iq_shift),
+        .S_w_t_iq = ldexp(1, iq_shift - T_BITS) *
+            ((double) S_w_t_iq_r + I * (double) S_w_t_iq_i),
+        .S_w_t_iq2 = ldexp((double) S_w_t_iq2,
+            WEIGHT_BITS + 2 * iq_shift - T_BITS),
+    };
+}
+
+
+/* The shift is applied to both data and error, and so cancels. */
+static double compute_fit_error_fixed(
+    unsigned int count, const int32_t t[], const int32_t iq_i[],
+    const int32_t iq_q[], unsigned int shift, const struct pole_fixed *pole)
+{
+    int64_t error = 0;
+    int64_t sum = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        int32_t model_i, model_q;
+        eval_pole_fixed(pole, t[i], &model_i, &model_q);
+        int64_t e_i = (iq_i[i] - model_i) >> shift;
+        int64_t e_q = (iq_q[i] - model_q) >> shift;
+        int64_t i_s = iq_i[i] >> shift;
+        int64_t q_s = iq_q[i] >> shift;
+        error += e_i * e_i + e_q * e_q;
+        sum += i_s * i_s + q_s * q_s;
+    }
+    return (double) error / (double) sum;
+}
+
+
+unsigned int fit_multiple_peaks_fixed(
+    unsigned int peak_count, bool refine_fit,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    const struct peak_range ranges[],
+    struct one_pole fits[], double errors[])
+{
+    unsigned int peak_ix = 0;
+    for (; peak_ix < peak_count; peak_ix ++)
+    {
+        const struct peak_range *range = &ranges[peak_ix];
+        struct one_pole *fit = &fits[peak_ix];
+
+        unsigned int count = range->right - range->left + 1;
+        const double *scale = &scale_in[range->left];
+        struct block_scale block;
+        if (!normalise_block(count, scale, &block))
+            break;
+
+        int32_t t[count], iq_i[count], iq_q[count];
+        double t_scale = ldexp(1 / block.h, T_BITS);
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            t[i] = (int32_t) lround((scale[i] - block.s0) * t_scale);
+            iq_i[i] = wf_i[range->left + i];
+            iq_q[i] = wf_q[range->left + i];
+        }
+
+        adjust_iq_with_model_fixed(
+            peak_count, fits, peak_ix, refine_fit, &block,
+            count, t, iq_i, iq_q);
+
+        struct pole_fixed pole = { };
+        if (refine_fit)
+            to_pole_fixed(&block, fit, &pole);
+        int32_t weights[count];
+        double w_scale = compute_weights_fixed(
+            count, refine_fit, weights, t, iq_i, iq_q, &pole, block.h);
+
+        unsigned int shift = compute_iq_shift(count, iq_i, iq_q);
+        struct fit_sums sums;
+        fit_sums_fixed(count, t, iq_i, iq_q, weights, shift, &sums);
+        double complex alpha, beta;
+        if (!solve_one_pole(&sums, w_scale, &alpha, &beta))
+            break;
+        denormalise_fit(&block, alpha, beta, fit);
+
+        to_pole_fixed(&block, fit, &pole);
+        errors[peak_ix] =
+            compute_fit_error_fixed(count, t, iq_i, iq_q, shift, &pole);
+    }
+    return peak_ix;
+}
@@ -0,0 +1,16 @@
+/* Single precision and fixed point implementations of peak fitting. */
+
+/* These have exactly the same interface and behaviour as the double precision
+ * reference fit_multiple_peaks() in tune_support.c, and are normally selected
+ * through fit_multiple_peaks_kernel(). */
+unsigned int fit_multiple_peaks_float(
+    unsigned int peak_count, bool refine_fit,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    const struct peak_range ranges[],
+    struct one_pole fits[], double errors[]);
+
+unsigned int fit_multiple_peaks_fixed(
+    unsigned int peak_count, bool refine_fit,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    const struct peak_range ranges[],
+    struct one_pole fits[], double errors[]);
@@ -0,0 +1,274 @@
+/* IQ extraction from the raw detector buffer.  This has no dependency on EPICS
+ * so that it can also be built and tested on the host.
+ *
+ * The raw buffer contains interleaved I and Q data for the four channels,
+ * channel c of point i is at index 4*i+c.  For each point we rotate the raw I
+ * and Q by the precomputed delay compensation and accumulate the mean over the
+ * four channels.
+ *
+ * The original implementation makes ten passes over the data (four
+ * extractions, four channel powers, the mean and its power) and is retained
+ * below as a reference for benchmarking.  The fused implementation extracts I
+ * and Q in a single pass, and the rotation step has variants chosen at build
+ * time to take advantage of the target instruction set.  The fused
+ * implementation leaves the power waveforms to the caller so that they need
+ * only be computed when needed. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware.h"
+#include "detector.h"
+
+#include "iq_extract.h"
+
+
+/* Returns 2^-31 * (a*c + b*d) with rounding of the last bit.  The scaling here
+ * is chosen to balance the 2^30 scaling on (sin,cos) without risking overflow,
+ * which unfortunately is possible if we scale by 2^-30. */
+static int32_t dot_product(int32_t a, int32_t b, int32_t c, int32_t d)
+{
+    int64_t full = (int64_t) a * c + (int64_t) b * d;
+    return (int32_t) ((full + (1UL << 30)) >> 31);
+}
+
+
+#if !defined(DETECTOR_SCALAR_IQ)  &&  \
+    (defined(__ARM_FEATURE_DSP)  ||  defined(__ARM_ARCH_5TE__))
+/* The ARMv5TE DSP extensions provide single cycle 32x16 multiplies returning
+ * the top 32 bits of the 48 bit product, which is exactly what we need here:
+ * the raw I and Q values fit into 16 bits.  The dropped bottom 16 bits of each
+ * product mean that the result can occasionally differ from dot_product() by
+ * one in the bottom bit. */
+#define IQ_KERNEL   "ARM DSP"
+static inline int32_t dsp_dot_product(
+    int32_t a, int32_t b, int32_t c, int32_t d)
+{
+    int32_t result;
+    __asm__("smulwb %0, %1, %2" : "=r" (result) : "r" (c), "r" (a));
+    __asm__("smlawb %0, %1, %2, %0" : "+r" (result) : "r" (d), "r" (b));
+    return (result + (1 << 14)) >> 15;
+}
+#define ROTATE_DOT  dsp_dot_product
+#else
+#define ROTATE_DOT  dot_product
+#endif
+
+
+#if defined(DETECTOR_SIMD_IQ)  &&  !defined(IQ_KERNEL)
+/* Portable SIMD: the four channels of each point are adjacent in the raw
+ * buffer, so we process each point as a vector of four channels using the GCC
+ * vector extensions (needs GCC 9 or later).  To keep everything in 32 bit
+ * lanes the rotation is reduced to 2^15 scaling, so again the result can differ
+ * from dot_product() by one in the bottom bit.  This needs to be enabled
+ * explicitly by defining DETECTOR_SIMD_IQ as it only pays off on targets with
+ * suitable vector units. */
+#define IQ_KERNEL   "SIMD"
+typedef int16_t v4hi __attribute__((vector_size(8)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+static inline v4si load_v4si(const short raw[4])
+{
+    v4hi result;
+    memcpy(&result, raw, sizeof(result));
+    return __builtin_convertvector(result, v4si);
+}
+
+static inline v4si abs_v4si(v4si x)
+{
+    v4si sign = x >> 31;
+    return (x ^ sign) - sign;
+}
+
+static inline v4si max_v4si(v4si a, v4si b)
+{
+    return a + ((b - a) & ((a - b) >> 31));
+}
+
+static void fused_extract_point(
+    struct sweep_info *info, unsigned int i, const struct rotation *rotate,
+    const short raw_I[4], const short raw_Q[4], v4si *abs_max)
+{
+    v4si I = load_v4si(raw_I);
+    v4si Q = load_v4si(raw_Q);
+    *abs_max = max_v4si(*abs_max, max_v4si(abs_v4si(I), abs_v4si(Q)));
+
+    int32_t rot_I = (rotate->I + (1 << 14)) >> 15;
+    int32_t rot_Q = (rotate->Q + (1 << 14)) >> 15;
+    v4si wf_I = (I * rot_I - Q * rot_Q + (1 << 15)) >> 16;
+    v4si wf_Q = (I * rot_Q + Q * rot_I + (1 << 15)) >> 16;
+
+    for (unsigned int channel = 0; channel < 4; channel ++)
+    {
+        struct channel_sweep *sweep = &info->channels[channel];
+        sweep->wf_i[i] = (short) wf_I[channel];
+        sweep->wf_q[i] = (short) wf_Q[channel];
+    }
+    int I_sum = wf_I[0] + wf_I[1] + wf_I[2] + wf_I[3];
+    int Q_sum = wf_Q[0] + wf_Q[1] + wf_Q[2] + wf_Q[3];
+    info->mean.wf_i[i] = (short) ((I_sum + 2) / 4);
+    info->mean.wf_q[i] = (short) ((Q_sum + 2) / 4);
+}
+
+static int fused_extract_iq(
+    struct sweep_info *info, const struct rotation rotations[],
+    const short buffer_low[], const short buffer_high[])
+{
+    v4si abs_max = { 0, 0, 0, 0 };
+    for (unsigned int i = 0; i < info->sweep_length; i ++)
+        fused_extract_point(info, i, &rotations[i],
+            &buffer_low[4 * i], &buffer_high[4 * i], &abs_max);
+    int result = 0;
+    for (unsigned int channel = 0; channel < 4; channel ++)
+        if (abs_max[channel] > result)
+            result = abs_max[channel];
+    return result;
+}
+
+#else
+#ifndef IQ_KERNEL
+#define IQ_KERNEL   "Scalar"
+#endif
+
+static int fused_extract_iq(
+    struct sweep_info *info, const struct rotation rotations[],
+    const short buffer_low[], const short buffer_high[])
+{
+    int abs_max = 0;
+    for (unsigned int i = 0; i < info->sweep_length; i ++)
+    {
+        const short *raw_I = &buffer_low[4 * i];
+        const short *raw_Q = &buffer_high[4 * i];
+        int32_t rot_I = rotations[i].I;
+        int32_t rot_Q = rotations[i].Q;
+
+        int I_sum = 0, Q_sum = 0;
+        for (unsigned int channel = 0; channel < 4; channel ++)
+        {
+            int I = raw_I[channel];
+            int Q = raw_Q[channel];
+            if (abs(I) > abs_max)  abs_max = abs(I);
+            if (abs(Q) > abs_max)  abs_max = abs(Q);
+
+            struct channel_sweep *sweep = &info->channels[channel];
+            int wf_i = ROTATE_DOT(I, Q, rot_I, -rot_Q);
+            int wf_q = ROTATE_DOT(I, Q, rot_Q, rot_I);
+            sweep->wf_i[i] = (short) wf_i;
+            sweep->wf_q[i] = (short) wf_q;
+            I_sum += wf_i;
+            Q_sum += wf_q;
+        }
+
+        info->mean.wf_i[i] = (short) ((I_sum + 2) / 4);
+        info->mean.wf_q[i] = (short) ((Q_sum + 2) / 4);
+    }
+    return abs_max;
+}
+#endif
+
+
+/* Ensure the entire array is filled.  If IQ capture was short we extend the
+ * last read value to fill the rest of the waveform.  This makes the resulting
+ * display look better on a display tool like EDM. */
+static void pad_channel(struct channel_sweep *sweep, unsigned int length)
+{
+    if (length > 0)
+        for (unsigned int i = length; i < TUNE_LENGTH; i ++)
+        {
+            sweep->wf_i[i] = sweep->wf_i[length - 1];
+            sweep->wf_q[i] = sweep->wf_q[length - 1];
+        }
+}
+
+
+/* From the raw buffer extract IQ data for each channel and the mean using the
+ * given delay compensation.  Returns the maximum raw value for autogain. */
+int fused_sweep_info(
+    struct sweep_info *info, const struct rotation rotations[],
+    const short buffer_low[], const short buffer_high[])
+{
+    int abs_max = fused_extract_iq(info, rotations, buffer_low, buffer_high);
+    for (unsigned int channel = 0; channel < 4; channel ++)
+        pad_channel(&info->channels[channel], info->sweep_length);
+    pad_channel(&info->mean, info->sweep_length);
+    return abs_max;
+}
+
+
+/* The power waveform for each sweep is simply the sum of squares. */
+#define SQR(x)      ((x) * (x))
+void compute_power(struct channel_sweep *sweep)
+{
+    for (int i = 0; i < TUNE_LENGTH; i ++)
+        sweep->power[i] = SQR(sweep->wf_i[i]) + SQR(sweep->wf_q[i]);
+}
+
+/* Reference implementation: extracts and scales IQ for one channel from the
+ * incoming raw IQ buffer.  Also updates *abs_max for autogain calculation. */
+static void extract_iq(
+    const short buffer_low[], const short buffer_high[], unsigned int channel,
+    const struct rotation rotations[],
+    unsigned int sweep_length, struct channel_sweep *sweep, int *abs_max)
+{
+    for (unsigned int i = 0; i < sweep_length; i ++)
+    {
+        int raw_I = buffer_low[4 * i + channel];
+        int raw_Q = buffer_high[4 * i + channel];
+        if (abs(raw_I) > *abs_max)  *abs_max = abs(raw_I);
+        if (abs(raw_Q) > *abs_max)  *abs_max = abs(raw_Q);
+
+        int rot_I = rotations[i].I;
+        int rot_Q = rotations[i].Q;
+        sweep->wf_i[i] = (short) dot_product(raw_I, raw_Q, rot_I, -rot_Q);
+        sweep->wf_q[i] = (short) dot_product(raw_I, raw_Q, rot_Q, rot_I);
+    }
+
+    for (unsigned int i = sweep_length; i < TUNE_LENGTH; i ++)
+    {
+        sweep->wf_i[i] = sweep->wf_i[sweep_length-1];
+        sweep->wf_q[i] = sweep->wf_q[sweep_length-1];
+    }
+}
+
+
+/* Reference implementation: once IQ has been computed for the four channels,
+ * the mean IQ is just the mean of the four channels. */
+static void compute_mean_iq(struct sweep_info *info)
+{
+    for (int i = 0; i < TUNE_LENGTH; i ++)
+    {
+        int I_sum = 0, Q_sum = 0;
+        for (int channel = 0; channel < 4; channel ++)
+        {
+            struct channel_sweep *sweep = &info->channels[channel];
+            I_sum += sweep->wf_i[i];
+            Q_sum += sweep->wf_q[i];
+        }
+        info->mean.wf_i[i] = (short) ((I_sum + 2) / 4);  // Rounded average
+        info->mean.wf_q[i] = (short) ((Q_sum + 2) / 4);  // of 4 channels
+    }
+}
+
+
+/* Reference implementation of fused_sweep_info(). */
+int reference_sweep_info(
+    struct sweep_info *info, const struct rotation rotations[],
+    const short buffer_low[], const short buffer_high[])
+{
+    int abs_max = 0;
+    for (unsigned int channel = 0; channel < 4; channel ++)
+    {
+        struct channel_sweep *sweep = &info->channels[channel];
+        extract_iq(buffer_low, buffer_high, channel, rotations,
+            info->sweep_length, sweep, &abs_max);
+        compute_power(sweep);
+    }
+    compute_mean_iq(info);
+    compute_power(&info->mean);
+    return abs_max;
+}
+
+
+const char iq_kernel_name[] = IQ_KERNEL;
@@ -0,0 +1,25 @@
+/* IQ extraction from the raw detector buffer. */
+
+/* Delay compensation for one sweep point, precomputed as scaled integers with
+ * I and Q interleaved as they are always used together. */
+struct rotation {
+    int32_t I;                      // 2**30 * cos(phase)
+    int32_t Q;                      // 2**30 * sin(phase)
+};
+
+/* From the raw buffer extract IQ data for each channel and the mean using the
+ * given delay compensation, padding each waveform to TUNE_LENGTH points.  The
+ * power waveforms are not computed.  Returns the maximum raw value for
+ * autogain. */
+int fused_sweep_info(
+    struct sweep_info *info, const struct rotation rotations[],
+    const short buffer_low[], const short buffer_high[]);
+
+/* Reference implementation of fused_sweep_info(), which also computes all the
+ * power waveforms. */
+int reference_sweep_info(
+    struct sweep_info *info, const struct rotation rotations[],
+    const short buffer_low[], const short buffer_high[]);
+
+/* Name of the implementation of fused_sweep_info() selected at build time. */
+extern const char iq_kernel_name[];
@@ -0,0 +1,171 @@
+/* Coupled bunch mode scan analysis.
+ *
+ * When the super sequencer offsets are set to step through integer mode
+ * numbers (as set up by SEQ:SUPER:RESET) each segment of the sweep is the
+ * response of a single coupled bunch mode.  Here we take the segment fits and
+ * convert them into per mode tune, damping and amplitude. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <complex.h>
+#include <math.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "hardware.h"
+#include "detector.h"
+#include "tune_support.h"
+
+#include "mode_scan.h"
+
+
+/* Segment offsets must be this close to an integer to count as a mode. */
+#define MODE_TOLERANCE  1e-6
+
+enum mode_scan_status {
+    MODE_SCAN_OK,           // Mode scan successfully processed
+    MODE_SCAN_NO_SCAN,      // Offsets not set for mode scan
+    MODE_SCAN_NO_FITS,      // No modes could be fitted
+};
+
+static bool mode_scan_enable;
+
+static struct epics_interlock *mode_trigger;
+static unsigned int scan_status;
+static unsigned int mode_count;         // Number of modes measured
+static unsigned int unstable_count;     // Number of modes with negative damping
+static unsigned int least_stable_mode;
+static double min_damping;              // Damping of least stable mode
+
+/* Mode indexed results. */
+static double mode_tune[BUNCHES_PER_TURN];
+static double mode_damping[BUNCHES_PER_TURN];   // Damping rate per turn
+static double mode_amplitude[BUNCHES_PER_TURN];
+static double mode_power[BUNCHES_PER_TURN];     // Peak power in dB
+
+
+bool mode_scan_enabled(void)
+{
+    return mode_scan_enable;
+}
+
+
+/* Checks whether the segment offset corresponds to a mode number. */
+static bool offset_to_mode(double offset, unsigned int *mode)
+{
+    double mode_number = round(offset);
+    if (fabs(offset - mode_number) < MODE_TOLERANCE)
+    {
+        *mode = (unsigned int) mode_number % BUNCHES_PER_TURN;
+        return true;
+    }
+    else
+        return false;
+}
+
+
+static bool is_mode_scan(const struct sweep_info *sweep_info)
+{
+    unsigned int mode;
+    for (unsigned int segment = 0; segment < sweep_info->segment_count;
+         segment ++)
+        if (!offset_to_mode(sweep_info->segment_offsets[segment], &mode))
+            return false;
+    return true;
+}
+
+
+static void reset_modes(void)
+{
+    for (unsigned int mode = 0; mode < BUNCHES_PER_TURN; mode ++)
+    {
+        mode_tune[mode] = NAN;
+        mode_damping[mode] = NAN;
+        mode_amplitude[mode] = NAN;
+        mode_power[mode] = NAN;
+    }
+    mode_count = 0;
+    unstable_count = 0;
+    least_stable_mode = 0;
+    min_damping = NAN;
+}
+
+
+/* The fit is a/(s - b) with s in tunes.  The imaginary part of b is minus the
+ * half width in tunes, which corresponds to a damping rate of 2 pi width per
+ * turn; a negative damping rate is a growing mode. */
+static void update_mode(
+    unsigned int mode, double offset, const struct one_pole *fit)
+{
+    double harmonic;
+    double tune = modf(peak_centre(fit) - offset, &harmonic);
+    if (tune < 0)
+        tune += 1;
+    double damping = 2 * M_PI * peak_width(fit);
+    double amplitude = cabs(fit->a) / fabs(peak_width(fit));
+
+    mode_tune[mode] = tune;
+    mode_damping[mode] = damping;
+    mode_amplitude[mode] = amplitude;
+    mode_power[mode] = 20 * log10(amplitude);
+
+    if (mode_count == 0  ||  damping < min_damping)
+    {
+        min_damping = damping;
+        least_stable_mode = mode;
+    }
+    if (damping < 0)
+        unstable_count += 1;
+    mode_count += 1;
+}
+
+
+void update_mode_scan(
+    const struct sweep_info *sweep_info,
+    const struct one_pole fits[], const bool valid[])
+{
+    if (!mode_scan_enable)
+        return;
+
+    interlock_wait(mode_trigger);
+    reset_modes();
+    if (!is_mode_scan(sweep_info))
+        scan_status = MODE_SCAN_NO_SCAN;
+    else
+    {
+        for (unsigned int segment = 0; segment < sweep_info->segment_count;
+             segment ++)
+        {
+            double offset = sweep_info->segment_offsets[segment];
+            unsigned int mode;
+            if (valid[segment]  &&  offset_to_mode(offset, &mode))
+                update_mode(mode, offset, &fits[segment]);
+        }
+        scan_status = mode_count > 0 ? MODE_SCAN_OK : MODE_SCAN_NO_FITS;
+    }
+    interlock_signal(mode_trigger, NULL);
+}
+
+
+bool initialise_mode_scan(void)
+{
+    PUBLISH_WRITE_VAR_P(bo, "MODE:ENABLE", mode_scan_enable);
+
+    mode_trigger = create_interlock("MODE", false);
+    PUBLISH_READ_VAR(mbbi, "MODE:STATUS", scan_status);
+    PUBLISH_READ_VAR(ulongin, "MODE:COUNT", mode_count);
+    PUBLISH_READ_VAR(ulongin, "MODE:UNSTABLE", unstable_count);
+    PUBLISH_READ_VAR(ulongin, "MODE:LEAST", least_stable_mode);
+    PUBLISH_READ_VAR(ai, "MODE:MIN_DAMPING", min_damping);
+    PUBLISH_WF_READ_VAR(double, "MODE:TUNE", BUNCHES_PER_TURN, mode_tune);
+    PUBLISH_WF_READ_VAR(
+        double, "MODE:DAMPING", BUNCHES_PER_TURN, mode_damping);
+    PUBLISH_WF_READ_VAR(
+        double, "MODE:AMPLITUDE", BUNCHES_PER_TURN, mode_amplitude);
+    PUBLISH_WF_READ_VAR(double, "MODE:POWER", BUNCHES_PER_TURN, mode_power);
+
+    reset_modes();
+    return true;
+}
@@ -0,0 +1,16 @@
+/* Coupled bunch mode scan analysis. */
+
+struct sweep_info;
+struct one_pole;
+
+/* Returns true if mode scan analysis has been requested, in which case segment
+ * fits are needed. */
+bool mode_scan_enabled(void);
+
+/* Called with the results of segment fitting.  If the super sequencer offsets
+ * step through coupled bunch modes then per mode results are computed. */
+void update_mode_scan(
+    const struct sweep_info *sweep_info,
+    const struct one_pole fits[], const bool valid[]);
+
+bool initialise_mode_scan(void);
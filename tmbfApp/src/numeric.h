@@ -61,7 +61,9 @@ static inline unsigned int clz_64(uint64_t x)
  * right shift).  Note the "=&r" modifiers: the true constraint on -mull is
  * that the first three registers be distinct, but the only practical way to
  * achieve this seems to be to mark the two (already separate) outputs as
- * "early clobber" to force them to be distinct from both inputs. */
+ * "early clobber" to force them to be distinct from both inputs.
+ *    Other targets, used for host testing, use the plain C equivalent. */
+#ifdef __arm__
 static inline unsigned int MulUU(unsigned int x, unsigned int y)
 {
     unsigned int result, temp;
@@ -77,6 +79,17 @@ static inline int MulSS(int x, int y)
         "=&r"(result), "=&r"(temp) : "r"(x), "r"(y));
     return result;
 }
+#else
+static inline unsigned int MulUU(unsigned int x, unsigned int y)
+{
+    return (unsigned int) (((uint64_t) x * y) >> 32);
+}
+
+static inline int MulSS(int x, int y)
+{
+    return (int) (((int64_t) x * y) >> 32);
+}
+#endif
 
 
 /* To retain the maximum possible number of bits we have to take a bit of
@@ -0,0 +1,246 @@
+/* Extraction of peaks from the second derivative of a smoothed power
+ * waveform.  These routines have no dependency on EPICS so that they can also
+ * be built and tested on the host. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+
+#include "peak_search.h"
+
+
+/* Given a point at the peak (as determined by DD) track away in both directions
+ * from this peak so that we span the entire raised peak.  Because the detected
+ * "peak" may be slightly off peak, we track up before tracking down.  Note that
+ * this can result in overlapping peak ranges, but this shouldn't matter.  */
+static void find_peak_limits(
+    unsigned int length, const int power[], unsigned int peak_ix,
+    unsigned int *peak_left, unsigned int *peak_right)
+{
+    /* Track up and then down from the putative peak to both left and right. */
+    unsigned int left = peak_ix;
+    while (left > 0  &&  power[left - 1] >= power[left])
+        left -= 1;
+    while (left > 0  &&  power[left - 1] <= power[left])
+        left -= 1;
+
+    unsigned int right = peak_ix;
+    while (right < length - 1  &&  power[right + 1] >= power[right])
+        right += 1;
+    while (right < length - 1  &&  power[right + 1] <= power[right])
+        right += 1;
+
+    *peak_left = left;
+    *peak_right = right;
+}
+
+
+/* The original extraction makes a full pass over the second derivative for
+ * each peak, masking off each peak as it is found.  This is retained as a
+ * reference for benchmarking. */
+
+/* Searches for point of highest downwards curvature not enclosed by a peak
+ * already found.  Returns -1 if nothing left to find. */
+static bool find_peak_ix(
+    unsigned int length, const int dd[], bool peak_marks[],
+    unsigned int *peak_ix)
+{
+    int min_val = 0;
+    bool found = false;
+    for (unsigned int ix = 0; ix < length; ix ++)
+        if (!peak_marks[ix]  &&  dd[ix] < min_val)
+        {
+            *peak_ix = ix;
+            min_val = dd[ix];
+            found = true;
+        }
+    return found;
+}
+
+
+unsigned int reference_extract_peaks(
+    unsigned int length, unsigned int max_peaks,
+    const int power[], const int dd[],
+    bool peak_marks[], struct raw_peak_data peak_data[])
+{
+    unsigned int peak_ix = 0;
+    for (; peak_ix < max_peaks; peak_ix ++)
+    {
+        unsigned int max_ix = 0;
+        if (!find_peak_ix(length, dd, peak_marks, &max_ix))
+            break;
+
+        /* Discover the bounds of the peak and mark it off as seen. */
+        unsigned int left, right;
+        find_peak_limits(length, power, max_ix, &left, &right);
+        for (unsigned int i = left; i <= right; i ++)
+            peak_marks[i] = true;
+
+        peak_data[peak_ix] = (struct raw_peak_data) {
+            .ix = max_ix, .left = left, .right = right };
+    }
+
+    return peak_ix;
+}
+
+
+/* Single pass extraction.  Only the local minima of the second derivative can
+ * be peaks, so these are collected in one pass and the best are selected with
+ * a heap bounded by the number of peaks wanted.  Candidates are then taken in
+ * order, skipping any enclosed by a peak already taken; if too many are
+ * skipped a further selection is made from the remaining candidates.
+ *    This finds the same peaks as the reference except in the rare case where
+ * the reference takes a point on the boundary of an earlier peak which is not
+ * itself a local minimum.
+ *    All working storage is taken from a fixed arena. */
+
+
+/* Candidates are ordered by second derivative, with the earliest first where
+ * values are equal, to match the reference. */
+static bool better_candidate(
+    const struct peak_candidate *a, const struct peak_candidate *b)
+{
+    return a->dd < b->dd  ||  (a->dd == b->dd  &&  a->ix < b->ix);
+}
+
+
+static unsigned int find_candidates(
+    unsigned int length, const int dd[], struct peak_candidate candidates[])
+{
+    unsigned int count = 0;
+    for (unsigned int ix = 0; ix < length; ix ++)
+        if (dd[ix] < 0  &&
+            (ix == 0  ||  dd[ix] < dd[ix - 1])  &&
+            (ix == length - 1  ||  dd[ix] <= dd[ix + 1]))
+            candidates[count++] = (struct peak_candidate) {
+                .dd = dd[ix], .ix = ix };
+    return count;
+}
+
+
+static void swap_candidates(struct peak_candidate *a, struct peak_candidate *b)
+{
+    struct peak_candidate t = *a;
+    *a = *b;
+    *b = t;
+}
+
+
+/* The heap keeps the worst candidate at the root so that it can be replaced. */
+static void sift_up(struct peak_candidate heap[], unsigned int ix)
+{
+    while (ix > 0  &&  better_candidate(&heap[(ix - 1) / 2], &heap[ix]))
+    {
+        swap_candidates(&heap[(ix - 1) / 2], &heap[ix]);
+        ix = (ix - 1) / 2;
+    }
+}
+
+static void sift_down(
+    struct peak_candidate heap[], unsigned int count, unsigned int ix)
+{
+    while (true)
+    {
+        unsigned int worst = ix;
+        unsigned int left = 2 * ix + 1;
+        unsigned int right = left + 1;
+        if (left < count  &&  better_candidate(&heap[worst], &heap[left]))
+            worst = left;
+        if (right < count  &&  better_candidate(&heap[worst], &heap[right]))
+            worst = right;
+        if (worst == ix)
+            break;
+        swap_candidates(&heap[ix], &heap[worst]);
+        ix = worst;
+    }
+}
+
+
+/* Selects the best max_count candidates worse than after (if given) into the
+ * heap and sorts them, best first.  Returns the number selected. */
+static unsigned int select_candidates(
+    unsigned int candidate_count, const struct peak_candidate candidates[],
+    const struct peak_candidate *after,
+    unsigned int max_count, struct peak_candidate heap[])
+{
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < candidate_count; i ++)
+    {
+        const struct peak_candidate *candidate = &candidates[i];
+        if (after  &&  !better_candidate(after, candidate))
+            continue;
+        if (count < max_count)
+        {
+            heap[count] = *candidate;
+            sift_up(heap, count);
+            count += 1;
+        }
+        else if (better_candidate(candidate, &heap[0]))
+        {
+            heap[0] = *candidate;
+            sift_down(heap, count, 0);
+        }
+    }
+
+    for (unsigned int n = count; n > 1; n --)
+    {
+        swap_candidates(&heap[0], &heap[n - 1]);
+        sift_down(heap, n - 1, 0);
+    }
+    return count;
+}
+
+
+static bool enclosed_by_peak(
+    unsigned int ix, unsigned int peak_count,
+    const struct raw_peak_data peak_data[])
+{
+    for (unsigned int i = 0; i < peak_count; i ++)
+        if (peak_data[i].left <= ix  &&  ix <= peak_data[i].right)
+            return true;
+    return false;
+}
+
+
+/* Walks through second derivative and extracts all peaks in descending order of
+ * size.  Returns the number of peaks successfully extracted. */
+unsigned int extract_peaks(
+    unsigned int length, unsigned int max_peaks,
+    const int power[], const int dd[],
+    const struct peak_arena *arena, struct raw_peak_data peak_data[])
+{
+    ASSERT_OK(length <= arena->max_length  &&  max_peaks <= arena->max_peaks);
+    struct peak_candidate *heap = arena->heap;
+    unsigned int candidate_count =
+        find_candidates(length, dd, arena->candidates);
+
+    unsigned int peak_count = 0;
+    struct peak_candidate last;
+    const struct peak_candidate *after = NULL;
+    while (peak_count < max_peaks)
+    {
+        unsigned int wanted = max_peaks - peak_count;
+        unsigned int count = select_candidates(
+            candidate_count, arena->candidates, after, wanted, heap);
+        for (unsigned int i = 0; i < count  &&  peak_count < max_peaks; i ++)
+        {
+            unsigned int ix = heap[i].ix;
+            if (!enclosed_by_peak(ix, peak_count, peak_data))
+            {
+                unsigned int left, right;
+                find_peak_limits(length, power, ix, &left, &right);
+                peak_data[peak_count++] = (struct raw_peak_data) {
+                    .ix = ix, .left = left, .right = right };
+            }
+        }
+
+        /* Stop when all candidates have been seen. */
+        if (count < wanted)
+            break;
+        last = heap[count - 1];
+        after = &last;
+    }
+    return peak_count;
+}
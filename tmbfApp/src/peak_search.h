@@ -0,0 +1,44 @@
+/* Extraction of peaks from the second derivative of a smoothed power
+ * waveform. */
+
+/* Result of peak extraction is the index of the maximum D2 point for each peak
+ * together with a span covering the peak. */
+struct raw_peak_data {
+    unsigned int ix;        // Index of discovered peak (for info only)
+    unsigned int left;      // Left and right boundaries of peak in smoothed
+    unsigned int right;     //  data indices.
+};
+
+
+/* Working storage for extract_peaks(), which is all preallocated by the
+ * caller. */
+struct peak_candidate {
+    int dd;                 // Second derivative at candidate
+    unsigned int ix;        // Index of candidate
+};
+
+/* No two local minima are adjacent, so this is enough for all candidates. */
+#define MAX_CANDIDATES(length)  ((length) / 2 + 1)
+
+struct peak_arena {
+    unsigned int max_length;            // Longest waveform supported
+    unsigned int max_peaks;             // Size of selection heap
+    struct peak_candidate *candidates;  // MAX_CANDIDATES(max_length) entries
+    struct peak_candidate *heap;        // max_peaks entries
+};
+
+
+/* Walks through second derivative and extracts up to max_peaks peaks in
+ * descending order of size.  Returns the number of peaks successfully
+ * extracted.  The length and peak count must fit within the arena. */
+unsigned int extract_peaks(
+    unsigned int length, unsigned int max_peaks,
+    const int power[], const int dd[],
+    const struct peak_arena *arena, struct raw_peak_data peak_data[]);
+
+/* Original implementation of extract_peaks() retained as a reference.  The
+ * peak_marks array of length points must be cleared before each call. */
+unsigned int reference_extract_peaks(
+    unsigned int length, unsigned int max_peaks,
+    const int power[], const int dd[],
+    bool peak_marks[], struct raw_peak_data peak_data[]);
@@ -0,0 +1,299 @@
+/* Soak replay of sweeps through the complete processing path.
+ *
+ * Recorded, injected or synthetic sweeps are pumped through the detector
+ * processing queue as fast as the processing will accept them.  Each sweep
+ * goes through detector scaling, tune fitting, peak fitting and EPICS
+ * publication exactly as a captured sweep would, including all interlocks, so
+ * this gives a throughput benchmark of the real IOC code.
+ *
+ * Live sweeps arriving during a replay compete for the same queue and are
+ * likely to be dropped, so replay is best run with triggering stopped. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "epics_extra.h"
+#include "hardware.h"
+#include "detector.h"
+#include "simulate.h"
+
+#include "replay.h"
+
+
+#define MAX_RECORDED    16
+
+struct recorded_sweep {
+    short buffer_low[BUF_DATA_LENGTH];
+    short buffer_high[BUF_DATA_LENGTH];
+};
+
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t replay_done = PTHREAD_COND_INITIALIZER;
+
+#define LOCK()      ASSERT_PTHREAD(pthread_mutex_lock(&replay_lock))
+#define UNLOCK()    ASSERT_PTHREAD(pthread_mutex_unlock(&replay_lock))
+
+/* Recording of captured sweeps, and a single sweep used for injected and
+ * synthetic data. */
+static struct recorded_sweep *recorded;
+static struct recorded_sweep *injected;
+static unsigned int recorded_count;     // Number of valid recorded sweeps
+static unsigned int record_request;     // Number of sweeps still to record
+static unsigned int record_depth = MAX_RECORDED;
+
+/* Replay settings. */
+enum { SOURCE_RECORDED, SOURCE_INJECTED, SOURCE_SYNTHETIC };
+static unsigned int replay_source;
+static unsigned int replay_count = 1000;    // Zero to run until stopped
+static bool stop_requested;
+static bool start_requested;
+
+/* Replay state, all updated under replay_lock. */
+enum { REPLAY_IDLE, REPLAY_RUNNING, REPLAY_NO_DATA };
+static unsigned int replay_status;
+static unsigned int sweeps_queued;
+static unsigned int sweeps_done;
+
+/* Published results, updated as each sweep completes. */
+static double start_time;
+static double start_cpu;
+static double sweep_rate;           // Sustained sweeps per second
+static double cpu_share;            // Percentage of one CPU used by the IOC
+static double total_queue;          // Accumulated stage times
+static double total_detector;
+static double total_tune;
+static double mean_queue;           // Mean stage latencies in ms
+static double mean_detector;
+static double mean_tune;
+static double mean_total;
+static double max_total;
+
+
+static double get_clock(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+
+void record_replay_sweep(
+    const short buffer_low[], const short buffer_high[], unsigned int length)
+{
+    LOCK();
+    if (record_request > 0)
+    {
+        struct recorded_sweep *sweep = &recorded[recorded_count];
+        memcpy(sweep->buffer_low, buffer_low, length * sizeof(short));
+        memcpy(sweep->buffer_high, buffer_high, length * sizeof(short));
+        recorded_count += 1;
+        record_request -= 1;
+    }
+    UNLOCK();
+}
+
+
+/* Recording starts afresh with the next captured sweep.  Ignored during
+ * replay as the recording may be in use. */
+static void start_recording(void)
+{
+    LOCK();
+    if (replay_status != REPLAY_RUNNING)
+    {
+        recorded_count = 0;
+        record_request =
+            record_depth > MAX_RECORDED ? MAX_RECORDED : record_depth;
+    }
+    UNLOCK();
+}
+
+
+/* The injected I and Q waveforms are used as the raw data for all four
+ * channels of a single replay sweep. */
+static void load_injected(struct recorded_sweep *sweep)
+{
+    short wf_i[TUNE_LENGTH];
+    short wf_q[TUNE_LENGTH];
+    READ_NAMED_RECORD_WF(short, "TUNE:INJECT:I", wf_i, TUNE_LENGTH);
+    READ_NAMED_RECORD_WF(short, "TUNE:INJECT:Q", wf_q, TUNE_LENGTH);
+    for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+        for (unsigned int channel = 0; channel < 4; channel ++)
+        {
+            sweep->buffer_low[4 * i + channel] = wf_i[i];
+            sweep->buffer_high[4 * i + channel] = wf_q[i];
+        }
+}
+
+
+void replay_complete(double queue, double detector, double tune)
+{
+    double now = get_clock(CLOCK_MONOTONIC);
+    double cpu = get_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+    LOCK();
+    sweeps_done += 1;
+    total_queue += queue;
+    total_detector += detector;
+    total_tune += tune;
+    double total = queue + detector + tune;
+    if (1e3 * total > max_total)
+        max_total = 1e3 * total;
+
+    mean_queue = 1e3 * total_queue / sweeps_done;
+    mean_detector = 1e3 * total_detector / sweeps_done;
+    mean_tune = 1e3 * total_tune / sweeps_done;
+    mean_total = mean_queue + mean_detector + mean_tune;
+    double elapsed = now - start_time;
+    if (elapsed > 0)
+    {
+        sweep_rate = sweeps_done / elapsed;
+        cpu_share = 100 * (cpu - start_cpu) / elapsed;
+    }
+
+    if (sweeps_done == sweeps_queued)
+        ASSERT_PTHREAD(pthread_cond_signal(&replay_done));
+    UNLOCK();
+}
+
+
+static void reset_statistics(void)
+{
+    sweeps_queued = 0;
+    sweeps_done = 0;
+    total_queue = 0;
+    total_detector = 0;
+    total_tune = 0;
+    max_total = 0;
+    start_time = get_clock(CLOCK_MONOTONIC);
+    start_cpu = get_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+
+/* Runs one replay, called with the lock held.  The lock is released while
+ * sweeps are being queued as replay_iq() can block. */
+static void run_replay(void)
+{
+    unsigned int sweep_count;
+    struct recorded_sweep *sweeps;
+    bool synthetic = replay_source == SOURCE_SYNTHETIC;
+    if (replay_source == SOURCE_INJECTED)
+    {
+        load_injected(injected);
+        sweeps = injected;
+        sweep_count = 1;
+    }
+    else if (synthetic)
+    {
+        /* A fresh synthetic sweep is generated into this buffer each time. */
+        reset_simulation();
+        sweeps = injected;
+        sweep_count = 1;
+    }
+    else
+    {
+        /* Replay whatever has been recorded so far. */
+        record_request = 0;
+        sweeps = recorded;
+        sweep_count = recorded_count;
+    }
+    if (sweep_count == 0)
+    {
+        replay_status = REPLAY_NO_DATA;
+        return;
+    }
+
+    replay_status = REPLAY_RUNNING;
+    stop_requested = false;
+    reset_statistics();
+    unsigned int count = replay_count;
+    for (unsigned int n = 0; !stop_requested  &&  (count == 0  ||  n < count);
+         n ++)
+    {
+        sweeps_queued += 1;
+        UNLOCK();
+        struct recorded_sweep *sweep = &sweeps[n % sweep_count];
+        bool overflow = synthetic  &&
+            generate_sweep(sweep->buffer_low, sweep->buffer_high);
+        replay_iq(sweep->buffer_low, sweep->buffer_high, overflow);
+        LOCK();
+    }
+
+    /* Wait for the last sweep to make it out the other end. */
+    while (sweeps_done < sweeps_queued)
+        ASSERT_PTHREAD(pthread_cond_wait(&replay_done, &replay_lock));
+    replay_status = REPLAY_IDLE;
+}
+
+
+static void *replay_thread(void *context)
+{
+    LOCK();
+    while (true)
+    {
+        while (!start_requested)
+            ASSERT_PTHREAD(pthread_cond_wait(&replay_start, &replay_lock));
+        start_requested = false;
+        run_replay();
+    }
+    UNLOCK();
+    return NULL;
+}
+
+
+static void start_replay(void)
+{
+    LOCK();
+    if (replay_status != REPLAY_RUNNING)
+    {
+        start_requested = true;
+        ASSERT_PTHREAD(pthread_cond_signal(&replay_start));
+    }
+    UNLOCK();
+}
+
+
+static void stop_replay(void)
+{
+    stop_requested = true;
+}
+
+
+bool initialise_replay(void)
+{
+    if (!TEST_NULL_(
+            recorded = malloc(MAX_RECORDED * sizeof(struct recorded_sweep)),
+            "Unable to allocate replay recording")  ||
+        !TEST_NULL_(
+            injected = malloc(sizeof(struct recorded_sweep)),
+            "Unable to allocate replay sweep"))
+        return false;
+
+    PUBLISH_ACTION("DET:REPLAY:RECORD", start_recording);
+    PUBLISH_WRITE_VAR_P(ulongout, "DET:REPLAY:DEPTH", record_depth);
+    PUBLISH_READ_VAR(ulongin, "DET:REPLAY:RECORDED", recorded_count);
+    PUBLISH_WRITE_VAR_P(mbbo, "DET:REPLAY:SOURCE", replay_source);
+    PUBLISH_WRITE_VAR_P(ulongout, "DET:REPLAY:COUNT", replay_count);
+    PUBLISH_ACTION("DET:REPLAY:START", start_replay);
+    PUBLISH_ACTION("DET:REPLAY:STOP", stop_replay);
+
+    PUBLISH_READ_VAR(mbbi, "DET:REPLAY:STATUS", replay_status);
+    PUBLISH_READ_VAR(ulongin, "DET:REPLAY:DONE", sweeps_done);
+    PUBLISH_READ_VAR(ai, "DET:REPLAY:RATE", sweep_rate);
+    PUBLISH_READ_VAR(ai, "DET:REPLAY:CPU", cpu_share);
+    PUBLISH_READ_VAR(ai, "DET:REPLAY:QUEUE", mean_queue);
+    PUBLISH_READ_VAR(ai, "DET:REPLAY:DET", mean_detector);
+    PUBLISH_READ_VAR(ai, "DET:REPLAY:TUNE", mean_tune);
+    PUBLISH_READ_VAR(ai, "DET:REPLAY:TOTAL", mean_total);
+    PUBLISH_READ_VAR(ai, "DET:REPLAY:MAX", max_total);
+
+    pthread_t thread_id;
+    return TEST_PTHREAD(pthread_create(&thread_id, NULL, replay_thread, NULL));
+}
@@ -0,0 +1,13 @@
+/* Soak replay of sweeps through the complete processing path. */
+
+/* Called by the detector with each captured raw IQ buffer of the given length
+ * in shorts, records the sweep if recording has been requested. */
+void record_replay_sweep(
+    const short buffer_low[], const short buffer_high[], unsigned int length);
+
+/* Called by the detector worker when a replayed sweep has been completely
+ * processed, with the time in seconds spent waiting in the queue, in detector
+ * processing and in tune processing. */
+void replay_complete(double queue, double detector, double tune);
+
+bool initialise_replay(void);
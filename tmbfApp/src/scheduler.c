@@ -0,0 +1,293 @@
+/* Interleaved scheduling of stored sweep configurations.
+ *
+ * Up to SCHEDULE_CONFIGS complete sweep configurations can be stored, each
+ * a snapshot of the sequencer and detector settings as set through EPICS at
+ * the time of storing.  When scheduling is enabled each trigger runs the next
+ * configuration, chosen by smooth weighted round robin: with equal weights the
+ * stored configurations simply take turns.  The tune results of each sweep are
+ * published separately for the configuration that produced them, and only the
+ * configuration selected as primary also updates the main tune results.
+ *
+ * The sequencer register images are converted when the configuration is
+ * stored and the detector scale for each configuration is held in the detector
+ * scale cache, so once each configuration has run once switching is just a
+ * matter of writing registers.  The time taken to switch is published. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "hardware.h"
+#include "detector.h"
+#include "sequencer.h"
+#include "timing.h"
+
+#include "scheduler.h"
+
+
+struct sweep_config {
+    int index;
+    EPICS_STRING name;
+    bool stored;
+    unsigned int weight;
+    int credit;                 // Weighted round robin selection state
+    unsigned int points;        // Number of points captured per sweep
+
+    /* Register settings, only valid if stored is set. */
+    struct sequencer_image sequencer;
+    struct detector_config detector;
+
+    /* Results from sweeps with this configuration. */
+    unsigned int sweeps;        // Number of sweeps started
+    unsigned int results;       // Number of sweeps processed
+    struct schedule_result basic;
+    struct schedule_result peak;
+    struct epics_interlock *interlock;
+};
+
+static pthread_mutex_t schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sweep_config configs[SCHEDULE_CONFIGS];
+
+#define LOCK()      ASSERT_PTHREAD(pthread_mutex_lock(&schedule_lock))
+#define UNLOCK()    ASSERT_PTHREAD(pthread_mutex_unlock(&schedule_lock))
+
+static bool schedule_enable;
+/* Index of the configuration last programmed, or -1 if the EPICS settings were
+ * used or the configuration may have changed since. */
+static int last_schedule = -1;
+static unsigned int current_config;     // As published, 0 for none
+static unsigned int primary_config;     // As published, 0 for none
+
+/* Switching statistics, times in ms. */
+static unsigned int switch_count;
+static double switch_time;
+static double switch_max;
+static double switch_mean;
+static double switch_total;
+
+
+/* Smooth weighted round robin: every configuration earns its weight in credit
+ * on each selection, and the configuration with the most credit is selected
+ * and pays back the total.  This spreads out the selections of each
+ * configuration as evenly as possible.  Returns NULL if nothing to run. */
+static struct sweep_config *select_config(void)
+{
+    struct sweep_config *best = NULL;
+    int total = 0;
+    for (int i = 0; i < SCHEDULE_CONFIGS; i ++)
+    {
+        struct sweep_config *config = &configs[i];
+        if (config->stored  &&  config->weight > 0)
+        {
+            config->credit += (int) config->weight;
+            total += (int) config->weight;
+            if (best == NULL  ||  config->credit > best->credit)
+                best = config;
+        }
+    }
+    if (best)
+        best->credit -= total;
+    return best;
+}
+
+
+static void update_switch_time(double duration)
+{
+    switch_count += 1;
+    switch_time = duration;
+    switch_total += duration;
+    switch_mean = switch_total / switch_count;
+    if (duration > switch_max)
+        switch_max = duration;
+}
+
+
+bool prepare_scheduled_sweep(void)
+{
+    LOCK();
+    struct sweep_config *config = schedule_enable ? select_config() : NULL;
+    if (config)
+    {
+        TIC();
+        const struct sequencer_image *image = &config->sequencer;
+        hw_write_seq_count(image->sequencer_pc);
+        hw_write_seq_entries(image->bank0, image->entries);
+        hw_write_seq_super_state(image->super_count, image->offsets);
+        prepare_detector(
+            config->index != last_schedule, &config->detector, config->index,
+            image->sequencer_pc, image->entries,
+            image->super_count, image->offsets);
+        if (config->index != last_schedule)
+            update_switch_time(1e3 * TOC());
+
+        last_schedule = config->index;
+        config->sweeps += 1;
+        current_config = (unsigned int) config->index + 1;
+    }
+    else
+    {
+        last_schedule = -1;
+        current_config = 0;
+    }
+    UNLOCK();
+    return config != NULL;
+}
+
+
+unsigned int sweep_state_index(int schedule, bool synthetic)
+{
+    unsigned int state = 0 <= schedule  &&  schedule < SCHEDULE_CONFIGS ?
+        (unsigned int) schedule + 1 : 0;
+    return synthetic ? state + SCHEDULE_CONFIGS + 1 : state;
+}
+
+
+bool schedule_is_primary(int schedule)
+{
+    return schedule < 0  ||  schedule + 1 == (int) primary_config;
+}
+
+
+void update_schedule_result(
+    int schedule,
+    const struct schedule_result *basic, const struct schedule_result *peak)
+{
+    if (0 <= schedule  &&  schedule < SCHEDULE_CONFIGS)
+    {
+        struct sweep_config *config = &configs[schedule];
+        interlock_wait(config->interlock);
+        config->basic = *basic;
+        config->peak = *peak;
+        config->results += 1;
+        interlock_signal(config->interlock, NULL);
+    }
+}
+
+
+/* Must be called with the lock held whenever the set of configurations
+ * changes so that the selection starts afresh. */
+static void reset_selection(void)
+{
+    for (int i = 0; i < SCHEDULE_CONFIGS; i ++)
+        configs[i].credit = 0;
+    last_schedule = -1;
+}
+
+
+/* Counts the points captured by one sweep with the given settings. */
+static unsigned int count_points(const struct sequencer_image *image)
+{
+    unsigned int points = 0;
+    for (unsigned int i = 0; i < image->sequencer_pc; i ++)
+        if (image->entries[i].write_enable)
+            points += image->entries[i].capture_count;
+    points *= image->super_count;
+    return points < TUNE_LENGTH ? points : TUNE_LENGTH;
+}
+
+
+static bool store_config(void *context, const bool *value)
+{
+    struct sweep_config *config = context;
+    LOCK();
+    read_sequencer_image(&config->sequencer);
+    read_detector_config(&config->detector);
+    config->points = count_points(&config->sequencer);
+    config->stored = true;
+    reset_selection();
+    UNLOCK();
+    return true;
+}
+
+
+static bool clear_config(void *context, const bool *value)
+{
+    struct sweep_config *config = context;
+    LOCK();
+    config->stored = false;
+    config->points = 0;
+    reset_selection();
+    UNLOCK();
+    return true;
+}
+
+
+static bool write_weight(void *context, const unsigned int *value)
+{
+    struct sweep_config *config = context;
+    LOCK();
+    config->weight = *value;
+    reset_selection();
+    UNLOCK();
+    return true;
+}
+
+
+static void reset_statistics(void)
+{
+    LOCK();
+    switch_count = 0;
+    switch_time = 0;
+    switch_max = 0;
+    switch_mean = 0;
+    switch_total = 0;
+    for (int i = 0; i < SCHEDULE_CONFIGS; i ++)
+    {
+        configs[i].sweeps = 0;
+        configs[i].results = 0;
+    }
+    UNLOCK();
+}
+
+
+static void publish_config(struct sweep_config *config)
+{
+    char buffer[40];
+#define FORMAT(field) \
+    (sprintf(buffer, "SCHED:%d:%s", config->index + 1, field), buffer)
+
+    PUBLISH_WRITE_VAR_P(stringout, FORMAT("NAME"), config->name);
+    PUBLISH(ulongout, FORMAT("WEIGHT"), write_weight,
+        .context = config, .persist = true);
+    PUBLISH(bo, FORMAT("STORE"), .write = store_config, .context = config);
+    PUBLISH(bo, FORMAT("CLEAR"), .write = clear_config, .context = config);
+    PUBLISH_READ_VAR(bi, FORMAT("STORED"), config->stored);
+    PUBLISH_READ_VAR(ulongin, FORMAT("POINTS"), config->points);
+    PUBLISH_READ_VAR(ulongin, FORMAT("SWEEPS"), config->sweeps);
+
+    PUBLISH_READ_VAR(ulongin, FORMAT("RESULTS"), config->results);
+    PUBLISH_READ_VAR(mbbi, FORMAT("BASIC:STATUS"), config->basic.status);
+    PUBLISH_READ_VAR(ai, FORMAT("BASIC:TUNE"), config->basic.tune);
+    PUBLISH_READ_VAR(ai, FORMAT("BASIC:PHASE"), config->basic.phase);
+    PUBLISH_READ_VAR(mbbi, FORMAT("PEAK:STATUS"), config->peak.status);
+    PUBLISH_READ_VAR(ai, FORMAT("PEAK:TUNE"), config->peak.tune);
+    PUBLISH_READ_VAR(ai, FORMAT("PEAK:PHASE"), config->peak.phase);
+    config->interlock = create_interlock(FORMAT("RESULT"), false);
+#undef FORMAT
+}
+
+
+bool initialise_scheduler(void)
+{
+    PUBLISH_WRITE_VAR_P(bo, "SCHED:ENABLE", schedule_enable);
+    PUBLISH_ACTION("SCHED:RESET", reset_statistics);
+    PUBLISH_READ_VAR(ulongin, "SCHED:CURRENT", current_config);
+    PUBLISH_WRITE_VAR_P(ulongout, "SCHED:PRIMARY", primary_config);
+    PUBLISH_READ_VAR(ulongin, "SCHED:SWITCHES", switch_count);
+    PUBLISH_READ_VAR(ai, "SCHED:SWITCH", switch_time);
+    PUBLISH_READ_VAR(ai, "SCHED:SWITCH:MAX", switch_max);
+    PUBLISH_READ_VAR(ai, "SCHED:SWITCH:MEAN", switch_mean);
+
+    for (int i = 0; i < SCHEDULE_CONFIGS; i ++)
+    {
+        configs[i].index = i;
+        configs[i].weight = 1;
+        publish_config(&configs[i]);
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+/* Interleaved scheduling of stored sweep configurations. */
+
+#define SCHEDULE_CONFIGS    4
+
+/* Sweeps with different configurations must not be mixed when carrying state
+ * from one sweep to the next, so such state is kept separately for the EPICS
+ * settings and for each scheduled configuration.  Synthetic sweeps have their
+ * own set of states so that they never disturb the state for beam sweeps. */
+#define SWEEP_STATES        (2 * (SCHEDULE_CONFIGS + 1))
+
+/* Returns the index in the range 0 to SWEEP_STATES-1 of the state to use for a
+ * sweep with the given schedule index, as recorded by the detector. */
+unsigned int sweep_state_index(int schedule, bool synthetic);
+
+/* Returns true if sweeps with the given schedule index are to update the main
+ * tune results.  This is true of sweeps with the EPICS settings and of the
+ * configuration selected as primary. */
+bool schedule_is_primary(int schedule);
+
+/* Tune result routed to the scheduled configuration. */
+struct schedule_result {
+    unsigned int status;
+    double tune;
+    double phase;
+};
+
+/* Called immediately before arming the sequencer.  If scheduling is enabled
+ * the next configuration is programmed into the sequencer and detector and
+ * true is returned, otherwise false is returned and nothing is done. */
+bool prepare_scheduled_sweep(void);
+
+/* Called with the basic and peak fit results of each processed sweep together
+ * with the schedule index recorded by the detector, which is -1 for sweeps
+ * with the EPICS settings. */
+void update_schedule_result(
+    int schedule,
+    const struct schedule_result *basic, const struct schedule_result *peak);
+
+bool initialise_scheduler(void);
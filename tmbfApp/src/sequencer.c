@@ -15,6 +15,7 @@
 #include "epics_extra.h"
 #include "detector.h"
 #include "tune_follow.h"
+#include "scheduler.h"
 
 #include "sequencer.h"
 
@@ -120,13 +121,13 @@ static void update_capture_count(void)
 
 
 /* Converts internal sequencer state into format suitable for writing to
- * hardware and updates hardware. */
-static void write_seq_state(void)
+ * hardware. */
+static void convert_seq_state(struct seq_entry entries[MAX_SEQUENCER_COUNT])
 {
     for (int i = 0; i < MAX_SEQUENCER_COUNT; i ++)
     {
         const struct sequencer_bank *bank = &banks[i];
-        struct seq_entry *entry = &current_sequencer[i];
+        struct seq_entry *entry = &entries[i];
         entry->start_freq = tune_to_freq(bank->start_freq);
         entry->delta_freq = tune_to_freq(bank->delta_freq);
         entry->dwell_time = bank->dwell_time;
@@ -140,10 +141,26 @@ static void write_seq_state(void)
         entry->window_rate = (unsigned int) lround(
             (pow(2, 32) / ATOMS_PER_TURN) / bank->dwell_time);
     }
+}
+
+
+static void write_seq_state(void)
+{
+    convert_seq_state(current_sequencer);
     hw_write_seq_entries(bank0, current_sequencer);
 }
 
 
+void read_sequencer_image(struct sequencer_image *image)
+{
+    image->sequencer_pc = sequencer_pc;
+    image->bank0 = bank0;
+    convert_seq_state(image->entries);
+    image->super_count = super_seq_count;
+    memcpy(image->offsets, super_offsets, sizeof(image->offsets));
+}
+
+
 static void update_seq_state(void)
 {
     /* Update all the end frequencies. */
@@ -178,13 +195,20 @@ void prepare_fast_buffer(void)
  * for operation. */
 void prepare_sequencer(void)
 {
-    hw_write_seq_count(sequencer_pc);
-    write_seq_state();
-    write_super_seq_state();
+    if (prepare_scheduled_sweep())
+        /* The scheduler has programmed its own settings, so our settings will
+         * need to be restored in full next time. */
+        settings_changed = true;
+    else
+    {
+        hw_write_seq_count(sequencer_pc);
+        write_seq_state();
+        write_super_seq_state();
 
-    prepare_detector(settings_changed,
-        sequencer_pc, current_sequencer, super_seq_count, super_offsets);
-    settings_changed = false;
+        prepare_detector(settings_changed, NULL, -1,
+            sequencer_pc, current_sequencer, super_seq_count, super_offsets);
+        settings_changed = false;
+    }
 }
 
 
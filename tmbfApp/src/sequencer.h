@@ -1,7 +1,20 @@
 /* Sequencer sweep and detector control. */
 
+/* Complete set of sequencer register settings for a single sweep. */
+struct sequencer_image {
+    unsigned int sequencer_pc;
+    unsigned int bank0;
+    struct seq_entry entries[MAX_SEQUENCER_COUNT];
+    unsigned int super_count;
+    uint32_t offsets[SUPER_SEQ_STATES];
+};
+
 bool initialise_sequencer(void);
 
+/* Converts the sequencer settings as currently set through EPICS into the
+ * corresponding register settings. */
+void read_sequencer_image(struct sequencer_image *image);
+
 /* Called immediately before arming the fast buffer. */
 void prepare_fast_buffer(void);
 
@@ -0,0 +1,247 @@
+/* Synthetic beam response generator.
+ *
+ * Generates swept IQ responses in the raw buffer layout returned by
+ * hw_read_buf_data() for driving the detector and tune processing without
+ * beam.  The response is a sum of one pole resonances: the tune, its two
+ * synchrotron sidebands and an optional coupling peak, with an optional tune
+ * spread across the four detector channels.  The detector group delay
+ * compensation is undone so that the processed sweep shows the response as
+ * configured.
+ *
+ * For speed the noise free response is only recomputed when the settings or
+ * the sweep scale change.  Each sweep then just adds noise drawn from a fixed
+ * table of Gaussian samples, scales for the detector gain and saturates to 16
+ * bits, reporting overflow if saturation occurs.  The noise sequence is
+ * restarted from the configured seed at the start of each run so that runs
+ * are reproducible. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <complex.h>
+#include <math.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "epics_extra.h"
+#include "hardware.h"
+#include "detector.h"
+#include "timing.h"
+
+#include "simulate.h"
+
+
+/* Gaussian noise table, unit standard deviation scaled by 2^NOISE_BITS. */
+#define NOISE_TABLE_BITS    12
+#define NOISE_TABLE_SIZE    (1 << NOISE_TABLE_BITS)
+#define NOISE_BITS          12
+
+/* Beam model settings as written through EPICS. */
+struct beam_model {
+    double tune;            // Fractional tune
+    double width;           // Resonance half width in tunes
+    double amplitude;       // Peak detector response at gain 0
+    double spread;          // Tune step between adjacent channels
+    double sync_tune;       // Synchrotron tune
+    double sideband;        // Relative amplitude of synchrotron sidebands
+    double couple_tune;     // Coupling peak fractional tune
+    double couple;          // Relative amplitude of coupling peak
+};
+
+static struct beam_model model = {
+    .tune = 0.2,
+    .width = 0.002,
+    .amplitude = 8000,
+    .sync_tune = 0.005,
+    .sideband = 0.2,
+    .couple_tune = 0.25,
+};
+static double noise_level = 50;     // Standard deviation of noise in counts
+static unsigned int seed = 1;
+
+/* Cached noise free response for the model and sweep scale below. */
+static struct beam_model cached_model;
+static double cached_scale[TUNE_LENGTH];
+static unsigned int cached_length;
+static int clean_low[BUF_DATA_LENGTH];
+static int clean_high[BUF_DATA_LENGTH];
+
+/* Scratch copies of the detector scale. */
+static double tune_scale[TUNE_LENGTH];
+static int rotation_i[TUNE_LENGTH];
+static int rotation_q[TUNE_LENGTH];
+
+static short noise_table[NOISE_TABLE_SIZE];
+static uint32_t random_state;
+
+/* Statistics. */
+static unsigned int sweep_count;
+static unsigned int overflow_count;
+static double generate_duration;    // Time to generate last sweep in ms
+
+
+/* Marsaglia's xorshift generator: fast and plenty good enough for indexing the
+ * noise table. */
+static uint32_t next_random(void)
+{
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state = x;
+    return x;
+}
+
+
+/* Fills the noise table using the Box-Muller transform on our own generator,
+ * so the table itself is also reproducible. */
+static void fill_noise_table(void)
+{
+    random_state = 0x9E3779B9;
+    for (unsigned int i = 0; i < NOISE_TABLE_SIZE; i += 2)
+    {
+        double u1 = (next_random() + 1.0) / 4294967297.0;
+        double u2 = next_random() / 4294967296.0;
+        double r = sqrt(-2 * log(u1)) * (1 << NOISE_BITS);
+        double a = 2 * M_PI * u2;
+        noise_table[i] = (short) fmax(fmin(r * cos(a), 32767), -32767);
+        noise_table[i + 1] = (short) fmax(fmin(r * sin(a), 32767), -32767);
+    }
+}
+
+
+/* One pole resonance normalised to the given amplitude at the centre.  The
+ * offset is wrapped so that the resonance repeats every tune. */
+static complex double resonance(
+    double tune, double centre, double width, double amplitude)
+{
+    double offset = remainder(tune - centre, 1);
+    return amplitude * width / (width + I * offset);
+}
+
+
+static complex double beam_response(double tune, double centre)
+{
+    complex double response =
+        resonance(tune, centre, model.width, model.amplitude);
+    if (model.sideband > 0)
+    {
+        double sideband = model.sideband * model.amplitude;
+        response +=
+            resonance(tune, centre - model.sync_tune, model.width, sideband) +
+            resonance(tune, centre + model.sync_tune, model.width, sideband);
+    }
+    if (model.couple > 0)
+        response += resonance(tune, model.couple_tune, model.width,
+            model.couple * model.amplitude);
+    return response;
+}
+
+
+/* Recomputes the noise free raw response.  The detector multiplies the raw
+ * data by the rotation (with a further factor of 2^-31), so here we multiply
+ * by the conjugate. */
+static void update_clean_response(unsigned int length)
+{
+    for (unsigned int i = 0; i < length; i ++)
+        for (unsigned int channel = 0; channel < 4; channel ++)
+        {
+            double centre = model.tune + (channel - 1.5) * model.spread;
+            complex double rotation =
+                ldexp(rotation_i[i], -30) - I * ldexp(rotation_q[i], -30);
+            complex double raw =
+                2 * beam_response(tune_scale[i], centre) * rotation;
+            clean_low[4 * i + channel] = (int) lround(creal(raw));
+            clean_high[4 * i + channel] = (int) lround(cimag(raw));
+        }
+
+    cached_model = model;
+    memcpy(cached_scale, tune_scale, sizeof(cached_scale));
+    cached_length = length;
+}
+
+
+/* Applies gain, adds noise and saturates.  Returns true on saturation. */
+static bool add_noise(
+    unsigned int count, const int clean[], short buffer[],
+    int shift, int noise)
+{
+    bool overflow = false;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        int value = clean[i] >> shift;
+        uint32_t index = next_random() >> (32 - NOISE_TABLE_BITS);
+        value += (noise_table[index] * noise) >> NOISE_BITS;
+        if (value > 32767)
+        {
+            value = 32767;
+            overflow = true;
+        }
+        else if (value < -32768)
+        {
+            value = -32768;
+            overflow = true;
+        }
+        buffer[i] = (short) value;
+    }
+    return overflow;
+}
+
+
+bool generate_sweep(short buffer_low[], short buffer_high[])
+{
+    TIC();
+    unsigned int length = read_sweep_scale(tune_scale, rotation_i, rotation_q);
+    if (length != cached_length  ||
+        memcmp(&model, &cached_model, sizeof(model)) != 0  ||
+        memcmp(tune_scale, cached_scale, sizeof(tune_scale)) != 0)
+        update_clean_response(length);
+
+    unsigned int gain = READ_NAMED_RECORD(mbbo, "DET:GAIN");
+    int shift = detector_gain_shift(gain);
+    int noise = (int) lround(noise_level);
+    bool overflow =
+        add_noise(4 * length, clean_low, buffer_low, shift, noise) |
+        add_noise(4 * length, clean_high, buffer_high, shift, noise);
+
+    sweep_count += 1;
+    if (overflow)
+        overflow_count += 1;
+    generate_duration = 1e3 * TOC();
+    return overflow;
+}
+
+
+void reset_simulation(void)
+{
+    random_state = seed != 0 ? seed : 1;
+    sweep_count = 0;
+    overflow_count = 0;
+}
+
+
+bool initialise_simulation(void)
+{
+    fill_noise_table();
+    reset_simulation();
+
+    PUBLISH_WRITE_VAR_P(ao, "SIM:TUNE", model.tune);
+    PUBLISH_WRITE_VAR_P(ao, "SIM:WIDTH", model.width);
+    PUBLISH_WRITE_VAR_P(ao, "SIM:AMPLITUDE", model.amplitude);
+    PUBLISH_WRITE_VAR_P(ao, "SIM:SPREAD", model.spread);
+    PUBLISH_WRITE_VAR_P(ao, "SIM:SYNC", model.sync_tune);
+    PUBLISH_WRITE_VAR_P(ao, "SIM:SIDEBAND", model.sideband);
+    PUBLISH_WRITE_VAR_P(ao, "SIM:COUPLE:TUNE", model.couple_tune);
+    PUBLISH_WRITE_VAR_P(ao, "SIM:COUPLE", model.couple);
+    PUBLISH_WRITE_VAR_P(ao, "SIM:NOISE", noise_level);
+    PUBLISH_WRITE_VAR_P(ulongout, "SIM:SEED", seed);
+    PUBLISH_ACTION("SIM:RESET", reset_simulation);
+
+    PUBLISH_READ_VAR(ulongin, "SIM:COUNT", sweep_count);
+    PUBLISH_READ_VAR(ulongin, "SIM:OVERFLOWS", overflow_count);
+    PUBLISH_READ_VAR(ai, "SIM:DURATION", generate_duration);
+    return true;
+}
@@ -0,0 +1,11 @@
+/* Synthetic beam response generator. */
+
+/* Fills the two buffers with a synthetic sweep in the raw IQ layout returned
+ * by hw_read_buf_data(), for the current sweep scale and detector gain.
+ * Returns true if the sweep saturated. */
+bool generate_sweep(short buffer_low[], short buffer_high[]);
+
+/* Restarts the noise sequence from the configured seed. */
+void reset_simulation(void);
+
+bool initialise_simulation(void);
@@ -33,6 +33,20 @@
 #include "tune.h"
 #include "tune_peaks.h"
 #include "tune_follow.h"
+#include "tune_average.h"
+#include "tune_segments.h"
+#include "mode_scan.h"
+#include "tune_channels.h"
+#include "tune_history.h"
+#include "tune_zoom.h"
+#include "tune_dwell.h"
+#include "replay.h"
+#include "simulate.h"
+#include "scheduler.h"
+#include "tune_multicast.h"
+#include "tune_kalman.h"
+#include "event_wait.h"
+#include "derived.h"
 #include "pvlogging.h"
 #include "persistence.h"
 
@@ -131,7 +145,7 @@ static bool ProcessOptions(int *argc, char ** *argv)
     bool Ok = true;
     while (Ok)
     {
-        switch (getopt(*argc, *argv, "+np:s:i:l:d:H:"))
+        switch (getopt(*argc, *argv, "+np:s:i:l:d:H:I:"))
         {
             case 'n':   Interactive = false;                    break;
             case 'p':   Ok = WritePid(optarg);                  break;
@@ -140,6 +154,7 @@ static bool ProcessOptions(int *argc, char ** *argv)
             case 'l':   max_log_array_length = atoi(optarg);    break;
             case 'd':   device_name = optarg;                   break;
             case 'H':   hardware_config_file = optarg;          break;
+            case 'I':   set_event_interrupt_device(optarg);     break;
             default:
                 printf("Sorry, didn't understand\n");
                 return false;
@@ -262,6 +277,7 @@ static bool initialise_subsystems(void)
     PUBLISH_ACTION("REBOOT", do_reboot);
 
     return
+        initialise_derived(device_name)  &&
         initialise_ddr_epics()  &&
         initialise_adc_dac()  &&
         initialise_fir()  &&
@@ -271,6 +287,18 @@ static bool initialise_subsystems(void)
         initialise_sensors()  &&
         initialise_detector()  &&
         initialise_tune()  &&
+        initialise_tune_average()  &&
+        initialise_tune_segments()  &&
+        initialise_mode_scan()  &&
+        initialise_tune_channels()  &&
+        initialise_tune_history()  &&
+        initialise_tune_zoom()  &&
+        initialise_tune_dwell()  &&
+        initialise_replay()  &&
+        initialise_simulation()  &&
+        initialise_scheduler()  &&
+        initialise_tune_multicast()  &&
+        initialise_tune_kalman()  &&
         initialise_tune_peaks()  &&
         initialise_tune_follow();
 }
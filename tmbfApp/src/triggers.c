@@ -15,6 +15,7 @@
 #include "epics_extra.h"
 #include "ddr_epics.h"
 #include "sequencer.h"
+#include "event_wait.h"
 
 #include "triggers.h"
 
@@ -39,6 +40,7 @@ struct trigger_target {
     enum { DDR_TARGET, BUF_TARGET } target_id;
 
     struct in_epics_record_mbbi *status;    // enum trigger_status
+    enum trigger_status last_status;        // Last status written
 
     // Configuration settings set by EPICS
     bool external;          // Configured source, written from PV
@@ -57,12 +59,14 @@ struct trigger_target {
  * buffer, but has its own enable state. */
 struct seq_target {
     struct in_epics_record_mbbi *status;
+    enum trigger_status last_status;
     unsigned int trigger_source;           // Updated from PV
     bool armed;             // Set if currently enabled and armed
 };
 
 struct ddr_buf {
     struct in_epics_record_mbbi *status;
+    enum trigger_status last_status;
     bool armed;
 };
 
@@ -240,6 +244,7 @@ static void do_arm_ddr(void)
     ddr_target.auto_arm_state = STATE_NORMAL;
 
     /* Do this to force the status to go through the armed state. */
+    ddr_target.last_status = TRIGGER_ARMED;
     WRITE_IN_RECORD(mbbi, ddr_target.status, TRIGGER_ARMED);
 }
 
@@ -250,6 +255,7 @@ static void do_arm_buf(void)
     buf_target.armed = true;
     buf_target.auto_arm_state = STATE_NORMAL;
 
+    buf_target.last_status = TRIGGER_ARMED;
     WRITE_IN_RECORD(mbbi, buf_target.status, TRIGGER_ARMED);
 }
 
@@ -257,6 +263,7 @@ static void do_arm_seq(void)
 {
     prepare_sequencer();
     seq_target.armed = true;
+    seq_target.last_status = TRIGGER_ARMED;
     WRITE_IN_RECORD(mbbi, seq_target.status, TRIGGER_ARMED);
 }
 
@@ -368,6 +375,21 @@ static void write_seq_trig_source(unsigned int source)
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Event processing and polling. */
 
+/* Wakeups for the monitor thread.  We poll quickly immediately after any
+ * activity and back off when nothing is happening, more slowly when nothing is
+ * armed. */
+#define MIN_POLL_INTERVAL       1000        // 1 ms
+#define ARMED_POLL_INTERVAL     10000       // 10 ms
+#define IDLE_POLL_INTERVAL      50000       // 50 ms
+static struct event_waiter *trigger_waiter;
+
+/* Event polling statistics, all in milliseconds.  The delay is an estimate
+ * derived from the poll interval, see event_poll_delay(). */
+static struct epics_interlock *poll_update;
+static double poll_delay_ms;
+static double max_poll_delay_ms;
+static double poll_interval_ms;
+
 static struct epics_interlock *trigger_tick;
 static unsigned int last_trig_phase;
 static unsigned int raw_trig_phase;
@@ -379,11 +401,13 @@ static void reset_trigger_count(void)
 {
     trigger_count = 0;
     jitter_count = 0;
+    max_poll_delay_ms = 0;
 }
 
 /* Probes the trigger phase so that we can observe the frequency of external
- * triggers.  We also watch for and record phase changes. */
-static void poll_trigger_phase(void)
+ * triggers.  We also watch for and record phase changes.  Returns true if a
+ * trigger was seen. */
+static bool poll_trigger_phase(void)
 {
     unsigned int phase = hw_read_trg_raw_phase();
     if (phase != 0)
@@ -398,6 +422,32 @@ static void poll_trigger_phase(void)
 
         last_trig_phase = raw_trig_phase;
     }
+    return phase != 0;
+}
+
+
+/* Records the estimated polling delay of the wakeup which found an event. */
+static void update_poll_delay(void)
+{
+    interlock_wait(poll_update);
+    poll_delay_ms = 1e3 * event_poll_delay(trigger_waiter);
+    if (poll_delay_ms > max_poll_delay_ms)
+        max_poll_delay_ms = poll_delay_ms;
+    poll_interval_ms = 1e3 * event_poll_interval(trigger_waiter);
+    interlock_signal(poll_update, NULL);
+}
+
+
+/* Only writes status records on change, as we may be polling quite fast. */
+static void write_status(
+    struct in_epics_record_mbbi *status, enum trigger_status *last_status,
+    enum trigger_status new_status)
+{
+    if (new_status != *last_status)
+    {
+        *last_status = new_status;
+        WRITE_IN_RECORD(mbbi, status, new_status);
+    }
 }
 
 
@@ -469,6 +519,8 @@ static void *monitor_events(void *context)
 
     while (true)
     {
+        wait_for_event(trigger_waiter);
+
         LOCK();
 
         enum trigger_status ddr_status, buf_status, seq_status, ddr_buf_status;
@@ -480,6 +532,11 @@ static void *monitor_events(void *context)
         bool seq_ready = seq_target.armed  &&  seq_status == TRIGGER_READY;
         bool ddr_buf_ready = ddr_buf.armed  &&  ddr_buf_status == TRIGGER_READY;
 
+        bool active =
+            ddr_ready  ||  buf_ready  ||  seq_ready  ||  ddr_buf_ready;
+        if (active)
+            update_poll_delay();
+
         /* Allow all the corresponding targets to be processed. */
         if (ddr_ready)
             update_trigger_hit(&ddr_trigger_source);
@@ -494,21 +551,25 @@ static void *monitor_events(void *context)
             process_ddr_buffer();
 
         /* Keep published status up to date. */
-        WRITE_IN_RECORD(mbbi, ddr_target.status, ddr_status);
-        WRITE_IN_RECORD(mbbi, buf_target.status, buf_status);
-        WRITE_IN_RECORD(mbbi, seq_target.status, seq_status);
-        WRITE_IN_RECORD(mbbi, ddr_buf.status, ddr_buf_status);
+        write_status(ddr_target.status, &ddr_target.last_status, ddr_status);
+        write_status(buf_target.status, &buf_target.last_status, buf_status);
+        write_status(seq_target.status, &seq_target.last_status, seq_status);
+        write_status(ddr_buf.status, &ddr_buf.last_status, ddr_buf_status);
 
         /* Clear the busy flags for all targets that have completed and handle
          * rearming as appropriate. */
         rearm_targets(ddr_ready, buf_ready, seq_ready, ddr_buf_status);
 
         /* Update trigger phase. */
-        poll_trigger_phase();
+        if (poll_trigger_phase())
+            active = true;
 
-        UNLOCK();
+        bool armed =
+            ddr_target.armed  ||  buf_target.armed  ||  seq_target.armed  ||
+            ddr_buf.armed;
+        update_event_interval(trigger_waiter, active, armed);
 
-        usleep(10000);      // Poll triggers at 100Hz for quick response
+        UNLOCK();
     }
     return NULL;
 }
@@ -532,6 +593,8 @@ static bool call_arm_target(void *context, const bool *value)
     LOCK();
     arm_target(context, false);
     UNLOCK();
+    /* Wake the monitor thread so it polls quickly for the response. */
+    notify_event(trigger_waiter);
     return true;
 }
 
@@ -591,10 +654,25 @@ bool initialise_triggers(void)
     PUBLISH_READ_VAR(ulongin, "TRG:JITTER", jitter_count);
     PUBLISH_ACTION("TRG:RESET_COUNT", reset_trigger_count);
 
+    poll_update = create_interlock("TRG:POLL", false);
+    PUBLISH_READ_VAR(ai, "TRG:POLL:DELAY", poll_delay_ms);
+    PUBLISH_READ_VAR(ai, "TRG:POLL:DELAY:MAX", max_poll_delay_ms);
+    PUBLISH_READ_VAR(ai, "TRG:POLL", poll_interval_ms);
+
     PUBLISH_WRITER(bo, "FPLED", hw_write_front_panel_led);
     PUBLISH_WRITER_P(ulongout, "TRG:BLANKING", hw_write_trg_blanking);
     PUBLISH_WRITER_P(mbbo, "TRG:BLANKING:SOURCE", hw_write_trg_blanking_source);
 
+    /* Ensure the status records are written on the first poll. */
+    ddr_target.last_status = (enum trigger_status) -1;
+    buf_target.last_status = (enum trigger_status) -1;
+    seq_target.last_status = (enum trigger_status) -1;
+    ddr_buf.last_status = (enum trigger_status) -1;
+    trigger_waiter = create_event_waiter(
+        MIN_POLL_INTERVAL, ARMED_POLL_INTERVAL, IDLE_POLL_INTERVAL);
+
     pthread_t thread_id;
-    return TEST_PTHREAD(pthread_create(&thread_id, NULL, monitor_events, NULL));
+    return
+        attach_event_interrupt(trigger_waiter)  &&
+        TEST_PTHREAD(pthread_create(&thread_id, NULL, monitor_events, NULL));
 }
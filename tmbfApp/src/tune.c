@@ -9,6 +9,7 @@
 #include <string.h>
 #include <complex.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "error.h"
 #include "epics_device.h"
@@ -18,6 +19,16 @@
 #include "sequencer.h"
 #include "tune_support.h"
 #include "tune_peaks.h"
+#include "derived.h"
+#include "tune_average.h"
+#include "tune_segments.h"
+#include "tune_channels.h"
+#include "tune_history.h"
+#include "scheduler.h"
+#include "tune_multicast.h"
+#include "tune_kalman.h"
+#include "tune_zoom.h"
+#include "tune_dwell.h"
 
 #include "tune.h"
 
@@ -27,6 +38,10 @@ struct tune_sweep_info {
     unsigned int sweep_length;
     double *tune_scale;
     struct channel_sweep *sweep;
+    bool synthetic;             // Replayed, simulated or injected data
+    int schedule;               // Schedule index, -1 for the EPICS settings
+    unsigned int state;         // Tracking state, see sweep_state_index()
+    bool primary;               // Set if this sweep updates the main results
 };
 
 
@@ -207,28 +222,40 @@ static void set_tune_result(
 }
 
 
-/* Updates tune results with result of calling given tune measurement function
- * on the given tune sweep data.  Nothing is called if detector measurement
- * overflowed. */
-static void compute_tune_result(
+typedef void measure_tune_t(
+    unsigned int length, const struct channel_sweep *sweep,
+    const double tune_scale[],
+    unsigned int *tune_status, double *tune, double *phase);
+
+/* Computes the result of calling given tune measurement function on the given
+ * tune sweep data.  Nothing is called if detector measurement overflowed. */
+static void measure_tune_result(
     bool overflow,
     unsigned int length, const struct channel_sweep *sweep,
-    const double tune_scale[], struct tune_result *result,
-    void (*measure_tune)(
-        unsigned int length, const struct channel_sweep *sweep,
-        const double tune_scale[],
-        unsigned int *tune_status, double *tune, double *phase))
+    const double tune_scale[], struct tune_result_value *result,
+    measure_tune_t *measure_tune)
 {
     if (overflow)
-        set_tune_result(&result->value, TUNE_OVERFLOW, 0, 0);
+        set_tune_result(result, TUNE_OVERFLOW, 0, 0);
     else
     {
         unsigned int status;
         double phase, tune;
         measure_tune(length, sweep, tune_scale, &status, &tune, &phase);
-        set_tune_result(&result->value, status, tune, phase);
+        set_tune_result(result, status, tune, phase);
     }
+}
 
+
+/* Updates published tune results with the given measurement. */
+static void compute_tune_result(
+    bool overflow,
+    unsigned int length, const struct channel_sweep *sweep,
+    const double tune_scale[], struct tune_result *result,
+    measure_tune_t *measure_tune)
+{
+    measure_tune_result(
+        overflow, length, sweep, tune_scale, &result->value, measure_tune);
     set_record_severity(result->tune_pv,  result->value.severity);
     set_record_severity(result->phase_pv, result->value.severity);
 }
@@ -245,6 +272,14 @@ static void copy_tune_result(
 }
 
 
+/* Passes the given result through to the tune history. */
+static void record_tune_history(
+    enum tune_history_method method, const struct tune_result_value *result)
+{
+    update_tune_history(method, result->status, result->tune, result->phase);
+}
+
+
 static void publish_tune_result(struct tune_result *result, const char *prefix)
 {
     char buffer[40];
@@ -265,6 +300,13 @@ static void publish_tune_result(struct tune_result *result, const char *prefix)
 /* Trigger interlock for record update. */
 static struct epics_interlock *tune_trigger;
 
+/* Serialises peak measurement, which keeps tracking state between calls.  Taken
+ * inside tune_trigger for published sweeps and on its own for scheduled sweeps
+ * whose results are not published. */
+static pthread_mutex_t measure_lock = PTHREAD_MUTEX_INITIALIZER;
+#define MEASURE_LOCK()    ASSERT_PTHREAD(pthread_mutex_lock(&measure_lock))
+#define MEASURE_UNLOCK()  ASSERT_PTHREAD(pthread_mutex_unlock(&measure_lock))
+
 /* Tune settings. */
 static int harmonic;            // Base frequency for tune sweep
 static bool reverse_tune;       // Set to sweep tune backwards
@@ -273,11 +315,15 @@ static bool keep_feedback;      // Action when updating DAC out control
 
 /* Waveforms from last detector sweep. */
 static struct channel_sweep sweep;
+static unsigned int sweep_length;
 static float phase_waveform[TUNE_LENGTH];
 static int cumsum_i[TUNE_LENGTH];
 static int cumsum_q[TUNE_LENGTH];
+static struct derived_wf *phase_derived;
+static struct derived_wf *cumsum_derived;
 static double mean_power;
 static int max_power;
+static bool synthetic_sweep;    // Set if this sweep isn't beam data
 
 /* Tune measurements. */
 static struct tune_result tune_result_selected;
@@ -289,6 +335,13 @@ static unsigned int selected_tune_result;
 static struct epics_interlock *tune_result;
 
 
+struct channel_sweep *tune_sweep_channel(struct sweep_info *sweep_info)
+{
+    return sweep_info->single_bunch_mode ?
+        &sweep_info->channels[selected_bunch % 4] : &sweep_info->mean;
+}
+
+
 /* Extracts tune sweep info from detector sweep info taking our channel selectio
  * into account. */
 static void extract_sweep_info(
@@ -297,8 +350,12 @@ static void extract_sweep_info(
 {
     tune_sweep->sweep_length = sweep_info->sweep_length;
     tune_sweep->tune_scale = sweep_info->tune_scale;
-    tune_sweep->sweep = sweep_info->single_bunch_mode ?
-        &sweep_info->channels[selected_bunch % 4] : &sweep_info->mean;
+    tune_sweep->sweep = tune_sweep_channel(sweep_info);
+    tune_sweep->synthetic = sweep_info->synthetic;
+    tune_sweep->schedule = sweep_info->schedule;
+    tune_sweep->state =
+        sweep_state_index(sweep_info->schedule, sweep_info->synthetic);
+    tune_sweep->primary = schedule_is_primary(sweep_info->schedule);
 }
 
 
@@ -307,6 +364,8 @@ static void update_iq_power(const struct tune_sweep_info *tune_sweep)
     /* Take copy of selected sweep so we can publish selection specific PVs for
      * I, Q and power. */
     memcpy(&sweep, tune_sweep->sweep, sizeof(sweep));
+    sweep_length = tune_sweep->sweep_length;
+    synthetic_sweep = tune_sweep->synthetic;
 
     /* Update the total and max power statistics. */
     double total_power = 0;
@@ -322,7 +381,7 @@ static void update_iq_power(const struct tune_sweep_info *tune_sweep)
 }
 
 
-static void update_phase_wf(void)
+static void update_phase_wf(void *context)
 {
     for (int i = 0; i < TUNE_LENGTH; i ++)
         phase_waveform[i] =
@@ -330,10 +389,10 @@ static void update_phase_wf(void)
 }
 
 
-static void update_cumsum(const struct tune_sweep_info *tune_sweep)
+static void update_cumsum(void *context)
 {
     int sum_i = 0, sum_q = 0;
-    for (unsigned int i = 0; i < tune_sweep->sweep_length; i ++)
+    for (unsigned int i = 0; i < sweep_length; i ++)
     {
         sum_i += sweep.wf_i[i];
         sum_q += sweep.wf_q[i];
@@ -342,7 +401,7 @@ static void update_cumsum(const struct tune_sweep_info *tune_sweep)
     }
 
     /* Pad the rest of the waveform with repeats of the last point. */
-    for (unsigned int i = tune_sweep->sweep_length; i < TUNE_LENGTH; i ++)
+    for (unsigned int i = sweep_length; i < TUNE_LENGTH; i ++)
     {
         cumsum_i[i] = sum_i;
         cumsum_q[i] = sum_q;
@@ -378,14 +437,72 @@ static void update_tune_result(void)
 }
 
 
+/* Passes the basic and peak results through to the sweep scheduler. */
+static void record_schedule_result(
+    int schedule, const struct tune_result_value *basic_result,
+    const struct tune_result_value *peak_result)
+{
+    struct schedule_result basic = {
+        .status = basic_result->status,
+        .tune = basic_result->tune,
+        .phase = basic_result->phase,
+    };
+    struct schedule_result peak = {
+        .status = peak_result->status,
+        .tune = peak_result->tune,
+        .phase = peak_result->phase,
+    };
+    update_schedule_result(schedule, &basic, &peak);
+}
+
+
+static void copy_datagram_value(
+    const struct tune_result_value *result, struct tune_datagram_value *value)
+{
+    value->tune = result->tune;
+    value->phase = result->phase;
+    value->status = result->status;
+    value->flags = 0;
+}
+
+
+/* Sends the results of this sweep to any multicast listeners. */
+static void multicast_sweep_results(
+    const struct tune_result_value *basic_result,
+    const struct tune_result_value *peak_result)
+{
+    struct tune_datagram_value selected, basic, peak;
+    copy_datagram_value(&tune_result_selected.value, &selected);
+    copy_datagram_value(basic_result, &basic);
+    copy_datagram_value(peak_result, &peak);
+    multicast_tune_sweep(&selected, &basic, &peak);
+}
+
+
+/* The peak fit is preferred for the Kalman filter, but the basic fit will do
+ * if the peak fit failed. */
+static void update_kalman_sweep(
+    const struct tune_result_value *basic,
+    const struct tune_result_value *peak)
+{
+    if (peak->status == TUNE_OK)
+        kalman_sweep_tune(true, peak->tune);
+    else
+        kalman_sweep_tune(basic->status == TUNE_OK, basic->tune);
+}
+
+
+/* Computes and publishes the tune results for the given sweep and returns a
+ * summary of the peak fit. */
 static void do_tune_sweep(
-    const struct tune_sweep_info *tune_sweep, bool overflow)
+    const struct tune_sweep_info *tune_sweep, bool overflow,
+    struct peak_summary *peak_summary)
 {
     interlock_wait(tune_trigger);
 
     update_iq_power(tune_sweep);
-    update_phase_wf();
-    update_cumsum(tune_sweep);
+    update_derived_wf(phase_derived);
+    update_derived_wf(cumsum_derived);
 
     compute_tune_result(
         overflow,
@@ -398,15 +515,61 @@ static void do_tune_sweep(
      * necessary because the PEAK tune result is updated on the tune_trigger
      * interlock, but we need to complete the processing of measure_tune_peaks
      * first.  A bit of gentle refactoring is in order to avoid this. */
+    MEASURE_LOCK();
+    select_peak_state(tune_sweep->state, true);
     compute_tune_result(
         overflow,
         tune_sweep->sweep_length, &sweep, tune_sweep->tune_scale,
         &tune_result_peaks, measure_tune_peaks);
+    read_peak_summary(peak_summary);
+    MEASURE_UNLOCK();
 
+    struct tune_result_value basic = tune_result_basic.value;
+    struct tune_result_value peak = tune_result_peaks.value;
     interlock_signal(tune_trigger, NULL);
 
-    if (selected_tune_result != SELECT_TUNE_PLL)
-        update_tune_result();
+    if (!tune_sweep->synthetic)
+        record_schedule_result(tune_sweep->schedule, &basic, &peak);
+
+    /* Replayed and injected sweeps are only shown in the detailed results
+     * above, flagged by TUNE:SYNTHETIC, and are kept out of the selected tune,
+     * the history, the multicast stream and the Kalman filter.  Once the
+     * interlock is released the published results can be overwritten by test
+     * injection, so the history, multicast and Kalman filter use our copies. */
+    if (!tune_sweep->synthetic)
+    {
+        record_tune_history(HISTORY_BASIC, &basic);
+        record_tune_history(HISTORY_PEAK, &peak);
+
+        if (selected_tune_result != SELECT_TUNE_PLL)
+            update_tune_result();
+        multicast_sweep_results(&basic, &peak);
+        update_kalman_sweep(&basic, &peak);
+    }
+}
+
+
+/* Scheduled sweeps other than the primary configuration are measured with their
+ * own tracking state and only update their own scheduler results: the main
+ * tune PVs, history, multicast and Kalman filter follow the primary sweeps.
+ * Replayed sweeps are measured in the same way but update no results. */
+static void measure_scheduled_sweep(
+    const struct tune_sweep_info *tune_sweep, bool overflow)
+{
+    struct tune_result_value basic, peak;
+    measure_tune_result(
+        overflow, tune_sweep->sweep_length, tune_sweep->sweep,
+        tune_sweep->tune_scale, &basic, measure_tune_basic);
+
+    MEASURE_LOCK();
+    select_peak_state(tune_sweep->state, false);
+    measure_tune_result(
+        overflow, tune_sweep->sweep_length, tune_sweep->sweep,
+        tune_sweep->tune_scale, &peak, measure_tune_peaks);
+    MEASURE_UNLOCK();
+
+    if (!tune_sweep->synthetic)
+        record_schedule_result(tune_sweep->schedule, &basic, &peak);
 }
 
 
@@ -416,7 +579,9 @@ void update_tune_pll_tune(bool tune_ok, double tune, double phase)
 {
     set_tune_result(
         &tune_result_pll, tune_ok ? TUNE_OK : TUNE_INVALID, tune, phase);
+    record_tune_history(HISTORY_PLL, &tune_result_pll);
     update_tune_result();
+    kalman_follow_tune(tune_ok, tune);
 }
 
 
@@ -435,7 +600,10 @@ static void set_selected_result(unsigned int selection)
 static struct tune_sweep_info injection_info = {
     .sweep_length = TUNE_LENGTH,
     .tune_scale = (double [TUNE_LENGTH]) {},
-    .sweep = &(struct channel_sweep) {}
+    .sweep = &(struct channel_sweep) {},
+    .synthetic = true,
+    .schedule = -1,
+    .primary = true,
 };
 
 
@@ -443,7 +611,34 @@ void update_tune_sweep(struct sweep_info *sweep_info, bool overflow)
 {
     struct tune_sweep_info tune_sweep;
     extract_sweep_info(&tune_sweep, sweep_info);
-    do_tune_sweep(&tune_sweep, overflow);
+
+    /* The selection identifies the channel used for the average. */
+    unsigned int selection =
+        sweep_info->single_bunch_mode ? selected_bunch + 1 : 0;
+    tune_sweep.sweep = average_tune_sweep(
+        sweep_info, tune_sweep.sweep, selection, overflow);
+    if (!tune_sweep.primary)
+    {
+        measure_scheduled_sweep(&tune_sweep, overflow);
+        return;
+    }
+
+    struct peak_summary peak_summary;
+    do_tune_sweep(&tune_sweep, overflow, &peak_summary);
+
+    /* Only the beam sweep set up through EPICS is planned from its results:
+     * scheduled configurations and replayed data would reprogram the
+     * sequencer under the wrong setup. */
+    if (!sweep_info->synthetic  &&  sweep_info->schedule < 0)
+    {
+        update_tune_zoom(peak_summary.tune_ok,
+            peak_summary.tune, peak_summary.width,
+            peak_summary.left, peak_summary.right);
+        update_tune_dwell(peak_summary.tune_ok,
+            peak_summary.snr, peak_summary.fit_error);
+    }
+    update_tune_segments(sweep_info, tune_sweep.sweep, overflow);
+    update_tune_channels(sweep_info, overflow);
 
     /* After performing a normal tune sweep update the injected sweep tune scale
      * so that things match by default. */
@@ -458,7 +653,9 @@ static void inject_test_data(void)
 {
     inject_tune_scale(injection_info.tune_scale);
     compute_power(injection_info.sweep);
-    do_tune_sweep(&injection_info, false);
+    injection_info.state = sweep_state_index(-1, true);
+    struct peak_summary peak_summary;
+    do_tune_sweep(&injection_info, false, &peak_summary);
 }
 
 
@@ -592,8 +789,12 @@ bool initialise_tune(void)
     PUBLISH_WF_READ_VAR(float, "TUNE:PHASEWF", TUNE_LENGTH, phase_waveform);
     PUBLISH_READ_VAR(ai, "TUNE:MEANPOWER", mean_power);
     PUBLISH_READ_VAR(longin, "TUNE:MAXPOWER", max_power);
+    PUBLISH_READ_VAR(bi, "TUNE:SYNTHETIC", synthetic_sweep);
     PUBLISH_WF_READ_VAR(int, "TUNE:CUMSUMI", TUNE_LENGTH, cumsum_i);
     PUBLISH_WF_READ_VAR(int, "TUNE:CUMSUMQ", TUNE_LENGTH, cumsum_q);
+    phase_derived = register_derived_wf("TUNE:PHASEWF", update_phase_wf, NULL);
+    cumsum_derived = register_derived_wf("TUNE:CUMSUMI", update_cumsum, NULL);
+    add_derived_record(cumsum_derived, "TUNE:CUMSUMQ");
 
     publish_tune_result(&tune_result_selected, "TUNE");
     publish_tune_result(&tune_result_basic, "TUNE:BASIC");
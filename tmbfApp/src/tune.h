@@ -1,6 +1,7 @@
 /* High level tune processing. */
 
 struct sweep_info;
+struct channel_sweep;
 
 /* Tune status enumerations used when reporting tune to users. */
 enum tune_status {
@@ -18,6 +19,10 @@ enum tune_status {
  * by the detector are passed through for detailed tune detection processing. */
 void update_tune_sweep(struct sweep_info *sweep_info, bool overflow);
 
+/* Returns the detector channel used for tune measurement, depending on the
+ * detector mode and selected bunch. */
+struct channel_sweep *tune_sweep_channel(struct sweep_info *sweep_info);
+
 /* Called by tune PLL on tune updates. */
 void update_tune_pll_tune(bool tune_ok, double tune, double phase);
 
@@ -0,0 +1,389 @@
+/* Coherent averaging of tune sweeps.
+ *
+ * At low excitation individual sweeps can be too noisy for a reliable tune fit.
+ * Here we average the complex IQ of consecutive sweeps with identical sweep
+ * settings before passing the result on for tune measurement.  Two forms of
+ * averaging are supported: a simple block average of the last N sweeps, or an
+ * exponentially weighted average with time constant N sweeps.
+ *
+ * Interleaved sweeps with different configurations are averaged separately, so
+ * the averaging state is kept for each sweep state as defined by the scheduler.
+ * Only sweeps which update the main tune results publish the statistics. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "hardware.h"
+#include "detector.h"
+#include "scheduler.h"
+
+#include "tune_average.h"
+
+
+/* Up to 64 sweeps can be averaged, set as a power of 2. */
+#define MAX_AVERAGE_SHIFT   6
+#define MAX_AVERAGE         (1 << MAX_AVERAGE_SHIFT)
+
+/* Fraction bits used for exponential averaging.  With 16 bit data this leaves
+ * one bit of headroom in 32 bits. */
+#define EXP_FRACTION_BITS   15
+#define EXP_SCALE           (1 << EXP_FRACTION_BITS)
+
+enum { AVERAGE_BLOCK, AVERAGE_EXPONENTIAL };
+
+/* Settings written through EPICS.  Any change of setting resets all averages
+ * by bumping the reset generation.  The settings and the block history buffers
+ * are changed under the lock, which is also held while averaging. */
+static pthread_mutex_t average_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()      ASSERT_PTHREAD(pthread_mutex_lock(&average_lock))
+#define UNLOCK()    ASSERT_PTHREAD(pthread_mutex_unlock(&average_lock))
+
+static unsigned int average_mode;
+static unsigned int average_shift;  // Average over 2^average_shift sweeps
+static unsigned int reset_generation = 1;
+
+struct iq_history {
+    short wf_i[TUNE_LENGTH];
+    short wf_q[TUNE_LENGTH];
+};
+
+struct average_state {
+    /* Sweep settings for the current average.  Any change resets the
+     * average. */
+    unsigned int generation;
+    unsigned int last_sweep_length;
+    unsigned int last_gain;
+    unsigned int last_selection;
+    double last_tune_scale[TUNE_LENGTH];
+
+    /* History for block averaging.  Running sums of the last history_count
+     * sweeps are maintained together with the total power of each sweep.  The
+     * history has 2^average_shift entries and is only allocated when block
+     * averaging is enabled. */
+    struct iq_history *history;
+    double history_power[MAX_AVERAGE];
+    unsigned int history_index;
+    unsigned int history_count;
+    int sum_i[TUNE_LENGTH];
+    int sum_q[TUNE_LENGTH];
+    double sum_power;
+
+    /* State for exponential averaging, scaled by 2^EXP_FRACTION_BITS. */
+    int exp_i[TUNE_LENGTH];
+    int exp_q[TUNE_LENGTH];
+    double exp_power;
+    double sum_weight_squared;  // Sum of squares of normalised weights
+    bool exp_empty;
+
+    /* Result of averaging. */
+    struct channel_sweep average;
+    double effective_count;
+    double average_snr;
+};
+
+/* Only accessed from the sweep processing thread, except for the history
+ * buffers which are replaced under the lock. */
+static struct average_state *average_states;
+
+/* Published statistics. */
+static struct epics_interlock *average_trigger;
+static double effective_count;      // 1 / sum of squared weights
+static double average_snr;          // Estimated SNR of averaged data in dB
+
+
+static void reset_average(struct average_state *state)
+{
+    state->history_index = 0;
+    state->history_count = 0;
+    memset(state->sum_i, 0, sizeof(state->sum_i));
+    memset(state->sum_q, 0, sizeof(state->sum_q));
+    state->sum_power = 0;
+    state->exp_empty = true;
+}
+
+
+/* Returns total power of the raw sweep over the valid sweep length. */
+static double sweep_power(
+    const struct channel_sweep *sweep, unsigned int sweep_length)
+{
+    double total = 0;
+    for (unsigned int i = 0; i < sweep_length; i ++)
+        total += sweep->power[i];
+    return total;
+}
+
+
+/* Adds new sweep to the block average, discarding the oldest if the history is
+ * full.  Returns the effective averaging count and mean total power. */
+static double update_block_average(
+    struct average_state *state,
+    const struct channel_sweep *sweep, double power, double *mean_power)
+{
+    unsigned int count = 1U << average_shift;
+    struct iq_history *entry = &state->history[state->history_index];
+    if (state->history_count >= count)
+    {
+        for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+        {
+            state->sum_i[i] -= entry->wf_i[i];
+            state->sum_q[i] -= entry->wf_q[i];
+        }
+        state->sum_power -= state->history_power[state->history_index];
+    }
+    else
+        state->history_count += 1;
+
+    memcpy(entry->wf_i, sweep->wf_i, sizeof(entry->wf_i));
+    memcpy(entry->wf_q, sweep->wf_q, sizeof(entry->wf_q));
+    state->history_power[state->history_index] = power;
+    state->sum_power += power;
+    state->history_index = (state->history_index + 1) % count;
+
+    /* Compute average as multiplication by reciprocal count to avoid a
+     * division for every point. */
+    struct channel_sweep *average = &state->average;
+    int64_t scale = (1 << 16) / state->history_count;
+    for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+    {
+        state->sum_i[i] += sweep->wf_i[i];
+        state->sum_q[i] += sweep->wf_q[i];
+        average->wf_i[i] =
+            (short) ((state->sum_i[i] * scale + (1 << 15)) >> 16);
+        average->wf_q[i] =
+            (short) ((state->sum_q[i] * scale + (1 << 15)) >> 16);
+    }
+
+    *mean_power = state->sum_power / state->history_count;
+    return state->history_count;
+}
+
+
+/* Updates the exponential average, where each new sweep is added with weight
+ * 2^-average_shift.  The first sweep after a reset has weight 1. */
+static double update_exp_average(
+    struct average_state *state,
+    const struct channel_sweep *sweep, double power, double *mean_power)
+{
+    int *exp_i = state->exp_i;
+    int *exp_q = state->exp_q;
+    if (state->exp_empty)
+    {
+        for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+        {
+            exp_i[i] = sweep->wf_i[i] * EXP_SCALE;
+            exp_q[i] = sweep->wf_q[i] * EXP_SCALE;
+        }
+        state->exp_power = power;
+        state->sum_weight_squared = 1;
+        state->exp_empty = false;
+    }
+    else
+    {
+        int shift = (int) average_shift;
+        for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+        {
+            exp_i[i] += (sweep->wf_i[i] * EXP_SCALE - exp_i[i]) >> shift;
+            exp_q[i] += (sweep->wf_q[i] * EXP_SCALE - exp_q[i]) >> shift;
+        }
+        double alpha = ldexp(1, -shift);
+        state->exp_power += alpha * (power - state->exp_power);
+        state->sum_weight_squared =
+            (1 - alpha) * (1 - alpha) * state->sum_weight_squared +
+            alpha * alpha;
+    }
+
+    struct channel_sweep *average = &state->average;
+    const int round = 1 << (EXP_FRACTION_BITS - 1);
+    for (unsigned int i = 0; i < TUNE_LENGTH; i ++)
+    {
+        average->wf_i[i] = (short) ((exp_i[i] + round) >> EXP_FRACTION_BITS);
+        average->wf_q[i] = (short) ((exp_q[i] + round) >> EXP_FRACTION_BITS);
+    }
+
+    *mean_power = state->exp_power;
+    return 1 / state->sum_weight_squared;
+}
+
+
+/* If the sweep has the form s + n_k with noise n_k of power P_n then the mean
+ * power of the individual sweeps is S + P_n and the power of the average is
+ * S + P_n/N where N is the effective count.  From these we can estimate the
+ * signal and noise power in the averaged data. */
+static double estimate_snr(
+    const struct channel_sweep *average,
+    double mean_power, double count, unsigned int sweep_length)
+{
+    double average_power = sweep_power(average, sweep_length);
+    if (count <= 1)
+        return NAN;
+
+    double noise = (mean_power - average_power) / (1 - 1 / count) / count;
+    double signal = average_power - noise;
+    if (noise <= 0  ||  signal <= 0)
+        return NAN;
+    else
+        return 10 * log10(signal / noise);
+}
+
+
+/* Checks whether the sweep settings have changed since the last sweep, records
+ * the new settings if so. */
+static bool sweep_changed(
+    struct average_state *state,
+    const struct sweep_info *sweep_info, unsigned int selection)
+{
+    bool changed =
+        sweep_info->sweep_length != state->last_sweep_length  ||
+        sweep_info->gain != state->last_gain  ||
+        selection != state->last_selection  ||
+        memcmp(sweep_info->tune_scale, state->last_tune_scale,
+            sizeof(state->last_tune_scale)) != 0;
+    if (changed)
+    {
+        state->last_sweep_length = sweep_info->sweep_length;
+        state->last_gain = sweep_info->gain;
+        state->last_selection = selection;
+        memcpy(state->last_tune_scale, sweep_info->tune_scale,
+            sizeof(state->last_tune_scale));
+    }
+    return changed;
+}
+
+
+/* Adds the sweep to the average for its sweep state. */
+static struct channel_sweep *update_average(
+    struct average_state *state,
+    const struct sweep_info *sweep_info, const struct channel_sweep *sweep,
+    unsigned int selection)
+{
+    if (sweep_changed(state, sweep_info, selection)  ||
+        state->generation != reset_generation)
+    {
+        reset_average(state);
+        state->generation = reset_generation;
+    }
+
+    double power = sweep_power(sweep, sweep_info->sweep_length);
+    double mean_power;
+    switch (average_mode)
+    {
+        default:
+        case AVERAGE_BLOCK:
+            state->effective_count = update_block_average(
+                state, sweep, power, &mean_power);
+            break;
+        case AVERAGE_EXPONENTIAL:
+            state->effective_count = update_exp_average(
+                state, sweep, power, &mean_power);
+            break;
+    }
+    compute_power(&state->average);
+    state->average_snr = estimate_snr(&state->average,
+        mean_power, state->effective_count, sweep_info->sweep_length);
+    return &state->average;
+}
+
+
+struct channel_sweep *average_tune_sweep(
+    const struct sweep_info *sweep_info, struct channel_sweep *sweep,
+    unsigned int selection, bool overflow)
+{
+    struct average_state *state = &average_states[
+        sweep_state_index(sweep_info->schedule, sweep_info->synthetic)];
+
+    /* With averaging disabled the sweep is passed straight through.
+     * Overflowed sweeps are also passed through without being included in
+     * the average, and leave the statistics unchanged. */
+    LOCK();
+    struct channel_sweep *result = sweep;
+    double count = 1;
+    double snr = NAN;
+    if (average_shift > 0  &&  !overflow)
+    {
+        result = update_average(state, sweep_info, sweep, selection);
+        count = state->effective_count;
+        snr = state->average_snr;
+    }
+    UNLOCK();
+
+    if (!overflow  &&  schedule_is_primary(sweep_info->schedule))
+    {
+        interlock_wait(average_trigger);
+        effective_count = count;
+        average_snr = snr;
+        interlock_signal(average_trigger, NULL);
+    }
+    return result;
+}
+
+
+/* Replaces the block history buffers to match the given settings, only
+ * allocating them when block averaging is enabled.  On failure the existing
+ * settings are left unchanged. */
+static bool update_settings(unsigned int mode, unsigned int shift)
+{
+    unsigned int count =
+        mode == AVERAGE_BLOCK  &&  shift > 0 ? 1U << shift : 0;
+    struct iq_history *history[SWEEP_STATES] = { NULL };
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  count > 0  &&  i < SWEEP_STATES; i ++)
+        ok = TEST_NULL_(
+            history[i] = malloc(count * sizeof(struct iq_history)),
+            "Unable to allocate history for %u sweeps", count);
+
+    if (ok)
+    {
+        LOCK();
+        for (unsigned int i = 0; i < SWEEP_STATES; i ++)
+        {
+            free(average_states[i].history);
+            average_states[i].history = history[i];
+        }
+        average_mode = mode;
+        average_shift = shift;
+        reset_generation += 1;
+        UNLOCK();
+    }
+    else
+        for (unsigned int i = 0; i < SWEEP_STATES; i ++)
+            free(history[i]);
+    return ok;
+}
+
+static bool set_average_mode(unsigned int mode)
+{
+    return update_settings(mode, average_shift);
+}
+
+static bool set_average_count(unsigned int shift)
+{
+    return update_settings(average_mode, shift);
+}
+
+static void request_reset(void)
+{
+    LOCK();
+    reset_generation += 1;
+    UNLOCK();
+}
+
+
+bool initialise_tune_average(void)
+{
+    average_states = calloc(SWEEP_STATES, sizeof(struct average_state));
+    PUBLISH_WRITER_B_P(mbbo, "TUNE:AVG:MODE", set_average_mode);
+    PUBLISH_WRITER_B_P(mbbo, "TUNE:AVG:COUNT", set_average_count);
+    PUBLISH_ACTION("TUNE:AVG:RESET", request_reset);
+
+    average_trigger = create_interlock("TUNE:AVG", false);
+    PUBLISH_READ_VAR(ai, "TUNE:AVG:N", effective_count);
+    PUBLISH_READ_VAR(ai, "TUNE:AVG:SNR", average_snr);
+    return true;
+}
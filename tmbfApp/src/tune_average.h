@@ -0,0 +1,15 @@
+/* Coherent averaging of tune sweeps. */
+
+struct sweep_info;
+struct channel_sweep;
+
+/* Called on each sweep with the channel selected for tune measurement.  Returns
+ * the sweep to use for tune measurement, which is the coherent average of
+ * recent matching sweeps, or the sweep itself if averaging is disabled or the
+ * sweep overflowed.  The selection identifies the selected channel, a change
+ * in selection resets the average. */
+struct channel_sweep *average_tune_sweep(
+    const struct sweep_info *sweep_info, struct channel_sweep *sweep,
+    unsigned int selection, bool overflow);
+
+bool initialise_tune_average(void);
@@ -0,0 +1,200 @@
+/* Tune measurement on all four detector channels.
+ *
+ * Only one detector channel (or the channel mean) is used for the main tune
+ * measurement.  Here we fit a single resonance to each of the four channels so
+ * that one sweep gives four independent bunch tunes.  Optionally a joint fit
+ * with a pole shared between all four channels is also computed, which gives a
+ * single tune with lower variance when the four bunches share a tune. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string.h>
+#include <complex.h>
+#include <math.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "hardware.h"
+#include "detector.h"
+#include "tune.h"
+#include "tune_support.h"
+#include "timing.h"
+
+#include "tune_channels.h"
+
+
+#define CHANNEL_COUNT   4
+
+static bool channels_enable;
+static bool joint_enable;
+static double fit_threshold = 0.3;  // Fraction of peak power to fit over
+
+struct channel_result {
+    unsigned int status;
+    double tune;
+    double phase;
+    double width;
+    double error;
+};
+
+static struct epics_interlock *channels_trigger;
+static struct channel_result channel_results[CHANNEL_COUNT];
+static struct channel_result joint_result;
+static double process_duration;     // Processing time in ms
+
+/* Working storage for find_fit_range(), only used on the sweep processing
+ * thread. */
+static double fit_power[TUNE_LENGTH];
+
+
+/* Finds the range around the highest point of the summed power of the given
+ * channels where the power is above the fit threshold. */
+static bool find_fit_range(
+    unsigned int channels, unsigned int length,
+    const short *const wf_i[], const short *const wf_q[],
+    struct peak_range *range)
+{
+    double *power = fit_power;
+    unsigned int max_ix = 0;
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        power[i] = 0;
+        for (unsigned int c = 0; c < channels; c ++)
+            power[i] +=
+                (double) wf_i[c][i] * wf_i[c][i] +
+                (double) wf_q[c][i] * wf_q[c][i];
+        if (power[i] > power[max_ix])
+            max_ix = i;
+    }
+
+    double threshold = fit_threshold * power[max_ix];
+    unsigned int left = max_ix;
+    while (left > 0  &&  power[left - 1] >= threshold)
+        left -= 1;
+    unsigned int right = max_ix;
+    while (right < length - 1  &&  power[right + 1] >= threshold)
+        right += 1;
+
+    *range = (struct peak_range) { .left = left, .right = right };
+    return power[max_ix] > 0  &&  right > left;
+}
+
+
+static void set_channel_result(
+    struct channel_result *result, unsigned int status,
+    const struct one_pole *fit, double error)
+{
+    result->status = status;
+    if (status == TUNE_OK)
+    {
+        double harmonic;
+        result->tune = modf(peak_centre(fit), &harmonic);
+        result->phase = 180 / M_PI * peak_phase(fit);
+        result->width = peak_width(fit);
+        result->error = error;
+    }
+    else
+    {
+        result->tune = NAN;
+        result->phase = NAN;
+        result->width = NAN;
+        result->error = NAN;
+    }
+}
+
+
+/* Fits channels together with a shared pole.  With a single channel this is
+ * the ordinary one pole fit.  The first fit is refined as for the segment and
+ * peak fits. */
+static void fit_channels(
+    unsigned int channels, unsigned int length, const double tune_scale[],
+    const short *const wf_i[], const short *const wf_q[],
+    struct channel_result *result)
+{
+    struct peak_range range;
+    struct one_pole fits[CHANNEL_COUNT];
+    double error;
+    if (!find_fit_range(channels, length, wf_i, wf_q, &range))
+        set_channel_result(result, TUNE_NO_PEAK, NULL, 0);
+    else if (
+        fit_shared_pole(channels, false,
+            tune_scale, wf_i, wf_q, &range, fits, &error)  &&
+        fit_shared_pole(channels, true,
+            tune_scale, wf_i, wf_q, &range, fits, &error)  &&
+        peak_width(&fits[0]) > 0)
+        set_channel_result(result, TUNE_OK, &fits[0], error);
+    else
+        set_channel_result(result, TUNE_BAD_FIT, NULL, 0);
+}
+
+
+void update_tune_channels(const struct sweep_info *sweep_info, bool overflow)
+{
+    if (!channels_enable)
+        return;
+
+    interlock_wait(channels_trigger);
+    TIC();
+
+    const short *wf_i[CHANNEL_COUNT];
+    const short *wf_q[CHANNEL_COUNT];
+    for (unsigned int c = 0; c < CHANNEL_COUNT; c ++)
+    {
+        wf_i[c] = sweep_info->channels[c].wf_i;
+        wf_q[c] = sweep_info->channels[c].wf_q;
+    }
+
+    unsigned int length = sweep_info->sweep_length;
+    for (unsigned int c = 0; c < CHANNEL_COUNT; c ++)
+        if (overflow)
+            set_channel_result(&channel_results[c], TUNE_OVERFLOW, NULL, 0);
+        else
+            fit_channels(1, length, sweep_info->tune_scale,
+                &wf_i[c], &wf_q[c], &channel_results[c]);
+
+    if (overflow)
+        set_channel_result(&joint_result, TUNE_OVERFLOW, NULL, 0);
+    else if (joint_enable)
+        fit_channels(CHANNEL_COUNT, length, sweep_info->tune_scale,
+            wf_i, wf_q, &joint_result);
+    else
+        set_channel_result(&joint_result, TUNE_INVALID, NULL, 0);
+
+    process_duration = 1e3 * TOC();
+    interlock_signal(channels_trigger, NULL);
+}
+
+
+static void publish_channel_result(
+    const char *name, struct channel_result *result)
+{
+    char buffer[40];
+#define FORMAT(field) (sprintf(buffer, "TUNE:CHAN:%s:%s", name, field), buffer)
+    PUBLISH_READ_VAR(mbbi, FORMAT("STATUS"), result->status);
+    PUBLISH_READ_VAR(ai, FORMAT("TUNE"), result->tune);
+    PUBLISH_READ_VAR(ai, FORMAT("PHASE"), result->phase);
+    PUBLISH_READ_VAR(ai, FORMAT("WIDTH"), result->width);
+    PUBLISH_READ_VAR(ai, FORMAT("ERROR"), result->error);
+#undef FORMAT
+}
+
+
+bool initialise_tune_channels(void)
+{
+    PUBLISH_WRITE_VAR_P(bo, "TUNE:CHAN:ENABLE", channels_enable);
+    PUBLISH_WRITE_VAR_P(bo, "TUNE:CHAN:JOINT", joint_enable);
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:CHAN:THRESHOLD", fit_threshold);
+
+    channels_trigger = create_interlock("TUNE:CHAN", false);
+    for (unsigned int c = 0; c < CHANNEL_COUNT; c ++)
+    {
+        char name[4];
+        sprintf(name, "%u", c);
+        publish_channel_result(name, &channel_results[c]);
+    }
+    publish_channel_result("JOINT", &joint_result);
+    PUBLISH_READ_VAR(ai, "TUNE:CHAN:DURATION", process_duration);
+    return true;
+}
@@ -0,0 +1,9 @@
+/* Tune measurement on all four detector channels. */
+
+struct sweep_info;
+
+/* Called on each sweep to fit a tune to each detector channel and, if enabled,
+ * a joint fit across all channels. */
+void update_tune_channels(const struct sweep_info *sweep_info, bool overflow);
+
+bool initialise_tune_channels(void);
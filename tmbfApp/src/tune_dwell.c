@@ -0,0 +1,253 @@
+/* Adaptive sweep dwell time control.
+ *
+ * The dwell time is normally a fixed compromise: with strong beam most of the
+ * sweep time is wasted, with weak beam the peak fit fails.  Here we watch the
+ * tune peak SNR reported by the peak fit and scale the total sweep effort,
+ * dwell time times capture count, to hold the SNR at a target value, so that
+ * the sweep runs as fast as the target allows.
+ *
+ * The SNR is a power ratio and the noise is averaged over each dwell, so the
+ * SNR in dB is taken to change by 10*log10 of the change in effort.  The
+ * relative fit error of the tune peak is likewise taken to scale inversely
+ * with effort, and is held below a limit: the effort is never reduced so far
+ * that the fit error would exceed the limit, and is increased when it does,
+ * even if the SNR is on target.  The dwell
+ * is adjusted first, with the capture count held at its maximum; only when the
+ * dwell reaches its minimum is the count reduced.  The count is only adjusted
+ * for a simple single state sweep when zoom planning is off, otherwise the
+ * count belongs to the zoom planner and only the dwell is adjusted.
+ *
+ * Changes are written through the SEQ PVs in the same way as TUNE:SET. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "epics_extra.h"
+#include "hardware.h"
+
+#include "tune_dwell.h"
+
+
+#define MIN(a, b)   ((a) < (b) ? (a) : (b))
+
+/* Largest change in effort made in a single step. */
+#define MAX_STEP            2.0
+/* Sweeps ignored after a change: the capture in progress and those already
+ * queued were taken with the old settings. */
+#define SETTLE_SWEEPS       3
+/* A failed fit is counted as this far below target, and with the fit error at
+ * this multiple of the limit, which asks for the largest permitted step up. */
+#define FAILED_SNR_OFFSET   10
+#define FAILED_ERROR_FACTOR 10
+
+/* Settings. */
+static bool dwell_enable;
+static double target_snr = 20;          // Target tune peak SNR in dB
+static double deadband = 3;             // Total width of deadband in dB
+static double max_error = 0.2;          // Limit on tune peak fit error
+static unsigned int min_dwell = 1;
+static unsigned int max_dwell = 1000;
+static unsigned int min_count = 256;
+static unsigned int max_count = 4096;
+static unsigned int filter_length = 4;  // Sweeps averaged before each decision
+
+/* Controller state. */
+enum {
+    DWELL_OFF, DWELL_SETTLING, DWELL_HOLDING,
+    DWELL_LONGER, DWELL_SHORTER, DWELL_LIMIT };
+static unsigned int dwell_status;
+static unsigned int settle_count;
+static unsigned int sample_count;       // Sweeps in filtered SNR and error
+static double filtered_snr;
+static double filtered_error;
+static double last_time;
+
+/* Published results. */
+static unsigned int chosen_dwell;
+static unsigned int chosen_count;
+static double sweep_rate;               // Achieved sweep rate in Hz
+static unsigned int change_count;
+
+
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+
+static unsigned int clamp(double value, unsigned int low, unsigned int high)
+{
+    if (value <= low)
+        return low;
+    else if (value >= high)
+        return high;
+    else
+        return (unsigned int) lround(value);
+}
+
+
+/* The sweep rate is filtered over the same number of sweeps as the SNR. */
+static void update_sweep_rate(void)
+{
+    double now = get_time();
+    double interval = now - last_time;
+    if (last_time > 0  &&  interval > 0)
+    {
+        if (sweep_rate > 0)
+            sweep_rate += (1 / interval - sweep_rate) / filter_length;
+        else
+            sweep_rate = 1 / interval;
+    }
+    last_time = now;
+}
+
+
+/* Rewrites the capture count of state 1, keeping the sweep range. */
+static void write_count(unsigned int count)
+{
+    double start = READ_NAMED_RECORD(ao, "SEQ:1:START_FREQ");
+    double step = READ_NAMED_RECORD(ao, "SEQ:1:STEP_FREQ");
+    unsigned int old_count = READ_NAMED_RECORD(ulongout, "SEQ:1:COUNT");
+    double end = start + old_count * step;
+    WRITE_NAMED_RECORD(ulongout, "SEQ:1:COUNT", count);
+    WRITE_NAMED_RECORD(ao, "SEQ:1:END_FREQ", end);
+}
+
+
+/* Scales the sweep effort by the given ratio, returns false if no change was
+ * possible. */
+static bool adjust_effort(double ratio)
+{
+    unsigned int state_count = READ_NAMED_RECORD(ulongout, "SEQ:PC");
+    unsigned int dwell = chosen_dwell;
+    unsigned int count = chosen_count;
+    bool zoom = READ_NAMED_RECORD(bo, "TUNE:ZOOM:ENABLE");
+    bool count_free = state_count == 1  &&  !zoom;
+
+    double effort = ratio * dwell * count;
+    unsigned int new_dwell, new_count;
+    if (count_free)
+    {
+        new_dwell = clamp(effort / max_count, min_dwell, max_dwell);
+        new_count = clamp(effort / new_dwell, min_count, max_count);
+    }
+    else
+    {
+        new_dwell = clamp(effort / count, min_dwell, max_dwell);
+        new_count = count;
+    }
+    if (new_dwell == dwell  &&  new_count == count)
+        return false;
+
+    if (new_count != count)
+        write_count(new_count);
+    for (unsigned int state = 1; state <= state_count; state ++)
+    {
+        char name[40];
+        sprintf(name, "SEQ:%u:DWELL", state);
+        WRITE_NAMED_RECORD(ulongout, name, new_dwell);
+    }
+    WRITE_NAMED_RECORD(bo, "SEQ:WRITE", true);
+
+    chosen_dwell = new_dwell;
+    chosen_count = new_count;
+    change_count += 1;
+    return true;
+}
+
+
+/* Returns the change in effort needed to bring the filtered SNR to target
+ * without letting the filtered fit error exceed its limit. */
+static double required_effort(void)
+{
+    double ratio = pow(10, (target_snr - filtered_snr) / 10);
+    if (max_error > 0)
+        ratio = fmax(ratio, filtered_error / max_error);
+    return ratio;
+}
+
+
+void update_tune_dwell(bool tune_ok, double snr, double fit_error)
+{
+    update_sweep_rate();
+    if (!dwell_enable)
+    {
+        dwell_status = DWELL_OFF;
+        return;
+    }
+
+    chosen_dwell = READ_NAMED_RECORD(ulongout, "SEQ:1:DWELL");
+    chosen_count = READ_NAMED_RECORD(ulongout, "SEQ:1:COUNT");
+    if (settle_count > 0)
+    {
+        settle_count -= 1;
+        dwell_status = DWELL_SETTLING;
+        return;
+    }
+
+    if (!tune_ok  ||  isnan(snr))
+        snr = target_snr - FAILED_SNR_OFFSET;
+    if (!tune_ok  ||  isnan(fit_error))
+        fit_error = FAILED_ERROR_FACTOR * max_error;
+    sample_count += 1;
+    if (sample_count == 1)
+    {
+        filtered_snr = snr;
+        filtered_error = fit_error;
+    }
+    else
+    {
+        unsigned int length = MIN(sample_count, filter_length);
+        filtered_snr += (snr - filtered_snr) / length;
+        filtered_error += (fit_error - filtered_error) / length;
+    }
+    if (sample_count < filter_length)
+        return;
+
+    double ratio = required_effort();
+    if (fabs(10 * log10(ratio)) <= deadband / 2)
+        dwell_status = DWELL_HOLDING;
+    else
+    {
+        ratio = fmin(fmax(ratio, 1 / MAX_STEP), MAX_STEP);
+        if (adjust_effort(ratio))
+        {
+            dwell_status = ratio > 1 ? DWELL_LONGER : DWELL_SHORTER;
+            settle_count = SETTLE_SWEEPS;
+            sample_count = 0;
+        }
+        else
+            dwell_status = DWELL_LIMIT;
+    }
+}
+
+
+bool initialise_tune_dwell(void)
+{
+    PUBLISH_WRITE_VAR_P(bo, "TUNE:DWELL:ENABLE", dwell_enable);
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:DWELL:TARGET", target_snr);
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:DWELL:DEADBAND", deadband);
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:DWELL:MAXERR", max_error);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:DWELL:MIN", min_dwell);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:DWELL:MAX", max_dwell);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:DWELL:MINCOUNT", min_count);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:DWELL:MAXCOUNT", max_count);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:DWELL:FILTER", filter_length);
+
+    PUBLISH_READ_VAR(mbbi, "TUNE:DWELL:STATUS", dwell_status);
+    PUBLISH_READ_VAR(ai, "TUNE:DWELL:SNR", filtered_snr);
+    PUBLISH_READ_VAR(ai, "TUNE:DWELL:ERROR", filtered_error);
+    PUBLISH_READ_VAR(ulongin, "TUNE:DWELL:DWELL", chosen_dwell);
+    PUBLISH_READ_VAR(ulongin, "TUNE:DWELL:COUNT", chosen_count);
+    PUBLISH_READ_VAR(ai, "TUNE:DWELL:RATE", sweep_rate);
+    PUBLISH_READ_VAR(ulongin, "TUNE:DWELL:CHANGES", change_count);
+    return true;
+}
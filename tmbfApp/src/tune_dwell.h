@@ -0,0 +1,9 @@
+/* Adaptive sweep dwell time control. */
+
+/* Called after each peak fit of a live unscheduled sweep with the fit status,
+ * the measured tune peak SNR in dB and the relative fit error of the tune peak.
+ * If enabled the sequencer dwell time and capture count are adjusted to hold
+ * the SNR at the target and the fit error within its limit. */
+void update_tune_dwell(bool tune_ok, double snr, double fit_error);
+
+bool initialise_tune_dwell(void);
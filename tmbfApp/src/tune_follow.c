@@ -17,12 +17,21 @@
 #include "numeric.h"
 #include "detector.h"
 #include "tune.h"
+#include "event_wait.h"
+#include "tune_multicast.h"
 
 #include "tune_follow.h"
 
 
 #define FTUN_FREQ_LENGTH 4096
 
+/* FIFO polling intervals.  While tune following is running we adapt the poll
+ * interval to the FIFO fill rate, but never poll more slowly than the original
+ * 100 Hz.  When tune following is stopped we back off to 10 Hz. */
+#define MIN_POLL_INTERVAL       1000        // 1 ms
+#define ARMED_POLL_INTERVAL     10000       // 10 ms
+#define IDLE_POLL_INTERVAL      100000      // 100 ms
+
 
 /* Control parameters written through EPICS. */
 static struct ftun_control ftun_control;
@@ -39,6 +48,7 @@ static double delay_offset_degrees;
 
 /* Tune following. */
 static struct epics_interlock *ftun_interlock;
+static struct event_waiter *ftun_waiter;
 /* The following buffers and state are needed to properly fill freq_wf and
  * manage the flow of data from the hardware. */
 static float freq_wf[FTUN_FREQ_LENGTH];         // Tune fraction PV
@@ -184,6 +194,7 @@ static void write_ftun_start(void)
     hw_write_ftun_disarm();
     hw_write_ftun_enable(true);
     hw_write_ftun_start();
+    notify_event(ftun_waiter);
 }
 
 static void write_ftun_arm(void)
@@ -192,6 +203,7 @@ static void write_ftun_arm(void)
 
     hw_write_ftun_enable(true);
     hw_write_ftun_arm();
+    notify_event(ftun_waiter);
 }
 
 static void write_ftun_stop(void)
@@ -300,6 +312,8 @@ static void update_ftun_buffer(void)
     dropout_seen = false;
 
     update_tune_pll_tune(true, mean_nco_frequency, current_angle);
+    multicast_tune_follow(
+        true, mean_nco_frequency, current_angle, data_dropout);
 }
 
 
@@ -333,12 +347,15 @@ static void *poll_tune_follow(void *context)
 {
     while (true)
     {
+        wait_for_event(ftun_waiter);
+
         int ftun_buffer[FTUN_FIFO_SIZE];
         bool dropout;
         size_t read_count = hw_read_ftun_buffer(ftun_buffer, &dropout);
         process_ftun_buffer(ftun_buffer, read_count, dropout);
 
-        usleep(10000); // 100 Hz polling
+        update_event_level(ftun_waiter, read_count, FTUN_FIFO_SIZE,
+            hw_read_ftun_status() != FTUN_STOPPED);
     }
     return NULL;
 }
@@ -387,6 +404,8 @@ bool initialise_tune_follow(void)
     PUBLISH_WF_READ_VAR(int, "FTUN:RAWFREQ", FTUN_FREQ_LENGTH, raw_freq_wf);
     PUBLISH_READ_VAR(ai, "NCO:FREQ:MEAN", mean_nco_frequency);
     ftun_interlock = create_interlock("FTUN", false);
+    ftun_waiter = create_event_waiter(
+        MIN_POLL_INTERVAL, ARMED_POLL_INTERVAL, IDLE_POLL_INTERVAL);
 
     /* Debug PVs available when fast buffer in debug mode. */
     PUBLISH_WF_READ_VAR(short, "FTUN:DEBUG:I", DATA_LENGTH, debug_i);
@@ -0,0 +1,251 @@
+/* History of recent tune results with rolling statistics.
+ *
+ * The tune result PVs only show the most recent measurement, so assessing tune
+ * stability otherwise requires high rate sampling over channel access.  Here
+ * we keep a ring of the last HISTORY_LENGTH results for each measurement
+ * method, each with a monotonic timestamp and status, and publish the ring
+ * together with rolling statistics over a configurable window. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "tune.h"
+
+#include "tune_history.h"
+
+
+#define HISTORY_LENGTH      1024
+
+struct history_entry {
+    double time;            // Monotonic time of arrival in seconds
+    float tune;
+    float phase;
+    unsigned int status;
+};
+
+struct tune_history {
+    /* Ring buffer, updated under history_lock. */
+    struct history_entry ring[HISTORY_LENGTH];
+    unsigned int index;     // Index of next entry to write
+    unsigned int count;     // Number of valid entries in ring
+    unsigned int total;     // Number of results ever received
+
+    /* Published waveforms in chronological order, oldest result first.  The
+     * time is given in seconds relative to the most recent result. */
+    float tune_wf[HISTORY_LENGTH];
+    float phase_wf[HISTORY_LENGTH];
+    float time_wf[HISTORY_LENGTH];
+    char status_wf[HISTORY_LENGTH];
+    struct history_entry entries[HISTORY_LENGTH];   // Unrolled copy of ring
+
+    /* Rolling statistics over the selected window. */
+    unsigned int length;    // Number of results in the published waveforms
+    unsigned int samples;   // Number of good results in the window
+    double mean;
+    double std;
+    double min;
+    double max;
+    double age;             // Seconds since most recent result
+};
+
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tune_history *histories;
+
+#define LOCK()      ASSERT_PTHREAD(pthread_mutex_lock(&history_lock))
+#define UNLOCK()    ASSERT_PTHREAD(pthread_mutex_unlock(&history_lock))
+
+/* Window for rolling statistics: the most recent window_length results, further
+ * restricted to results younger than window_period seconds if this is set. */
+static unsigned int window_length = 100;
+static double window_period = 0;
+
+
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+
+/* Only results with a measured tune contribute to the statistics, we include
+ * results outside the alarm range. */
+static bool good_status(unsigned int status)
+{
+    return status == TUNE_OK  ||  status == TUNE_RANGE;
+}
+
+
+void update_tune_history(
+    enum tune_history_method method,
+    unsigned int status, double tune, double phase)
+{
+    struct tune_history *history = &histories[method];
+    double now = get_time();
+
+    LOCK();
+    history->ring[history->index] = (struct history_entry) {
+        .time = now,
+        .tune = (float) tune,
+        .phase = (float) phase,
+        .status = status,
+    };
+    history->index = (history->index + 1) % HISTORY_LENGTH;
+    if (history->count < HISTORY_LENGTH)
+        history->count += 1;
+    history->total += 1;
+    UNLOCK();
+}
+
+
+/* Unrolls the ring into chronological order, returns the number of entries. */
+static unsigned int copy_history(
+    struct tune_history *history, struct history_entry entries[])
+{
+    LOCK();
+    unsigned int count = history->count;
+    unsigned int start =
+        (history->index + HISTORY_LENGTH - count) % HISTORY_LENGTH;
+    for (unsigned int i = 0; i < count; i ++)
+        entries[i] = history->ring[(start + i) % HISTORY_LENGTH];
+    UNLOCK();
+    return count;
+}
+
+
+static void compute_statistics(
+    struct tune_history *history,
+    const struct history_entry entries[], unsigned int count, double now)
+{
+    unsigned int window = window_length;
+    if (window > count)
+        window = count;
+
+    unsigned int samples = 0;
+    double sum = 0, sum_sq = 0;
+    double min = INFINITY, max = -INFINITY;
+    for (unsigned int i = count - window; i < count; i ++)
+    {
+        const struct history_entry *entry = &entries[i];
+        if (good_status(entry->status)  &&
+            (window_period <= 0  ||  now - entry->time <= window_period))
+        {
+            double tune = entry->tune;
+            samples += 1;
+            sum += tune;
+            sum_sq += tune * tune;
+            if (tune < min)  min = tune;
+            if (tune > max)  max = tune;
+        }
+    }
+
+    history->samples = samples;
+    if (samples > 0)
+    {
+        double mean = sum / samples;
+        double var = samples > 1 ?
+            (sum_sq - samples * mean * mean) / (samples - 1) : 0;
+        history->mean = mean;
+        history->std = var > 0 ? sqrt(var) : 0;
+        history->min = min;
+        history->max = max;
+    }
+    else
+    {
+        history->mean = NAN;
+        history->std = NAN;
+        history->min = NAN;
+        history->max = NAN;
+    }
+}
+
+
+/* Called on the scan record to refresh the published waveforms and statistics
+ * for one method. */
+static bool read_history(void *context, const bool *ignore)
+{
+    struct tune_history *history = context;
+    struct history_entry *entries = history->entries;
+    unsigned int count = copy_history(history, entries);
+    double now = get_time();
+
+    double last = count > 0 ? entries[count - 1].time : now;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        history->tune_wf[i] = entries[i].tune;
+        history->phase_wf[i] = entries[i].phase;
+        history->time_wf[i] = (float) (entries[i].time - last);
+        history->status_wf[i] = (char) entries[i].status;
+    }
+    for (unsigned int i = count; i < HISTORY_LENGTH; i ++)
+    {
+        history->tune_wf[i] = NAN;
+        history->phase_wf[i] = NAN;
+        history->time_wf[i] = NAN;
+        history->status_wf[i] = TUNE_INVALID;
+    }
+    history->length = count;
+    history->age = count > 0 ? now - last : NAN;
+
+    compute_statistics(history, entries, count, now);
+    return true;
+}
+
+
+static void reset_histories(void)
+{
+    LOCK();
+    for (int i = 0; i < HISTORY_METHODS; i ++)
+    {
+        histories[i].index = 0;
+        histories[i].count = 0;
+    }
+    UNLOCK();
+}
+
+
+static void publish_history(struct tune_history *history, const char *name)
+{
+    char buffer[40];
+#define FORMAT(field) (sprintf(buffer, "TUNE:HIST:%s:%s", name, field), buffer)
+    PUBLISH(bo, FORMAT("SCAN"), .write = read_history, .context = history);
+    PUBLISH_WF_READ_VAR(
+        float, FORMAT("TUNE"), HISTORY_LENGTH, history->tune_wf);
+    PUBLISH_WF_READ_VAR(
+        float, FORMAT("PHASE"), HISTORY_LENGTH, history->phase_wf);
+    PUBLISH_WF_READ_VAR(
+        float, FORMAT("TIME"), HISTORY_LENGTH, history->time_wf);
+    PUBLISH_WF_READ_VAR(
+        char, FORMAT("STATUS"), HISTORY_LENGTH, history->status_wf);
+    PUBLISH_READ_VAR(ulongin, FORMAT("LENGTH"), history->length);
+    PUBLISH_READ_VAR(ulongin, FORMAT("TOTAL"), history->total);
+    PUBLISH_READ_VAR(ulongin, FORMAT("SAMPLES"), history->samples);
+    PUBLISH_READ_VAR(ai, FORMAT("MEAN"), history->mean);
+    PUBLISH_READ_VAR(ai, FORMAT("STD"), history->std);
+    PUBLISH_READ_VAR(ai, FORMAT("MIN"), history->min);
+    PUBLISH_READ_VAR(ai, FORMAT("MAX"), history->max);
+    PUBLISH_READ_VAR(ai, FORMAT("AGE"), history->age);
+#undef FORMAT
+}
+
+
+bool initialise_tune_history(void)
+{
+    histories = calloc(HISTORY_METHODS, sizeof(struct tune_history));
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:HIST:WINDOW", window_length);
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:HIST:PERIOD", window_period);
+    PUBLISH_ACTION("TUNE:HIST:RESET", reset_histories);
+
+    publish_history(&histories[HISTORY_BASIC], "BASIC");
+    publish_history(&histories[HISTORY_PEAK], "PEAK");
+    publish_history(&histories[HISTORY_PLL], "PLL");
+    return true;
+}
@@ -0,0 +1,17 @@
+/* History of recent tune results with rolling statistics. */
+
+/* Tune measurement methods with a separate history. */
+enum tune_history_method {
+    HISTORY_BASIC,          // TUNE:TUNE, basic peak detection
+    HISTORY_PEAK,           // PEAK:TUNE, peak fitting
+    HISTORY_PLL,            // Tune PLL result
+    HISTORY_METHODS
+};
+
+/* Records a new tune result for the given method, timestamped on arrival.  May
+ * be called from any thread. */
+void update_tune_history(
+    enum tune_history_method method,
+    unsigned int status, double tune, double phase);
+
+bool initialise_tune_history(void);
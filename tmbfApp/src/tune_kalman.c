@@ -0,0 +1,311 @@
+/* Kalman filter fusing sweep and tune follow tune measurements.
+ *
+ * The tune is modelled as a random walk with a configured drift rate, and is
+ * measured independently by the sweep fits and by tune follow, at very
+ * different rates and with different noise.  Each measurement is folded into
+ * a single scalar estimate weighted by its variance, so between sweeps the
+ * estimate follows tune follow, and each sweep corrects it.
+ *
+ * The noise of each source is not known in advance, so it is estimated from
+ * the innovation sequence: the expected squared innovation is the measurement
+ * variance plus the prediction variance, so a running mean of the squared
+ * innovation less the prediction variance estimates the measurement variance.
+ * The configured noise for each source serves as the starting value and lower
+ * bound of this estimate.
+ *
+ * Measurements whose innovation lies outside the gate are rejected as
+ * outliers; after a run of rejections from one source the filter is restarted
+ * from that source, as the tune has evidently moved.
+ *
+ * All tunes are fractional, innovations are computed modulo 1. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "epics_device.h"
+
+#include "tune_kalman.h"
+
+
+/* Number of consecutive rejections from one source before restarting. */
+#define RESTART_COUNT   5
+
+enum { KALMAN_OFF, KALMAN_WAITING, KALMAN_TRACKING, KALMAN_RESTARTED };
+
+struct kalman_source {
+    const char *name;
+    /* Settings. */
+    double noise;               // Minimum and initial noise standard deviation
+    /* Noise estimate. */
+    double variance;            // Current measurement variance estimate
+    double last_time;
+    /* Innovation statistics. */
+    double innovation;          // Last innovation
+    double mean_innovation;     // Filtered innovation, shows bias
+    double nis;                 // Filtered normalised innovation squared
+    double noise_sd;            // Square root of variance
+    double rate;                // Filtered update rate in Hz
+    unsigned int count;
+    unsigned int rejected;
+    unsigned int run_rejected;  // Consecutive rejections
+};
+
+static struct kalman_source sweep_source = {
+    .name = "SWEEP", .noise = 1e-4 };
+static struct kalman_source follow_source = {
+    .name = "FTUN", .noise = 1e-5 };
+
+/* Settings. */
+static bool kalman_enable;
+static double drift_rate = 1e-4;    // Random walk of tune in tune/sqrt(s)
+static double gate = 5;             // Innovation gate in standard deviations
+static unsigned int filter_length = 20;    // Length of statistics filters
+
+/* Filter state. */
+static pthread_mutex_t kalman_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool initialised;
+static double estimate;
+static double covariance;
+static double estimate_time;
+
+/* Published results.  The tune estimate is updated under the interlock. */
+static struct epics_interlock *kalman_interlock;
+static unsigned int kalman_status;
+static double kalman_tune;
+static double kalman_sd;
+static unsigned int restart_count;
+
+#define LOCK()      ASSERT_PTHREAD(pthread_mutex_lock(&kalman_lock))
+#define UNLOCK()    ASSERT_PTHREAD(pthread_mutex_unlock(&kalman_lock))
+
+
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+
+static double wrap_tune(double tune)
+{
+    return tune - floor(tune);
+}
+
+
+/* Difference of two fractional tunes in the range -0.5 to 0.5. */
+static double tune_difference(double a, double b)
+{
+    double difference = wrap_tune(a - b);
+    return difference >= 0.5 ? difference - 1 : difference;
+}
+
+
+static void filter_value(double *filtered, double value, unsigned int count)
+{
+    if (count <= 1)
+        *filtered = value;
+    else
+    {
+        unsigned int length = count < filter_length ? count : filter_length;
+        *filtered += (value - *filtered) / length;
+    }
+}
+
+
+static void update_rate(struct kalman_source *source, double now)
+{
+    double interval = now - source->last_time;
+    if (source->last_time > 0  &&  interval > 0)
+        filter_value(&source->rate, 1 / interval, source->count);
+    source->last_time = now;
+}
+
+
+static void restart_filter(struct kalman_source *source, double tune)
+{
+    estimate = wrap_tune(tune);
+    covariance = source->variance;
+    initialised = true;
+    source->run_rejected = 0;
+}
+
+
+/* Advances the estimate to the given time: the tune is predicted unchanged, and
+ * its variance grows with the drift rate. */
+static void predict(double now)
+{
+    double interval = now - estimate_time;
+    if (interval > 0)
+        covariance += drift_rate * drift_rate * interval;
+    estimate_time = now;
+}
+
+
+/* Folds a measurement into the estimate, returns the new filter status. */
+static unsigned int update_estimate(
+    struct kalman_source *source, double tune, double now)
+{
+    double floor_variance = source->noise * source->noise;
+    if (source->variance < floor_variance)
+        source->variance = floor_variance;
+
+    source->count += 1;
+    update_rate(source, now);
+
+    if (!initialised)
+    {
+        restart_filter(source, tune);
+        estimate_time = now;
+        return KALMAN_TRACKING;
+    }
+
+    predict(now);
+    double innovation = tune_difference(tune, estimate);
+    double innovation_variance = covariance + source->variance;
+    double nis = innovation * innovation / innovation_variance;
+    source->innovation = innovation;
+
+    if (nis > gate * gate)
+    {
+        source->rejected += 1;
+        source->run_rejected += 1;
+        if (source->run_rejected < RESTART_COUNT)
+            return KALMAN_TRACKING;
+        restart_filter(source, tune);
+        restart_count += 1;
+        return KALMAN_RESTARTED;
+    }
+    source->run_rejected = 0;
+
+    /* Innovation statistics and measurement noise estimate. */
+    filter_value(&source->mean_innovation, innovation, source->count);
+    filter_value(&source->nis, nis, source->count);
+    filter_value(&source->variance,
+        innovation * innovation - covariance, source->count);
+    if (source->variance < floor_variance)
+        source->variance = floor_variance;
+    source->noise_sd = sqrt(source->variance);
+
+    double gain = covariance / innovation_variance;
+    estimate = wrap_tune(estimate + gain * innovation);
+    covariance = (1 - gain) * covariance;
+    return KALMAN_TRACKING;
+}
+
+
+static void process_measurement(
+    struct kalman_source *source, bool tune_ok, double tune)
+{
+    if (!kalman_enable  ||  !tune_ok  ||  !isfinite(tune))
+        return;
+
+    LOCK();
+    kalman_status = update_estimate(source, tune, get_time());
+    double tune_out = estimate;
+    double sd_out = sqrt(covariance);
+    UNLOCK();
+
+    interlock_wait(kalman_interlock);
+    kalman_tune = tune_out;
+    kalman_sd = sd_out;
+    interlock_signal(kalman_interlock, NULL);
+}
+
+
+void kalman_sweep_tune(bool tune_ok, double tune)
+{
+    process_measurement(&sweep_source, tune_ok, tune);
+}
+
+
+void kalman_follow_tune(bool tune_ok, double tune)
+{
+    process_measurement(&follow_source, tune_ok, tune);
+}
+
+
+static void reset_source(struct kalman_source *source)
+{
+    source->variance = 0;
+    source->last_time = 0;
+    source->innovation = 0;
+    source->mean_innovation = 0;
+    source->nis = 0;
+    source->noise_sd = 0;
+    source->rate = 0;
+    source->count = 0;
+    source->rejected = 0;
+    source->run_rejected = 0;
+}
+
+
+static void reset_kalman(void)
+{
+    LOCK();
+    initialised = false;
+    reset_source(&sweep_source);
+    reset_source(&follow_source);
+    restart_count = 0;
+    kalman_status = kalman_enable ? KALMAN_WAITING : KALMAN_OFF;
+    UNLOCK();
+
+    if (check_epics_ready())
+    {
+        interlock_wait(kalman_interlock);
+        kalman_tune = 0;
+        kalman_sd = 0;
+        interlock_signal(kalman_interlock, NULL);
+    }
+}
+
+
+static void set_kalman_enable(bool enable)
+{
+    kalman_enable = enable;
+    reset_kalman();
+}
+
+
+static void publish_source(struct kalman_source *source)
+{
+    char buffer[40];
+#define FORMAT(field) \
+    (sprintf(buffer, "TUNE:KF:%s:%s", source->name, field), buffer)
+
+    PUBLISH_WRITE_VAR_P(ao, FORMAT("NOISE"), source->noise);
+    PUBLISH_READ_VAR(ai, FORMAT("SD"), source->noise_sd);
+    PUBLISH_READ_VAR(ai, FORMAT("INNOV"), source->innovation);
+    PUBLISH_READ_VAR(ai, FORMAT("BIAS"), source->mean_innovation);
+    PUBLISH_READ_VAR(ai, FORMAT("NIS"), source->nis);
+    PUBLISH_READ_VAR(ai, FORMAT("RATE"), source->rate);
+    PUBLISH_READ_VAR(ulongin, FORMAT("COUNT"), source->count);
+    PUBLISH_READ_VAR(ulongin, FORMAT("REJECT"), source->rejected);
+#undef FORMAT
+}
+
+
+bool initialise_tune_kalman(void)
+{
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:KF:DRIFT", drift_rate);
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:KF:GATE", gate);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:KF:FILTER", filter_length);
+    PUBLISH_WRITER_P(bo, "TUNE:KF:ENABLE", set_kalman_enable);
+    PUBLISH_ACTION("TUNE:KF:RESET", reset_kalman);
+    PUBLISH_READ_VAR(mbbi, "TUNE:KF:STATUS", kalman_status);
+    PUBLISH_READ_VAR(ulongin, "TUNE:KF:RESTARTS", restart_count);
+
+    publish_source(&sweep_source);
+    publish_source(&follow_source);
+
+    kalman_interlock = create_interlock("TUNE:KF", false);
+    PUBLISH_READ_VAR(ai, "TUNE:KF:TUNE", kalman_tune);
+    PUBLISH_READ_VAR(ai, "TUNE:KF:SD", kalman_sd);
+    return true;
+}
@@ -0,0 +1,9 @@
+/* Kalman filter fusing sweep and tune follow tune measurements. */
+
+/* Called with each new sweep tune result. */
+void kalman_sweep_tune(bool tune_ok, double tune);
+
+/* Called with each tune follow update. */
+void kalman_follow_tune(bool tune_ok, double tune);
+
+bool initialise_tune_kalman(void);
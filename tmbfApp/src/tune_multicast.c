@@ -0,0 +1,357 @@
+/* UDP multicast of tune results.
+ *
+ * Consumers which correct the tune would otherwise have to monitor the tune
+ * PVs over channel access.  Here each new tune result and each tune follow
+ * update is sent as a small sequence numbered and timestamped datagram to a
+ * multicast group, directly from the thread producing the result.  Sending
+ * never blocks: if the socket buffer is full the datagram is counted as an
+ * error and dropped.
+ *
+ * A loopback receiver can be enabled to join the same group, it checks the
+ * sequence numbers and measures the delivery latency from the monotonic send
+ * timestamp. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "tune.h"
+
+#include "tune_multicast.h"
+
+
+/* Receive timeout so that the receiver notices when it is disabled. */
+#define RECEIVE_TIMEOUT_US  200000
+
+enum { MULTICAST_OFF, MULTICAST_ON, MULTICAST_ERROR };
+
+/* Sender settings. */
+static EPICS_STRING group_name = { "239.255.77.1" };
+static unsigned int group_port = 21920;
+static unsigned int multicast_ttl = 1;
+
+/* Sender state, protected by send_lock. */
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+static int send_socket = -1;
+static struct sockaddr_in group_address;
+static uint32_t sequence;
+static unsigned int send_status;
+
+/* Sender statistics. */
+static unsigned int sent_count;
+static unsigned int send_errors;
+static double send_time;            // Time spent in last send in us
+
+/* Receiver state. */
+static pthread_mutex_t receive_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t receive_start = PTHREAD_COND_INITIALIZER;
+static bool receive_enable;
+static unsigned int receive_status;
+
+/* Receiver statistics, all updated under receive_lock. */
+static unsigned int received_count;
+static unsigned int lost_count;
+static unsigned int invalid_count;
+static uint32_t last_sequence;
+static double mean_latency;         // Latencies in us
+static double max_latency;
+static double total_latency;
+static double received_tune;        // Last selected sweep tune received
+static double received_follow;      // Last tune follow tune received
+
+#define SEND_LOCK()      ASSERT_PTHREAD(pthread_mutex_lock(&send_lock))
+#define SEND_UNLOCK()    ASSERT_PTHREAD(pthread_mutex_unlock(&send_lock))
+#define RECEIVE_LOCK()   ASSERT_PTHREAD(pthread_mutex_lock(&receive_lock))
+#define RECEIVE_UNLOCK() ASSERT_PTHREAD(pthread_mutex_unlock(&receive_lock))
+
+
+static uint64_t get_clock_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t) now.tv_sec * 1000000000U + (uint64_t) now.tv_nsec;
+}
+
+
+static bool lookup_group(struct sockaddr_in *address)
+{
+    memset(address, 0, sizeof(struct sockaddr_in));
+    address->sin_family = AF_INET;
+    address->sin_port = htons((in_port_t) group_port);
+    return TEST_OK_(inet_aton(group_name.s, &address->sin_addr),
+        "Invalid multicast address \"%s\"", group_name.s);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Sender. */
+
+static void send_datagram(
+    enum tune_datagram_type type, const struct tune_datagram_value values[3])
+{
+    struct tune_datagram datagram = {
+        .magic = TUNE_DATAGRAM_MAGIC,
+        .version = TUNE_DATAGRAM_VERSION,
+        .type = (uint16_t) type,
+        .length = sizeof(struct tune_datagram),
+    };
+    memcpy(datagram.values, values, sizeof(datagram.values));
+
+    SEND_LOCK();
+    if (send_socket >= 0)
+    {
+        datagram.sequence = sequence++;
+        datagram.timestamp = get_clock_ns(CLOCK_REALTIME);
+        datagram.monotonic = get_clock_ns(CLOCK_MONOTONIC);
+        ssize_t sent = sendto(send_socket, &datagram, sizeof(datagram),
+            MSG_DONTWAIT, (const struct sockaddr *) &group_address,
+            sizeof(group_address));
+        send_time = 1e-3 * (double)
+            (get_clock_ns(CLOCK_MONOTONIC) - datagram.monotonic);
+        if (sent == sizeof(datagram))
+            sent_count += 1;
+        else
+            send_errors += 1;
+    }
+    SEND_UNLOCK();
+}
+
+
+void multicast_tune_sweep(
+    const struct tune_datagram_value *selected,
+    const struct tune_datagram_value *basic,
+    const struct tune_datagram_value *peak)
+{
+    struct tune_datagram_value values[3] = { *selected, *basic, *peak };
+    send_datagram(TUNE_DATAGRAM_SWEEP, values);
+}
+
+
+void multicast_tune_follow(
+    bool tune_ok, double tune, double phase, bool dropout)
+{
+    struct tune_datagram_value values[3] = {
+        [0] = {
+            .tune = tune,
+            .phase = phase,
+            .status = tune_ok ? TUNE_OK : TUNE_INVALID,
+            .flags = dropout,
+        },
+    };
+    send_datagram(TUNE_DATAGRAM_FOLLOW, values);
+}
+
+
+static bool open_sender(void)
+{
+    unsigned char ttl = (unsigned char) multicast_ttl;
+    unsigned char loop = 1;     // Needed for the loopback receiver
+    int sock = -1;
+    bool ok =
+        lookup_group(&group_address)  &&
+        TEST_IO(sock = socket(AF_INET, SOCK_DGRAM, 0))  &&
+        TEST_IO(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL,
+            &ttl, sizeof(ttl)))  &&
+        TEST_IO(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP,
+            &loop, sizeof(loop)));
+    if (ok)
+        send_socket = sock;
+    else if (sock >= 0)
+        IGNORE(TEST_IO(close(sock)));
+    return ok;
+}
+
+
+/* Changes to the address, port or TTL take effect when sending is enabled. */
+static void set_send_enable(bool enable)
+{
+    SEND_LOCK();
+    if (send_socket >= 0)
+    {
+        IGNORE(TEST_IO(close(send_socket)));
+        send_socket = -1;
+    }
+    if (enable)
+        send_status = open_sender() ? MULTICAST_ON : MULTICAST_ERROR;
+    else
+        send_status = MULTICAST_OFF;
+    SEND_UNLOCK();
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Loopback receiver. */
+
+static void process_datagram(
+    const struct tune_datagram *datagram, size_t length, uint64_t now)
+{
+    RECEIVE_LOCK();
+    if (length != sizeof(struct tune_datagram)  ||
+        datagram->magic != TUNE_DATAGRAM_MAGIC  ||
+        datagram->version != TUNE_DATAGRAM_VERSION)
+        invalid_count += 1;
+    else
+    {
+        if (received_count > 0)
+            lost_count += datagram->sequence - last_sequence - 1;
+        last_sequence = datagram->sequence;
+        received_count += 1;
+
+        double latency = 1e-3 * (double) (now - datagram->monotonic);
+        total_latency += latency;
+        mean_latency = total_latency / received_count;
+        if (latency > max_latency)
+            max_latency = latency;
+
+        if (datagram->type == TUNE_DATAGRAM_SWEEP)
+            received_tune = datagram->values[0].tune;
+        else if (datagram->type == TUNE_DATAGRAM_FOLLOW)
+            received_follow = datagram->values[0].tune;
+    }
+    RECEIVE_UNLOCK();
+}
+
+
+static int open_receiver(void)
+{
+    struct sockaddr_in address;
+    struct ip_mreq request = {
+        .imr_interface.s_addr = htonl(INADDR_ANY) };
+    struct timeval timeout = { .tv_usec = RECEIVE_TIMEOUT_US };
+    int reuse = 1;
+    int sock = -1;
+    bool ok =
+        lookup_group(&address)  &&
+        DO(request.imr_multiaddr = address.sin_addr)  &&
+        DO(address.sin_addr.s_addr = htonl(INADDR_ANY))  &&
+        TEST_IO(sock = socket(AF_INET, SOCK_DGRAM, 0))  &&
+        TEST_IO(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+            &reuse, sizeof(reuse)))  &&
+        TEST_IO(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,
+            &timeout, sizeof(timeout)))  &&
+        TEST_IO(bind(sock,
+            (const struct sockaddr *) &address, sizeof(address)))  &&
+        TEST_IO(setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+            &request, sizeof(request)));
+    if (!ok  &&  sock >= 0)
+    {
+        IGNORE(TEST_IO(close(sock)));
+        sock = -1;
+    }
+    return sock;
+}
+
+
+static void run_receiver(int sock)
+{
+    while (receive_enable)
+    {
+        struct tune_datagram datagram;
+        ssize_t length = recv(sock, &datagram, sizeof(datagram), 0);
+        uint64_t now = get_clock_ns(CLOCK_MONOTONIC);
+        if (length >= 0)
+            process_datagram(&datagram, (size_t) length, now);
+        else if (errno != EAGAIN  &&  errno != EINTR)
+        {
+            TEST_IO(length);
+            receive_status = MULTICAST_ERROR;
+            break;
+        }
+    }
+}
+
+
+static void *receive_thread(void *context)
+{
+    while (true)
+    {
+        RECEIVE_LOCK();
+        while (!receive_enable)
+            ASSERT_PTHREAD(pthread_cond_wait(&receive_start, &receive_lock));
+        RECEIVE_UNLOCK();
+
+        int sock = open_receiver();
+        if (sock >= 0)
+        {
+            receive_status = MULTICAST_ON;
+            run_receiver(sock);
+            IGNORE(TEST_IO(close(sock)));
+            if (receive_status == MULTICAST_ON)
+                receive_status = MULTICAST_OFF;
+        }
+        else
+            receive_status = MULTICAST_ERROR;
+
+        /* On failure wait to be explicitly enabled again. */
+        if (receive_status == MULTICAST_ERROR)
+            receive_enable = false;
+    }
+    return NULL;
+}
+
+
+static void set_receive_enable(bool enable)
+{
+    RECEIVE_LOCK();
+    receive_enable = enable;
+    if (enable)
+        ASSERT_PTHREAD(pthread_cond_signal(&receive_start));
+    RECEIVE_UNLOCK();
+}
+
+
+static void reset_statistics(void)
+{
+    SEND_LOCK();
+    sent_count = 0;
+    send_errors = 0;
+    SEND_UNLOCK();
+
+    RECEIVE_LOCK();
+    received_count = 0;
+    lost_count = 0;
+    invalid_count = 0;
+    mean_latency = 0;
+    max_latency = 0;
+    total_latency = 0;
+    RECEIVE_UNLOCK();
+}
+
+
+bool initialise_tune_multicast(void)
+{
+    PUBLISH_WRITE_VAR_P(stringout, "TUNE:MCAST:ADDR", group_name);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:MCAST:PORT", group_port);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:MCAST:TTL", multicast_ttl);
+    PUBLISH_WRITER_P(bo, "TUNE:MCAST:ENABLE", set_send_enable);
+    PUBLISH_ACTION("TUNE:MCAST:RESET", reset_statistics);
+    PUBLISH_READ_VAR(mbbi, "TUNE:MCAST:STATUS", send_status);
+    PUBLISH_READ_VAR(ulongin, "TUNE:MCAST:SENT", sent_count);
+    PUBLISH_READ_VAR(ulongin, "TUNE:MCAST:ERRORS", send_errors);
+    PUBLISH_READ_VAR(ai, "TUNE:MCAST:SEND", send_time);
+
+    PUBLISH_WRITER_P(bo, "TUNE:MCAST:RX:ENABLE", set_receive_enable);
+    PUBLISH_READ_VAR(mbbi, "TUNE:MCAST:RX:STATUS", receive_status);
+    PUBLISH_READ_VAR(ulongin, "TUNE:MCAST:RX:COUNT", received_count);
+    PUBLISH_READ_VAR(ulongin, "TUNE:MCAST:RX:LOST", lost_count);
+    PUBLISH_READ_VAR(ulongin, "TUNE:MCAST:RX:INVALID", invalid_count);
+    PUBLISH_READ_VAR(ai, "TUNE:MCAST:RX:LATENCY", mean_latency);
+    PUBLISH_READ_VAR(ai, "TUNE:MCAST:RX:MAX", max_latency);
+    PUBLISH_READ_VAR(ai, "TUNE:MCAST:RX:TUNE", received_tune);
+    PUBLISH_READ_VAR(ai, "TUNE:MCAST:RX:FTUN", received_follow);
+
+    pthread_t thread_id;
+    return TEST_PTHREAD(
+        pthread_create(&thread_id, NULL, receive_thread, NULL));
+}
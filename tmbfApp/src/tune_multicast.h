@@ -0,0 +1,47 @@
+/* UDP multicast of tune results. */
+
+/* Datagram format.  Every datagram has the same fixed layout, with all fields
+ * in native (little endian) byte order and natural alignment.  The sequence
+ * number counts all datagrams sent, so gaps reveal lost datagrams.
+ *    Sweep datagrams carry the selected, basic and peak fit tune results in
+ * that order.  Tune follow datagrams carry the mean tune and phase from the
+ * last tune follow buffer in the first value, with bit 0 of flags set if the
+ * buffer dropped data. */
+#define TUNE_DATAGRAM_MAGIC     0x46424D54      // "TMBF"
+#define TUNE_DATAGRAM_VERSION   1
+
+enum tune_datagram_type {
+    TUNE_DATAGRAM_SWEEP = 1,
+    TUNE_DATAGRAM_FOLLOW = 2,
+};
+
+struct tune_datagram_value {
+    double tune;                // Fractional tune
+    double phase;               // Phase in degrees
+    uint32_t status;            // As for enum tune_status
+    uint32_t flags;
+};
+
+struct tune_datagram {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;              // enum tune_datagram_type
+    uint32_t sequence;
+    uint32_t length;            // Size of datagram in bytes
+    uint64_t timestamp;         // Real time at sending in ns since epoch
+    uint64_t monotonic;         // Monotonic time at sending in ns
+    struct tune_datagram_value values[3];
+};
+
+
+/* Called with each new set of sweep tune results. */
+void multicast_tune_sweep(
+    const struct tune_datagram_value *selected,
+    const struct tune_datagram_value *basic,
+    const struct tune_datagram_value *peak);
+
+/* Called with each tune follow update. */
+void multicast_tune_follow(
+    bool tune_ok, double tune, double phase, bool dropout);
+
+bool initialise_tune_multicast(void);
@@ -5,10 +5,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
 #include <time.h>
 #include <string.h>
 #include <complex.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "error.h"
 #include "epics_device.h"
@@ -18,6 +20,10 @@
 #include "tune_support.h"
 #include "tune.h"
 #include "timing.h"
+#include "derived.h"
+#include "peak_search.h"
+#include "scheduler.h"
+#include "tune_pyramid.h"
 
 #include "tune_peaks.h"
 
@@ -29,92 +35,6 @@ static double max_peak_width = 1;
 static double max_fit_error = 1;
 
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Peak detection and extraction. */
-
-/* Result of peak extraction is the index of the maximum D2 point for each peak
- * together with a span covering the peak. */
-struct raw_peak_data {
-    unsigned int ix;        // Index of discovered peak (for info only)
-    unsigned int left;      // Left and right boundaries of peak in smoothed
-    unsigned int right;     //  data indices.
-};
-
-
-/* Searches for point of highest downwards curvature not enclosed by a peak
- * already found.  Returns -1 if nothing left to find. */
-static bool find_peak_ix(
-    unsigned int length, const int dd[], bool peak_marks[],
-    unsigned int *peak_ix)
-{
-    int min_val = 0;
-    bool found = false;
-    for (unsigned int ix = 0; ix < length; ix ++)
-        if (!peak_marks[ix]  &&  dd[ix] < min_val)
-        {
-            *peak_ix = ix;
-            min_val = dd[ix];
-            found = true;
-        }
-    return found;
-}
-
-
-/* Given a point at the peak (as determined by DD) track away in both directions
- * from this peak so that we span the entire raised peak.  Because the detected
- * "peak" may be slightly off peak, we track up before tracking down.  Note that
- * this can result in overlapping peak ranges, but this shouldn't matter.  */
-static void find_peak_limits(
-    unsigned int length, const int power[], unsigned int peak_ix,
-    unsigned int *peak_left, unsigned int *peak_right)
-{
-    /* Track up and then down from the putative peak to both left and right. */
-    unsigned int left = peak_ix;
-    while (left > 0  &&  power[left - 1] >= power[left])
-        left -= 1;
-    while (left > 0  &&  power[left - 1] <= power[left])
-        left -= 1;
-
-    unsigned int right = peak_ix;
-    while (right < length - 1  &&  power[right + 1] >= power[right])
-        right += 1;
-    while (right < length - 1  &&  power[right + 1] <= power[right])
-        right += 1;
-
-    *peak_left = left;
-    *peak_right = right;
-}
-
-
-/* Walks through second derivative and extracts all peaks in descending order of
- * size.  Returns the number of peaks successfully extracted, all remaining
- * peaks are set to invalid values. */
-static unsigned int extract_peaks(
-    unsigned int length, unsigned int max_peaks,
-    const int power[], const int dd[],
-    bool peak_marks[], struct raw_peak_data peak_data[])
-{
-    unsigned int peak_ix = 0;
-    for (; peak_ix < max_peaks; peak_ix ++)
-    {
-        unsigned int max_ix = 0;
-        if (!find_peak_ix(length, dd, peak_marks, &max_ix))
-            break;
-
-        /* Discover the bounds of the peak and mark it off as seen. */
-        unsigned int left, right;
-        find_peak_limits(length, power, max_ix, &left, &right);
-        for (unsigned int i = left; i <= right; i ++)
-            peak_marks[i] = true;
-
-        peak_data[peak_ix] = (struct raw_peak_data) {
-            .ix = max_ix, .left = left, .right = right };
-    }
-
-    return peak_ix;
-}
-
-
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Peak digest.  Having extracted peaks by second derivative extraction we
  * publish information about each peak and perform some preliminary processing
@@ -131,13 +51,19 @@ static unsigned int extract_peaks(
 
 struct peak_info {
     unsigned int length;    // Length of waveform
-    unsigned int scaling;   // Scaling factor (4 or 16 or 64)
+    unsigned int scaling;   // Scaling factor (16 or 64)
 
     int *power;             // Smoothed power waveform
     int *power_dd;          // Second derivative of smoothed waveform
 
     unsigned int peak_count;    // Number of valid peaks found
 
+    /* The smoothed power is one level of the smoothing pyramid, which is
+     * computed for all levels together.  Both the smoothed power and the peak
+     * extraction are only computed when needed. */
+    struct derived_wf *power_derived;
+    struct derived_wf *peaks_derived;
+
     /* Waveforms for EPICS viewing. */
     int peak_ix_wf[MAX_PEAKS];      // Index of peak
     int peak_val_wf[MAX_PEAKS];     // Value at peak index
@@ -166,33 +92,80 @@ static void extract_peak_data(
 }
 
 
-/* Top level routine for peak processing.  Takes as input smoothed peak data and
- * from this computes the second derivatives and extracts low level peaks. */
-static void process_peak_info(struct peak_info *info)
+/* Smoothing pyramid.  Each level is decimated from the level before by the
+ * given factor, and peaks are searched for on the levels from FIRST_PEAK_LEVEL
+ * onwards.  The levels are defined in tune_pyramid.py together with the peak
+ * records, and the finest peak level must be no finer than MIN_PEAK_SCALING. */
+#define PEAK_LEVELS         (PYRAMID_LEVELS - FIRST_PEAK_LEVEL)
+#define MIN_PEAK_SCALING    16
+
+static const unsigned int pyramid_factors[PYRAMID_LEVELS] = PYRAMID_FACTORS;
+
+/* Power waveform from the current sweep, used as the source for smoothing. */
+static const int *sweep_power;
+static int *pyramid_power[PYRAMID_LEVELS];
+static struct derived_wf *pyramid_derived;
+
+/* Smoothing pyramid and peak levels for sweeps whose results aren't published,
+ * these are computed directly rather than through the derived waveforms. */
+static int *scratch_pyramid[PYRAMID_LEVELS];
+static struct peak_info scratch_levels[PEAK_LEVELS];
+
+/* Peak extraction storage, sized for the finest smoothing level. */
+static struct peak_candidate peak_candidates[
+    MAX_CANDIDATES(TUNE_LENGTH / MIN_PEAK_SCALING)];
+static struct peak_candidate peak_heap[MAX_PEAKS];
+static const struct peak_arena peak_arena = {
+    .max_length = TUNE_LENGTH / MIN_PEAK_SCALING,
+    .max_peaks = MAX_PEAKS,
+    .candidates = peak_candidates,
+    .heap = peak_heap,
+};
+
+
+/* Computes smoothed power for all smoothing levels in one pass. */
+static void smooth_peak_power(void *context)
+{
+    smooth_waveform_pyramid(TUNE_LENGTH, sweep_power,
+        PYRAMID_LEVELS, pyramid_factors, pyramid_power);
+}
+
+
+/* Takes as input smoothed peak data and from this computes the second
+ * derivatives and extracts low level peaks. */
+static void find_level_peaks(struct peak_info *info)
 {
     /* Compute second derivative of smoothed data for peak detection. */
     compute_dd(info->length, info->power, info->power_dd);
 
     /* Work through second derivative and extract all peaks. */
-    bool peak_marks[info->length];
-    memset(peak_marks, 0, sizeof(peak_marks));
     struct raw_peak_data peak_data[MAX_PEAKS];
     info->peak_count = extract_peaks(
         info->length, MAX_PEAKS, info->power, info->power_dd,
-        peak_marks, peak_data);
+        &peak_arena, peak_data);
 
     /* Convert peak data into presentation format. */
     extract_peak_data(peak_data, info);
 }
 
 
+/* Top level routine for peak processing of the published levels. */
+static void process_peak_info(void *context)
+{
+    struct peak_info *info = context;
+    require_derived_wf(info->power_derived);
+    find_level_peaks(info);
+}
+
+
 /* EPICS interface for the peak processing stage. */
-static void publish_peak_info(struct peak_info *info, unsigned int ratio)
+static void publish_peak_info(
+    struct peak_info *info, unsigned int ratio, int *power)
 {
     unsigned int length = TUNE_LENGTH / ratio;
     info->scaling = ratio;
     info->length = length;
-    info->power = malloc(length * sizeof(int));
+    info->power = power;
     info->power_dd = malloc(length * sizeof(int));
 
     char buffer[20];
@@ -204,10 +177,194 @@ static void publish_peak_info(struct peak_info *info, unsigned int ratio)
     PUBLISH_WF_READ_VAR(int, FORMAT("V"), MAX_PEAKS, info->peak_val_wf);
     PUBLISH_WF_READ_VAR(int, FORMAT("L"), MAX_PEAKS, info->peak_left_wf);
     PUBLISH_WF_READ_VAR(int, FORMAT("R"), MAX_PEAKS, info->peak_right_wf);
+
+    /* All levels share the one pyramid computation. */
+    if (pyramid_derived)
+        add_derived_record(pyramid_derived, FORMAT("POWER"));
+    else
+        pyramid_derived =
+            register_derived_wf(FORMAT("POWER"), smooth_peak_power, NULL);
+    info->power_derived = pyramid_derived;
+    info->peaks_derived =
+        register_derived_wf(FORMAT("PDD"), process_peak_info, info);
+    add_derived_record(info->peaks_derived, FORMAT("IX"));
+    add_derived_record(info->peaks_derived, FORMAT("V"));
+    add_derived_record(info->peaks_derived, FORMAT("L"));
+    add_derived_record(info->peaks_derived, FORMAT("R"));
 #undef FORMAT
 }
 
 
+static bool publish_pyramid(struct peak_info peak_levels[])
+{
+    bool ok = true;
+    unsigned int ratio = 1;
+    for (unsigned int level = 0; ok  &&  level < PYRAMID_LEVELS; level ++)
+    {
+        ratio *= pyramid_factors[level];
+        unsigned int length = TUNE_LENGTH / ratio;
+        pyramid_power[level] = malloc(length * sizeof(int));
+        scratch_pyramid[level] = malloc(length * sizeof(int));
+        if (level >= FIRST_PEAK_LEVEL)
+        {
+            ok = TEST_OK_(ratio >= MIN_PEAK_SCALING,
+                "Peak smoothing level /%u too fine", ratio);
+            publish_peak_info(&peak_levels[level - FIRST_PEAK_LEVEL],
+                ratio, pyramid_power[level]);
+            scratch_levels[level - FIRST_PEAK_LEVEL] = (struct peak_info) {
+                .length = length,
+                .scaling = ratio,
+                .power = scratch_pyramid[level],
+                .power_dd = malloc(length * sizeof(int)),
+            };
+        }
+    }
+    return ok;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Peak extraction benchmark.  The reference and single pass extractions are
+ * timed on a synthetic power waveform with many peaks over a range of lengths,
+ * both for the usual number of peaks and for a much larger number. */
+
+#define BENCHMARK_REPEAT    10
+#define BENCHMARK_PEAKS     32      // Large peak count for scaling
+#define BENCHMARK_LENGTHS   4
+
+static const int benchmark_lengths[BENCHMARK_LENGTHS] = {
+    256, 1024, 4096, 16384 };
+#define MAX_BENCHMARK_LENGTH    16384
+
+static struct epics_interlock *benchmark_trigger;
+static double reference_duration[BENCHMARK_LENGTHS];     // Times in us
+static double fast_duration[BENCHMARK_LENGTHS];
+static double reference_duration_k[BENCHMARK_LENGTHS];
+static double fast_duration_k[BENCHMARK_LENGTHS];
+static unsigned int benchmark_difference;  // Number of mismatched peaks
+
+
+/* Lorentzian peaks at random positions with a little noise. */
+static void make_benchmark_power(unsigned int length, int power[])
+{
+    unsigned int seed = 1;
+    for (unsigned int i = 0; i < length; i ++)
+        power[i] = rand_r(&seed) % 1000;
+    for (unsigned int peak = 0; peak < 2 * BENCHMARK_PEAKS; peak ++)
+    {
+        double centre = (double) length * rand_r(&seed) / RAND_MAX;
+        double width = 0.002 * length * (1 + rand_r(&seed) % 4);
+        double height = 1e5 * (1 + rand_r(&seed) % 100);
+        for (unsigned int i = 0; i < length; i ++)
+        {
+            double x = (i - centre) / width;
+            power[i] += (int) (height / (1 + x * x));
+        }
+    }
+}
+
+
+static unsigned int compare_peaks(
+    unsigned int count_a, const struct raw_peak_data a[],
+    unsigned int count_b, const struct raw_peak_data b[])
+{
+    unsigned int count = count_a < count_b ? count_a : count_b;
+    unsigned int difference = count_a + count_b - 2 * count;
+    for (unsigned int i = 0; i < count; i ++)
+        if (a[i].ix != b[i].ix  ||
+            a[i].left != b[i].left  ||  a[i].right != b[i].right)
+            difference += 1;
+    return difference;
+}
+
+
+/* Times both extractions, returns the number of mismatched peaks. */
+static unsigned int benchmark_extraction(
+    unsigned int length, unsigned int max_peaks,
+    const int power[], const int dd[],
+    bool peak_marks[], const struct peak_arena *arena,
+    double *reference_time, double *fast_time)
+{
+    struct raw_peak_data reference[BENCHMARK_PEAKS];
+    struct raw_peak_data fast[BENCHMARK_PEAKS];
+    unsigned int reference_count = 0, fast_count = 0;
+    {
+        TIC();
+        for (int n = 0; n < BENCHMARK_REPEAT; n ++)
+        {
+            memset(peak_marks, 0, length * sizeof(bool));
+            reference_count = reference_extract_peaks(
+                length, max_peaks, power, dd, peak_marks, reference);
+        }
+        *reference_time = 1e6 * TOC() / BENCHMARK_REPEAT;
+    }
+    {
+        TIC();
+        for (int n = 0; n < BENCHMARK_REPEAT; n ++)
+            fast_count = extract_peaks(
+                length, max_peaks, power, dd, arena, fast);
+        *fast_time = 1e6 * TOC() / BENCHMARK_REPEAT;
+    }
+    return compare_peaks(reference_count, reference, fast_count, fast);
+}
+
+
+static void run_benchmark(void)
+{
+    int *power = malloc(MAX_BENCHMARK_LENGTH * sizeof(int));
+    int *dd = malloc(MAX_BENCHMARK_LENGTH * sizeof(int));
+    bool *peak_marks = malloc(MAX_BENCHMARK_LENGTH * sizeof(bool));
+    struct peak_arena arena = {
+        .max_length = MAX_BENCHMARK_LENGTH,
+        .max_peaks = BENCHMARK_PEAKS,
+        .candidates = malloc(
+            MAX_CANDIDATES(MAX_BENCHMARK_LENGTH) *
+            sizeof(struct peak_candidate)),
+        .heap = malloc(BENCHMARK_PEAKS * sizeof(struct peak_candidate)),
+    };
+
+    interlock_wait(benchmark_trigger);
+    benchmark_difference = 0;
+    for (unsigned int i = 0; i < BENCHMARK_LENGTHS; i ++)
+    {
+        unsigned int length = (unsigned int) benchmark_lengths[i];
+        make_benchmark_power(length, power);
+        compute_dd(length, power, dd);
+        benchmark_difference += benchmark_extraction(
+            length, MAX_PEAKS, power, dd, peak_marks, &arena,
+            &reference_duration[i], &fast_duration[i]);
+        benchmark_difference += benchmark_extraction(
+            length, BENCHMARK_PEAKS, power, dd, peak_marks, &arena,
+            &reference_duration_k[i], &fast_duration_k[i]);
+    }
+    interlock_signal(benchmark_trigger, NULL);
+
+    free(power);
+    free(dd);
+    free(peak_marks);
+    free(arena.candidates);
+    free(arena.heap);
+}
+
+
+static void publish_benchmark(void)
+{
+    PUBLISH_ACTION("PEAK:BENCH", run_benchmark);
+    PUBLISH_WF_READ_VAR(int, "PEAK:BENCH:LENGTH",
+        BENCHMARK_LENGTHS, benchmark_lengths);
+    PUBLISH_WF_READ_VAR(double, "PEAK:BENCH:REF",
+        BENCHMARK_LENGTHS, reference_duration);
+    PUBLISH_WF_READ_VAR(double, "PEAK:BENCH:FAST",
+        BENCHMARK_LENGTHS, fast_duration);
+    PUBLISH_WF_READ_VAR(double, "PEAK:BENCH:REFK",
+        BENCHMARK_LENGTHS, reference_duration_k);
+    PUBLISH_WF_READ_VAR(double, "PEAK:BENCH:FASTK",
+        BENCHMARK_LENGTHS, fast_duration_k);
+    PUBLISH_READ_VAR(ulongin, "PEAK:BENCH:DIFF", benchmark_difference);
+    benchmark_trigger = create_interlock("PEAK:BENCH", false);
+}
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Peak fitting results. */
@@ -490,20 +647,160 @@ static void discard_small_peaks(struct peak_fit_result *peak_fit)
 }
 
 
-/* Extract final good peak fit from fitted results in ascending order of centre
- * frequency.  For the tiny number of peaks insertion sort is good. */
+/* Extract final good peak fit and its fit errors from fitted results in
+ * ascending order of centre frequency.  For the tiny number of peaks insertion
+ * sort is good. */
 static unsigned int extract_final_fits(
-    const struct peak_fit_result *peak_fit, struct one_pole *restrict fits)
+    const struct peak_fit_result *peak_fit,
+    struct one_pole *restrict fits, double errors[])
 {
     unsigned int sorted_index[MAX_PEAKS];
     unsigned int peak_count = sort_fits_by_key(
         peak_fit, sorted_index, peak_centre, true);
     extract_sorted_fits(peak_count, peak_fit, sorted_index, fits);
+    for (unsigned int i = 0; i < peak_count; i ++)
+        errors[i] = peak_fit->errors[sorted_index[i]];
     return peak_count;
 }
 
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Optional joint refinement of the final fits.  The peak at a time fits above
+ * are biased where peaks overlap, so here all the final poles and a background
+ * term are refined together over the union of the fitted ranges, starting from
+ * the existing fits.  The refined fits are only used if all the peaks remain
+ * sensible and in the same order. */
+
+enum {
+    JOINT_OFF, JOINT_CONVERGED, JOINT_ITERATIONS, JOINT_REJECTED, JOINT_FAILED
+};
+
+static bool joint_fit_enable;
+static unsigned int joint_max_iterations = 10;
+
+struct joint_result {
+    unsigned int status;
+    unsigned int iterations;
+    double duration;            // Refinement time in ms
+    double initial_error;       // Relative residual before refinement
+    double final_error;         // Relative residual after refinement
+    double improvement;         // Residual reduction in dB
+    double background;          // Magnitude of fitted background
+};
+
+
+/* Checks that every refined peak has positive width, has its centre within the
+ * fitted range, and that the peaks are still in ascending order. */
+static bool check_joint_fits(
+    const double tune_scale[], const struct peak_range *range,
+    unsigned int peak_count, const struct one_pole fits[])
+{
+    double low  = tune_scale[range->left];
+    double high = tune_scale[range->right];
+    if (low > high)
+    {
+        double t = low;
+        low = high;
+        high = t;
+    }
+
+    for (unsigned int i = 0; i < peak_count; i ++)
+    {
+        double centre = peak_centre(&fits[i]);
+        if (!(peak_width(&fits[i]) > 0)  ||  centre < low  ||  centre > high)
+            return false;
+        if (i > 0  &&  centre <= peak_centre(&fits[i - 1]))
+            return false;
+    }
+    return true;
+}
+
+
+static unsigned int refine_final_fits(
+    const struct channel_sweep *sweep, const double tune_scale[],
+    const struct peak_fit_result *peak_fit,
+    unsigned int peak_count, struct one_pole fits[],
+    struct joint_result *joint)
+{
+    /* Fit over the union of the ranges of all the good peaks. */
+    struct peak_range range = { .left = UINT_MAX, .right = 0 };
+    for (unsigned int i = 0; i < MAX_PEAKS; i ++)
+        if (peak_fit->status[i] == PEAK_GOOD)
+        {
+            if (peak_fit->ranges[i].left < range.left)
+                range.left = peak_fit->ranges[i].left;
+            if (peak_fit->ranges[i].right > range.right)
+                range.right = peak_fit->ranges[i].right;
+        }
+
+    struct one_pole refined[MAX_PEAKS];
+    memcpy(refined, fits, sizeof(refined));
+    double complex background = 0;
+    struct joint_fit_stats stats;
+    enum joint_fit_status status = refine_joint_fit(
+        peak_count, &range, tune_scale, sweep->wf_i, sweep->wf_q,
+        joint_max_iterations, refined, &background, &stats);
+
+    joint->iterations = stats.iterations;
+    joint->initial_error = stats.initial_error;
+    joint->final_error = stats.final_error;
+    joint->background = cabs(background);
+    if (status == JOINT_FIT_FAILED)
+        return JOINT_FAILED;
+    else if (!check_joint_fits(tune_scale, &range, peak_count, refined))
+        return JOINT_REJECTED;
+    else
+    {
+        memcpy(fits, refined, sizeof(refined));
+        joint->improvement = 10 * log10(
+            stats.initial_error / stats.final_error);
+        return status == JOINT_FIT_CONVERGED ?
+            JOINT_CONVERGED : JOINT_ITERATIONS;
+    }
+}
+
+
+static void process_joint_fit(
+    const struct channel_sweep *sweep, const double tune_scale[],
+    const struct peak_fit_result *peak_fit,
+    unsigned int peak_count, struct one_pole fits[],
+    struct joint_result *joint)
+{
+    joint->iterations = 0;
+    joint->duration = 0;
+    joint->initial_error = NAN;
+    joint->final_error = NAN;
+    joint->improvement = 0;
+    joint->background = NAN;
+    if (!joint_fit_enable  ||  peak_count == 0)
+        joint->status = JOINT_OFF;
+    else
+    {
+        TIC();
+        joint->status = refine_final_fits(
+            sweep, tune_scale, peak_fit, peak_count, fits, joint);
+        joint->duration = 1e3 * TOC();
+    }
+}
+
+
+static void publish_joint_fit(struct joint_result *joint)
+{
+    PUBLISH_WRITE_VAR_P(bo, "PEAK:LM:ENABLE", joint_fit_enable);
+    PUBLISH_WRITE_VAR_P(ulongout, "PEAK:LM:MAXITER", joint_max_iterations);
+
+    PUBLISH_READ_VAR(mbbi, "PEAK:LM:STATUS", joint->status);
+    PUBLISH_READ_VAR(ulongin, "PEAK:LM:ITER", joint->iterations);
+    PUBLISH_READ_VAR(ai, "PEAK:LM:DURATION", joint->duration);
+    PUBLISH_READ_VAR(ai, "PEAK:LM:BEFORE", joint->initial_error);
+    PUBLISH_READ_VAR(ai, "PEAK:LM:AFTER", joint->final_error);
+    PUBLISH_READ_VAR(ai, "PEAK:LM:IMPROVE", joint->improvement);
+    PUBLISH_READ_VAR(ai, "PEAK:LM:BACKGROUND", joint->background);
+}
+
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Published results from final fitting and evaluation stage. */
 
@@ -525,20 +822,41 @@ struct peak_result_relative {
     double rel_height;
 };
 
-static unsigned fitted_peak_count;
+/* All the results of one peak measurement.  Only sweeps which update the main
+ * tune results are measured into the published results, other sweeps are
+ * measured into a scratch copy. */
+struct peak_results {
+    unsigned int fitted_peak_count;
+
+    struct peak_fit_result first_fit;
+    struct peak_fit_result second_fit;
+    struct joint_result joint;
+
+    /* Results are published for the central tune resonance and the two
+     * immediate synchrotron sidebands, if they are detected. */
+    struct peak_result left_peak;
+    struct peak_result centre_peak;
+    struct peak_result right_peak;
+    struct peak_result_relative left_peak_relative;
+    struct peak_result_relative right_peak_relative;
+    double synchrotron_tune;
+
+    /* Fit quality over the whole sweep. */
+    double snr;             // Tune peak power over residual in dB
+    double residual;        // Relative residual of complete model
+    double fit_error;       // Relative fit error of the tune peak
+};
 
-static struct peak_fit_result first_fit  = INITIALISE_PEAK_FIT_RESULT;
-static struct peak_fit_result second_fit = INITIALISE_PEAK_FIT_RESULT;
+#define INITIALISE_PEAK_RESULTS { \
+    .first_fit  = INITIALISE_PEAK_FIT_RESULT, \
+    .second_fit = INITIALISE_PEAK_FIT_RESULT, \
+}
 
+static struct peak_results published_results = INITIALISE_PEAK_RESULTS;
+static struct peak_results scratch_results = INITIALISE_PEAK_RESULTS;
 
-/* Results are published for the central tune resonance and the two immediate
- * synchrotron sidebands, if they are detected. */
-static struct peak_result left_peak;
-static struct peak_result centre_peak;
-static struct peak_result right_peak;
-static struct peak_result_relative left_peak_relative;
-static struct peak_result_relative right_peak_relative;
-static double synchrotron_tune;
+/* Summary of the last fit for read_peak_summary(). */
+static struct peak_summary peak_summary;
 
 
 /* Computes tune properties (centre frequency, phase, area, width) from an
@@ -577,13 +895,14 @@ static double wrap_angle(double angle)
 }
 
 static void update_peak_result_relative(
-    const struct peak_result *absolute, struct peak_result_relative *result)
+    const struct peak_result *absolute, const struct peak_result *centre,
+    struct peak_result_relative *result)
 {
-    result->delta_tune  = fabs(absolute->tune - centre_peak.tune);
-    result->delta_phase = wrap_angle(absolute->phase - centre_peak.phase);
-    result->rel_area    = absolute->area / centre_peak.area;
-    result->rel_width   = absolute->width / centre_peak.width;
-    result->rel_height  = absolute->height / centre_peak.height;
+    result->delta_tune  = fabs(absolute->tune - centre->tune);
+    result->delta_phase = wrap_angle(absolute->phase - centre->phase);
+    result->rel_area    = absolute->area / centre->area;
+    result->rel_width   = absolute->width / centre->width;
+    result->rel_height  = absolute->height / centre->height;
 }
 
 
@@ -635,21 +954,26 @@ static void identify_three_peaks(
 
 /* Extract the tune and its sidebands as sensible published results. */
 static unsigned int extract_peak_tune(
+    struct peak_results *results,
     unsigned int peak_count, const struct one_pole fits[],
-    double *tune, double *phase)
+    const double errors[], double *tune, double *phase)
 {
     const struct one_pole *left, *centre, *right;
     identify_three_peaks(peak_count, fits, &left, &centre, &right);
-
-    update_peak_result(&left_peak,   left);
-    update_peak_result(&centre_peak, centre);
-    update_peak_result(&right_peak,  right);
-    update_peak_result_relative(&left_peak,  &left_peak_relative);
-    update_peak_result_relative(&right_peak, &right_peak_relative);
+    results->fit_error = centre ? errors[centre - fits] : NAN;
+
+    update_peak_result(&results->left_peak,   left);
+    update_peak_result(&results->centre_peak, centre);
+    update_peak_result(&results->right_peak,  right);
+    update_peak_result_relative(&results->left_peak,
+        &results->centre_peak, &results->left_peak_relative);
+    update_peak_result_relative(&results->right_peak,
+        &results->centre_peak, &results->right_peak_relative);
     /* Estimate synchrotron tune from the average of the two tune sidebands, but
      * only if both sidebands are present. */
-    synchrotron_tune = 0.5 * (
-        left_peak_relative.delta_tune + right_peak_relative.delta_tune);
+    results->synchrotron_tune = 0.5 * (
+        results->left_peak_relative.delta_tune +
+        results->right_peak_relative.delta_tune);
 
     if (centre == NULL)
     {
@@ -659,7 +983,7 @@ static unsigned int extract_peak_tune(
     }
     else
     {
-        *tune = centre_peak.tune;
+        *tune = results->centre_peak.tune;
         /* For the reported phase use the entire model to compute this to give
          * us a slightly more realistic measurement. */
         *phase = 180 / M_PI *
@@ -669,32 +993,296 @@ static unsigned int extract_peak_tune(
 }
 
 
+/* Assesses the final model against the complete sweep.  The residual after
+ * subtracting the model is treated as noise: the SNR is the power at the
+ * centre of the tune peak relative to the mean residual power, and the overall
+ * residual is computed in the same way as for a single peak fit. */
+static void assess_peak_model(
+    struct peak_results *results, unsigned int length,
+    const struct channel_sweep *sweep, const double tune_scale[],
+    unsigned int peak_count, const struct one_pole fits[])
+{
+    double residual = 0;
+    double total = 0;
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        double complex iq = sweep->wf_i[i] + I * sweep->wf_q[i];
+        double complex model =
+            eval_one_pole_model(peak_count, fits, tune_scale[i]);
+        residual += cabs2(iq - model);
+        total += cabs2(iq);
+    }
+
+    results->residual = total > 0 ? residual / total : NAN;
+    if (results->centre_peak.valid  &&  residual > 0)
+        results->snr = 10 * log10(
+            results->centre_peak.height * length / residual);
+    else
+        results->snr = NAN;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Fitting kernel benchmark.  The last sweep is recorded together with its
+ * initial peak ranges so that the alternative fitting kernels can be timed and
+ * compared with the double precision reference on real data.  The worst tune
+ * error seen is accumulated over all benchmark runs until reset. */
+
+#define FIT_KERNEL_COUNT    3       // Double, float, fixed in that order
+
+struct fit_benchmark {
+    double duration;        // Time for both fitting passes in ms
+    double speedup;         // Reference time over this time
+    double error;           // Largest tune error on this run
+    double worst;           // Largest tune error since reset
+    unsigned int mismatch;  // Runs where the number of fits differed
+};
+
+struct fit_record {
+    struct channel_sweep sweep;
+    double scale[TUNE_LENGTH];
+    struct peak_range ranges[MAX_PEAKS];
+    unsigned int peak_count;
+};
+
+static pthread_mutex_t fit_record_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool fit_recorded;
+static struct fit_record fit_record;
+
+static struct epics_interlock *fit_benchmark_trigger;
+static struct fit_benchmark fit_benchmarks[FIT_KERNEL_COUNT];
+static unsigned int fit_benchmark_runs;
+
+
+static void record_fit_sweep(
+    const struct channel_sweep *sweep, const double tune_scale[],
+    const struct peak_fit_result *peak_fit)
+{
+    ASSERT_PTHREAD(pthread_mutex_lock(&fit_record_lock));
+    fit_record.sweep = *sweep;
+    memcpy(fit_record.scale, tune_scale, sizeof(fit_record.scale));
+    memcpy(fit_record.ranges, peak_fit->ranges, sizeof(fit_record.ranges));
+    fit_record.peak_count = peak_fit->peak_count;
+    fit_recorded = true;
+    ASSERT_PTHREAD(pthread_mutex_unlock(&fit_record_lock));
+}
+
+
+/* Runs both fitting passes as done by process_peak_tune(), returns the number
+ * of fits and the time taken in ms. */
+static unsigned int time_fit_kernel(
+    enum fit_kernel kernel, const struct fit_record *record,
+    struct one_pole fits[], double *duration)
+{
+    const struct channel_sweep *sweep = &record->sweep;
+    double errors[MAX_PEAKS];
+    unsigned int count = 0;
+    TIC();
+    for (int n = 0; n < BENCHMARK_REPEAT; n ++)
+    {
+        count = fit_multiple_peaks_kernel(kernel,
+            record->peak_count, false, record->scale,
+            sweep->wf_i, sweep->wf_q, record->ranges, fits, errors);
+        count = fit_multiple_peaks_kernel(kernel,
+            count, true, record->scale,
+            sweep->wf_i, sweep->wf_q, record->ranges, fits, errors);
+    }
+    *duration = 1e3 * TOC() / BENCHMARK_REPEAT;
+    return count;
+}
+
+
+static void run_fit_benchmark(void)
+{
+    static const enum fit_kernel kernels[FIT_KERNEL_COUNT] = {
+        FIT_KERNEL_DOUBLE, FIT_KERNEL_FLOAT, FIT_KERNEL_FIXED };
+
+    /* Take a copy of the record so that the sweep is not held up. */
+    struct fit_record *record = malloc(sizeof(struct fit_record));
+    ASSERT_PTHREAD(pthread_mutex_lock(&fit_record_lock));
+    bool recorded = fit_recorded;
+    *record = fit_record;
+    ASSERT_PTHREAD(pthread_mutex_unlock(&fit_record_lock));
+    if (!recorded)
+    {
+        free(record);
+        return;
+    }
+
+    interlock_wait(fit_benchmark_trigger);
+    struct one_pole reference[MAX_PEAKS];
+    unsigned int reference_count = 0;
+    for (unsigned int k = 0; k < FIT_KERNEL_COUNT; k ++)
+    {
+        struct fit_benchmark *benchmark = &fit_benchmarks[k];
+        struct one_pole fits[MAX_PEAKS];
+        unsigned int count = time_fit_kernel(
+            kernels[k], record, fits, &benchmark->duration);
+        if (k == 0)
+        {
+            memcpy(reference, fits, sizeof(reference));
+            reference_count = count;
+        }
+
+        benchmark->speedup = fit_benchmarks[0].duration / benchmark->duration;
+        benchmark->error = 0;
+        if (count != reference_count)
+            benchmark->mismatch += 1;
+        for (unsigned int i = 0; i < count  &&  i < reference_count; i ++)
+        {
+            double error =
+                fabs(peak_centre(&fits[i]) - peak_centre(&reference[i]));
+            if (error > benchmark->error)
+                benchmark->error = error;
+        }
+        if (benchmark->error > benchmark->worst)
+            benchmark->worst = benchmark->error;
+    }
+    fit_benchmark_runs += 1;
+    interlock_signal(fit_benchmark_trigger, NULL);
+
+    free(record);
+}
+
+
+static void reset_fit_benchmark(void)
+{
+    interlock_wait(fit_benchmark_trigger);
+    memset(fit_benchmarks, 0, sizeof(fit_benchmarks));
+    fit_benchmark_runs = 0;
+    interlock_signal(fit_benchmark_trigger, NULL);
+}
+
+
+static void write_fit_kernel(unsigned int kernel)
+{
+    set_fit_kernel((enum fit_kernel) kernel);
+}
+
+
+static void publish_fit_benchmark(void)
+{
+    static const char *names[FIT_KERNEL_COUNT] = { "DOUBLE", "FLOAT", "FIXED" };
+
+    PUBLISH_WRITER_P(mbbo, "PEAK:FIT:KERNEL", write_fit_kernel);
+    PUBLISH_ACTION("PEAK:FIT:BENCH", run_fit_benchmark);
+    PUBLISH_ACTION("PEAK:FIT:RESET", reset_fit_benchmark);
+    PUBLISH_READ_VAR(ulongin, "PEAK:FIT:RUNS", fit_benchmark_runs);
+    for (unsigned int k = 0; k < FIT_KERNEL_COUNT; k ++)
+    {
+        struct fit_benchmark *benchmark = &fit_benchmarks[k];
+        char buffer[40];
+#define FORMAT(field) \
+    (sprintf(buffer, "PEAK:FIT:%s:%s", names[k], field), buffer)
+        PUBLISH_READ_VAR(ai, FORMAT("TIME"), benchmark->duration);
+        PUBLISH_READ_VAR(ai, FORMAT("SPEEDUP"), benchmark->speedup);
+        PUBLISH_READ_VAR(ai, FORMAT("ERROR"), benchmark->error);
+        PUBLISH_READ_VAR(ai, FORMAT("WORST"), benchmark->worst);
+        PUBLISH_READ_VAR(ulongin, FORMAT("MISMATCH"), benchmark->mismatch);
+#undef FORMAT
+    }
+    fit_benchmark_trigger = create_interlock("PEAK:FIT", false);
+}
+
+
+/* State carried from one sweep to the next, kept separately for each sweep
+ * state.  The seed for tracking and automatic level selection is the final fits
+ * from the last sweep, if it had a good tune. */
+struct peak_state {
+    bool seed_valid;
+    unsigned int seed_count;
+    struct one_pole seed[MAX_PEAKS];
+    double seed_tune;
+};
+
+static struct peak_state peak_states[SWEEP_STATES];
+
+/* State and destination for the current measurement, set by
+ * select_peak_state(). */
+static struct peak_state *current_state = &peak_states[0];
+static bool publish_results = true;
+
+
+/* Final peaks in ascending order of frequency. */
+struct final_fits {
+    unsigned int peak_count;
+    struct one_pole fits[MAX_PEAKS];
+    double errors[MAX_PEAKS];
+};
+
+
+/* Extracts the final peaks from the refined fits in second_fit and computes
+ * the three peaks and the associated tune from them. */
+static unsigned int extract_final_tune(
+    struct peak_results *results, struct final_fits *final,
+    double *tune, double *phase)
+{
+    /* Discard all but the three largest peaks. */
+    discard_small_peaks(&results->second_fit);
+
+    final->peak_count = extract_final_fits(
+        &results->second_fit, final->fits, final->errors);
+    results->fitted_peak_count = final->peak_count;
+    return extract_peak_tune(results,
+        final->peak_count, final->fits, final->errors, tune, phase);
+}
+
+
+/* Completes peak processing from the final peaks once the result has been
+ * accepted.  If joint refinement is run the tune is computed again from the
+ * refined fits. */
+static void finish_peak_tune(
+    struct peak_results *results, unsigned int length,
+    const struct channel_sweep *sweep, const double tune_scale[],
+    struct final_fits *final, unsigned int *status, double *tune, double *phase)
+{
+    process_joint_fit(sweep, tune_scale,
+        &results->second_fit, final->peak_count, final->fits, &results->joint);
+    if (results->joint.status != JOINT_OFF)
+        *status = extract_peak_tune(results,
+            final->peak_count, final->fits, final->errors, tune, phase);
+    assess_peak_model(
+        results, length, sweep, tune_scale, final->peak_count, final->fits);
+
+    /* Remember a good result as the seed for the next sweep. */
+    struct peak_state *state = current_state;
+    state->seed_valid = *status == TUNE_OK;
+    if (state->seed_valid)
+    {
+        state->seed_count = final->peak_count;
+        memcpy(state->seed, final->fits, sizeof(state->seed));
+        state->seed_tune = *tune;
+    }
+}
+
+
 /* Top level control of peak fitting and tune extraction.  Takes as given a list
  * of candidate peaks, and the quality of the rest of the result depends on the
  * quality of this initial list. */
 static void process_peak_tune(
-    unsigned int length,
+    struct peak_results *results, unsigned int length,
     const struct channel_sweep *sweep, const double tune_scale[],
     const struct peak_info *info,
     unsigned int *status, double *tune, double *phase)
 {
-    /* Perform initial fit on raw peak ranges. */
-    extract_peak_ranges(length, info, &first_fit);
-    fit_peaks(sweep, tune_scale, &first_fit, false);
+    struct peak_fit_result *first_fit = &results->first_fit;
+    struct peak_fit_result *second_fit = &results->second_fit;
 
-    /* Refine the fit. */
-    extract_good_peaks(length, tune_scale, &first_fit, &second_fit);
-    fit_peaks(sweep, tune_scale, &second_fit, true);
-
-    /* Discard all but the three largest peaks. */
-    discard_small_peaks(&second_fit);
+    /* Perform initial fit on raw peak ranges.  Only published sweeps are
+     * recorded for the fitting benchmark. */
+    extract_peak_ranges(length, info, first_fit);
+    if (publish_results)
+        record_fit_sweep(sweep, tune_scale, first_fit);
+    fit_peaks(sweep, tune_scale, first_fit, false);
 
-    /* Extract the final peaks in ascending order of frequency. */
-    struct one_pole final_fits[MAX_PEAKS];
-    fitted_peak_count = extract_final_fits(&second_fit, final_fits);
+    /* Refine the fit. */
+    extract_good_peaks(length, tune_scale, first_fit, second_fit);
+    fit_peaks(sweep, tune_scale, second_fit, true);
 
-    /* Finally compute the three peaks and the associated tune. */
-    *status = extract_peak_tune(fitted_peak_count, final_fits, tune, phase);
+    struct final_fits final;
+    *status = extract_final_tune(results, &final, tune, phase);
+    finish_peak_tune(
+        results, length, sweep, tune_scale, &final, status, tune, phase);
 }
 
 
@@ -735,48 +1323,321 @@ static void publish_peak_result_relative(
 static struct epics_interlock *peak_trigger;
 static double process_duration;
 
-static int peak_power_4[TUNE_LENGTH / 4];
-static struct peak_info peak_info_16;
-static struct peak_info peak_info_64;
+static struct peak_info peak_levels[PEAK_LEVELS];
 
-enum { PEAK_16, PEAK_64 };
+/* Peak levels are selected by index from finest to coarsest, or automatically
+ * by selecting one more than the last level. */
+#define PEAK_AUTO   PEAK_LEVELS
 static unsigned int peak_select;
 
+/* Automatic level selection.  The width of each peak of the last good result
+ * is converted into sweep points using the sweep spacing around the peak, as
+ * the spacing need not be uniform, and the coarsest level over which the
+ * narrowest peak spans at least auto_points smoothed points is used.  The
+ * finest level is used until peak widths are known. */
+static unsigned int auto_points = 4;
+static double expected_width;           // Peak full width in sweep points
+static unsigned int selected_scaling;   // Scaling of level last searched
+
+
+/* Returns the tune step per sweep point around the given index. */
+static double local_spacing(
+    unsigned int length, const double tune_scale[], unsigned int ix)
+{
+    unsigned int left = ix > 0 ? ix - 1 : ix;
+    unsigned int right = ix + 1 < length ? ix + 1 : ix;
+    if (right > left)
+        return fabs(tune_scale[right] - tune_scale[left]) / (right - left);
+    else
+        return 0;
+}
+
+
+static unsigned int select_auto_level(
+    unsigned int length, const double tune_scale[])
+{
+    const struct peak_state *state = current_state;
+    double width = 0;
+    if (state->seed_valid)
+    {
+        for (unsigned int i = 0; i < state->seed_count; i ++)
+        {
+            const struct one_pole *fit = &state->seed[i];
+            unsigned int ix =
+                tune_to_index(length, tune_scale, peak_centre(fit));
+            double spacing = local_spacing(length, tune_scale, ix);
+            if (spacing > 0)
+            {
+                double points = 2 * peak_width(fit) / spacing;
+                if (width == 0  ||  points < width)
+                    width = points;
+            }
+        }
+    }
+    if (publish_results)
+        expected_width = width;
+
+    unsigned int level = 0;
+    for (unsigned int i = 1; i < PEAK_LEVELS; i ++)
+        if (width >= auto_points * peak_levels[i].scaling)
+            level = i;
+    return level;
+}
+
 
-static struct peak_info *select_peak_info(void)
+/* Returns the peaks found at the selected smoothing level.  Published sweeps
+ * go through the derived waveforms so that watched levels are updated too,
+ * other sweeps are searched directly in scratch storage. */
+static const struct peak_info *find_peak_info(
+    unsigned int length,
+    const struct channel_sweep *sweep, const double tune_scale[])
 {
-    switch (peak_select)
+    unsigned int level = peak_select < PEAK_LEVELS ?
+        peak_select : select_auto_level(length, tune_scale);
+    if (publish_results)
+    {
+        struct peak_info *info = &peak_levels[level];
+        selected_scaling = info->scaling;
+        require_derived_wf(info->peaks_derived);
+        return info;
+    }
+    else
     {
-        default:        // (arbitrary choice for default)
-        case PEAK_16:   return &peak_info_16;
-        case PEAK_64:   return &peak_info_64;
+        struct peak_info *info = &scratch_levels[level];
+        smooth_waveform_pyramid(TUNE_LENGTH, sweep->power,
+            PYRAMID_LEVELS, pyramid_factors, scratch_pyramid);
+        find_level_peaks(info);
+        return info;
     }
 }
 
 
-/* Process each waveform in turn by smoothing it and then searching for peaks.
- * Once done, process the selected smoothing level to calculate the tune. */
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Incremental tracking.  While the last result is good the peak search and
+ * first fitting pass are skipped: the previous final fits stand in for the
+ * first fit, so only a window around each previous peak is refitted.  If any
+ * peak is lost or the tune jumps too far the full search is run instead. */
+
+enum {
+    TRACK_OFF,          // Tracking disabled
+    TRACK_TRACKING,     // Result from tracking
+    TRACK_SEARCH,       // No seed, full search
+    TRACK_LOST,         // Tracked fit failed, full search
+    TRACK_JUMP,         // Tune jumped too far, full search
+};
+
+#define TRACK_FILTER    20      // Length of duration filters
+
+static bool track_enable;
+static double track_max_jump = 0.01;    // Largest tune change tracked
+
+static unsigned int track_status;
+static unsigned int track_sweeps;       // Sweeps processed since reset
+static unsigned int track_fast;         // Sweeps served by tracking
+static unsigned int track_fallbacks;    // Tracking attempts which failed
+static unsigned int search_count;       // Sweeps in search_duration
+static double track_fraction;           // Fraction of sweeps tracked
+static double search_duration;          // Mean full search time in ms
+static double tracked_duration;         // Mean tracked sweep time in ms
+static double track_saved;              // Total time saved in seconds
+
+
+static double tune_distance(double a, double b)
+{
+    double distance = fabs(a - b);
+    return distance > 0.5 ? 1 - distance : distance;
+}
+
+
+static unsigned int track_peak_tune(
+    struct peak_results *results, unsigned int length,
+    const struct channel_sweep *sweep, const double tune_scale[],
+    unsigned int *status, double *tune, double *phase)
+{
+    const struct peak_state *state = current_state;
+    struct peak_fit_result *first_fit = &results->first_fit;
+    struct peak_fit_result *second_fit = &results->second_fit;
+
+    /* The previous fits are treated as a good first fit. */
+    for (unsigned int i = 0; i < state->seed_count; i ++)
+    {
+        first_fit->fits[i] = state->seed[i];
+        first_fit->status[i] = PEAK_GOOD;
+        first_fit->errors[i] = NAN;
+        compute_peak_bounds(&state->seed[i], peak_fit_threshold,
+            length, tune_scale, &first_fit->ranges[i]);
+    }
+    reset_fit_result(first_fit, state->seed_count);
+
+    extract_good_peaks(length, tune_scale, first_fit, second_fit);
+    fit_peaks(sweep, tune_scale, second_fit, true);
+    if (second_fit->peak_count < state->seed_count)
+        return TRACK_LOST;
+    for (unsigned int i = 0; i < second_fit->peak_count; i ++)
+        if (second_fit->status[i] != PEAK_GOOD)
+            return TRACK_LOST;
+
+    /* The result is only finished and recorded once tracking is accepted,
+     * otherwise the full search does all of this. */
+    struct final_fits final;
+    *status = extract_final_tune(results, &final, tune, phase);
+    if (*status != TUNE_OK)
+        return TRACK_LOST;
+    else if (tune_distance(*tune, state->seed_tune) > track_max_jump)
+        return TRACK_JUMP;
+    else
+    {
+        if (publish_results)
+            record_fit_sweep(sweep, tune_scale, first_fit);
+        finish_peak_tune(
+            results, length, sweep, tune_scale, &final, status, tune, phase);
+        return TRACK_TRACKING;
+    }
+}
+
+
+static void filter_duration(double *mean, double duration, unsigned int count)
+{
+    if (count <= 1)
+        *mean = duration;
+    else
+        *mean += (duration - *mean) /
+            (count < TRACK_FILTER ? count : TRACK_FILTER);
+}
+
+
+/* Time saved is measured against the mean time of a full search, and sweeps
+ * where tracking was tried and failed count against this. */
+static void update_track_stats(double duration)
+{
+    track_sweeps += 1;
+    switch (track_status)
+    {
+        case TRACK_TRACKING:
+            track_fast += 1;
+            filter_duration(&tracked_duration, duration, track_fast);
+            if (search_count > 0)
+                track_saved += 1e-3 * (search_duration - duration);
+            break;
+        case TRACK_LOST:
+        case TRACK_JUMP:
+            track_fallbacks += 1;
+            if (search_count > 0)
+                track_saved += 1e-3 * (search_duration - duration);
+            break;
+        default:
+            search_count += 1;
+            filter_duration(&search_duration, duration, search_count);
+            break;
+    }
+    track_fraction = (double) track_fast / track_sweeps;
+}
+
+
+static void reset_track_stats(void)
+{
+    interlock_wait(peak_trigger);
+    track_sweeps = 0;
+    track_fast = 0;
+    track_fallbacks = 0;
+    search_count = 0;
+    track_fraction = 0;
+    search_duration = 0;
+    tracked_duration = 0;
+    track_saved = 0;
+    interlock_signal(peak_trigger, NULL);
+}
+
+
+static void publish_tracking(void)
+{
+    PUBLISH_WRITE_VAR_P(bo, "PEAK:TRACK:ENABLE", track_enable);
+    PUBLISH_WRITE_VAR_P(ao, "PEAK:TRACK:JUMP", track_max_jump);
+    PUBLISH_ACTION("PEAK:TRACK:RESET", reset_track_stats);
+
+    PUBLISH_READ_VAR(mbbi, "PEAK:TRACK:STATUS", track_status);
+    PUBLISH_READ_VAR(ulongin, "PEAK:TRACK:SWEEPS", track_sweeps);
+    PUBLISH_READ_VAR(ulongin, "PEAK:TRACK:FAST", track_fast);
+    PUBLISH_READ_VAR(ulongin, "PEAK:TRACK:FALLBACK", track_fallbacks);
+    PUBLISH_READ_VAR(ai, "PEAK:TRACK:FRACTION", track_fraction);
+    PUBLISH_READ_VAR(ai, "PEAK:TRACK:FULLTIME", search_duration);
+    PUBLISH_READ_VAR(ai, "PEAK:TRACK:FASTTIME", tracked_duration);
+    PUBLISH_READ_VAR(ai, "PEAK:TRACK:SAVED", track_saved);
+}
+
+
+/* Smoothing and peak searching is only done for the selected smoothing level
+ * and for any levels which are being watched.  The selected smoothing level is
+ * then processed to calculate the tune. */
+void select_peak_state(unsigned int state, bool publish)
+{
+    current_state = &peak_states[state];
+    publish_results = publish;
+}
+
+
 void measure_tune_peaks(
     unsigned int length, const struct channel_sweep *sweep,
     const double *tune_scale,
     unsigned int *status, double *tune, double *phase)
 {
-    interlock_wait(peak_trigger);
+    struct peak_results *results =
+        publish_results ? &published_results : &scratch_results;
+    if (publish_results)
+    {
+        interlock_wait(peak_trigger);
+
+        /* Mark the smoothing pyramid as stale first, as the peaks depend on
+         * it. */
+        sweep_power = sweep->power;
+        update_derived_wf(pyramid_derived);
+        for (unsigned int i = 0; i < PEAK_LEVELS; i ++)
+            update_derived_wf(peak_levels[i].peaks_derived);
+    }
     TIC();
 
-    smooth_waveform_4(TUNE_LENGTH,    sweep->power, peak_power_4);
-    smooth_waveform_4(TUNE_LENGTH/4,  peak_power_4, peak_info_16.power);
-    smooth_waveform_4(TUNE_LENGTH/16, peak_info_16.power, peak_info_64.power);
+    unsigned int tracking;
+    if (!track_enable)
+        tracking = TRACK_OFF;
+    else if (!current_state->seed_valid)
+        tracking = TRACK_SEARCH;
+    else
+        tracking = track_peak_tune(
+            results, length, sweep, tune_scale, status, tune, phase);
+
+    /* Fall back to a full search if tracking didn't succeed. */
+    if (tracking != TRACK_TRACKING)
+    {
+        const struct peak_info *peak_info =
+            find_peak_info(length, sweep, tune_scale);
+        process_peak_tune(results,
+            length, sweep, tune_scale, peak_info, status, tune, phase);
+    }
+
+    double duration = 1e3 * TOC();
+    if (publish_results)
+    {
+        track_status = tracking;
+        process_duration = duration;
+        update_track_stats(duration);
+        interlock_signal(peak_trigger, NULL);
+    }
 
-    process_peak_info(&peak_info_16);
-    process_peak_info(&peak_info_64);
+    peak_summary = (struct peak_summary) {
+        .tune_ok = *status == TUNE_OK,
+        .tune = results->centre_peak.tune,
+        .width = results->centre_peak.width,
+        .left = results->left_peak.tune,
+        .right = results->right_peak.tune,
+        .snr = results->snr,
+        .fit_error = results->fit_error,
+    };
+}
 
-    struct peak_info *peak_info = select_peak_info();
-    process_peak_tune(
-        length, sweep, tune_scale, peak_info, status, tune, phase);
 
-    process_duration = 1e3 * TOC();
-    interlock_signal(peak_trigger, NULL);
+void read_peak_summary(struct peak_summary *summary)
+{
+    *summary = peak_summary;
 }
 
 
@@ -788,8 +1649,8 @@ bool initialise_tune_peaks(void)
 {
     peak_trigger = create_interlock("PEAK", false);
 
-    publish_peak_info(&peak_info_16, 16);
-    publish_peak_info(&peak_info_64, 64);
+    if (!publish_pyramid(peak_levels))
+        return false;
 
     PUBLISH_WRITE_VAR_P(ao, "PEAK:THRESHOLD", peak_fit_threshold);
     PUBLISH_WRITE_VAR_P(ao, "PEAK:MINWIDTH", min_peak_width);
@@ -797,20 +1658,32 @@ bool initialise_tune_peaks(void)
     PUBLISH_WRITE_VAR_P(ao, "PEAK:FITERROR", max_fit_error);
 
     PUBLISH_WRITE_VAR_P(mbbo, "PEAK:SEL", peak_select);
-
-    PUBLISH_READ_VAR(ulongin, "PEAK:COUNT", fitted_peak_count);
-
-    PUBLISH_PEAK_FIT("PEAK:FIRSTFIT", first_fit);
-    PUBLISH_PEAK_FIT("PEAK:SECONDFIT", second_fit);
-
-    publish_peak_result("LEFT",   &left_peak);
-    publish_peak_result("CENTRE", &centre_peak);
-    publish_peak_result("RIGHT",  &right_peak);
-    publish_peak_result_relative("LEFT",  &left_peak_relative);
-    publish_peak_result_relative("RIGHT", &right_peak_relative);
-
-    PUBLISH_READ_VAR(ai, "PEAK:SYNCTUNE", synchrotron_tune);
+    PUBLISH_WRITE_VAR_P(ulongout, "PEAK:AUTO:POINTS", auto_points);
+    PUBLISH_READ_VAR(ulongin, "PEAK:AUTO:SCALING", selected_scaling);
+    PUBLISH_READ_VAR(ai, "PEAK:AUTO:WIDTH", expected_width);
+
+    struct peak_results *results = &published_results;
+    PUBLISH_READ_VAR(ulongin, "PEAK:COUNT", results->fitted_peak_count);
+
+    PUBLISH_PEAK_FIT("PEAK:FIRSTFIT", results->first_fit);
+    PUBLISH_PEAK_FIT("PEAK:SECONDFIT", results->second_fit);
+
+    publish_peak_result("LEFT",   &results->left_peak);
+    publish_peak_result("CENTRE", &results->centre_peak);
+    publish_peak_result("RIGHT",  &results->right_peak);
+    publish_peak_result_relative("LEFT",  &results->left_peak_relative);
+    publish_peak_result_relative("RIGHT", &results->right_peak_relative);
+
+    PUBLISH_READ_VAR(ai, "PEAK:SYNCTUNE", results->synchrotron_tune);
+    PUBLISH_READ_VAR(ai, "PEAK:SNR", results->snr);
+    PUBLISH_READ_VAR(ai, "PEAK:RESIDUAL", results->residual);
+    PUBLISH_READ_VAR(ai, "PEAK:ERROR", results->fit_error);
     PUBLISH_READ_VAR(ai, "PEAK:DURATION", process_duration);
 
+    publish_benchmark();
+    publish_fit_benchmark();
+    publish_joint_fit(&results->joint);
+    publish_tracking();
+
     return true;
 }
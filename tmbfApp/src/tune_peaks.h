@@ -1,7 +1,27 @@
+/* Selects the tracking state, as returned by sweep_state_index(), used by the
+ * following call to measure_tune_peaks(), and whether its results are
+ * published.  Must be called under the same lock as that call. */
+void select_peak_state(unsigned int state, bool publish);
+
 /* Called on each successful tune sweep to update peak tune processing. */
 void measure_tune_peaks(
     unsigned int length, const struct channel_sweep *sweep,
     const double *tune_scale,
     unsigned int *status, double *tune, double *phase);
 
+/* Summary of the last peak fit used for planning the following sweeps. */
+struct peak_summary {
+    bool tune_ok;           // Set if the tune was successfully measured
+    double tune;            // Fitted tune and peak width
+    double width;
+    double left;            // Synchrotron sidebands, NAN if not found
+    double right;
+    double snr;             // Tune peak SNR in dB
+    double fit_error;       // Relative fit error of the tune peak
+};
+
+/* Returns the summary of the last call to measure_tune_peaks(), must be called
+ * under the same lock as that call. */
+void read_peak_summary(struct peak_summary *summary);
+
 bool initialise_tune_peaks(void);
@@ -0,0 +1,149 @@
+/* Segmented tune analysis for super sequencer sweeps.
+ *
+ * When the super sequencer is used to step through bunches or frequency
+ * offsets a single capture contains one short independent sweep for each super
+ * sequencer state.  Here we split the sweep at the segment boundaries and fit a
+ * single one pole model to each segment. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string.h>
+#include <complex.h>
+#include <math.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "hardware.h"
+#include "detector.h"
+#include "tune_support.h"
+#include "timing.h"
+#include "mode_scan.h"
+
+#include "tune_segments.h"
+
+
+#define MAX_SEGMENTS    SUPER_SEQ_STATES
+
+static bool segment_enable;
+
+static struct epics_interlock *segment_trigger;
+static unsigned int segment_count;
+static unsigned int segment_length;
+static unsigned int good_count;     // Number of segments successfully fitted
+static double process_duration;     // Processing time in ms
+
+/* Per segment results. */
+static double segment_tune[MAX_SEGMENTS];
+static double segment_phase[MAX_SEGMENTS];
+static double segment_amplitude[MAX_SEGMENTS];
+static double segment_error[MAX_SEGMENTS];
+
+/* Raw fits retained for mode scan analysis. */
+static struct one_pole segment_fits[MAX_SEGMENTS];
+static bool segment_valid[MAX_SEGMENTS];
+
+
+/* Fits a single peak to the entire segment: an initial fit is refined by a
+ * second weighted fit. */
+static bool fit_segment(
+    unsigned int length, const double tune_scale[],
+    const short wf_i[], const short wf_q[],
+    struct one_pole *fit, double *error)
+{
+    struct peak_range range = { .left = 0, .right = length - 1 };
+    return
+        fit_multiple_peaks(
+            1, false, tune_scale, wf_i, wf_q, &range, fit, error) == 1  &&
+        fit_multiple_peaks(
+            1, true, tune_scale, wf_i, wf_q, &range, fit, error) == 1;
+}
+
+
+static void set_segment_result(
+    unsigned int segment, const struct one_pole *fit, double error)
+{
+    segment_valid[segment] = fit != NULL;
+    if (fit)
+    {
+        double harmonic;
+        segment_tune[segment] = modf(peak_centre(fit), &harmonic);
+        segment_phase[segment] = 180 / M_PI * peak_phase(fit);
+        segment_amplitude[segment] = cabs(fit->a) / fabs(peak_width(fit));
+        segment_error[segment] = error;
+    }
+    else
+    {
+        segment_tune[segment] = NAN;
+        segment_phase[segment] = NAN;
+        segment_amplitude[segment] = NAN;
+        segment_error[segment] = NAN;
+    }
+}
+
+
+static void fit_segments(
+    const struct sweep_info *sweep_info, const struct channel_sweep *sweep)
+{
+    segment_length = sweep_info->segment_length;
+    segment_count = sweep_info->segment_count;
+    good_count = 0;
+    for (unsigned int segment = 0; segment < segment_count; segment ++)
+    {
+        unsigned int start = segment * segment_length;
+        struct one_pole fit;
+        double error;
+        if (segment_length >= 2  &&
+            fit_segment(segment_length, &sweep_info->tune_scale[start],
+                &sweep->wf_i[start], &sweep->wf_q[start], &fit, &error))
+        {
+            segment_fits[segment] = fit;
+            set_segment_result(segment, &fit, error);
+            good_count += 1;
+        }
+        else
+            set_segment_result(segment, NULL, 0);
+    }
+
+    for (unsigned int segment = segment_count; segment < MAX_SEGMENTS;
+         segment ++)
+        set_segment_result(segment, NULL, 0);
+}
+
+
+void update_tune_segments(
+    const struct sweep_info *sweep_info, const struct channel_sweep *sweep,
+    bool overflow)
+{
+    /* A single segment is the ordinary tune sweep, nothing to do here. */
+    bool enabled = segment_enable  ||  mode_scan_enabled();
+    if (!enabled  ||  overflow  ||  sweep_info->segment_count < 2)
+        return;
+
+    interlock_wait(segment_trigger);
+    TIC();
+    fit_segments(sweep_info, sweep);
+    process_duration = 1e3 * TOC();
+    interlock_signal(segment_trigger, NULL);
+
+    update_mode_scan(sweep_info, segment_fits, segment_valid);
+}
+
+
+bool initialise_tune_segments(void)
+{
+    PUBLISH_WRITE_VAR_P(bo, "TUNE:SEG:ENABLE", segment_enable);
+
+    segment_trigger = create_interlock("TUNE:SEG", false);
+    PUBLISH_READ_VAR(ulongin, "TUNE:SEG:COUNT", segment_count);
+    PUBLISH_READ_VAR(ulongin, "TUNE:SEG:LENGTH", segment_length);
+    PUBLISH_READ_VAR(ulongin, "TUNE:SEG:GOOD", good_count);
+    PUBLISH_READ_VAR(ai, "TUNE:SEG:DURATION", process_duration);
+    PUBLISH_WF_READ_VAR(double, "TUNE:SEG:TUNE", MAX_SEGMENTS, segment_tune);
+    PUBLISH_WF_READ_VAR(double, "TUNE:SEG:PHASE", MAX_SEGMENTS, segment_phase);
+    PUBLISH_WF_READ_VAR(
+        double, "TUNE:SEG:AMPLITUDE", MAX_SEGMENTS, segment_amplitude);
+    PUBLISH_WF_READ_VAR(double, "TUNE:SEG:ERROR", MAX_SEGMENTS, segment_error);
+    return true;
+}
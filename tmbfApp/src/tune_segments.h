@@ -0,0 +1,13 @@
+/* Segmented tune analysis for super sequencer sweeps. */
+
+struct sweep_info;
+struct channel_sweep;
+
+/* Called on each sweep with the channel used for tune measurement.  If
+ * segmented analysis is enabled and the sweep consists of more than one super
+ * sequencer segment then each segment is fitted separately. */
+void update_tune_segments(
+    const struct sweep_info *sweep_info, const struct channel_sweep *sweep,
+    bool overflow);
+
+bool initialise_tune_segments(void);
@@ -12,6 +12,7 @@
 #include "detector.h"
 
 #include "tune_support.h"
+#include "fit_kernels.h"
 
 
 
@@ -311,7 +312,7 @@ static void compute_weights(
  * unweighted fit to the residual data after subtracting previous fits, the
  * second time we refine the data by redoing the fit with weighting and
  * subtracting the best model from the data. */
-unsigned int fit_multiple_peaks(
+static unsigned int fit_multiple_peaks_double(
     unsigned int peak_count, bool refine_fit,
     const double scale_in[], const short wf_i[], const short wf_q[],
     const struct peak_range ranges[],
@@ -352,6 +353,371 @@ unsigned int fit_multiple_peaks(
 
 
 
+#ifndef FIT_KERNEL
+#define FIT_KERNEL  FIT_KERNEL_DOUBLE
+#endif
+
+static enum fit_kernel fit_kernel = FIT_KERNEL;
+
+void set_fit_kernel(enum fit_kernel kernel)
+{
+    fit_kernel = kernel == FIT_KERNEL_DEFAULT ? FIT_KERNEL : kernel;
+}
+
+
+unsigned int fit_multiple_peaks_kernel(
+    enum fit_kernel kernel,
+    unsigned int peak_count, bool refine_fit,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    const struct peak_range ranges[],
+    struct one_pole fits[], double errors[])
+{
+    if (kernel == FIT_KERNEL_DEFAULT)
+        kernel = FIT_KERNEL;
+    switch (kernel)
+    {
+        case FIT_KERNEL_FLOAT:
+            return fit_multiple_peaks_float(
+                peak_count, refine_fit, scale_in, wf_i, wf_q,
+                ranges, fits, errors);
+        case FIT_KERNEL_FIXED:
+            return fit_multiple_peaks_fixed(
+                peak_count, refine_fit, scale_in, wf_i, wf_q,
+                ranges, fits, errors);
+        default:
+            return fit_multiple_peaks_double(
+                peak_count, refine_fit, scale_in, wf_i, wf_q,
+                ranges, fits, errors);
+    }
+}
+
+
+unsigned int fit_multiple_peaks(
+    unsigned int peak_count, bool refine_fit,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    const struct peak_range ranges[],
+    struct one_pole fits[], double errors[])
+{
+    return fit_multiple_peaks_kernel(
+        fit_kernel, peak_count, refine_fit, scale_in, wf_i, wf_q,
+        ranges, fits, errors);
+}
+
+
+
+/* Fitting a single pole shared between several channels.  Each channel c has
+ * its own residue a_c but all channels share the same pole b, so we minimise
+ *
+ *      E = sum_c sum_i w[c,i] |a_c + b . iq[c,i] - s[i] . iq[c,i]|^2 .
+ *
+ * Writing S_c(.) for the weighted sums over channel c, as for fit_one_pole()
+ * above, the normal equations are
+ *
+ *      S_c(w) a_c + S_c(w iq) b = S_c(w s iq)                  for each c,
+ *      sum_c (S_c(w iq)* a_c + S_c(w |iq|^2) b) = sum_c S_c(w s |iq|^2) ,
+ *
+ * and eliminating a_c from the last equation gives b directly as
+ *
+ *          sum_c (S_c(w s |iq|^2) - S_c(w iq)* S_c(w s iq) / S_c(w))
+ *      b = --------------------------------------------------------- .
+ *              sum_c (S_c(w |iq|^2) - |S_c(w iq)|^2 / S_c(w))
+ */
+bool fit_shared_pole(
+    unsigned int channels, bool refine_fit,
+    const double scale_in[], const short *const wf_i[],
+    const short *const wf_q[], const struct peak_range *range,
+    struct one_pole fits[], double *error)
+{
+    unsigned int count = range->right - range->left + 1;
+    const double *scale = &scale_in[range->left];
+    double complex pole = fits[0].b;
+    double S_w[channels];
+    double complex S_w_iq[channels];
+    double complex S_w_s_iq[channels];
+
+    /* The weights are computed as for compute_weights() above, but we work
+     * point by point to avoid keeping copies of all the channels. */
+    double complex numerator = 0;
+    double denominator = 0;
+    for (unsigned int c = 0; c < channels; c ++)
+    {
+        S_w[c] = 0;
+        S_w_iq[c] = 0;
+        S_w_s_iq[c] = 0;
+        double S_w_iq2 = 0;
+        double S_w_s_iq2 = 0;
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            unsigned int ix = range->left + i;
+            double complex iq = wf_i[c][ix] + I * wf_q[c][ix];
+            double w = refine_fit ? 1 / cabs2(scale[i] - pole) : cabs2(iq);
+            double complex w_iq = w * iq;
+            double w_iq2 = w * cabs2(iq);
+            S_w[c]      += w;
+            S_w_iq[c]   += w_iq;
+            S_w_s_iq[c] += scale[i] * w_iq;
+            S_w_iq2     += w_iq2;
+            S_w_s_iq2   += scale[i] * w_iq2;
+        }
+        if (S_w[c] <= 0)
+            return false;
+        numerator += S_w_s_iq2 - conj(S_w_iq[c]) * S_w_s_iq[c] / S_w[c];
+        denominator += S_w_iq2 - cabs2(S_w_iq[c]) / S_w[c];
+    }
+
+    /* As for fit_one_pole() reject degenerate fits. */
+    if (count < 2  ||  denominator <= 0)
+        return false;
+    double complex b = numerator / denominator;
+
+    double total_error = 0, total = 0;
+    for (unsigned int c = 0; c < channels; c ++)
+    {
+        fits[c].b = b;
+        fits[c].a = (S_w_s_iq[c] - S_w_iq[c] * b) / S_w[c];
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            unsigned int ix = range->left + i;
+            double complex iq = wf_i[c][ix] + I * wf_q[c][ix];
+            total_error += cabs2(iq - peak_eval(&fits[c], scale[i]));
+            total += cabs2(iq);
+        }
+    }
+    *error = total_error / total;
+    return true;
+}
+
+
+
+/* Joint Levenberg-Marquardt refinement of several poles.  The model is
+ *
+ *      z(s) = c + sum_k a_k / (s - b_k)
+ *
+ * and as this is holomorphic in each parameter the Gauss-Newton step can be
+ * computed directly in complex arithmetic from the Jacobian
+ *
+ *      dz/da_k = 1 / (s - b_k),  dz/db_k = a_k / (s - b_k)^2,  dz/dc = 1 .
+ *
+ * Each step solves the damped normal equations
+ *
+ *      (J^H J + lambda diag(J^H J)) delta = J^H (iq - z)
+ *
+ * with lambda reduced after each successful step and increased after each
+ * step that fails to reduce the residual.  Parameters are ordered as
+ * a_0, b_0, a_1, b_1, ..., c. */
+
+#define JOINT_MAX_PARAMS    (2 * JOINT_MAX_POLES + 1)
+
+#define LM_INITIAL_LAMBDA   1e-3
+#define LM_MAX_LAMBDA       1e8
+#define LM_TOLERANCE        1e-6    // Relative improvement for convergence
+
+
+static double compute_joint_error(
+    unsigned int count, const double scale[], const double complex iq[],
+    unsigned int peak_count, const struct one_pole fits[],
+    double complex background)
+{
+    double error = 0;
+    for (unsigned int i = 0; i < count; i ++)
+        error += cabs2(iq[i] - background -
+            eval_one_pole_model(peak_count, fits, scale[i]));
+    return error;
+}
+
+
+/* Accumulates J^H J and J^H r for the current parameters.  Only the upper
+ * triangle is accumulated, the rest follows as J^H J is Hermitian. */
+static void compute_joint_normal(
+    unsigned int count, const double scale[], const double complex iq[],
+    unsigned int peak_count, const struct one_pole fits[],
+    double complex background,
+    double complex jhj[][JOINT_MAX_PARAMS], double complex jhr[])
+{
+    unsigned int n = 2 * peak_count + 1;
+    for (unsigned int r = 0; r < n; r ++)
+    {
+        jhr[r] = 0;
+        for (unsigned int c = r; c < n; c ++)
+            jhj[r][c] = 0;
+    }
+
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        double complex jacobian[JOINT_MAX_PARAMS];
+        double complex model = background;
+        for (unsigned int k = 0; k < peak_count; k ++)
+        {
+            double complex d = 1 / (scale[i] - fits[k].b);
+            double complex a_d = fits[k].a * d;
+            jacobian[2*k] = d;
+            jacobian[2*k + 1] = a_d * d;
+            model += a_d;
+        }
+        jacobian[n - 1] = 1;
+
+        double complex residual = iq[i] - model;
+        for (unsigned int r = 0; r < n; r ++)
+        {
+            double complex j_r = conj(jacobian[r]);
+            jhr[r] += j_r * residual;
+            for (unsigned int c = r; c < n; c ++)
+                jhj[r][c] += j_r * jacobian[c];
+        }
+    }
+
+    for (unsigned int r = 0; r < n; r ++)
+        for (unsigned int c = 0; c < r; c ++)
+            jhj[r][c] = conj(jhj[c][r]);
+}
+
+
+/* Solves a x = y by Gaussian elimination with partial pivoting.  Both a and x
+ * are overwritten, x is passed in as y. */
+static bool solve_complex_system(
+    unsigned int n, double complex a[][JOINT_MAX_PARAMS], double complex x[])
+{
+    for (unsigned int col = 0; col < n; col ++)
+    {
+        unsigned int pivot = col;
+        for (unsigned int row = col + 1; row < n; row ++)
+            if (cabs2(a[row][col]) > cabs2(a[pivot][col]))
+                pivot = row;
+        if (cabs2(a[pivot][col]) == 0)
+            return false;
+        if (pivot != col)
+        {
+            for (unsigned int k = col; k < n; k ++)
+            {
+                double complex t = a[col][k];
+                a[col][k] = a[pivot][k];
+                a[pivot][k] = t;
+            }
+            double complex t = x[col];
+            x[col] = x[pivot];
+            x[pivot] = t;
+        }
+
+        for (unsigned int row = col + 1; row < n; row ++)
+        {
+            double complex factor = a[row][col] / a[col][col];
+            for (unsigned int k = col; k < n; k ++)
+                a[row][k] -= factor * a[col][k];
+            x[row] -= factor * x[col];
+        }
+    }
+
+    for (unsigned int row = n; row -- > 0; )
+    {
+        double complex sum = x[row];
+        for (unsigned int k = row + 1; k < n; k ++)
+            sum -= a[row][k] * x[k];
+        x[row] = sum / a[row][row];
+        if (!isfinite(creal(x[row]))  ||  !isfinite(cimag(x[row])))
+            return false;
+    }
+    return true;
+}
+
+
+enum joint_fit_status refine_joint_fit(
+    unsigned int peak_count, const struct peak_range *range,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    unsigned int max_iterations,
+    struct one_pole fits[], double complex *background,
+    struct joint_fit_stats *stats)
+{
+    unsigned int count = range->right - range->left + 1;
+    unsigned int n = 2 * peak_count + 1;
+    const double *scale = &scale_in[range->left];
+    double complex iq[count];
+    double total = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        iq[i] = wf_i[range->left + i] + I * wf_q[range->left + i];
+        total += cabs2(iq[i]);
+    }
+
+    *stats = (struct joint_fit_stats) { };
+    if (peak_count == 0  ||  peak_count > JOINT_MAX_POLES  ||
+        count <= n  ||  total <= 0)
+        return JOINT_FIT_FAILED;
+
+    double error = compute_joint_error(
+        count, scale, iq, peak_count, fits, *background);
+    stats->initial_error = error / total;
+
+    double complex jhj[JOINT_MAX_PARAMS][JOINT_MAX_PARAMS];
+    double complex jhr[JOINT_MAX_PARAMS];
+    double lambda = LM_INITIAL_LAMBDA;
+    bool recompute = true;
+    enum joint_fit_status status = JOINT_FIT_ITERATIONS;
+    while (stats->iterations < max_iterations)
+    {
+        /* The normal equations only change when a step is accepted. */
+        if (recompute)
+            compute_joint_normal(
+                count, scale, iq, peak_count, fits, *background, jhj, jhr);
+        stats->iterations += 1;
+
+        double complex a[JOINT_MAX_PARAMS][JOINT_MAX_PARAMS];
+        double complex delta[JOINT_MAX_PARAMS];
+        for (unsigned int r = 0; r < n; r ++)
+        {
+            for (unsigned int c = 0; c < n; c ++)
+                a[r][c] = jhj[r][c];
+            a[r][r] *= 1 + lambda;
+            delta[r] = jhr[r];
+        }
+        if (!solve_complex_system(n, a, delta))
+        {
+            status = JOINT_FIT_FAILED;
+            break;
+        }
+
+        struct one_pole trial[JOINT_MAX_POLES];
+        for (unsigned int k = 0; k < peak_count; k ++)
+        {
+            trial[k].a = fits[k].a + delta[2*k];
+            trial[k].b = fits[k].b + delta[2*k + 1];
+        }
+        double complex trial_background = *background + delta[n - 1];
+        double trial_error = compute_joint_error(
+            count, scale, iq, peak_count, trial, trial_background);
+
+        if (trial_error < error)
+        {
+            double improvement = (error - trial_error) / error;
+            memcpy(fits, trial, peak_count * sizeof(struct one_pole));
+            *background = trial_background;
+            error = trial_error;
+            lambda /= 10;
+            recompute = true;
+            if (improvement < LM_TOLERANCE)
+            {
+                status = JOINT_FIT_CONVERGED;
+                break;
+            }
+        }
+        else
+        {
+            /* Also catches a NAN residual from a wild step. */
+            lambda *= 10;
+            recompute = false;
+            if (lambda > LM_MAX_LAMBDA)
+            {
+                status = JOINT_FIT_CONVERGED;
+                break;
+            }
+        }
+    }
+
+    stats->final_error = error / total;
+    return status;
+}
+
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Waveform processing for supporting peak detection. */
 
@@ -388,3 +754,55 @@ void smooth_waveform_4(unsigned int length, const int wf_in[], int wf_out[])
         wf_out[i] = (int) ((accum + 2) >> 2);   // Rounded division by 4
     }
 }
+
+
+/* Rounded division by the decimation factor, rounding down as for the shift in
+ * smooth_waveform_4().  The common power of two case is done by shifting. */
+static int decimate_value(int64_t accum, unsigned int factor)
+{
+    accum += factor / 2;
+    if ((factor & (factor - 1)) == 0)
+        return (int) (accum >> __builtin_ctz(factor));
+    else
+    {
+        int64_t result = accum / factor;
+        if (accum % factor < 0)
+            result -= 1;
+        return (int) result;
+    }
+}
+
+
+/* Each input point is carried down through the levels as far as it completes
+ * a block, so every level is written in order in one pass over the input. */
+void smooth_waveform_pyramid(
+    unsigned int length, const int wf_in[],
+    unsigned int levels, const unsigned int factors[], int *const wf_out[])
+{
+    int64_t accum[levels];
+    unsigned int count[levels];
+    unsigned int out_ix[levels];
+    for (unsigned int k = 0; k < levels; k ++)
+    {
+        accum[k] = 0;
+        count[k] = 0;
+        out_ix[k] = 0;
+    }
+
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        int value = wf_in[i];
+        for (unsigned int k = 0; k < levels; k ++)
+        {
+            accum[k] += value;
+            count[k] += 1;
+            if (count[k] < factors[k])
+                break;
+
+            value = decimate_value(accum[k], factors[k]);
+            wf_out[k][out_ix[k]++] = value;
+            accum[k] = 0;
+            count[k] = 0;
+        }
+    }
+}
@@ -65,6 +65,64 @@ unsigned int fit_multiple_peaks(
     const struct peak_range ranges[],
     struct one_pole fits[], double errors[]);
 
+/* Implementations of fit_multiple_peaks(): the double precision reference and
+ * the single precision and fixed point versions in fit_kernels.c.  The default
+ * is the reference unless FIT_KERNEL is defined at build time. */
+enum fit_kernel {
+    FIT_KERNEL_DEFAULT,     // As selected at build time
+    FIT_KERNEL_DOUBLE,
+    FIT_KERNEL_FLOAT,
+    FIT_KERNEL_FIXED,
+};
+
+/* Selects the implementation used by fit_multiple_peaks(). */
+void set_fit_kernel(enum fit_kernel kernel);
+
+/* As for fit_multiple_peaks() with an explicit choice of implementation. */
+unsigned int fit_multiple_peaks_kernel(
+    enum fit_kernel kernel,
+    unsigned int peak_count, bool refine_fit,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    const struct peak_range ranges[],
+    struct one_pole fits[], double errors[]);
+
+/* Fits a single resonance common to several channels: each channel has its
+ * own residue but all share the same pole.  The fit is done over the given
+ * range of each channel, and if refine_fit is set the existing fits[0] is used
+ * for weighting.  One fit is returned for each channel together with the
+ * overall relative fit error. */
+bool fit_shared_pole(
+    unsigned int channels, bool refine_fit,
+    const double scale_in[], const short *const wf_i[],
+    const short *const wf_q[], const struct peak_range *range,
+    struct one_pole fits[], double *error);
+
+/* Joint refinement of a set of peak fits.  All poles together with a constant
+ * background term are fitted simultaneously to the data over the given range by
+ * Levenberg-Marquardt iteration, starting from the given fits and background.
+ * At most max_iterations steps are taken, and the fits and background are only
+ * updated by steps which reduce the residual. */
+#define JOINT_MAX_POLES     5
+
+enum joint_fit_status {
+    JOINT_FIT_CONVERGED,    // Residual no longer improving
+    JOINT_FIT_ITERATIONS,   // Iteration limit reached
+    JOINT_FIT_FAILED,       // Singular system or unusable data
+};
+
+struct joint_fit_stats {
+    unsigned int iterations;    // Number of steps tried
+    double initial_error;       // Relative residual of starting fit
+    double final_error;         // Relative residual of refined fit
+};
+
+enum joint_fit_status refine_joint_fit(
+    unsigned int peak_count, const struct peak_range *range,
+    const double scale_in[], const short wf_i[], const short wf_q[],
+    unsigned int max_iterations,
+    struct one_pole fits[], double complex *background,
+    struct joint_fit_stats *stats);
+
 /* Given index into sweep and the corresponding tune scale computes the tune and
  * phase for the given index. */
 void index_to_tune(
@@ -82,3 +140,12 @@ void compute_dd(unsigned int length, const int wf_in[], int wf_out[]);
 /* Smooths and decimates waveform by factor of four.  Output waveform must be
  * length/4 points long. */
 void smooth_waveform_4(unsigned int length, const int wf_in[], int wf_out[]);
+
+/* Smooths and decimates a waveform through several levels in a single pass over
+ * the data.  Level k is decimated from level k-1, or from the input for the
+ * first level, by factors[k], and wf_out[k] must be correspondingly long.  Each
+ * point is the rounded mean of the points it covers, so factors of 4 give the
+ * same result as repeated calls to smooth_waveform_4(). */
+void smooth_waveform_pyramid(
+    unsigned int length, const int wf_in[],
+    unsigned int levels, const unsigned int factors[], int *const wf_out[]);
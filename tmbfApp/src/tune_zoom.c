@@ -0,0 +1,475 @@
+/* Adaptive zoom sweep planning.
+ *
+ * A uniform sweep over the configured tune range spends most of its points
+ * where there is no resonance.  Here we use the most recent peak fit to replan
+ * the sweep as a coarse sweep over the full range with dense windows around
+ * the tune and its synchrotron sidebands.  Windows and gaps are each assigned
+ * to one sequencer state, so at most MAX_SEQUENCER_COUNT segments are used.
+ *
+ * The new sweep is written through the SEQ PVs in the same way as TUNE:SET, so
+ * the sequencer and detector pick it up at the next sweep.  The operator's
+ * sequencer setup is saved before the first plan is written, and is restored
+ * when zoom is disabled or the tune is lost. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "epics_device.h"
+#include "epics_extra.h"
+#include "hardware.h"
+#include "detector.h"
+
+#include "tune_zoom.h"
+
+
+#define MIN(a, b)   ((a) < (b) ? (a) : (b))
+
+/* Zoom windows: the tune and at most two sidebands. */
+#define MAX_WINDOWS     3
+
+struct zoom_segment {
+    double start;
+    double end;
+    unsigned int count;
+};
+
+/* Settings. */
+static bool zoom_enable;
+static bool zoom_sidebands = true;
+static unsigned int coarse_points = 256;   // Points in full range coarse sweep
+static unsigned int dense_points = 256;    // Points across tune window
+static double window_span = 5;             // Window half width in peak widths
+static double min_window = 0.001;          // Minimum window half width
+static unsigned int max_misses = 3;        // Failed fits before widening
+
+/* Sequencer setup saved from the SEQ PVs before zoom takes over. */
+struct saved_state {
+    unsigned int count;
+    double start_freq;
+    double step_freq;
+    unsigned int dwell;
+    unsigned int holdoff;
+    unsigned int gain;
+    bool enable_window;
+    bool blanking;
+    bool capture;
+    unsigned int bank;
+};
+static struct {
+    bool valid;
+    unsigned int pc;
+    struct saved_state states[MAX_SEQUENCER_COUNT];
+} saved_setup;
+
+/* The saved setup and the plan are updated both from the tune thread and from
+ * EPICS, so are only touched under this lock. */
+static pthread_mutex_t zoom_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()      ASSERT_PTHREAD(pthread_mutex_lock(&zoom_lock))
+#define UNLOCK()    ASSERT_PTHREAD(pthread_mutex_unlock(&zoom_lock))
+
+/* Plan currently programmed. */
+enum { ZOOM_OFF, ZOOM_RESTORED, ZOOM_ACTIVE };
+static unsigned int zoom_status;
+static double planned_tune;
+static double planned_width;
+static unsigned int planned_windows;
+static unsigned int miss_count;
+
+/* Published plan statistics. */
+static unsigned int plan_states;
+static unsigned int plan_points;
+static unsigned int plan_count;
+static double fine_step;
+static double plan_speedup;
+
+
+/* Clips frequency to range 0..BUNCHES_PER_TURN, as for TUNE:SET. */
+static double clip_frequency(double frequency)
+{
+    if (frequency < 0)
+        return 0;
+    else if (frequency > BUNCHES_PER_TURN)
+        return BUNCHES_PER_TURN;
+    else
+        return frequency;
+}
+
+
+/* The configured sweep range as absolute frequencies in units of turns. */
+static void read_sweep_range(double *centre, double *low, double *high)
+{
+    int harmonic = READ_NAMED_RECORD(longout, "TUNE:HARMONIC");
+    double centre_tune = READ_NAMED_RECORD(ao, "TUNE:CENTRE");
+    double half_range = READ_NAMED_RECORD(ao, "TUNE:RANGE");
+    *centre = harmonic + centre_tune;
+    *low  = clip_frequency(*centre - half_range);
+    *high = clip_frequency(*centre + half_range);
+}
+
+
+/* Fitted tunes are fractional, return the equivalent frequency nearest to the
+ * sweep centre. */
+static double absolute_tune(double centre, double tune)
+{
+    return centre - remainder(centre - tune, 1);
+}
+
+
+/* Adds the window [centre-half, centre+half] clipped to [low,high] into the
+ * sorted list of windows, merging with any windows it overlaps. */
+static unsigned int add_window(
+    double windows[][2], unsigned int count,
+    double centre, double half, double low, double high)
+{
+    double start = fmax(centre - half, low);
+    double end = fmin(centre + half, high);
+    if (start >= end)
+        return count;
+
+    /* Absorb any overlapping windows into the new window. */
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        if (windows[i][1] < start  ||  windows[i][0] > end)
+        {
+            windows[kept][0] = windows[i][0];
+            windows[kept][1] = windows[i][1];
+            kept += 1;
+        }
+        else
+        {
+            start = fmin(start, windows[i][0]);
+            end = fmax(end, windows[i][1]);
+        }
+    }
+
+    /* Insert in order of start frequency. */
+    unsigned int ix = kept;
+    while (ix > 0  &&  windows[ix - 1][0] > start)
+    {
+        windows[ix][0] = windows[ix - 1][0];
+        windows[ix][1] = windows[ix - 1][1];
+        ix -= 1;
+    }
+    windows[ix][0] = start;
+    windows[ix][1] = end;
+    return kept + 1;
+}
+
+
+/* Appends a segment covering [start,end) with the given step, at least one
+ * point is always used.  Returns the updated segment count. */
+static unsigned int add_segment(
+    struct zoom_segment segments[], unsigned int count,
+    double start, double end, double step)
+{
+    if (end <= start)
+        return count;
+    unsigned int points = (unsigned int) ceil((end - start) / step);
+    if (points == 0)
+        points = 1;
+    segments[count] = (struct zoom_segment) {
+        .start = start, .end = end, .count = points };
+    return count + 1;
+}
+
+
+/* Covers [low,high] with coarse segments in the gaps between the windows and
+ * dense segments across each window.  Returns the number of segments. */
+static unsigned int plan_segments(
+    double low, double high,
+    double windows[][2], unsigned int window_count,
+    double coarse_step, double dense_step,
+    struct zoom_segment segments[MAX_SEQUENCER_COUNT])
+{
+    unsigned int count = 0;
+    double position = low;
+    for (unsigned int i = 0; i < window_count; i ++)
+    {
+        count = add_segment(
+            segments, count, position, windows[i][0], coarse_step);
+        count = add_segment(
+            segments, count, windows[i][0], windows[i][1], dense_step);
+        position = windows[i][1];
+    }
+    return add_segment(segments, count, position, high, coarse_step);
+}
+
+
+static unsigned int total_points(
+    const struct zoom_segment segments[], unsigned int count)
+{
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < count; i ++)
+        total += segments[i].count;
+    return total;
+}
+
+
+#define FORMAT(field) (sprintf(name, "SEQ:%u:%s", state, field), name)
+
+/* Saves the operator's sequencer setup, unless we've already done so. */
+static void save_user_setup(void)
+{
+    if (saved_setup.valid)
+        return;
+
+    saved_setup.pc = READ_NAMED_RECORD(ulongout, "SEQ:PC");
+    for (unsigned int state = 1; state <= MAX_SEQUENCER_COUNT; state ++)
+    {
+        struct saved_state *saved = &saved_setup.states[state - 1];
+        char name[40];
+        saved->count = READ_NAMED_RECORD(ulongout, FORMAT("COUNT"));
+        saved->start_freq = READ_NAMED_RECORD(ao, FORMAT("START_FREQ"));
+        saved->step_freq = READ_NAMED_RECORD(ao, FORMAT("STEP_FREQ"));
+        saved->dwell = READ_NAMED_RECORD(ulongout, FORMAT("DWELL"));
+        saved->holdoff = READ_NAMED_RECORD(ulongout, FORMAT("HOLDOFF"));
+        saved->gain = READ_NAMED_RECORD(mbbo, FORMAT("GAIN"));
+        saved->enable_window = READ_NAMED_RECORD(bo, FORMAT("ENWIN"));
+        saved->blanking = READ_NAMED_RECORD(bo, FORMAT("BLANK"));
+        saved->capture = READ_NAMED_RECORD(bo, FORMAT("CAPTURE"));
+        saved->bank = READ_NAMED_RECORD(mbbo, FORMAT("BANK"));
+    }
+    saved_setup.valid = true;
+}
+
+
+/* Writes back the saved setup, if any.  The saved setup is kept until zoom is
+ * disabled so that it can be restored again after replanning. */
+static void restore_user_setup(void)
+{
+    if (!saved_setup.valid)
+        return;
+
+    for (unsigned int state = 1; state <= MAX_SEQUENCER_COUNT; state ++)
+    {
+        const struct saved_state *saved = &saved_setup.states[state - 1];
+        char name[40];
+        WRITE_NAMED_RECORD(ulongout, FORMAT("COUNT"), saved->count);
+        WRITE_NAMED_RECORD(ao, FORMAT("START_FREQ"), saved->start_freq);
+        WRITE_NAMED_RECORD(ao, FORMAT("STEP_FREQ"), saved->step_freq);
+        WRITE_NAMED_RECORD(ulongout, FORMAT("DWELL"), saved->dwell);
+        WRITE_NAMED_RECORD(ulongout, FORMAT("HOLDOFF"), saved->holdoff);
+        WRITE_NAMED_RECORD(mbbo, FORMAT("GAIN"), saved->gain);
+        WRITE_NAMED_RECORD(bo, FORMAT("ENWIN"), saved->enable_window);
+        WRITE_NAMED_RECORD(bo, FORMAT("BLANK"), saved->blanking);
+        WRITE_NAMED_RECORD(bo, FORMAT("CAPTURE"), saved->capture);
+        WRITE_NAMED_RECORD(mbbo, FORMAT("BANK"), saved->bank);
+    }
+    WRITE_NAMED_RECORD(ulongout, "SEQ:PC", saved_setup.pc);
+    WRITE_NAMED_RECORD(bo, "SEQ:WRITE", true);
+}
+
+
+/* Programs the sequencer with the given segments.  The sequencer runs from
+ * state SEQ:PC down to state 1, so the first segment goes into the highest
+ * state.  All states share the dwell and output settings of state 1. */
+static void write_segments(
+    const struct zoom_segment segments[], unsigned int count)
+{
+    bool reverse = READ_NAMED_RECORD(bo, "TUNE:DIRECTION");
+    unsigned int dwell = READ_NAMED_RECORD(ulongout, "SEQ:1:DWELL");
+    unsigned int holdoff = READ_NAMED_RECORD(ulongout, "SEQ:1:HOLDOFF");
+    unsigned int gain = READ_NAMED_RECORD(mbbo, "SEQ:1:GAIN");
+    bool enable_window = READ_NAMED_RECORD(bo, "SEQ:1:ENWIN");
+    bool blanking = READ_NAMED_RECORD(bo, "SEQ:1:BLANK");
+
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        /* In reverse we run through the segments backwards, and sweep each
+         * segment from end to start. */
+        const struct zoom_segment *segment =
+            &segments[reverse ? count - 1 - i : i];
+        unsigned int state = count - i;
+        char name[40];
+        WRITE_NAMED_RECORD(ulongout, FORMAT("COUNT"), segment->count);
+        WRITE_NAMED_RECORD(ao, FORMAT("START_FREQ"),
+            reverse ? segment->end : segment->start);
+        WRITE_NAMED_RECORD(ao, FORMAT("END_FREQ"),
+            reverse ? segment->start : segment->end);
+        WRITE_NAMED_RECORD(ulongout, FORMAT("DWELL"), dwell);
+        WRITE_NAMED_RECORD(ulongout, FORMAT("HOLDOFF"), holdoff);
+        WRITE_NAMED_RECORD(mbbo, FORMAT("GAIN"), gain);
+        WRITE_NAMED_RECORD(bo, FORMAT("ENWIN"), enable_window);
+        WRITE_NAMED_RECORD(bo, FORMAT("BLANK"), blanking);
+        WRITE_NAMED_RECORD(bo, FORMAT("CAPTURE"), true);
+        WRITE_NAMED_RECORD(mbbo, FORMAT("BANK"), 1);
+    }
+    WRITE_NAMED_RECORD(ulongout, "SEQ:PC", count);
+    WRITE_NAMED_RECORD(bo, "SEQ:WRITE", true);
+}
+
+#undef FORMAT
+
+
+/* Plans and programs a sweep with dense windows around the given absolute
+ * frequencies.  With no windows this is a uniform sweep of TUNE_LENGTH points
+ * over the full range. */
+static void program_zoom(
+    double low, double high,
+    unsigned int window_count, const double centres[], double half_width)
+{
+    double windows[MAX_WINDOWS][2];
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < window_count; i ++)
+        count = add_window(
+            windows, count, centres[i], half_width, low, high);
+
+    /* Keep at least half the buffer for the windows. */
+    unsigned int coarse = count > 0 ?
+        MIN(coarse_points, TUNE_LENGTH / 2) : TUNE_LENGTH;
+    double coarse_step = (high - low) / coarse;
+    double dense_step = 2 * half_width / dense_points;
+
+    struct zoom_segment segments[MAX_SEQUENCER_COUNT];
+    unsigned int segment_count = plan_segments(
+        low, high, windows, count, coarse_step, dense_step, segments);
+
+    /* If we've overrun the capture buffer coarsen the dense windows until we
+     * fit.  This converges quickly as the dense points dominate. */
+    unsigned int total = total_points(segments, segment_count);
+    while (total > TUNE_LENGTH  &&  count > 0)
+    {
+        dense_step *= (double) total / TUNE_LENGTH + 0.01;
+        segment_count = plan_segments(
+            low, high, windows, count, coarse_step, dense_step, segments);
+        total = total_points(segments, segment_count);
+    }
+
+    if (segment_count > 0)
+    {
+        save_user_setup();
+        write_segments(segments, segment_count);
+    }
+
+    plan_states = segment_count;
+    plan_points = total;
+    plan_count += 1;
+    fine_step = count > 0 ? dense_step : coarse_step;
+    plan_speedup = total > 0 ? (high - low) / fine_step / total : 0;
+}
+
+
+/* Returns to the operator's sweep, used when we lose the peak.  Must be called
+ * under the lock. */
+static void program_restore(void)
+{
+    restore_user_setup();
+    zoom_status = ZOOM_RESTORED;
+    planned_windows = 0;
+}
+
+
+/* Restore requested through EPICS. */
+static void request_restore(void)
+{
+    LOCK();
+    program_restore();
+    UNLOCK();
+}
+
+
+/* A new plan is only needed when the tune has moved a significant part of the
+ * window, or the width or set of sidebands has changed substantially. */
+static bool need_replan(double tune, double width, unsigned int windows)
+{
+    double half_width = fmax(window_span * width, min_window);
+    return
+        zoom_status != ZOOM_ACTIVE  ||
+        windows != planned_windows  ||
+        fabs(remainder(tune - planned_tune, 1)) > 0.25 * half_width  ||
+        width > 2 * planned_width  ||  width < 0.5 * planned_width;
+}
+
+
+static void update_zoom(
+    bool tune_ok, double tune, double width, double left, double right)
+{
+    if (!zoom_enable)
+    {
+        zoom_status = ZOOM_OFF;
+        return;
+    }
+
+    if (!tune_ok  ||  !isfinite(width)  ||  width <= 0)
+    {
+        /* After too many failures fall back to the operator's sweep to find
+         * the tune again. */
+        miss_count += 1;
+        if (miss_count >= max_misses  &&  zoom_status == ZOOM_ACTIVE)
+            program_restore();
+        return;
+    }
+    miss_count = 0;
+
+    double centre, low, high;
+    read_sweep_range(&centre, &low, &high);
+    double centres[MAX_WINDOWS];
+    unsigned int windows = 0;
+    centres[windows++] = absolute_tune(centre, tune);
+    if (zoom_sidebands  &&  isfinite(left))
+        centres[windows++] = absolute_tune(centre, left);
+    if (zoom_sidebands  &&  isfinite(right))
+        centres[windows++] = absolute_tune(centre, right);
+
+    if (need_replan(tune, width, windows))
+    {
+        double half_width = fmax(window_span * width, min_window);
+        program_zoom(low, high, windows, centres, half_width);
+        zoom_status = ZOOM_ACTIVE;
+        planned_tune = tune;
+        planned_width = width;
+        planned_windows = windows;
+    }
+}
+
+
+void update_tune_zoom(
+    bool tune_ok, double tune, double width, double left, double right)
+{
+    LOCK();
+    update_zoom(tune_ok, tune, width, left, right);
+    UNLOCK();
+}
+
+
+static void set_zoom_enable(bool enable)
+{
+    LOCK();
+    zoom_enable = enable;
+    /* On disabling zoom put back the operator's sweep and forget it, so that
+     * any later changes are picked up when zoom is next enabled. */
+    if (!enable  &&  check_epics_ready())
+        restore_user_setup();
+    if (!enable)
+        saved_setup.valid = false;
+    zoom_status = ZOOM_OFF;
+    miss_count = 0;
+    UNLOCK();
+}
+
+
+bool initialise_tune_zoom(void)
+{
+    PUBLISH_WRITER_P(bo, "TUNE:ZOOM:ENABLE", set_zoom_enable);
+    PUBLISH_WRITE_VAR_P(bo, "TUNE:ZOOM:SIDEBANDS", zoom_sidebands);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:ZOOM:COARSE", coarse_points);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:ZOOM:DENSE", dense_points);
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:ZOOM:SPAN", window_span);
+    PUBLISH_WRITE_VAR_P(ao, "TUNE:ZOOM:MINWIN", min_window);
+    PUBLISH_WRITE_VAR_P(ulongout, "TUNE:ZOOM:MISSES", max_misses);
+    PUBLISH_ACTION("TUNE:ZOOM:WIDE", request_restore);
+
+    PUBLISH_READ_VAR(mbbi, "TUNE:ZOOM:STATUS", zoom_status);
+    PUBLISH_READ_VAR(ulongin, "TUNE:ZOOM:STATES", plan_states);
+    PUBLISH_READ_VAR(ulongin, "TUNE:ZOOM:POINTS", plan_points);
+    PUBLISH_READ_VAR(ulongin, "TUNE:ZOOM:PLANS", plan_count);
+    PUBLISH_READ_VAR(ai, "TUNE:ZOOM:STEP", fine_step);
+    PUBLISH_READ_VAR(ai, "TUNE:ZOOM:SPEEDUP", plan_speedup);
+    return true;
+}
@@ -0,0 +1,10 @@
+/* Adaptive zoom sweep planning. */
+
+/* Called after each peak fit of a live unscheduled sweep with the fitted tune,
+ * its width and the sidebands (NAN if not found).  If zoom is enabled the
+ * sequencer is reprogrammed when the fit has moved far enough from the current
+ * plan. */
+void update_tune_zoom(
+    bool tune_ok, double tune, double width, double left, double right);
+
+bool initialise_tune_zoom(void);
@@ -0,0 +1,341 @@
+/* Detector window generation and window quality metrics.
+ *
+ * The window is only recomputed on request, so everything here is done in
+ * double precision without any particular attention to speed. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "error.h"
+
+#include "window.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Window generators. */
+
+/* Windows of the form sum_k (-1)^k a_k cos(2 pi k n / (N-1)). */
+static void cosine_window(
+    unsigned int length, const double coeffs[], unsigned int count,
+    double window[])
+{
+    double f = 2 * M_PI / (length - 1);
+    for (unsigned int n = 0; n < length; n ++)
+    {
+        double sum = 0;
+        double sign = 1;
+        for (unsigned int k = 0; k < count; k ++)
+        {
+            sum += sign * coeffs[k] * cos(f * k * n);
+            sign = -sign;
+        }
+        window[n] = sum;
+    }
+}
+
+
+/* Modified Bessel function of the first kind of order zero computed from its
+ * power series, which converges quickly for the arguments we use. */
+static double bessel_i0(double x)
+{
+    double sum = 1;
+    double term = 1;
+    for (unsigned int k = 1; term > 1e-12 * sum; k ++)
+    {
+        double t = x / (2 * k);
+        term *= t * t;
+        sum += term;
+    }
+    return sum;
+}
+
+static void kaiser_window(unsigned int length, double beta, double window[])
+{
+    for (unsigned int n = 0; n < length; n ++)
+    {
+        double r = 2.0 * n / (length - 1) - 1;
+        window[n] = bessel_i0(beta * sqrt(1 - r * r));
+    }
+}
+
+
+/* Cosine tapers over a fraction alpha of the window with a flat top.  Alpha=0
+ * is the rectangular window and alpha=1 the Hann window. */
+static void tukey_window(unsigned int length, double alpha, double window[])
+{
+    if (alpha < 0)  alpha = 0;
+    if (alpha > 1)  alpha = 1;
+    double taper = alpha * (length - 1) / 2;
+    for (unsigned int n = 0; n < length; n ++)
+    {
+        double m = n < length / 2 ? n : length - 1 - n;
+        if (m < taper)
+            window[n] = 0.5 * (1 - cos(M_PI * m / taper));
+        else
+            window[n] = 1;
+    }
+}
+
+
+/* The first discrete prolate spheroidal sequence is the eigenvector for the
+ * largest eigenvalue of the symmetric tridiagonal matrix with
+ *      diagonal        d_n = ((N-1-2n)/2)^2 cos(2 pi W)
+ *      off diagonal    e_n = n(N-n)/2
+ * where W = NW/N.  We find the largest eigenvalue by Sturm sequence bisection
+ * and then the eigenvector by inverse iteration. */
+struct tridiagonal {
+    unsigned int length;
+    double *diag;
+    double *off;            // off[n] couples n-1 and n, off[0] unused
+};
+
+/* Returns the number of eigenvalues less than x. */
+static unsigned int sturm_count(const struct tridiagonal *t, double x)
+{
+    unsigned int count = 0;
+    double q = 1;
+    for (unsigned int n = 0; n < t->length; n ++)
+    {
+        double e2 = n > 0 ? t->off[n] * t->off[n] : 0;
+        if (q == 0)
+            q = 1e-300;
+        q = t->diag[n] - x - e2 / q;
+        if (q < 0)
+            count += 1;
+    }
+    return count;
+}
+
+static double largest_eigenvalue(const struct tridiagonal *t)
+{
+    /* Gershgorin bounds on the spectrum. */
+    double low = INFINITY, high = -INFINITY;
+    for (unsigned int n = 0; n < t->length; n ++)
+    {
+        double radius = fabs(t->off[n]);
+        if (n + 1 < t->length)
+            radius += fabs(t->off[n + 1]);
+        if (t->diag[n] - radius < low)   low = t->diag[n] - radius;
+        if (t->diag[n] + radius > high)  high = t->diag[n] + radius;
+    }
+
+    for (unsigned int i = 0; i < 100  &&  high - low > 1e-12 * fabs(high);
+         i ++)
+    {
+        double mid = 0.5 * (low + high);
+        if (sturm_count(t, mid) == t->length)
+            high = mid;
+        else
+            low = mid;
+    }
+    return high;
+}
+
+/* Solves (T - shift) x = b in place using the Thomas algorithm.  As the shift
+ * is very close to an eigenvalue the system is nearly singular, which is
+ * exactly what makes inverse iteration converge so quickly: we only need the
+ * direction of the result. */
+static void solve_shifted(
+    const struct tridiagonal *t, double shift, double b[], double work[])
+{
+    unsigned int N = t->length;
+    for (unsigned int n = 0; n < N; n ++)
+    {
+        double pivot = t->diag[n] - shift;
+        if (n > 0)
+        {
+            pivot -= t->off[n] * work[n - 1];
+            b[n] -= t->off[n] * b[n - 1];
+        }
+        if (pivot == 0)
+            pivot = 1e-300;
+        work[n] = n + 1 < N ? t->off[n + 1] / pivot : 0;
+        b[n] /= pivot;
+    }
+    for (unsigned int n = N - 1; n > 0; n --)
+        b[n - 1] -= work[n - 1] * b[n];
+}
+
+static void dpss_window(unsigned int length, double nw, double window[])
+{
+    double *diag = malloc(3 * length * sizeof(double));
+    struct tridiagonal t = {
+        .length = length,
+        .diag = diag,
+        .off = diag + length,
+    };
+    double *work = diag + 2 * length;
+
+    double cos_w = cos(2 * M_PI * nw / length);
+    for (unsigned int n = 0; n < length; n ++)
+    {
+        double c = (length - 1 - 2.0 * n) / 2;
+        t.diag[n] = c * c * cos_w;
+        t.off[n] = n * (double) (length - n) / 2;
+    }
+
+    /* Shifting just past the eigenvalue keeps the shifted matrix nonsingular
+     * while still converging in a couple of iterations. */
+    double lambda = largest_eigenvalue(&t);
+    double shift = lambda + 1e-10 * fabs(lambda) + 1e-10;
+    for (unsigned int n = 0; n < length; n ++)
+        window[n] = 1;
+    for (unsigned int i = 0; i < 3; i ++)
+    {
+        solve_shifted(&t, shift, window, work);
+        double max = 0;
+        for (unsigned int n = 0; n < length; n ++)
+            if (fabs(window[n]) > max)
+                max = fabs(window[n]);
+        for (unsigned int n = 0; n < length; n ++)
+            window[n] /= max;
+    }
+
+    /* Eigenvectors are only determined up to sign. */
+    if (window[length / 2] < 0)
+        for (unsigned int n = 0; n < length; n ++)
+            window[n] = -window[n];
+    free(diag);
+}
+
+
+void compute_window(
+    enum window_type type, double parameter,
+    unsigned int length, float window[])
+{
+    static const double hamming[] = { 0.54, 0.46 };
+    static const double blackman_harris[] = {
+        0.35875, 0.48829, 0.14128, 0.01168 };
+    static const double flat_top[] = {
+        0.21557895, 0.41663158, 0.277263158, 0.083578947, 0.006947368 };
+
+    double *result = malloc(length * sizeof(double));
+    switch (type)
+    {
+        default:
+        case WINDOW_HAMMING:
+            cosine_window(length, hamming, ARRAY_SIZE(hamming), result);
+            break;
+        case WINDOW_KAISER:
+            kaiser_window(length, parameter, result);
+            break;
+        case WINDOW_BLACKMAN_HARRIS:
+            cosine_window(length,
+                blackman_harris, ARRAY_SIZE(blackman_harris), result);
+            break;
+        case WINDOW_FLAT_TOP:
+            cosine_window(length, flat_top, ARRAY_SIZE(flat_top), result);
+            break;
+        case WINDOW_TUKEY:
+            tukey_window(length, parameter, result);
+            break;
+        case WINDOW_DPSS:
+            dpss_window(length, parameter, result);
+            break;
+    }
+
+    /* Normalise to unit peak so that the full range of the hardware window is
+     * used. */
+    double max = 0;
+    for (unsigned int n = 0; n < length; n ++)
+        if (fabs(result[n]) > max)
+            max = fabs(result[n]);
+    for (unsigned int n = 0; n < length; n ++)
+        window[n] = (float) (max > 0 ? result[n] / max : 1);
+    free(result);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Window metrics. */
+
+/* Sidelobes are searched over this many bins either side of the main lobe
+ * centre with this oversampling. */
+#define SIDELOBE_BINS       32
+#define SIDELOBE_OVERSAMPLE 4
+
+
+/* Magnitude of the window spectrum at the given frequency in bins.  The
+ * rotation is computed by recurrence to avoid a trig call per point. */
+static double window_response(
+    const double window[], unsigned int length, double bins)
+{
+    double angle = 2 * M_PI * bins / length;
+    double step_c = cos(angle), step_s = sin(angle);
+    double c = 1, s = 0;
+    double sum_c = 0, sum_s = 0;
+    for (unsigned int n = 0; n < length; n ++)
+    {
+        sum_c += window[n] * c;
+        sum_s += window[n] * s;
+        double next_c = c * step_c - s * step_s;
+        s = s * step_c + c * step_s;
+        c = next_c;
+    }
+    return sqrt(sum_c * sum_c + sum_s * sum_s);
+}
+
+
+/* The main lobe extends to the first minimum of the response, the highest
+ * response beyond this is the peak sidelobe.  Flat top windows ripple across
+ * the top of the main lobe, so minima above half the peak are ignored. */
+static double peak_sidelobe(
+    const double window[], unsigned int length, double peak)
+{
+    double last = peak;
+    bool in_main_lobe = true;
+    double sidelobe = 0;
+    for (unsigned int i = 1; i <= SIDELOBE_BINS * SIDELOBE_OVERSAMPLE; i ++)
+    {
+        double response = window_response(
+            window, length, (double) i / SIDELOBE_OVERSAMPLE);
+        if (in_main_lobe)
+            in_main_lobe = response < last  ||  response > 0.5 * peak;
+        else if (response > sidelobe)
+            sidelobe = response;
+        last = response;
+    }
+    return sidelobe > 0 ? 20 * log10(sidelobe / peak) : -INFINITY;
+}
+
+
+void compute_window_metrics(
+    const float window[], unsigned int length, unsigned int dwell,
+    struct window_metrics *metrics)
+{
+    /* For short dwells the window advances by length/dwell points per turn,
+     * for long dwells each point is repeated and the table itself is a good
+     * enough approximation. */
+    unsigned int points = dwell > 0  &&  dwell < length ? dwell : length;
+    double *sampled = malloc(points * sizeof(double));
+    for (unsigned int i = 0; i < points; i ++)
+        sampled[i] = window[(size_t) i * length / points];
+
+    double sum = 0, sum_squares = 0;
+    for (unsigned int i = 0; i < points; i ++)
+    {
+        sum += sampled[i];
+        sum_squares += sampled[i] * sampled[i];
+    }
+
+    metrics->coherent_gain = sum / points;
+    if (sum > 0)
+    {
+        double peak = window_response(sampled, points, 0);
+        metrics->enbw = points * sum_squares / (sum * sum);
+        metrics->scalloping =
+            -20 * log10(window_response(sampled, points, 0.5) / peak);
+        metrics->sidelobe = peak_sidelobe(sampled, points, peak);
+    }
+    else
+    {
+        metrics->enbw = NAN;
+        metrics->scalloping = NAN;
+        metrics->sidelobe = NAN;
+    }
+    free(sampled);
+}
@@ -0,0 +1,34 @@
+/* Detector window generation and window quality metrics. */
+
+/* Available window functions.  The order matches DET:WINDOW:TYPE. */
+enum window_type {
+    WINDOW_HAMMING,
+    WINDOW_KAISER,              // Parameter is beta
+    WINDOW_BLACKMAN_HARRIS,     // Four term minimum sidelobe form
+    WINDOW_FLAT_TOP,
+    WINDOW_TUKEY,               // Parameter is taper fraction alpha
+    WINDOW_DPSS,                // Parameter is time bandwidth product NW
+};
+
+/* Fills window[] with the selected window function normalised to a peak value
+ * of 1.  The parameter is ignored for windows without a parameter. */
+void compute_window(
+    enum window_type type, double parameter,
+    unsigned int length, float window[]);
+
+
+/* Figures of merit for a window as seen by the detector. */
+struct window_metrics {
+    double coherent_gain;       // Mean window value
+    double enbw;                // Equivalent noise bandwidth in bins
+    double scalloping;          // Worst case loss between bins in dB
+    double sidelobe;            // Highest sidelobe relative to peak in dB
+};
+
+/* Computes metrics for the window as it is applied with the given dwell time.
+ * The detector steps through the window once per dwell, so for dwells shorter
+ * than the window only every few points are used.  Frequency bins are 1/dwell
+ * tunes wide, so the noise bandwidth in tunes is enbw/dwell. */
+void compute_window_metrics(
+    const float window[], unsigned int length, unsigned int dwell,
+    struct window_metrics *metrics);